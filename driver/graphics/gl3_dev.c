@@ -117,8 +117,8 @@ dev_init_lock_cb_(
 
 static
 void
-dev_init_pathfind_cb_(
-  upd_pathfind_t* pf);
+dev_init_find_cb_(
+  upd_req_t* req);
 
 static
 void
@@ -868,14 +868,20 @@ static void dev_init_lock_cb_(upd_file_lock_t* k) {
     goto ABORT;
   }
 
-  const bool pf = upd_pathfind_with_dup(&(upd_pathfind_t) {
-      .iso   = f->iso,
-      .path  = (uint8_t*) GRA_GLFW_DEV_PATH,
-      .len   = sizeof(GRA_GLFW_DEV_PATH)-1,
+  /* root resolves the absolute path by a single DIR_FIND */
+  upd_file_t* root = upd_file_get(iso, UPD_FILE_ID_ROOT);
+
+  const bool find = root && upd_req_with_dup(&(upd_req_t) {
+      .file = root,
+      .type = UPD_REQ_DIR_FIND,
+      .dir  = { .entry = {
+        .name = (uint8_t*) GRA_GLFW_DEV_PATH,
+        .len  = sizeof(GRA_GLFW_DEV_PATH)-1,
+      }, },
       .udata = k,
-      .cb    = dev_init_pathfind_cb_,
+      .cb    = dev_init_find_cb_,
     });
-  if (HEDLEY_UNLIKELY(!pf)) {
+  if (HEDLEY_UNLIKELY(!find)) {
     upd_iso_msgf(iso, LOG_PREFIX_"GLFW device pathfind refusal\n");
     goto ABORT;
   }
@@ -886,14 +892,15 @@ ABORT:
   upd_iso_unstack(iso, k);
 }
 
-static void dev_init_pathfind_cb_(upd_pathfind_t* pf) {
-  upd_file_lock_t* k   = pf->udata;
+static void dev_init_find_cb_(upd_req_t* req) {
+  upd_file_lock_t* k   = req->udata;
   upd_file_t*      f   = k->udata;
   upd_iso_t*       iso = f->iso;
   gra_gl3_dev_t*   ctx = f->ctx;
 
-  ctx->glfw = pf->len? NULL: pf->base;
-  upd_iso_unstack(iso, pf);
+  const bool found = req->result == UPD_REQ_OK && req->dir.entry.len == 0;
+  ctx->glfw = found? req->dir.entry.file: NULL;
+  upd_iso_unstack(iso, req);
 
   if (HEDLEY_UNLIKELY(ctx->glfw == NULL)) {
     upd_iso_msgf(iso, LOG_PREFIX_"no GLFW device found\n");
@@ -167,8 +167,8 @@ stream_output_http_error_(
 
 static
 void
-req_pathfind_cb_(
-  upd_pathfind_t* pf);
+req_find_cb_(
+  upd_req_t* req);
 
 static
 void
@@ -430,15 +430,33 @@ static bool stream_parse_req_(http_t_* ctx, upd_req_t* req) {
     return true;
   }
 
+  if (HEDLEY_UNLIKELY(hreq->path_len == 0 || hreq->path[0] != '/')) {
+    upd_iso_unstack(ctx->file->iso, hreq);
+    if (HEDLEY_UNLIKELY(!stream_output_http_error_(ctx, 404, "not found"))) {
+      req->result = UPD_REQ_ABORTED;
+      return false;
+    }
+    req->result = UPD_REQ_OK;
+    req->cb(req);
+    return true;
+  }
+
+  /*  Root resolves the whole path by a single DIR_FIND through the
+   * dentry cache, as the path starts with a slash. */
+  upd_file_t* root = upd_file_get(ctx->file->iso, UPD_FILE_ID_ROOT);
+
   upd_file_ref(ctx->file);
-  const bool pathfind = upd_pathfind_with_dup(&(upd_pathfind_t) {
-      .iso   = ctx->file->iso,
-      .path  = hreq->path,
-      .len   = hreq->path_len,
+  const bool find = root && upd_req_with_dup(&(upd_req_t) {
+      .file = root,
+      .type = UPD_REQ_DIR_FIND,
+      .dir  = { .entry = {
+        .name = hreq->path,
+        .len  = hreq->path_len,
+      }, },
       .udata = hreq,
-      .cb    = req_pathfind_cb_,
+      .cb    = req_find_cb_,
     });
-  if (HEDLEY_UNLIKELY(!pathfind)) {
+  if (HEDLEY_UNLIKELY(!find)) {
     upd_file_unref(ctx->file);
     upd_iso_unstack(ctx->file->iso, hreq);
     if (HEDLEY_UNLIKELY(!stream_output_http_error_(ctx, 500, "pathfind failure"))) {
@@ -485,12 +503,13 @@ static bool stream_output_http_error_(
 }
 
 
-static void req_pathfind_cb_(upd_pathfind_t* pf) {
-  req_t_*  req = pf->udata;
+static void req_find_cb_(upd_req_t* r) {
+  req_t_*  req = r->udata;
   http_t_* ctx = req->ctx;
 
-  req->file = pf->len? NULL: pf->base;
-  upd_iso_unstack(ctx->file->iso, pf);
+  const bool found = r->result == UPD_REQ_OK && r->dir.entry.len == 0;
+  req->file = found? r->dir.entry.file: NULL;
+  upd_iso_unstack(ctx->file->iso, r);
 
   if (HEDLEY_UNLIKELY(!req->file)) {
     stream_output_http_error_(ctx, 404, "not found");
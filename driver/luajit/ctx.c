@@ -3,6 +3,49 @@
 #include "ctx_req.h"
 
 
+typedef struct find_t_ {
+  upd_req_t     req;
+  lj_promise_t* pro;
+  uint8_t       path[];
+} find_t_;
+
+/*  Finds the path by a single DIR_FIND on root, which resolves a name
+ * starting with a slash through the dentry cache of core. */
+static bool find_with_dup_(
+    lj_promise_t* pro, const char* path, size_t len, void (*cb)(upd_req_t*)) {
+  upd_iso_t* iso = pro->stream->iso;
+
+  upd_file_t* root = upd_file_get(iso, UPD_FILE_ID_ROOT);
+  if (HEDLEY_UNLIKELY(root == NULL)) {
+    return false;
+  }
+
+  find_t_* fd = upd_iso_stack(iso, sizeof(*fd)+len+1);
+  if (HEDLEY_UNLIKELY(fd == NULL)) {
+    return false;
+  }
+  fd->path[0] = '/';
+  memcpy(fd->path+1, path, len);
+
+  fd->pro = pro;
+  fd->req = (upd_req_t) {
+    .file = root,
+    .type = UPD_REQ_DIR_FIND,
+    .dir  = { .entry = {
+      .name = fd->path,
+      .len  = len+1,
+    }, },
+    .udata = fd,
+    .cb    = cb,
+  };
+  if (HEDLEY_UNLIKELY(!upd_req(&fd->req))) {
+    upd_iso_unstack(iso, fd);
+    return false;
+  }
+  return true;
+}
+
+
 static void lock_cb_(upd_file_lock_t* k) {
   lj_promise_t* pro = k->udata;
   upd_file_t*   stf = pro->stream;
@@ -59,28 +102,36 @@ EXIT:
 }
 
 
-static void pathfind_cb_(upd_pathfind_t* pf) {
-  lj_promise_t* pro = pf->udata;
+static void pathfind_cb_(upd_req_t* req) {
+  find_t_*      fd  = req->udata;
+  lj_promise_t* pro = fd->pro;
   upd_file_t*   stf = pro->stream;
   upd_iso_t*    iso = stf->iso;
   lj_stream_t*  st  = stf->ctx;
   lua_State*    L   = st->L;
 
+  const upd_req_dir_entry_t e = req->dir.entry;
+  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK || e.file == NULL)) {
+    upd_iso_unstack(iso, fd);
+    lj_promise_finalize(pro, false);
+    return;
+  }
+
   lua_createtable(L, 0, 0);
-  if (HEDLEY_UNLIKELY(pf->len)) {
+  if (HEDLEY_UNLIKELY(e.len)) {
     lua_pushnil(L);
     lua_rawseti(L, -2, 1);
 
-    lua_pushlstring(L, (char*) pf->path, pf->len);
+    lua_pushlstring(L, (char*) e.name, e.len);
     lua_rawseti(L, -2, 2);
 
-    lj_file_new(stf, pf->base);
+    lj_file_new(stf, e.file);
     lua_rawseti(L, -2, 3);
   } else {
-    lj_file_new(stf, pf->base);
+    lj_file_new(stf, e.file);
     lua_rawseti(L, -2, 1);
   }
-  upd_iso_unstack(iso, pf);
+  upd_iso_unstack(iso, fd);
 
   pro->registry.result = luaL_ref(L, LUA_REGISTRYINDEX);
   lj_promise_finalize(pro, true);
@@ -94,13 +145,7 @@ static int pathfind_(lua_State* L) {
   lj_promise_t* pro   = lj_promise_new(stf);
   const int     index = lua_gettop(L);
 
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
-      .iso   = stf->iso,
-      .path  = (uint8_t*) path,
-      .len   = len,
-      .udata = pro,
-      .cb    = pathfind_cb_,
-    });
+  const bool ok = find_with_dup_(pro, path, len, pathfind_cb_);
   if (HEDLEY_UNLIKELY(!ok)) {
     lj_promise_finalize(pro, false);
   }
@@ -165,13 +210,15 @@ static void require_compile_cb_(lj_compile_t* cp) {
   pro->registry.result = luaL_ref(st->L, LUA_REGISTRYINDEX);
   lj_promise_finalize(pro, true);
 }
-static void require_pathfind_cb_(upd_pathfind_t* pf) {
-  lj_promise_t* pro = pf->udata;
+static void require_pathfind_cb_(upd_req_t* req) {
+  find_t_*      fd  = req->udata;
+  lj_promise_t* pro = fd->pro;
   upd_file_t*   stf = pro->stream;
   upd_iso_t*    iso = stf->iso;
 
-  upd_file_t* tar = pf->len? NULL: pf->base;
-  upd_iso_unstack(iso, pf);
+  const bool  ok  = req->result == UPD_REQ_OK && req->dir.entry.len == 0;
+  upd_file_t* tar = ok? req->dir.entry.file: NULL;
+  upd_iso_unstack(iso, fd);
 
   if (HEDLEY_UNLIKELY(tar == NULL)) {
     lj_promise_finalize(pro, false);
@@ -201,13 +248,7 @@ static int require_(lua_State* L) {
   lj_promise_t* pro   = lj_promise_new(stf);
   const int     index = lua_gettop(L);
 
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
-      .iso   = stf->iso,
-      .path  = (uint8_t*) path,
-      .len   = len,
-      .udata = pro,
-      .cb    = require_pathfind_cb_,
-    });
+  const bool ok = find_with_dup_(pro, path, len, require_pathfind_cb_);
   if (HEDLEY_UNLIKELY(!ok)) {
     lj_promise_finalize(pro, false);
   }
@@ -0,0 +1,194 @@
+#include "common.h"
+
+
+typedef struct key_t_ {
+  upd_file_id_t file;
+  uint32_t      gen;
+  uint64_t      index;
+} key_t_;
+
+
+static
+uint64_t
+bcache_hash_(
+  const key_t_* k);
+
+static
+bool
+bcache_eq_(
+  const void* item,
+  const void* key);
+
+static
+upd_bcache_block_t*
+bcache_find_(
+  upd_iso_t*    iso,
+  const key_t_* k,
+  uint64_t      hash);
+
+static
+void
+bcache_link_(
+  upd_iso_t*          iso,
+  upd_bcache_block_t* b);
+
+static
+void
+bcache_unlink_(
+  upd_iso_t*          iso,
+  upd_bcache_block_t* b);
+
+static
+void
+bcache_remove_(
+  upd_iso_t*          iso,
+  upd_bcache_block_t* b);
+
+
+void upd_bcache_deinit(upd_iso_t* iso) {
+  while (iso->bcache.head) {
+    bcache_remove_(iso, iso->bcache.head);
+  }
+  upd_hmap_clear(&iso->bcache.map);
+}
+
+const upd_bcache_block_t* upd_bcache_lookup(
+    upd_file_t* f, uint32_t gen, uint64_t index) {
+  upd_iso_t* iso = f->iso;
+
+  const key_t_ k = {
+    .file  = f->id,
+    .gen   = gen,
+    .index = index,
+  };
+  upd_bcache_block_t* b = bcache_find_(iso, &k, bcache_hash_(&k));
+  if (HEDLEY_UNLIKELY(b == NULL)) {
+    ++iso->bcache.misses;
+    return NULL;
+  }
+
+  if (HEDLEY_UNLIKELY(iso->bcache.head != b)) {
+    bcache_unlink_(iso, b);
+    bcache_link_(iso, b);
+  }
+  ++iso->bcache.hits;
+  return b;
+}
+
+void upd_bcache_put(
+    upd_file_t*    f,
+    uint32_t       gen,
+    uint64_t       index,
+    const uint8_t* data,
+    size_t         len) {
+  upd_iso_t* iso = f->iso;
+
+  assert(len <= UPD_BCACHE_BLOCK);
+  if (HEDLEY_UNLIKELY(len > iso->bcache.budget)) {
+    return;  /* disabled */
+  }
+
+  const key_t_ k = {
+    .file  = f->id,
+    .gen   = gen,
+    .index = index,
+  };
+  const uint64_t hash = bcache_hash_(&k);
+
+  upd_bcache_block_t* b = bcache_find_(iso, &k, hash);
+  if (HEDLEY_UNLIKELY(b)) {
+    bcache_remove_(iso, b);
+  }
+  while (iso->bcache.bytes+len > iso->bcache.budget) {
+    bcache_remove_(iso, iso->bcache.tail);
+  }
+
+  b = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&b, sizeof(*b)+len))) {
+    return;
+  }
+  *b = (upd_bcache_block_t) {
+    .hash  = hash,
+    .file  = f->id,
+    .gen   = gen,
+    .index = index,
+    .len   = len,
+  };
+  memcpy(b->data, data, len);
+
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->bcache.map, hash, b))) {
+    upd_free(&b);
+    return;
+  }
+  bcache_link_(iso, b);
+  iso->bcache.bytes += len;
+}
+
+void upd_bcache_forget(upd_file_t* f, uint32_t gen, uint64_t index) {
+  upd_iso_t* iso = f->iso;
+
+  const key_t_ k = {
+    .file  = f->id,
+    .gen   = gen,
+    .index = index,
+  };
+  upd_bcache_block_t* b = bcache_find_(iso, &k, bcache_hash_(&k));
+  if (HEDLEY_UNLIKELY(b)) {
+    bcache_remove_(iso, b);
+  }
+}
+
+
+static uint64_t bcache_hash_(const key_t_* k) {
+  return upd_hmap_hash_str(upd_hmap_hash_ptr((void*) (uintptr_t) k->file),
+    (const uint8_t*) &k->index, sizeof(k->index)) ^ k->gen;
+}
+
+static bool bcache_eq_(const void* item, const void* key) {
+  const upd_bcache_block_t* b = item;
+  const key_t_*             k = key;
+  return b->file == k->file && b->gen == k->gen && b->index == k->index;
+}
+
+static upd_bcache_block_t* bcache_find_(
+    upd_iso_t* iso, const key_t_* k, uint64_t hash) {
+  return upd_hmap_find(&iso->bcache.map, hash, bcache_eq_, k);
+}
+
+static void bcache_link_(upd_iso_t* iso, upd_bcache_block_t* b) {
+  b->prev = NULL;
+  b->next = iso->bcache.head;
+  if (iso->bcache.head) {
+    iso->bcache.head->prev = b;
+  } else {
+    iso->bcache.tail = b;
+  }
+  iso->bcache.head = b;
+}
+
+static void bcache_unlink_(upd_iso_t* iso, upd_bcache_block_t* b) {
+  if (b->prev) {
+    b->prev->next = b->next;
+  } else {
+    iso->bcache.head = b->next;
+  }
+  if (b->next) {
+    b->next->prev = b->prev;
+  } else {
+    iso->bcache.tail = b->prev;
+  }
+}
+
+static void bcache_remove_(upd_iso_t* iso, upd_bcache_block_t* b) {
+  const key_t_ k = {
+    .file  = b->file,
+    .gen   = b->gen,
+    .index = b->index,
+  };
+  upd_hmap_remove(&iso->bcache.map, b->hash, bcache_eq_, &k);
+  bcache_unlink_(iso, b);
+
+  assert(iso->bcache.bytes >= b->len);
+  iso->bcache.bytes -= b->len;
+  upd_free(&b);
+}
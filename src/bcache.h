@@ -0,0 +1,62 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Isolate-wide cache of file contents in fixed size blocks keyed by
+ * (file, generation, index), filled by upd.bin reads and evicted in LRU
+ * order once the total exceeds UPD_BCACHE_BUDGET bytes (0 disables).
+ * The generation is owned by the caller, which bumps it to forget all
+ * blocks of a file at once (e.g. on npoll update), and blocks of old
+ * generations or deleted files just age out of the LRU. */
+
+
+#define UPD_BCACHE_BLOCK (1024*64)  /* = 64 KiB */
+
+#define UPD_BCACHE_DEFAULT_BUDGET (1024*1024*64)  /* = 64 MiB */
+
+
+struct upd_bcache_block_t {
+  uint64_t      hash;
+  upd_file_id_t file;
+  uint32_t      gen;
+  uint64_t      index;  /* offset / UPD_BCACHE_BLOCK */
+
+  upd_bcache_block_t* prev;  /* LRU, head is the most recent */
+  upd_bcache_block_t* next;
+
+  size_t  len;  /* less than UPD_BCACHE_BLOCK only at the end of file */
+  uint8_t data[];
+};
+
+
+HEDLEY_NON_NULL(1)
+void
+upd_bcache_deinit(
+  upd_iso_t* iso);
+
+/*  Returns the cached block or NULL. The block is valid until the next
+ * put to the cache, so callers use it synchronously. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+const upd_bcache_block_t*
+upd_bcache_lookup(
+  upd_file_t* f,
+  uint32_t    gen,
+  uint64_t    index);
+
+HEDLEY_NON_NULL(1, 4)
+void
+upd_bcache_put(
+  upd_file_t*    f,
+  uint32_t       gen,
+  uint64_t       index,
+  const uint8_t* data,
+  size_t         len);
+
+HEDLEY_NON_NULL(1)
+void
+upd_bcache_forget(
+  upd_file_t* f,
+  uint32_t    gen,
+  uint64_t    index);
@@ -26,6 +26,13 @@
 # include <valgrind.h>
 #endif
 
+#if defined(__unix__)
+# include <setjmp.h>
+# include <signal.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
 
 #define UPD_DECL_FUNC static inline
 #include <libupd.h>
@@ -43,8 +50,18 @@
 
 typedef struct upd_pkg_t upd_pkg_t;
 
+#include "hmap.h"
+#include "dirindex.h"
+#include "lag.h"
 #include "iso.h"
 
 #include "config.h"
 #include "driver.h"
+#include "trace.h"
+#include "dcache.h"
+#include "bcache.h"
+#include "fdcache.h"
+#include "prefetch.h"
+#include "fs.h"
+#include "watch.h"
 #include "file.h"
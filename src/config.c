@@ -209,8 +209,8 @@ bool upd_config_load(upd_config_load_t* load) {
   utf8ncpy(ctx->path, ctx->fpath, ctx->pathlen);
   ctx->path[ctx->pathlen] = 0;
 
-  const bool stat = 0 <= uv_fs_stat(
-    &iso->loop, &ctx->fsreq, (char*) ctx->fpath, config_stat_cb_);
+  const bool stat = 0 <= upd_fs_stat(
+    iso, &ctx->fsreq, (char*) ctx->fpath, config_stat_cb_);
   if (HEDLEY_UNLIKELY(!stat)) {
     upd_iso_unstack(iso, ctx);
     return false;
@@ -434,8 +434,8 @@ static void config_stat_cb_(uv_fs_t* req) {
     goto ABORT;
   }
 
-  const bool open = 0 <= uv_fs_open(
-    &iso->loop, &ctx->fsreq, (char*) ctx->fpath, O_RDONLY, 0, config_open_cb_);
+  const bool open = 0 <= upd_fs_open(
+    iso, &ctx->fsreq, (char*) ctx->fpath, O_RDONLY, 0, config_open_cb_);
   if (HEDLEY_UNLIKELY(!open)) {
     config_logf_(ctx, "open failure");
     goto ABORT;
@@ -464,7 +464,7 @@ static void config_open_cb_(uv_fs_t* req) {
     config_logf_(ctx, "config file buffer allocation failure");
 
     const bool close =
-      0 <= uv_fs_close(&iso->loop, &ctx->fsreq, ctx->fd, config_close_cb_);
+      0 <= upd_fs_close(iso, &ctx->fsreq, ctx->fd, config_close_cb_);
     if (HEDLEY_UNLIKELY(!close)) {
       goto ABORT;
     }
@@ -473,14 +473,14 @@ static void config_open_cb_(uv_fs_t* req) {
 
   const uv_buf_t buf = uv_buf_init((char*) ctx->buf, ctx->size);
 
-  const bool read = 0 <= uv_fs_read(
-    &iso->loop, &ctx->fsreq, ctx->fd, &buf, 1, 0, config_read_cb_);
+  const bool read = 0 <= upd_fs_read(
+    iso, &ctx->fsreq, ctx->fd, &buf, 1, 0, config_read_cb_);
   if (HEDLEY_UNLIKELY(!read)) {
     upd_iso_unstack(iso, ctx->buf);
     config_logf_(ctx, "read failure");
 
     const bool close =
-      0 <= uv_fs_close(&iso->loop, &ctx->fsreq, ctx->fd, config_close_cb_);
+      0 <= upd_fs_close(iso, &ctx->fsreq, ctx->fd, config_close_cb_);
     if (HEDLEY_UNLIKELY(!close)) {
       goto ABORT;
     }
@@ -570,7 +570,7 @@ static void config_read_cb_(uv_fs_t* req) {
 
   bool close;
 EXIT:
-  close = 0 <= uv_fs_close(&iso->loop, &ctx->fsreq, ctx->fd, config_close_cb_);
+  close = 0 <= upd_fs_close(iso, &ctx->fsreq, ctx->fd, config_close_cb_);
   if (HEDLEY_UNLIKELY(!close)) {
     config_unref_(ctx);
   }
@@ -801,7 +801,7 @@ static void task_parse_file_cb_(task_t_* task) {
     };
 
     ++task->refcnt;
-    const bool pf = upd_pathfind_with_dup(&(upd_pathfind_t) {
+    const bool pf = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
         .iso    = iso,
         .path   = (uint8_t*) ftask->dir,
         .len    = ftask->dirlen,
@@ -0,0 +1,330 @@
+#include "common.h"
+
+
+typedef struct key_t_ {
+  upd_file_id_t  parent;
+  const uint8_t* name;
+  size_t         len;
+} key_t_;
+
+
+static
+uint64_t
+dcache_hash_(
+  const key_t_* k);
+
+static
+bool
+dcache_eq_(
+  const void* item,
+  const void* key);
+
+static
+upd_dcache_entry_t*
+dcache_find_(
+  upd_iso_t*    iso,
+  const key_t_* k,
+  uint64_t      hash);
+
+static
+void
+dcache_link_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* e);
+
+static
+void
+dcache_unlink_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* e);
+
+static
+void
+dcache_remove_(
+  upd_iso_t*          iso,
+  upd_dcache_entry_t* e);
+
+
+static
+void
+dcache_find_path_cb_(
+  upd_pathfind_t* pf);
+
+
+void upd_dcache_deinit(upd_iso_t* iso) {
+  while (iso->dcache.head) {
+    dcache_remove_(iso, iso->dcache.head);
+  }
+  upd_hmap_clear(&iso->dcache.map);
+}
+
+bool upd_dcache_lookup(
+    upd_iso_t*     iso,
+    upd_file_t*    parent,
+    const uint8_t* name,
+    size_t         len,
+    upd_file_t**   child) {
+  const key_t_ k = {
+    .parent = parent->id,
+    .name   = name,
+    .len    = len,
+  };
+  const uint64_t hash = dcache_hash_(&k);
+
+  upd_dcache_entry_t* e = dcache_find_(iso, &k, hash);
+  if (HEDLEY_UNLIKELY(e == NULL)) {
+    ++iso->dcache.misses;
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(e->gen != ((upd_file_t_*) parent)->dcache_gen)) {
+    dcache_remove_(iso, e);
+    ++iso->dcache.misses;
+    return false;
+  }
+
+  *child = NULL;
+  if (HEDLEY_LIKELY(e->found)) {
+    *child = upd_file_get(iso, e->child);
+    if (HEDLEY_UNLIKELY(*child == NULL)) {
+      dcache_remove_(iso, e);
+      ++iso->dcache.misses;
+      return false;
+    }
+  }
+
+  if (HEDLEY_UNLIKELY(iso->dcache.head != e)) {
+    dcache_unlink_(iso, e);
+    dcache_link_(iso, e);
+  }
+  ++iso->dcache.hits;
+  return true;
+}
+
+void upd_dcache_put(
+    upd_iso_t*     iso,
+    upd_file_t*    parent,
+    const uint8_t* name,
+    size_t         len,
+    upd_file_t*    child) {
+  const key_t_ k = {
+    .parent = parent->id,
+    .name   = name,
+    .len    = len,
+  };
+  const uint64_t hash = dcache_hash_(&k);
+
+  upd_dcache_entry_t* e = dcache_find_(iso, &k, hash);
+  if (HEDLEY_UNLIKELY(e)) {
+    dcache_remove_(iso, e);
+  }
+
+  if (HEDLEY_UNLIKELY(iso->dcache.n >= iso->dcache.max)) {
+    if (HEDLEY_UNLIKELY(iso->dcache.tail == NULL)) {
+      return;  /* disabled */
+    }
+    dcache_remove_(iso, iso->dcache.tail);
+  }
+
+  e = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len))) {
+    return;
+  }
+  *e = (upd_dcache_entry_t) {
+    .hash   = hash,
+    .parent = parent->id,
+    .gen    = ((upd_file_t_*) parent)->dcache_gen,
+    .child  = child? child->id: 0,
+    .found  = child,
+    .len    = len,
+  };
+  memcpy(e->name, name, len);
+
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->dcache.map, hash, e))) {
+    upd_free(&e);
+    return;
+  }
+  dcache_link_(iso, e);
+  ++iso->dcache.n;
+}
+
+void upd_dcache_forget(
+    upd_iso_t* iso, upd_file_t* parent, const uint8_t* name, size_t len) {
+  const key_t_ k = {
+    .parent = parent->id,
+    .name   = name,
+    .len    = len,
+  };
+  upd_dcache_entry_t* e = dcache_find_(iso, &k, dcache_hash_(&k));
+  if (HEDLEY_UNLIKELY(e)) {
+    dcache_remove_(iso, e);
+  }
+}
+
+void upd_dcache_forget_dir(upd_file_t* parent) {
+  /* stale entries are removed lazily on lookup or by LRU */
+  ++((upd_file_t_*) parent)->dcache_gen;
+}
+
+bool upd_dcache_pathfind_with_dup(const upd_pathfind_t* src) {
+  upd_iso_t* iso = src->iso;
+
+  upd_file_t* base = src->base;
+  if (base == NULL) {
+    base = upd_file_get(iso, UPD_FILE_ID_ROOT);
+    if (HEDLEY_UNLIKELY(base == NULL)) {
+      goto MISS;
+    }
+  } else if (src->len && src->path[0] == '/') {
+    goto MISS;
+  }
+
+  const uint8_t* path = src->path;
+  size_t         len  = src->len;
+  while (len) {
+    if (*path == '/') {
+      ++path, --len;
+      continue;
+    }
+
+    size_t term = 0;
+    while (term < len && path[term] != '/') {
+      ++term;
+    }
+    const bool dots =
+      (term == 1 && path[0] == '.') ||
+      (term == 2 && path[0] == '.' && path[1] == '.');
+    if (HEDLEY_UNLIKELY(dots)) {
+      goto MISS;
+    }
+
+    upd_file_t* child;
+    if (!upd_dcache_lookup(iso, base, path, term, &child)) {
+      goto MISS;
+    }
+    if (child == NULL) {
+      if (src->create) {
+        goto MISS;
+      }
+      break;
+    }
+    base  = child;
+    path += term;
+    len  -= term;
+  }
+
+  upd_pathfind_t* pf = upd_iso_stack(iso, sizeof(*pf));
+  if (HEDLEY_UNLIKELY(pf == NULL)) {
+    return false;
+  }
+  *pf = *src;
+  pf->base = base;
+  pf->path = path;
+  pf->len  = len;
+  pf->cb(pf);
+  return true;
+
+MISS:
+  return upd_pathfind_with_dup(src);
+}
+
+bool upd_dcache_find_path(upd_req_t* req) {
+  upd_file_t*          f = req->file;
+  upd_req_dir_entry_t* e = &req->dir.entry;
+
+  /* the name is relative to the dir even if it starts with a slash */
+  const uint8_t* path = e->name;
+  size_t         len  = e->len;
+  while (len && *path == '/') {
+    ++path, --len;
+  }
+
+  const bool ok = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
+      .iso   = f->iso,
+      .base  = f,
+      .path  = path,
+      .len   = len,
+      .udata = req,
+      .cb    = dcache_find_path_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    req->result = UPD_REQ_NOMEM;
+    return false;
+  }
+  return true;
+}
+
+
+static uint64_t dcache_hash_(const key_t_* k) {
+  return upd_hmap_hash_str(upd_hmap_hash_ptr((void*) (uintptr_t) k->parent),
+    k->name, k->len);
+}
+
+static bool dcache_eq_(const void* item, const void* key) {
+  const upd_dcache_entry_t* e = item;
+  const key_t_*             k = key;
+  return
+    e->parent == k->parent &&
+    e->len    == k->len    &&
+    memcmp(e->name, k->name, k->len) == 0;
+}
+
+static upd_dcache_entry_t* dcache_find_(
+    upd_iso_t* iso, const key_t_* k, uint64_t hash) {
+  return upd_hmap_find(&iso->dcache.map, hash, dcache_eq_, k);
+}
+
+static void dcache_link_(upd_iso_t* iso, upd_dcache_entry_t* e) {
+  e->prev = NULL;
+  e->next = iso->dcache.head;
+  if (iso->dcache.head) {
+    iso->dcache.head->prev = e;
+  } else {
+    iso->dcache.tail = e;
+  }
+  iso->dcache.head = e;
+}
+
+static void dcache_unlink_(upd_iso_t* iso, upd_dcache_entry_t* e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    iso->dcache.head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    iso->dcache.tail = e->prev;
+  }
+}
+
+static void dcache_find_path_cb_(upd_pathfind_t* pf) {
+  upd_req_t*           req = pf->udata;
+  upd_req_dir_entry_t* e   = &req->dir.entry;
+  upd_iso_t*           iso = pf->iso;
+
+  /* components left are always the tail of the name */
+  const size_t left = pf->len < e->len? pf->len: e->len;
+  *e = (upd_req_dir_entry_t) {
+    .name = e->name + e->len - left,
+    .len  = left,
+    .file = pf->base,
+  };
+  upd_iso_unstack(iso, pf);
+
+  req->result = UPD_REQ_OK;
+  upd_file_req_cb(req);
+}
+
+static void dcache_remove_(upd_iso_t* iso, upd_dcache_entry_t* e) {
+  const key_t_ k = {
+    .parent = e->parent,
+    .name   = e->name,
+    .len    = e->len,
+  };
+  upd_hmap_remove(&iso->dcache.map, e->hash, dcache_eq_, &k);
+  dcache_unlink_(iso, e);
+
+  assert(iso->dcache.n);
+  --iso->dcache.n;
+  upd_free(&e);
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Isolate-wide cache of directory entries keyed by (parent, name).
+ * Entries are filled by UPD_REQ_DIR_FIND on dirs in core, and both found
+ * and not-found results are cached, so a path whose components are all
+ * cached resolves without any request.
+ * Directories forget an entry whenever it's added or removed, and bump
+ * their generation to forget all at once (e.g. on syncdir rescan).
+ * Children are held by id without reference, so entries of deleted
+ * files are detected on lookup.
+ * Drivers outside core can't call upd_dcache_pathfind_with_dup, so
+ * DIR_FIND on upd.dir and upd.syncdir also accepts a name of multiple
+ * components and resolves it through the cache. */
+
+
+#define UPD_DCACHE_DEFAULT_MAX 65536
+
+
+struct upd_dcache_entry_t {
+  uint64_t      hash;
+  upd_file_id_t parent;
+  uint32_t      gen;    /* generation of the parent when cached */
+  upd_file_id_t child;
+  bool          found;
+
+  upd_dcache_entry_t* prev;  /* LRU, head is the most recent */
+  upd_dcache_entry_t* next;
+
+  size_t  len;
+  uint8_t name[];
+};
+
+
+HEDLEY_NON_NULL(1)
+void
+upd_dcache_deinit(
+  upd_iso_t* iso);
+
+/*  Returns true if the entry is cached, and *child is set to the found
+ * file or NULL (not found). */
+HEDLEY_NON_NULL(1, 2, 5)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_dcache_lookup(
+  upd_iso_t*     iso,
+  upd_file_t*    parent,
+  const uint8_t* name,
+  size_t         len,
+  upd_file_t**   child);
+
+/* Caches the result of DIR_FIND, child is NULL if not found. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_dcache_put(
+  upd_iso_t*     iso,
+  upd_file_t*    parent,
+  const uint8_t* name,
+  size_t         len,
+  upd_file_t*    child);
+
+HEDLEY_NON_NULL(1, 2)
+void
+upd_dcache_forget(
+  upd_iso_t*     iso,
+  upd_file_t*    parent,
+  const uint8_t* name,
+  size_t         len);
+
+HEDLEY_NON_NULL(1)
+void
+upd_dcache_forget_dir(
+  upd_file_t* parent);
+
+/*  Same as upd_pathfind_with_dup, but completes synchronously without
+ * requests when all components are cached. */
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_dcache_pathfind_with_dup(
+  const upd_pathfind_t* pf);
+
+/*  Handles DIR_FIND whose name is a path (see upd_dcache_is_path).
+ * The entry is set to the deepest file found and the rest of the name
+ * which is not resolved, so the path is found only when len is 0.
+ * Returns false with the result set if it fails synchronously. */
+HEDLEY_NON_NULL(1)
+bool
+upd_dcache_find_path(
+  upd_req_t* req);
+
+
+static inline bool upd_dcache_is_path(const upd_req_dir_entry_t* e) {
+  return e->file == NULL && e->len && memchr(e->name, '/', e->len);
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Hash index of directory entries, maintained next to the ordered
+ * children array of dir drivers in core.
+ * Names are unique in a directory, but a file may appear under
+ * multiple names, so the reverse index allows duplicated keys.
+ * Entries without file (not instantiated yet) are indexed only by name. */
+
+
+typedef struct upd_dirindex_t upd_dirindex_t;
+
+struct upd_dirindex_t {
+  upd_hmap_t names;  /* upd_req_dir_entry_t* */
+  upd_hmap_t files;  /* upd_req_dir_entry_t* */
+};
+
+
+static inline uint64_t upd_dirindex_hash_name_(const uint8_t* name, size_t len) {
+  return upd_hmap_hash_str(0, name, len);
+}
+
+static inline bool upd_dirindex_eq_name_(const void* item, const void* key) {
+  const upd_req_dir_entry_t* e = item;
+  const upd_req_dir_entry_t* k = key;
+  return upd_streq(e->name, e->len, k->name, k->len);
+}
+
+static inline bool upd_dirindex_eq_file_(const void* item, const void* key) {
+  const upd_req_dir_entry_t* e = item;
+  return e->file == key;
+}
+
+
+static inline void upd_dirindex_clear(upd_dirindex_t* idx) {
+  upd_hmap_clear(&idx->names);
+  upd_hmap_clear(&idx->files);
+}
+
+static inline bool upd_dirindex_insert(
+    upd_dirindex_t* idx, upd_req_dir_entry_t* e) {
+  const uint64_t hname = upd_dirindex_hash_name_(e->name, e->len);
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&idx->names, hname, e))) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(e->file &&
+      !upd_hmap_insert(&idx->files, upd_hmap_hash_ptr(e->file), e))) {
+    upd_hmap_remove(&idx->names, hname, upd_hmap_eq_ptr, e);
+    return false;
+  }
+  return true;
+}
+
+static inline void upd_dirindex_remove(
+    upd_dirindex_t* idx, upd_req_dir_entry_t* e) {
+  upd_hmap_remove(&idx->names,
+    upd_dirindex_hash_name_(e->name, e->len), upd_hmap_eq_ptr, e);
+  if (e->file) {
+    upd_hmap_remove(&idx->files,
+      upd_hmap_hash_ptr(e->file), upd_hmap_eq_ptr, e);
+  }
+}
+
+/* Replaces the file of the indexed entry without unref of the old one. */
+static inline bool upd_dirindex_set_file(
+    upd_dirindex_t* idx, upd_req_dir_entry_t* e, upd_file_t* f) {
+  if (HEDLEY_UNLIKELY(f && !upd_hmap_insert(&idx->files, upd_hmap_hash_ptr(f), e))) {
+    return false;
+  }
+  if (e->file) {
+    upd_hmap_remove(&idx->files,
+      upd_hmap_hash_ptr(e->file), upd_hmap_eq_ptr, e);
+  }
+  e->file = f;
+  return true;
+}
+
+static inline upd_req_dir_entry_t* upd_dirindex_find_by_name(
+    const upd_dirindex_t* idx, const uint8_t* name, size_t len) {
+  const upd_req_dir_entry_t k = {
+    .name = (uint8_t*) name,
+    .len  = len,
+  };
+  return upd_hmap_find(&idx->names,
+    upd_dirindex_hash_name_(name, len), upd_dirindex_eq_name_, &k);
+}
+
+static inline upd_req_dir_entry_t* upd_dirindex_find_by_file(
+    const upd_dirindex_t* idx, const upd_file_t* f) {
+  return upd_hmap_find(&idx->files,
+    upd_hmap_hash_ptr(f), upd_dirindex_eq_file_, f);
+}
+
+static inline upd_req_dir_entry_t* upd_dirindex_find(
+    const upd_dirindex_t* idx, const upd_req_dir_entry_t* e) {
+  return e->file?
+    upd_dirindex_find_by_file(idx, e->file):
+    upd_dirindex_find_by_name(idx, e->name, e->len);
+}
@@ -12,6 +12,22 @@
 static const upd_host_t host_ = UPD_HOST_INSTANCE;
 
 
+typedef struct sys_file_t_ {
+  const char* name;
+  const char* param;
+} sys_file_t_;
+
+static const sys_file_t_ sys_files_[] = {
+  { .name = "upd.cache", .param = "cache", },
+  { .name = "upd.lock",  .param = "lock",  },
+  { .name = "upd.stats", .param = "stats", },
+  { .name = "upd.trace", .param = "trace", },
+  { .name = "upd.lag",   .param = "lag",   },
+  { .name = "upd.mount", .param = "mount", },
+  { NULL, },
+};
+
+
 static
 void
 setup_pathfind_cb_(
@@ -22,6 +38,17 @@ void
 setup_lock_for_add_cb_(
   upd_file_lock_t* lock);
 
+static
+void
+setup_add_sys_file_(
+  upd_file_t*        sys,
+  const sys_file_t_* file);
+
+static
+void
+setup_add_cb_(
+  upd_req_t* req);
+
 
 static
 void
@@ -40,13 +67,14 @@ void upd_driver_setup(upd_iso_t* iso) {
     upd_driver_register(iso, &upd_driver_bin) &&
     upd_driver_register(iso, &upd_driver_factory) &&
     upd_driver_register(iso, &upd_driver_srv_tcp) &&
-    upd_driver_register(iso, &upd_driver_syncdir);
+    upd_driver_register(iso, &upd_driver_syncdir) &&
+    upd_driver_register(iso, &upd_driver_sys);
   if (HEDLEY_UNLIKELY(!reg)) {
     upd_iso_msgf(iso, "system driver registration failure\n");
     return;
   }
 
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
+  const bool ok = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
       .iso  = iso,
       .path = (uint8_t*) "/sys",
       .len  = 4,
@@ -115,11 +143,58 @@ static void setup_lock_for_add_cb_(upd_file_lock_t* lock) {
     goto EXIT;
   }
 
+  for (const sys_file_t_* file = sys_files_; file->name; ++file) {
+    setup_add_sys_file_(sys, file);
+  }
+
 EXIT:
   upd_file_unlock(lock);
   upd_iso_unstack(iso, lock);
 }
 
+static void setup_add_sys_file_(upd_file_t* sys, const sys_file_t_* file) {
+  upd_iso_t* iso = sys->iso;
+
+  upd_file_t* f = upd_file_new(&(upd_file_t) {
+      .iso      = iso,
+      .driver   = &upd_driver_sys,
+      .param    = (uint8_t*) file->param,
+      .paramlen = utf8size_lazy(file->param),
+    });
+  if (HEDLEY_UNLIKELY(f == NULL)) {
+    upd_iso_msgf(iso,
+      "'/sys/%s' creation failure, while driver setup\n", file->name);
+    return;
+  }
+
+  const bool add = upd_req_with_dup(&(upd_req_t) {
+      .file = sys,
+      .type = UPD_REQ_DIR_ADD,
+      .dir  = { .entry = {
+        .file = f,
+        .name = (uint8_t*) file->name,
+        .len  = utf8size_lazy(file->name),
+      }, },
+      .cb = setup_add_cb_,
+    });
+  upd_file_unref(f);
+
+  if (HEDLEY_UNLIKELY(!add)) {
+    upd_iso_msgf(iso,
+      "'/sys/%s' addition failure, while driver setup\n", file->name);
+    return;
+  }
+}
+
+static void setup_add_cb_(upd_req_t* req) {
+  upd_iso_t* iso = req->file->iso;
+
+  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
+    upd_iso_msgf(iso, "'/sys' refused to add a file, while driver setup\n");
+  }
+  upd_iso_unstack(iso, req);
+}
+
 
 static void load_work_cb_(uv_work_t* w) {
   upd_driver_load_external_t* load = w->data;
@@ -3,8 +3,14 @@
 #include "common.h"
 
 
+#define UPD_DRIVER_STATS_CATS    8
+#define UPD_DRIVER_STATS_TYPES   8
+#define UPD_DRIVER_STATS_BUCKETS 24  /* log2 of microseconds */
+
+
 typedef struct upd_driver_rule_t          upd_driver_rule_t;
 typedef struct upd_driver_load_external_t upd_driver_load_external_t;
+typedef struct upd_driver_stats_t         upd_driver_stats_t;
 
 
 struct upd_driver_load_external_t {
@@ -25,12 +31,26 @@ struct upd_driver_load_external_t {
 };
 
 
+/*  Counters of each registered driver, which are allocated on the
+ * registration so that nothing is allocated on the request path.
+ * Requests are counted by drivers in core only, because upd_req()
+ * dispatches to drivers directly without the core. */
+struct upd_driver_stats_t {
+  const upd_driver_t* driver;
+
+  size_t   files;
+  uint64_t reqs[UPD_DRIVER_STATS_CATS][UPD_DRIVER_STATS_TYPES];
+  uint64_t latency[UPD_DRIVER_STATS_BUCKETS];
+};
+
+
 extern const upd_driver_t upd_driver_bin;
 extern const upd_driver_t upd_driver_dir;
 extern const upd_driver_t upd_driver_factory;
 extern const upd_driver_t upd_driver_syncdir;
 extern const upd_driver_t upd_driver_srv;
 extern const upd_driver_t upd_driver_srv_tcp;
+extern const upd_driver_t upd_driver_sys;
 
 
 HEDLEY_NON_NULL(1)
@@ -60,6 +80,18 @@ upd_driver_register(
   upd_iso_t*          iso,
   const upd_driver_t* driver);
 
+HEDLEY_NON_NULL(1, 2)
+static inline
+upd_driver_stats_t*
+upd_driver_stats(
+  upd_iso_t*          iso,
+  const upd_driver_t* driver);
+
+
+static inline bool upd_driver_stats_eq_(const void* item, const void* d) {
+  const upd_driver_stats_t* s = item;
+  return s->driver == d;
+}
 
 static inline bool upd_driver_register(
     upd_iso_t* iso, const upd_driver_t* driver) {
@@ -68,7 +100,25 @@ static inline bool upd_driver_register(
     upd_iso_msgf(iso, "driver '%s' is already registered\n", driver->name);
     return false;
   }
+
+  upd_driver_stats_t* stats = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&stats, sizeof(*stats)))) {
+    upd_iso_msgf(iso, "driver registration failure because of memory error\n");
+    return false;
+  }
+  *stats = (upd_driver_stats_t) {
+    .driver = driver,
+  };
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->driver_stats, upd_hmap_hash_ptr(driver), stats))) {
+    upd_free(&stats);
+    upd_iso_msgf(iso, "driver registration failure because of memory error\n");
+    return false;
+  }
+
   if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->drivers, (void*) driver, SIZE_MAX))) {
+    upd_hmap_remove(&iso->driver_stats,
+      upd_hmap_hash_ptr(driver), upd_driver_stats_eq_, driver);
+    upd_free(&stats);
     upd_iso_msgf(iso, "driver registration failure because of memory error\n");
     return false;
   }
@@ -85,3 +135,9 @@ static inline const upd_driver_t* upd_driver_lookup(
   }
   return NULL;
 }
+
+static inline upd_driver_stats_t* upd_driver_stats(
+    upd_iso_t* iso, const upd_driver_t* driver) {
+  return upd_hmap_find(&iso->driver_stats,
+    upd_hmap_hash_ptr(driver), upd_driver_stats_eq_, driver);
+}
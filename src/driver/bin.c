@@ -7,22 +7,85 @@
 
 #define DEFAULT_MIMETYPE_ "application/octet-stream"
 
+#define READERS_DEFAULT_ 4
+#define READERS_MAX_     64
 
-typedef struct bin_t_  bin_t_;
-typedef struct task_t_ task_t_;
+#define WRITEV_MAX_ 64  /* writes merged into a single pwritev */
 
+#define BCACHE_READ_MAX_ 16  /* blocks, larger reads bypass the block cache */
+#define SEQ_MIN_         2   /* sequential reads in a row to start read-ahead */
+#define READAHEAD_       8   /* blocks */
 
-struct bin_t_ {
-  uv_file          fd;
-  upd_file_watch_t watch;
+#define SYNC_MS_DEFAULT_ 100
 
-  size_t bytes;
+#if defined(__unix__)
+# define MMAP_AVAILABLE_ 1
+#else
+# define MMAP_AVAILABLE_ 0
+#endif
 
-  task_t_* last_task;
 
-  unsigned read  : 1;
-  unsigned write : 1;
-  unsigned open  : 1;
+typedef struct bin_t_    bin_t_;
+typedef struct task_t_   task_t_;
+typedef struct closer_t_ closer_t_;
+
+typedef enum sync_t_ {
+  SYNC_NONE_,
+  SYNC_PERIODIC_,  /* fdatasync within sync_ms after writes */
+  SYNC_REQUEST_,   /* writes are answered after fdatasync */
+} sync_t_;
+
+
+struct bin_t_ {
+  uv_file             fd;
+  upd_file_watch_t    watch;
+  upd_fdcache_entry_t fdcache;
+
+  /*  The last stat result, kept up to date by our own writes. Updates
+   * notified by npoll reopen the fd only when it differs. */
+  uv_stat_t stat;
+  size_t    bytes;
+
+  /*  Whole file mapped while open in mmap mode, NULL if empty, failed
+   * or dropped by an update until the stat confirms the size. Reads
+   * copy from it under a SIGBUS guard, and a fault caused by others
+   * truncating the file drops the mapping until the next stat. */
+  uint8_t* map;
+  size_t   maplen;
+
+  /*  Tasks run in the queued order, but consecutive reads run in
+   * parallel up to `readers`. Any other task waits for all running
+   * tasks and blocks the following ones until it finishes. */
+  task_t_* first_task;  /* the oldest one waiting for dispatch */
+  task_t_* last_task;
+  size_t   running;
+  size_t   readers;
+  size_t   closes;  /* close tasks not finished, the fd is going away */
+
+  /* blocks in the isolate cache are keyed with gen, bumped to forget all */
+  uint32_t gen;
+  uint64_t seq_end;  /* end of the last read */
+  size_t   seq;      /* sequential reads in a row */
+  uint64_t ra_end;   /* end of the read-ahead issued */
+
+  /*  Writes waiting for durability share a single fdatasync queued
+   * as a task, and the ones finished meanwhile join the next. */
+  sync_t_           sync;
+  uint64_t          sync_ms;
+  upd_iso_timeout_t sync_timer;
+  upd_array_of(upd_req_t*) syncq;
+
+  unsigned read        : 1;
+  unsigned write       : 1;
+  unsigned open        : 1;
+  unsigned mmap        : 1;
+  unsigned exclusive   : 1;
+  unsigned dispatching : 1;
+  unsigned dirty       : 1;  /* written since the last fdatasync */
+  unsigned sync_queued : 1;
+  unsigned stat_ok     : 1;  /* the file existed at the last stat */
+  unsigned stat_done   : 1;
+  unsigned stat_queued : 1;
 };
 
 struct task_t_ {
@@ -32,13 +95,46 @@ struct task_t_ {
   upd_req_t*  req;
   task_t_*    next;
 
+  uint64_t since;  /* hrtime when the req is queued */
+
   uint8_t* buf;
 
+  /* file range of buf, filled into the block cache */
+  uint64_t base;
+  size_t   len;
+  uint32_t gen;
+
+  /* adjacent writes merged into this, linked by next */
+  task_t_* group;
+
+  /* writes answered by this fdatasync */
+  upd_req_t** syncs;
+  size_t      nsyncs;
+
   void
   (*exec)(
     task_t_* task);
+
+  unsigned shared : 1;
+  unsigned cache  : 1;  /* buf is aligned to blocks */
 };
 
+struct closer_t_ {
+  uv_fs_t    fsreq;
+  upd_iso_t* iso;
+  uv_file    fd;
+};
+
+
+#if MMAP_AVAILABLE_
+/*  The handler is installed once for the process, and jumps back to
+ * the copy running on the faulting thread. */
+static uv_once_t                 bin_sigbus_once_ = UV_ONCE_INIT;
+static bool                      bin_sigbus_ok_;
+static struct sigaction          bin_sigbus_prev_;
+static _Thread_local sigjmp_buf* bin_sigbus_jmp_;
+#endif
+
 
 static
 void
@@ -75,27 +171,155 @@ const upd_driver_t upd_driver_bin = {
 };
 
 
+static
+bool
+bin_read_cached_(
+  upd_file_t* f,
+  upd_req_t*  req);
+
+static
+void
+bin_note_read_(
+  upd_file_t* f,
+  uint64_t    off,
+  size_t      sz);
+
+static
+void
+bin_cache_fill_(
+  upd_file_t*    f,
+  uint32_t       gen,
+  uint64_t       base,
+  const uint8_t* buf,
+  size_t         len);
+
+static
+void
+bin_cache_forget_(
+  upd_file_t* f,
+  uint64_t    off,
+  size_t      len);
+
+static
+void
+bin_map_(
+  upd_file_t* f);
+
+static
+void
+bin_unmap_(
+  upd_file_t* f);
+
+static
+bool
+bin_map_copy_(
+  uint8_t*       dst,
+  const uint8_t* src,
+  size_t         len);
+
+#if MMAP_AVAILABLE_
+static
+void
+bin_sigbus_install_(
+  void);
+
+static
+void
+bin_sigbus_handler_(
+  int        sig,
+  siginfo_t* info,
+  void*      uctx);
+#endif
+
+
+static
+task_t_*
+task_dup_(
+  const task_t_* src);
+
 static
 bool
 task_queue_with_dup_(
   const task_t_* task);
 
+static
+bool
+task_unshift_with_dup_(
+  const task_t_* task);
+
+static
+bool
+task_queue_stat_(
+  upd_file_t* f);
+
 static
 bool
 task_queue_open_(
   upd_file_t* f);
 
+static
+bool
+task_queue_close_(
+  upd_file_t* f);
+
+static
+void
+task_dispatch_(
+  upd_file_t* f);
+
 static
 void
 task_finalize_(
   task_t_* task);
 
+static
+bool
+task_queue_sync_(
+  upd_file_t* f);
+
+static
+void
+task_take_syncq_(
+  task_t_* task);
+
+static
+void
+task_answer_syncs_(
+  task_t_*         task,
+  upd_req_result_t result);
+
+static
+void
+task_write_finish_(
+  task_t_* task,
+  ssize_t  result);
+
+static
+void
+task_schedule_sync_(
+  task_t_* task);
+
 
 static
 void
 bin_watch_cb_(
   upd_file_watch_t* watch);
 
+static
+bool
+bin_fdcache_evict_cb_(
+  upd_fdcache_entry_t* e);
+
+static
+void
+bin_sync_timer_cb_(
+  upd_iso_timeout_t* t);
+
+static
+void
+bin_deinit_sync_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 bin_deinit_close_cb_(
@@ -132,6 +356,16 @@ void
 task_read_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+task_readahead_exec_cb_(
+  task_t_* task);
+
+static
+void
+task_readahead_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 task_write_exec_cb_(
@@ -152,11 +386,31 @@ void
 task_truncate_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+task_sync_exec_cb_(
+  task_t_* task);
+
+static
+void
+task_sync_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 task_close_exec_cb_(
   task_t_* task);
 
+static
+void
+task_close_sync_cb_(
+  uv_fs_t* fsreq);
+
+static
+void
+task_close_(
+  task_t_* task);
+
 static
 void
 task_close_cb_(
@@ -177,11 +431,17 @@ static void bin_parse_param_(upd_file_t* f) {
     return;
   }
 
-  const yaml_node_t* mode = NULL;
+  const yaml_node_t* mode    = NULL;
+  const yaml_node_t* sync    = NULL;
+  uint64_t           readers = ctx->readers;
+  uint64_t           sync_ms = ctx->sync_ms;
 
   const char* invalid =
     upd_yaml_find_fields_from_root(&doc, (upd_yaml_field_t[]) {
-        { .name = "mode", .str = &mode, },
+        { .name = "mode",    .str = &mode,    },
+        { .name = "readers", .ui  = &readers, },
+        { .name = "sync",    .str = &sync,    },
+        { .name = "sync_ms", .ui  = &sync_ms, },
         { NULL, },
       });
   if (HEDLEY_UNLIKELY(invalid)) {
@@ -204,6 +464,17 @@ static void bin_parse_param_(upd_file_t* f) {
       ctx->read  = false;
       ctx->write = true;
 
+    } else if (upd_strcaseq_c("mmap", mode_s, mode_n)) {
+      ctx->read  = true;
+      ctx->write = false;
+#if MMAP_AVAILABLE_
+      uv_once(&bin_sigbus_once_, bin_sigbus_install_);
+      ctx->mmap = bin_sigbus_ok_;
+#endif
+      if (HEDLEY_UNLIKELY(!ctx->mmap)) {
+        upd_iso_msgf(iso, LOG_PREFIX_"mmap is not supported, falls back to r\n");
+      }
+
     } else {
       upd_iso_msgf(iso,
         LOG_PREFIX_"invalid mode: '%.*s'\n", (int) mode_n, mode_s);
@@ -211,6 +482,32 @@ static void bin_parse_param_(upd_file_t* f) {
     }
   }
 
+  if (sync) {
+    const uint8_t* sync_s = sync->data.scalar.value;
+    const size_t   sync_n = sync->data.scalar.length;
+    if (upd_strcaseq_c("none", sync_s, sync_n)) {
+      ctx->sync = SYNC_NONE_;
+
+    } else if (upd_strcaseq_c("periodic", sync_s, sync_n)) {
+      ctx->sync = SYNC_PERIODIC_;
+
+    } else if (upd_strcaseq_c("request", sync_s, sync_n)) {
+      ctx->sync = SYNC_REQUEST_;
+
+    } else {
+      upd_iso_msgf(iso,
+        LOG_PREFIX_"invalid sync: '%.*s'\n", (int) sync_n, sync_s);
+      goto EXIT;
+    }
+  }
+  ctx->sync_ms = sync_ms;
+
+  if (HEDLEY_UNLIKELY(readers == 0 || readers > READERS_MAX_)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"readers must be in 1~%d\n", READERS_MAX_);
+    goto EXIT;
+  }
+  ctx->readers = readers;
+
 EXIT:
   yaml_document_delete(&doc);
 }
@@ -245,23 +542,32 @@ static bool bin_init_(upd_file_t* f) {
       .file = f,
       .cb   = bin_watch_cb_,
     },
-    .read  = true,
-    .write = true,
+    .fdcache = {
+      .udata = f,
+      .evict = bin_fdcache_evict_cb_,
+    },
+    .readers = READERS_DEFAULT_,
+    .sync_ms = SYNC_MS_DEFAULT_,
+    .sync_timer = {
+      .udata = f,
+      .cb    = bin_sync_timer_cb_,
+    },
+    .read    = true,
+    .write   = true,
   };
   f->ctx = ctx;
   bin_parse_param_(f);
 
-  if (HEDLEY_UNLIKELY(!upd_file_watch(&ctx->watch))) {
+  const uint16_t mask =
+    UPD_FILE_EVENT_BIT(UPD_FILE_UPDATE_N) |
+    UPD_FILE_EVENT_BIT(UPD_FILE_UNCACHE);
+  if (HEDLEY_UNLIKELY(!upd_file_watch_with_mask(&ctx->watch, mask))) {
     upd_iso_msgf(iso, LOG_PREFIX_"self watch failure\n");
     upd_free(&ctx);
     return false;
   }
 
-  const bool q = task_queue_with_dup_(&(task_t_) {
-      .file = f,
-      .exec = task_stat_exec_cb_,
-    });
-  if (HEDLEY_UNLIKELY(!q)) {
+  if (HEDLEY_UNLIKELY(!task_queue_stat_(f))) {
     upd_iso_msgf(iso, LOG_PREFIX_"failed to queue first task\n");
     upd_file_unwatch(&ctx->watch);
     upd_free(&ctx);
@@ -275,18 +581,37 @@ static void bin_deinit_(upd_file_t* f) {
   upd_iso_t* iso = f->iso;
 
   upd_file_unwatch(&ctx->watch);
+  upd_iso_timeout_stop(iso, &ctx->sync_timer);
+  upd_fdcache_remove(iso, &ctx->fdcache);
+  bin_unmap_(f);
+
+  /* tasks hold refs of the file, so no one can wait for a sync here */
+  assert(ctx->syncq.n == 0);
 
   if (HEDLEY_LIKELY(!ctx->open)) {
     goto EXIT;
   }
-  uv_fs_t* fsreq = upd_iso_stack(iso, sizeof(*fsreq));
-  if (HEDLEY_UNLIKELY(fsreq == NULL)) {
+  closer_t_* cl = upd_iso_stack(iso, sizeof(*cl));
+  if (HEDLEY_UNLIKELY(cl == NULL)) {
     goto EXIT;
   }
-  *fsreq = (uv_fs_t) { .data = iso, };
+  *cl = (closer_t_) {
+    .fsreq = { .data = cl, },
+    .iso   = iso,
+    .fd    = ctx->fd,
+  };
 
-  const int err = uv_fs_close(&iso->loop, fsreq, ctx->fd, bin_deinit_close_cb_);
+  if (HEDLEY_UNLIKELY(ctx->dirty && ctx->sync != SYNC_NONE_)) {
+    const int err = upd_fs_fdatasync(
+      iso, &cl->fsreq, cl->fd, bin_deinit_sync_cb_);
+    if (HEDLEY_LIKELY(0 <= err)) {
+      goto EXIT;
+    }
+  }
+  const int err = upd_fs_close(
+    iso, &cl->fsreq, cl->fd, bin_deinit_close_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_unstack(iso, cl);
     goto EXIT;
   }
 
@@ -297,6 +622,15 @@ EXIT:
 static bool bin_handle_(upd_req_t* req) {
   upd_file_t* f   = req->file;
   bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  upd_file_stats_req(req);
+
+  /* tasks queued after a pending close need another open */
+  const bool open = ctx->open && !ctx->closes;
+  if (HEDLEY_LIKELY(open)) {
+    upd_fdcache_touch(iso, &ctx->fdcache);
+  }
 
   switch (req->type) {
   case UPD_REQ_STREAM_READ: {
@@ -304,14 +638,22 @@ static bool bin_handle_(upd_req_t* req) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
-    if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
+
+    /* hits are answered right away unless a barrier is pending */
+    const uint64_t since = uv_hrtime();
+    if (!ctx->exclusive && !ctx->first_task && bin_read_cached_(f, req)) {
+      upd_file_stats_done(f, since);
+      return true;
+    }
+    if (HEDLEY_UNLIKELY(!open && !task_queue_open_(f))) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
     const bool ok = task_queue_with_dup_(&(task_t_) {
-        .file = f,
-        .req  = req,
-        .exec = task_read_exec_cb_,
+        .file   = f,
+        .req    = req,
+        .exec   = task_read_exec_cb_,
+        .shared = true,
       });
     if (HEDLEY_UNLIKELY(!ok)) {
       req->result = UPD_REQ_NOMEM;
@@ -324,7 +666,7 @@ static bool bin_handle_(upd_req_t* req) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
-    if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
+    if (HEDLEY_UNLIKELY(!open && !task_queue_open_(f))) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
@@ -344,7 +686,7 @@ static bool bin_handle_(upd_req_t* req) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
-    if (HEDLEY_UNLIKELY(!ctx->open && !task_queue_open_(f))) {
+    if (HEDLEY_UNLIKELY(!open && !task_queue_open_(f))) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
@@ -366,136 +708,685 @@ static bool bin_handle_(upd_req_t* req) {
 }
 
 
-static bool task_queue_with_dup_(const task_t_* src) {
-  upd_file_t* f   = src->file;
-  bin_t_*     ctx = f->ctx;
-  upd_iso_t*  iso = f->iso;
+static bool bin_read_cached_(upd_file_t* f, upd_req_t* req) {
+  bin_t_*    ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
 
-  task_t_* task = upd_iso_stack(iso, sizeof(*task));
-  if (HEDLEY_UNLIKELY(task == NULL)) {
-    return false;
-  }
+  const uint64_t off = req->stream.io.offset;
 
-  upd_file_ref(f);
-  *task = *src;
-  if (HEDLEY_LIKELY(ctx->last_task)) {
-    ctx->last_task->next = task;
-    ctx->last_task       = task;
-  } else {
-    ctx->last_task = task;
-    task->exec(task);
+  size_t sz = req->stream.io.size;
+  if (HEDLEY_LIKELY(sz+off > ctx->bytes)) {
+    sz = ctx->bytes > off? ctx->bytes-off: 0;
   }
-  return task;
-}
-
-static bool task_queue_open_(upd_file_t* f) {
-  return task_queue_with_dup_(&(task_t_) {
-      .file = f,
-      .exec = task_open_exec_cb_,
-    });
-}
 
-static void task_finalize_(task_t_* task) {
-  upd_file_t* f   = task->file;
-  bin_t_*     ctx = f->ctx;
-  upd_iso_t*  iso = f->iso;
+  /* reads at the end need no fd as long as the stat is known */
+  if (HEDLEY_UNLIKELY(off >= ctx->bytes && ctx->stat_ok)) {
+    req->stream.io = (upd_req_stream_io_t) {
+      .offset = off,
+      .tail   = true,
+    };
+    req->result = UPD_REQ_OK;
+    upd_file_req_cb(req);
+    return true;
+  }
+  if (HEDLEY_UNLIKELY(sz == 0 || ctx->mmap || !iso->bcache.budget)) {
+    return false;
+  }
+  const uint64_t end   = off+sz;
+  const uint64_t first = off / UPD_BCACHE_BLOCK;
+  const uint64_t last  = (end-1) / UPD_BCACHE_BLOCK;
+  if (HEDLEY_UNLIKELY(last-first >= BCACHE_READ_MAX_)) {
+    return false;
+  }
 
-  if (HEDLEY_UNLIKELY(ctx->last_task == task)) {
-    ctx->last_task = NULL;
-  } else if (HEDLEY_UNLIKELY(task->next)) {
-    task->next->exec(task->next);
+  const upd_bcache_block_t* blocks[BCACHE_READ_MAX_];
+  for (uint64_t i = first; i <= last; ++i) {
+    const upd_bcache_block_t* b = upd_bcache_lookup(f, ctx->gen, i);
+    if (HEDLEY_UNLIKELY(b == NULL)) {
+      return false;
+    }
+    const uint64_t bend = i*UPD_BCACHE_BLOCK + b->len;
+    if (HEDLEY_UNLIKELY(bend < end && b->len < UPD_BCACHE_BLOCK)) {
+      return false;  /* cached when the file was shorter */
+    }
+    blocks[i-first] = b;
   }
-  upd_iso_unstack(iso, task);
-  upd_file_unref(f);
-}
 
+  uint8_t* tmp = NULL;
+  uint8_t* buf = (uint8_t*) blocks[0]->data + off%UPD_BCACHE_BLOCK;
+  if (HEDLEY_UNLIKELY(first != last)) {
+    tmp = upd_iso_stack(iso, sz);
+    if (HEDLEY_UNLIKELY(tmp == NULL)) {
+      return false;
+    }
+    size_t copied = 0;
+    for (uint64_t i = first; i <= last; ++i) {
+      const upd_bcache_block_t* b = blocks[i-first];
+
+      const size_t boff = i == first? off%UPD_BCACHE_BLOCK: 0;
+      const size_t rem  = sz - copied;
+      const size_t n    = b->len-boff < rem? b->len-boff: rem;
+      memcpy(tmp+copied, b->data+boff, n);
+      copied += n;
+    }
+    buf = tmp;
+  }
 
-static void bin_watch_cb_(upd_file_watch_t* watch) {
-  upd_file_t* f   = watch->file;
-  bin_t_*     ctx = f->ctx;
+  bin_note_read_(f, off, sz);
 
-  switch (watch->event) {
-  case UPD_FILE_UPDATE_N:
-    task_queue_with_dup_(&(task_t_) {
-        .file = f,
-        .exec = task_stat_exec_cb_,
-      });
-    if (HEDLEY_LIKELY(ctx->open)) {
-      task_queue_with_dup_(&(task_t_) {
-          .file = f,
-          .exec = task_close_exec_cb_,
-        });
-      task_queue_with_dup_(&(task_t_) {
-          .file = f,
-          .exec = task_open_exec_cb_,
-        });
-    }
-    upd_file_trigger(f, UPD_FILE_UPDATE);
-    break;
+  req->stream.io = (upd_req_stream_io_t) {
+    .offset = off,
+    .size   = sz,
+    .buf    = buf,
+    .tail   = end >= ctx->bytes,
+  };
+  req->result = UPD_REQ_OK;
+  upd_file_req_cb(req);
 
-  case UPD_FILE_UNCACHE:
-    if (HEDLEY_UNLIKELY(ctx->open)) {
-      task_queue_with_dup_(&(task_t_) {
-          .file = f,
-          .exec = task_close_exec_cb_,
-        });
-    }
-    break;
+  if (HEDLEY_UNLIKELY(tmp)) {
+    upd_iso_unstack(iso, tmp);
   }
+  return true;
 }
 
-static void bin_deinit_close_cb_(uv_fs_t* fsreq) {
-  upd_iso_t* iso = fsreq->data;
-  upd_iso_unstack(iso, fsreq);
-}
+static void bin_note_read_(upd_file_t* f, uint64_t off, size_t sz) {
+  bin_t_*    ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
 
+  if (off == ctx->seq_end) {
+    ctx->seq += ctx->seq < SEQ_MIN_;
+  } else {
+    ctx->seq    = 0;
+    ctx->ra_end = 0;
+  }
+  ctx->seq_end = off+sz;
+  if (HEDLEY_LIKELY(ctx->seq < SEQ_MIN_)) {
+    return;
+  }
 
-static void task_stat_exec_cb_(task_t_* task) {
-  upd_file_t* f   = task->file;
-  upd_iso_t*  iso = f->iso;
+  /* keeps at least a half of the window ahead of the reader */
+  const uint64_t window = READAHEAD_*UPD_BCACHE_BLOCK;
+  if (ctx->ra_end >= ctx->seq_end + window/2) {
+    return;
+  }
+  const uint64_t next =
+    (ctx->seq_end + UPD_BCACHE_BLOCK-1) / UPD_BCACHE_BLOCK * UPD_BCACHE_BLOCK;
 
-  const int err = uv_fs_stat(
-    &iso->loop, &task->fsreq, (char*) f->npath, task_stat_cb_);
-  if (HEDLEY_UNLIKELY(0 > err)) {
-    goto ABORT;
+  const uint64_t begin = ctx->ra_end > next? ctx->ra_end: next;
+  const uint64_t end   = next+window < ctx->bytes? next+window: ctx->bytes;
+  if (HEDLEY_UNLIKELY(begin >= end)) {
+    return;
   }
-  return;
 
-ABORT:
-  task_finalize_(task);
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file   = f,
+      .base   = begin,
+      .len    = end-begin,
+      .exec   = task_readahead_exec_cb_,
+      .shared = true,
+    });
+  if (HEDLEY_LIKELY(ok)) {
+    ctx->ra_end = end;
+    ++iso->bcache.readahead;
+  }
 }
 
-static void task_stat_cb_(uv_fs_t* fsreq) {
-  task_t_*    task = (void*) fsreq;
-  upd_file_t* f    = task->file;
-  bin_t_*     ctx  = f->ctx;
+static void bin_cache_fill_(
+    upd_file_t*    f,
+    uint32_t       gen,
+    uint64_t       base,
+    const uint8_t* buf,
+    size_t         len) {
+  bin_t_* ctx = f->ctx;
 
-  const ssize_t result = fsreq->result;
-  const size_t  bytes  = fsreq->statbuf.st_size;
-  uv_fs_req_cleanup(fsreq);
+  /* a block stale by a change while reading is never hit */
+  if (HEDLEY_UNLIKELY(gen != ctx->gen)) {
+    return;
+  }
+  assert(base%UPD_BCACHE_BLOCK == 0);
 
-  if (HEDLEY_UNLIKELY(result < 0)) {
-    goto EXIT;
+  for (size_t off = 0; off < len; off += UPD_BCACHE_BLOCK) {
+    const size_t n = len-off < UPD_BCACHE_BLOCK? len-off: UPD_BCACHE_BLOCK;
+    if (HEDLEY_UNLIKELY(n < UPD_BCACHE_BLOCK && base+off+n < ctx->bytes)) {
+      break;  /* short read */
+    }
+    upd_bcache_put(f, gen, (base+off) / UPD_BCACHE_BLOCK, buf+off, n);
   }
+}
 
-  ctx->bytes = bytes;
+static void bin_cache_forget_(upd_file_t* f, uint64_t off, size_t len) {
+  bin_t_* ctx = f->ctx;
 
-EXIT:
-  task_finalize_(task);
+  if (HEDLEY_UNLIKELY(len == 0)) {
+    return;
+  }
+  const uint64_t first = off / UPD_BCACHE_BLOCK;
+  const uint64_t last  = (off+len-1) / UPD_BCACHE_BLOCK;
+  if (HEDLEY_UNLIKELY(last-first >= BCACHE_READ_MAX_)) {
+    ++ctx->gen;
+    return;
+  }
+  for (uint64_t i = first; i <= last; ++i) {
+    upd_bcache_forget(f, ctx->gen, i);
+  }
 }
 
-static void task_open_exec_cb_(task_t_* task) {
-  upd_file_t* f   = task->file;
+static void bin_map_(upd_file_t* f) {
+  bin_t_*    ctx = f->ctx;
+  upd_iso_t* iso = f->iso;
+
+  assert(ctx->map == NULL);
+  if (HEDLEY_UNLIKELY(ctx->bytes == 0)) {
+    return;  /* mmap refuses an empty range */
+  }
+#if MMAP_AVAILABLE_
+  void* ptr = mmap(NULL, ctx->bytes, PROT_READ, MAP_SHARED, ctx->fd, 0);
+  if (HEDLEY_UNLIKELY(ptr == MAP_FAILED)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"mmap failure, falls back to read\n");
+    return;
+  }
+  ctx->map    = ptr;
+  ctx->maplen = ctx->bytes;
+#else
+  (void) iso;
+#endif
+}
+
+static void bin_unmap_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(ctx->map == NULL)) {
+    return;
+  }
+#if MMAP_AVAILABLE_
+  munmap(ctx->map, ctx->maplen);
+#endif
+  ctx->map    = NULL;
+  ctx->maplen = 0;
+}
+
+static bool bin_map_copy_(uint8_t* dst, const uint8_t* src, size_t len) {
+#if MMAP_AVAILABLE_
+  sigjmp_buf jmp;
+  if (HEDLEY_UNLIKELY(sigsetjmp(jmp, 0))) {
+    return false;
+  }
+  bin_sigbus_jmp_ = &jmp;
+  memcpy(dst, src, len);
+  bin_sigbus_jmp_ = NULL;
+  return true;
+#else
+  (void) dst;
+  (void) src;
+  (void) len;
+  return false;
+#endif
+}
+
+#if MMAP_AVAILABLE_
+static void bin_sigbus_install_(void) {
+  /*  SA_NODEFER leaves SIGBUS unblocked after the jump, so the copy
+   * doesn't have to save and restore the signal mask. */
+  struct sigaction sa = {
+    .sa_sigaction = bin_sigbus_handler_,
+    .sa_flags     = SA_SIGINFO | SA_NODEFER,
+  };
+  sigemptyset(&sa.sa_mask);
+  bin_sigbus_ok_ = 0 == sigaction(SIGBUS, &sa, &bin_sigbus_prev_);
+}
+
+static void bin_sigbus_handler_(int sig, siginfo_t* info, void* uctx) {
+  sigjmp_buf* jmp = bin_sigbus_jmp_;
+  if (HEDLEY_LIKELY(jmp)) {
+    bin_sigbus_jmp_ = NULL;
+    siglongjmp(*jmp, 1);
+  }
+
+  /* not raised by our copy */
+  const struct sigaction* prev = &bin_sigbus_prev_;
+  if (prev->sa_flags & SA_SIGINFO) {
+    prev->sa_sigaction(sig, info, uctx);
+  } else if (prev->sa_handler != SIG_DFL && prev->sa_handler != SIG_IGN) {
+    prev->sa_handler(sig);
+  } else {
+    /* the faulting access is retried and kills the process */
+    signal(sig, SIG_DFL);
+  }
+}
+#endif
+
+
+static task_t_* task_dup_(const task_t_* src) {
+  upd_file_t* f   = src->file;
+  upd_iso_t*  iso = f->iso;
+
+  task_t_* task = upd_iso_stack(iso, sizeof(*task));
+  if (HEDLEY_UNLIKELY(task == NULL)) {
+    return NULL;
+  }
+
+  upd_file_ref(f);
+  *task = *src;
+  if (task->req) {
+    task->since = uv_hrtime();
+    upd_trace(iso, "bin.task", UPD_TRACE_BEGIN, task->req, f, task->req->type);
+  }
+  return task;
+}
+
+static bool task_queue_with_dup_(const task_t_* src) {
+  upd_file_t* f   = src->file;
+  bin_t_*     ctx = f->ctx;
+
+  task_t_* task = task_dup_(src);
+  if (HEDLEY_UNLIKELY(task == NULL)) {
+    return false;
+  }
+  if (HEDLEY_LIKELY(ctx->last_task)) {
+    ctx->last_task->next = task;
+  } else {
+    ctx->first_task = task;
+  }
+  ctx->last_task = task;
+
+  task_dispatch_(f);
+  return true;
+}
+
+static bool task_unshift_with_dup_(const task_t_* src) {
+  upd_file_t* f   = src->file;
+  bin_t_*     ctx = f->ctx;
+
+  task_t_* task = task_dup_(src);
+  if (HEDLEY_UNLIKELY(task == NULL)) {
+    return false;
+  }
+  task->next      = ctx->first_task;
+  ctx->first_task = task;
+  if (HEDLEY_UNLIKELY(ctx->last_task == NULL)) {
+    ctx->last_task = task;
+  }
+
+  task_dispatch_(f);
+  return true;
+}
+
+static bool task_queue_stat_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  /* a burst of updates is answered by a single stat */
+  if (HEDLEY_UNLIKELY(ctx->stat_queued)) {
+    return true;
+  }
+  ctx->stat_queued = true;
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file = f,
+      .exec = task_stat_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    ctx->stat_queued = false;
+  }
+  return ok;
+}
+
+static bool task_queue_open_(upd_file_t* f) {
+  return task_queue_with_dup_(&(task_t_) {
+      .file = f,
+      .exec = task_open_exec_cb_,
+    });
+}
+
+static bool task_queue_close_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  /* the task may run immediately and finish the count */
+  ++ctx->closes;
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file = f,
+      .exec = task_close_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    --ctx->closes;
+  }
+  return ok;
+}
+
+static void task_dispatch_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  /* tasks finished synchronously are picked up by the loop below */
+  if (HEDLEY_UNLIKELY(ctx->dispatching)) {
+    return;
+  }
+  ctx->dispatching = true;
+  upd_file_ref(f);
+
+  for (;;) {
+    task_t_* task = ctx->first_task;
+    if (task == NULL || ctx->exclusive) {
+      break;
+    }
+    if (task->shared? ctx->running >= ctx->readers: ctx->running > 0) {
+      break;
+    }
+    ctx->first_task = task->next;
+    if (HEDLEY_LIKELY(ctx->first_task == NULL)) {
+      ctx->last_task = NULL;
+    }
+    ++ctx->running;
+    ctx->exclusive = !task->shared;
+    task->exec(task);
+  }
+
+  ctx->dispatching = false;
+  upd_file_unref(f);
+}
+
+static void task_finalize_(task_t_* task) {
+  upd_file_t* f   = task->file;
   bin_t_*     ctx = f->ctx;
   upd_iso_t*  iso = f->iso;
 
+  if (task->req) {
+    upd_file_stats_done(f, task->since);
+    upd_trace(iso, "bin.task", UPD_TRACE_END, task->req, f, 0);
+  }
+
+  /* merged writes are never dispatched, and the head keeps the file alive */
+  for (task_t_* g = task->group; g;) {
+    task_t_* next = g->next;
+    upd_file_stats_done(f, g->since);
+    upd_trace(iso, "bin.task", UPD_TRACE_END, g->req, f, 0);
+    upd_iso_unstack(iso, g);
+    upd_file_unref(f);
+    g = next;
+  }
+
+  --ctx->running;
+  if (HEDLEY_LIKELY(!task->shared)) {
+    ctx->exclusive = false;
+  }
+  upd_iso_unstack(iso, task);
+
+  task_dispatch_(f);
+  upd_file_unref(f);
+}
+
+
+static bool task_queue_sync_(upd_file_t* f) {
+  bin_t_* ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(ctx->sync_queued)) {
+    return true;
+  }
+  /* the task may run immediately and clear the flag */
+  ctx->sync_queued = true;
+  const bool ok = task_queue_with_dup_(&(task_t_) {
+      .file = f,
+      .exec = task_sync_exec_cb_,
+    });
+  if (HEDLEY_UNLIKELY(!ok)) {
+    ctx->sync_queued = false;
+  }
+  return ok;
+}
+
+static void task_take_syncq_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  task->syncs  = (upd_req_t**) ctx->syncq.p;
+  task->nsyncs = ctx->syncq.n;
+  ctx->syncq.p = NULL;
+  ctx->syncq.n = 0;
+
+  ctx->dirty = false;
+  upd_iso_timeout_stop(iso, &ctx->sync_timer);
+}
+
+static void task_answer_syncs_(task_t_* task, upd_req_result_t result) {
+  for (size_t i = 0; i < task->nsyncs; ++i) {
+    upd_req_t* req = task->syncs[i];
+    if (HEDLEY_UNLIKELY(result != UPD_REQ_OK)) {
+      req->stream.io.size = 0;
+    }
+    req->result = result;
+    upd_file_req_cb(req);
+  }
+  upd_free(&task->syncs);
+  task->nsyncs = 0;
+}
+
+static void task_write_finish_(task_t_* task, ssize_t result) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(result > 0)) {
+    const uint64_t end = task->req->stream.io.offset + result;
+    if (HEDLEY_UNLIKELY(end > ctx->bytes)) {
+      ctx->bytes = end;
+    }
+    ctx->dirty = true;
+    bin_cache_forget_(f, task->req->stream.io.offset, result);
+  }
+  const bool wait = result > 0 && ctx->sync == SYNC_REQUEST_;
+
+  /* a short write is split from the head */
+  size_t rem = result > 0? (size_t) result: 0;
+  for (task_t_* t = task; t; t = t == task? task->group: t->next) {
+    upd_req_t* req = t->req;
+    if (HEDLEY_UNLIKELY(result < 0)) {
+      req->stream.io.size = 0;
+      req->result = UPD_REQ_ABORTED;
+    } else {
+      const size_t sz = rem < req->stream.io.size? rem: req->stream.io.size;
+      rem -= sz;
+      req->stream.io.size = sz;
+      req->result = UPD_REQ_OK;
+    }
+    if (HEDLEY_LIKELY(wait)) {
+      if (HEDLEY_LIKELY(upd_array_insert(&ctx->syncq, req, SIZE_MAX))) {
+        continue;
+      }
+      req->result = UPD_REQ_NOMEM;
+    }
+    upd_file_req_cb(req);
+  }
+
+  task_schedule_sync_(task);
+  task_finalize_(task);
+}
+
+static void task_schedule_sync_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->syncq.n && !task_queue_sync_(f))) {
+    task_take_syncq_(task);
+    task_answer_syncs_(task, UPD_REQ_NOMEM);
+  }
+  if (HEDLEY_UNLIKELY(ctx->dirty && ctx->sync == SYNC_PERIODIC_)) {
+    if (HEDLEY_LIKELY(ctx->sync_timer.head == NULL)) {
+      upd_iso_timeout_start(iso, &ctx->sync_timer, ctx->sync_ms);
+    }
+  }
+}
+
+
+static void bin_watch_cb_(upd_file_watch_t* watch) {
+  upd_file_t* f   = watch->file;
+  bin_t_*     ctx = f->ctx;
+
+  switch (watch->event) {
+  case UPD_FILE_UPDATE_N:
+    /* the file may be shrunk, so reads fall back to pread until stat */
+    if (HEDLEY_UNLIKELY(ctx->map)) {
+      bin_unmap_(f);
+      f->cache = 0;
+      upd_file_cache_update(f);
+    }
+    /* the stat decides whether the fd and the cache are stale */
+    task_queue_stat_(f);
+    break;
+
+  case UPD_FILE_UNCACHE:
+    /* only a mapping holds memory, plain fds are bounded by fdcache */
+    if (HEDLEY_UNLIKELY(ctx->map && !ctx->closes)) {
+      task_queue_close_(f);
+    }
+    break;
+  }
+}
+
+static bool bin_fdcache_evict_cb_(upd_fdcache_entry_t* e) {
+  upd_file_t* f   = e->udata;
+  bin_t_*     ctx = f->ctx;
+
+  /* queued tasks expect the fd to stay open */
+  if (HEDLEY_UNLIKELY(ctx->running || ctx->first_task)) {
+    return false;
+  }
+  return task_queue_close_(f);
+}
+
+static void bin_sync_timer_cb_(upd_iso_timeout_t* t) {
+  upd_file_t* f   = t->udata;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->dirty && !task_queue_sync_(f))) {
+    upd_iso_timeout_start(iso, t, ctx->sync_ms);
+  }
+}
+
+static void bin_deinit_sync_cb_(uv_fs_t* fsreq) {
+  closer_t_* cl  = fsreq->data;
+  upd_iso_t* iso = cl->iso;
+
+  uv_fs_req_cleanup(fsreq);
+
+  const int err = upd_fs_close(
+    iso, &cl->fsreq, cl->fd, bin_deinit_close_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_unstack(iso, cl);
+  }
+}
+
+static void bin_deinit_close_cb_(uv_fs_t* fsreq) {
+  closer_t_* cl  = fsreq->data;
+  upd_iso_t* iso = cl->iso;
+
+  uv_fs_req_cleanup(fsreq);
+  upd_iso_unstack(iso, cl);
+}
+
+
+static void task_stat_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  /* updates notified from now need another stat */
+  ctx->stat_queued = false;
+
+  const int err = upd_fs_stat(
+    iso, &task->fsreq, (char*) f->npath, task_stat_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  task_finalize_(task);
+}
+
+static void task_stat_cb_(uv_fs_t* fsreq) {
+  task_t_*    task = (void*) fsreq;
+  upd_file_t* f    = task->file;
+  bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
+
+  const ssize_t   result = fsreq->result;
+  const uv_stat_t st     = fsreq->statbuf;
+  uv_fs_req_cleanup(fsreq);
+
+  /* the first stat has nothing to compare */
+  const bool first = !ctx->stat_done;
+  ctx->stat_done = true;
+
+  bool same;
+  if (HEDLEY_UNLIKELY(result < 0)) {
+    same = !ctx->stat_ok;  /* still missing */
+    ctx->stat_ok = false;
+  } else {
+    const uv_stat_t* prev = &ctx->stat;
+    same = ctx->stat_ok &&
+      prev->st_dev          == st.st_dev          &&
+      prev->st_ino          == st.st_ino          &&
+      prev->st_size         == st.st_size         &&
+      prev->st_mtim.tv_sec  == st.st_mtim.tv_sec  &&
+      prev->st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+
+    ctx->stat    = st;
+    ctx->bytes   = st.st_size;
+    ctx->stat_ok = true;
+  }
+  if (HEDLEY_UNLIKELY(first)) {
+    goto EXIT;
+  }
+  if (HEDLEY_LIKELY(same)) {
+    if (ctx->open) {
+      ++iso->fdcache.kept;
+    }
+    /* the size is confirmed, so maps again what the update dropped */
+    if (HEDLEY_UNLIKELY(ctx->mmap && ctx->open && !ctx->map && !ctx->closes)) {
+      bin_map_(f);
+      f->cache = ctx->maplen;
+      upd_file_cache_update(f);
+    }
+    goto EXIT;
+  }
+
+  /* reopens before any task queued while stat, by pushing in reverse */
+  ++ctx->gen;
+  if (HEDLEY_LIKELY(ctx->open && !ctx->closes)) {
+    task_unshift_with_dup_(&(task_t_) {
+        .file = f,
+        .exec = task_open_exec_cb_,
+      });
+    ++ctx->closes;
+    const bool ok = task_unshift_with_dup_(&(task_t_) {
+        .file = f,
+        .exec = task_close_exec_cb_,
+      });
+    if (HEDLEY_UNLIKELY(!ok)) {
+      --ctx->closes;
+    }
+  }
+  upd_file_trigger(f, UPD_FILE_UPDATE);
+
+EXIT:
+  task_finalize_(task);
+}
+
+static void task_open_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(ctx->open)) {
+    goto ABORT;  /* queued twice while a close is pending */
+  }
+
   const int flag =
     ctx->read && ctx->write? O_RDWR:
     ctx->read?               O_RDONLY:
     ctx->write?              O_WRONLY: 0;
 
-  const int open = uv_fs_open(
-    &iso->loop, &task->fsreq, (char*) f->npath, flag, 0, task_open_cb_);
+  const int open = upd_fs_open(
+    iso, &task->fsreq, (char*) f->npath, flag, 0, task_open_cb_);
   if (HEDLEY_UNLIKELY(0 > open)) {
     goto ABORT;
   }
@@ -509,6 +1400,7 @@ static void task_open_cb_(uv_fs_t* fsreq) {
   task_t_*    task = (void*) fsreq;
   upd_file_t* f    = task->file;
   bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
 
   const ssize_t result = fsreq->result;
   uv_fs_req_cleanup(fsreq);
@@ -519,7 +1411,13 @@ static void task_open_cb_(uv_fs_t* fsreq) {
 
   ctx->fd   = result;
   ctx->open = true;
-  f->cache  = BUF_MAX_ < ctx->bytes? BUF_MAX_: ctx->bytes;
+  if (ctx->mmap) {
+    bin_map_(f);
+  }
+  upd_fdcache_add(iso, &ctx->fdcache);
+
+  f->cache = ctx->maplen;
+  upd_file_cache_update(f);
 
 EXIT:
   task_finalize_(task);
@@ -542,24 +1440,82 @@ static void task_read_exec_cb_(task_t_* task) {
   if (HEDLEY_LIKELY(sz+off > ctx->bytes)) {
     sz = ctx->bytes > off? ctx->bytes-off: 0;
   }
+
   if (HEDLEY_LIKELY(sz > BUF_MAX_)) {
     sz = BUF_MAX_;
   }
+
+  /*  Others may truncate the file under the mapping before the update
+   * is notified, so the pages are copied under the SIGBUS guard. */
+  if (ctx->map) {
+    if (HEDLEY_UNLIKELY(off+sz > ctx->maplen)) {
+      sz = ctx->maplen > off? ctx->maplen-off: 0;
+    }
+
+    uint8_t* buf = NULL;
+    if (HEDLEY_LIKELY(sz)) {
+      buf = upd_iso_stack(iso, sz);
+      if (HEDLEY_UNLIKELY(buf == NULL)) {
+        req->result = UPD_REQ_NOMEM;
+        goto ABORT;
+      }
+    }
+    if (HEDLEY_LIKELY(sz == 0 || bin_map_copy_(buf, ctx->map+off, sz))) {
+      req->stream.io = (upd_req_stream_io_t) {
+        .offset = off,
+        .size   = sz,
+        .buf    = buf,
+        .tail   = off+sz >= ctx->maplen,
+      };
+      req->result = UPD_REQ_OK;
+      upd_file_req_cb(req);
+      upd_iso_unstack(iso, buf);
+      task_finalize_(task);
+      return;
+    }
+    upd_iso_unstack(iso, buf);
+
+    /* reads go through the fd until the stat confirms the new size */
+    upd_iso_msgf(iso, LOG_PREFIX_"mapped file is truncated by others\n");
+    bin_unmap_(f);
+    task_queue_stat_(f);
+  }
   if (HEDLEY_UNLIKELY(sz == 0)) {
     req->result = UPD_REQ_OK;
     goto ABORT;
   }
 
-  task->buf = upd_iso_stack(iso, sz);
+  /* may be filled by reads finished while this is queued */
+  if (bin_read_cached_(f, req)) {
+    task_finalize_(task);
+    return;
+  }
+
+  /* misses read whole blocks to fill the cache */
+  task->base = off;
+  task->len  = sz;
+  task->gen  = ctx->gen;
+  if (HEDLEY_LIKELY(iso->bcache.budget && !ctx->mmap)) {
+    const uint64_t first = off / UPD_BCACHE_BLOCK;
+    const uint64_t last  = (off+sz-1) / UPD_BCACHE_BLOCK;
+    if (HEDLEY_LIKELY(last-first < BCACHE_READ_MAX_)) {
+      const uint64_t end = (last+1)*UPD_BCACHE_BLOCK;
+      task->base  = first*UPD_BCACHE_BLOCK;
+      task->len   = (end < ctx->bytes? end: ctx->bytes) - task->base;
+      task->cache = true;
+    }
+  }
+
+  task->buf = upd_iso_stack(iso, task->len);
   if (HEDLEY_UNLIKELY(task->buf == NULL)) {
     req->result = UPD_REQ_NOMEM;
     goto ABORT;
   }
 
-  const uv_buf_t buf = uv_buf_init((char*) task->buf, sz);
+  const uv_buf_t buf = uv_buf_init((char*) task->buf, task->len);
 
-  const int err = uv_fs_read(
-    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, off, task_read_cb_);
+  const int err = upd_fs_read(
+    iso, &task->fsreq, ctx->fd, &buf, 1, task->base, task_read_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
     upd_iso_unstack(iso, task->buf);
     req->result = UPD_REQ_ABORTED;
@@ -569,7 +1525,7 @@ static void task_read_exec_cb_(task_t_* task) {
 
 ABORT:
   req->stream.io.size = 0;
-  req->cb(req);
+  upd_file_req_cb(req);
   task_finalize_(task);
 }
 
@@ -589,70 +1545,133 @@ static void task_read_cb_(uv_fs_t* fsreq) {
     goto EXIT;
   }
 
-  const size_t off = req->stream.io.offset;
+  const size_t off  = req->stream.io.offset;
+  const size_t skip = off - task->base;
+  if (HEDLEY_LIKELY(task->cache)) {
+    bin_cache_fill_(f, task->gen, task->base, task->buf, result);
+  }
+
+  /* whole blocks read for the cache may exceed the request */
+  const size_t got  = (size_t) result > skip? result-skip: 0;
+  const size_t want = req->stream.io.size < BUF_MAX_? req->stream.io.size: BUF_MAX_;
+  const size_t sz   = got < want? got: want;
+  bin_note_read_(f, off, sz);
+
   req->stream.io = (upd_req_stream_io_t) {
     .offset = off,
-    .size   = result,
-    .buf    = task->buf,
-    .tail   = off+result >= ctx->bytes,
+    .size   = sz,
+    .buf    = task->buf + skip,
+    .tail   = off+sz >= ctx->bytes,
   };
   req->result = UPD_REQ_OK;
 
 EXIT:
-  req->cb(req);
+  upd_file_req_cb(req);
   upd_iso_unstack(iso, task->buf);
   task_finalize_(task);
 }
 
-static void task_write_exec_cb_(task_t_* task) {
-  upd_file_t* f    = task->file;
-  upd_req_t*  req  = task->req;
-  bin_t_*     ctx  = f->ctx;
-  upd_iso_t*  iso  = f->iso;
+static void task_readahead_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
 
   if (HEDLEY_UNLIKELY(!ctx->open)) {
     goto ABORT;
   }
+  task->gen = ctx->gen;
 
-  const size_t sz  = req->stream.io.size;
-  const size_t off = req->stream.io.offset;
+  task->buf = upd_iso_stack(iso, task->len);
+  if (HEDLEY_UNLIKELY(task->buf == NULL)) {
+    goto ABORT;
+  }
 
-  const uv_buf_t buf = uv_buf_init((char*) req->stream.io.buf, sz);
+  const uv_buf_t buf = uv_buf_init((char*) task->buf, task->len);
 
-  const int err = uv_fs_write(
-    &iso->loop, &task->fsreq, ctx->fd, &buf, 1, off, task_write_cb_);
+  const int err = upd_fs_read(
+    iso, &task->fsreq, ctx->fd, &buf, 1, task->base, task_readahead_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_unstack(iso, task->buf);
     goto ABORT;
   }
   return;
 
 ABORT:
-  req->stream.io.size = 0;
-  req->result = UPD_REQ_ABORTED;
-  req->cb(req);
   task_finalize_(task);
 }
 
-static void task_write_cb_(uv_fs_t* fsreq) {
-  task_t_*   task = (void*) fsreq;
-  upd_req_t* req  = task->req;
+static void task_readahead_cb_(uv_fs_t* fsreq) {
+  task_t_*    task = (void*) fsreq;
+  upd_file_t* f    = task->file;
+  upd_iso_t*  iso  = f->iso;
 
   const ssize_t result = fsreq->result;
   uv_fs_req_cleanup(fsreq);
 
-  if (HEDLEY_UNLIKELY(result < 0)) {
-    req->stream.io.size = 0;
-    req->result = UPD_REQ_ABORTED;
-    goto EXIT;
+  if (HEDLEY_LIKELY(result > 0)) {
+    bin_cache_fill_(f, task->gen, task->base, task->buf, result);
   }
-  req->result = UPD_REQ_OK;
-  req->stream.io.size = result;
-
-EXIT:
-  req->cb(req);
+  upd_iso_unstack(iso, task->buf);
   task_finalize_(task);
 }
 
+static void task_write_exec_cb_(task_t_* task) {
+  upd_file_t* f    = task->file;
+  upd_req_t*  req  = task->req;
+  bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
+
+  if (HEDLEY_UNLIKELY(!ctx->open)) {
+    task_write_finish_(task, UV_EBADF);
+    return;
+  }
+
+  const size_t off = req->stream.io.offset;
+  size_t       end = off + req->stream.io.size;
+
+  uv_buf_t bufs[WRITEV_MAX_];
+  size_t   nbufs = 0;
+  bufs[nbufs++] = uv_buf_init((char*) req->stream.io.buf, req->stream.io.size);
+
+  /* queued writes continuing from this are merged into a single pwritev */
+  task_t_** tail = &task->group;
+  while (nbufs < WRITEV_MAX_) {
+    task_t_* next = ctx->first_task;
+    if (next == NULL || next->exec != task_write_exec_cb_) {
+      break;
+    }
+    const upd_req_stream_io_t* io = &next->req->stream.io;
+    if (io->offset != end) {
+      break;
+    }
+    ctx->first_task = next->next;
+    if (HEDLEY_LIKELY(ctx->first_task == NULL)) {
+      ctx->last_task = NULL;
+    }
+    next->next = NULL;
+    *tail = next;
+    tail  = &next->next;
+
+    bufs[nbufs++] = uv_buf_init((char*) io->buf, io->size);
+    end += io->size;
+  }
+
+  const int err = upd_fs_write(
+    iso, &task->fsreq, ctx->fd, bufs, nbufs, off, task_write_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    task_write_finish_(task, err);
+  }
+}
+
+static void task_write_cb_(uv_fs_t* fsreq) {
+  task_t_* task = (void*) fsreq;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+
+  task_write_finish_(task, result);
+}
+
 static void task_truncate_exec_cb_(task_t_* task) {
   upd_file_t* f   = task->file;
   upd_req_t*  req = task->req;
@@ -674,13 +1693,14 @@ static void task_truncate_exec_cb_(task_t_* task) {
 
 ABORT:
   req->result = UPD_REQ_ABORTED;
-  req->cb(req);
+  upd_file_req_cb(req);
   task_finalize_(task);
 }
 
 static void task_truncate_cb_(uv_fs_t* fsreq) {
   task_t_*   task = (void*) fsreq;
   upd_req_t* req  = task->req;
+  bin_t_*    ctx  = task->file->ctx;
 
   const ssize_t result = fsreq->result;
   uv_fs_req_cleanup(fsreq);
@@ -689,10 +1709,65 @@ static void task_truncate_cb_(uv_fs_t* fsreq) {
     req->result = UPD_REQ_ABORTED;
     goto EXIT;
   }
+  ++ctx->gen;
+  ctx->bytes = req->stream.io.size;
+  ctx->dirty = true;
   req->result = UPD_REQ_OK;
 
+  /* the new size is as durable as writes are */
+  if (HEDLEY_UNLIKELY(ctx->sync == SYNC_REQUEST_)) {
+    if (HEDLEY_LIKELY(upd_array_insert(&ctx->syncq, req, SIZE_MAX))) {
+      goto SYNC;
+    }
+    req->result = UPD_REQ_NOMEM;
+  }
+
+EXIT:
+  upd_file_req_cb(req);
+SYNC:
+  task_schedule_sync_(task);
+  task_finalize_(task);
+}
+
+static void task_sync_exec_cb_(task_t_* task) {
+  upd_file_t* f   = task->file;
+  bin_t_*     ctx = f->ctx;
+  upd_iso_t*  iso = f->iso;
+
+  ctx->sync_queued = false;
+  if (HEDLEY_UNLIKELY(!ctx->dirty && ctx->syncq.n == 0)) {
+    goto EXIT;  /* already done by close */
+  }
+  task_take_syncq_(task);
+
+  if (HEDLEY_UNLIKELY(!ctx->open)) {
+    goto ABORT;
+  }
+  const int err = upd_fs_fdatasync(
+    iso, &task->fsreq, ctx->fd, task_sync_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    goto ABORT;
+  }
+  return;
+
+ABORT:
+  upd_iso_msgf(iso, LOG_PREFIX_"fdatasync failure\n");
+  task_answer_syncs_(task, UPD_REQ_ABORTED);
 EXIT:
-  req->cb(req);
+  task_finalize_(task);
+}
+
+static void task_sync_cb_(uv_fs_t* fsreq) {
+  task_t_*   task = (void*) fsreq;
+  upd_iso_t* iso  = task->file->iso;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+
+  if (HEDLEY_UNLIKELY(result < 0)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"fdatasync failure\n");
+  }
+  task_answer_syncs_(task, result >= 0? UPD_REQ_OK: UPD_REQ_ABORTED);
   task_finalize_(task);
 }
 
@@ -702,21 +1777,51 @@ static void task_close_exec_cb_(task_t_* task) {
   upd_iso_t*  iso  = f->iso;
 
   if (HEDLEY_UNLIKELY(!ctx->open)) {
-    goto ABORT;
+    --ctx->closes;
+    task_finalize_(task);
+    return;
+  }
+
+  /* pending writes are synced before the fd goes away */
+  if (HEDLEY_UNLIKELY(ctx->dirty && ctx->sync != SYNC_NONE_)) {
+    task_take_syncq_(task);
+
+    const int err = upd_fs_fdatasync(
+      iso, &task->fsreq, ctx->fd, task_close_sync_cb_);
+    if (HEDLEY_LIKELY(0 <= err)) {
+      return;
+    }
+    task_answer_syncs_(task, UPD_REQ_ABORTED);
   }
+  task_close_(task);
+}
+
+static void task_close_sync_cb_(uv_fs_t* fsreq) {
+  task_t_* task = (void*) fsreq;
+
+  const ssize_t result = fsreq->result;
+  uv_fs_req_cleanup(fsreq);
+
+  task_answer_syncs_(task, result >= 0? UPD_REQ_OK: UPD_REQ_ABORTED);
+  task_close_(task);
+}
+
+static void task_close_(task_t_* task) {
+  upd_file_t* f    = task->file;
+  bin_t_*     ctx  = f->ctx;
+  upd_iso_t*  iso  = f->iso;
 
   /* we don't care about if the file is actually closed */
   f->cache = 0;
+  bin_unmap_(f);
+  upd_fdcache_remove(iso, &ctx->fdcache);
 
-  const int err = uv_fs_close(
-    &iso->loop, &task->fsreq, ctx->fd, task_close_cb_);
+  const int err = upd_fs_close(
+    iso, &task->fsreq, ctx->fd, task_close_cb_);
   if (HEDLEY_UNLIKELY(0 > err)) {
-    goto ABORT;
+    --ctx->closes;
+    task_finalize_(task);
   }
-  return;
-
-ABORT:
-  task_finalize_(task);
 }
 
 static void task_close_cb_(uv_fs_t* fsreq) {
@@ -724,6 +1829,11 @@ static void task_close_cb_(uv_fs_t* fsreq) {
   upd_file_t* f    = task->file;
   bin_t_*     ctx  = f->ctx;
 
+  uv_fs_req_cleanup(fsreq);
+
   ctx->open = false;
+  --ctx->closes;
+  f->cache  = 0;
+  upd_file_cache_update(f);
   task_finalize_(task);
 }
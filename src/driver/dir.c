@@ -3,6 +3,7 @@
 
 typedef struct dir_t_ {
   upd_array_of(upd_req_dir_entry_t*) children;
+  upd_dirindex_t index;
 } dir_t_;
 
 
@@ -43,29 +44,6 @@ void
 entry_delete_(
   upd_req_dir_entry_t* e);
 
-static
-bool
-entry_find_(
-  dir_t_*                    ctx,
-  size_t*                    i,
-  const upd_req_dir_entry_t* e);
-
-static
-bool
-entry_find_by_file_(
-  dir_t_*     ctx,
-  size_t*     i,
-  upd_file_t* f);
-
-static
-bool
-entry_find_by_name_(
-  dir_t_*        ctx,
-  size_t*        i,
-  const uint8_t* name,
-  size_t         len);
-
-
 static bool dir_init_(upd_file_t* f) {
   dir_t_* ctx = NULL;
   if (HEDLEY_UNLIKELY(!upd_malloc(&ctx, sizeof(*ctx)))) {
@@ -82,6 +60,7 @@ static void dir_deinit_(upd_file_t* f) {
     entry_delete_(ctx->children.p[i]);
   }
   upd_array_clear(&ctx->children);
+  upd_dirindex_clear(&ctx->index);
   upd_free(&ctx);
 }
 
@@ -90,6 +69,8 @@ static bool dir_handle_(upd_req_t* req) {
   dir_t_*     ctx = f->ctx;
   upd_iso_t*  iso = f->iso;
 
+  upd_file_stats_req(req);
+
   switch (req->type) {
   case UPD_REQ_DIR_LIST:
     req->dir.entries = (upd_req_dir_entries_t) {
@@ -97,18 +78,26 @@ static bool dir_handle_(upd_req_t* req) {
       .p = (upd_req_dir_entry_t**) ctx->children.p,
     };
     req->result = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
     return true;
 
   case UPD_REQ_DIR_FIND: {
-    size_t i;
-    if (HEDLEY_LIKELY(entry_find_(ctx, &i, &req->dir.entry))) {
-      req->dir.entry = *(upd_req_dir_entry_t*) ctx->children.p[i];
+    const upd_req_dir_entry_t q = req->dir.entry;
+    if (HEDLEY_UNLIKELY(upd_dcache_is_path(&q))) {
+      return upd_dcache_find_path(req);
+    }
+
+    const upd_req_dir_entry_t* e = upd_dirindex_find(&ctx->index, &q);
+    if (HEDLEY_LIKELY(e)) {
+      req->dir.entry = *e;
     } else {
       req->dir.entry = (upd_req_dir_entry_t) {0};
     }
+    if (q.file == NULL) {
+      upd_dcache_put(iso, f, q.name, q.len, req->dir.entry.file);
+    }
     req->result = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
   } return true;
 
   case UPD_REQ_DIR_ADD: {
@@ -121,8 +110,7 @@ static bool dir_handle_(upd_req_t* req) {
       return false;
     }
 
-    size_t i;
-    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, &i, re->name, re->len))) {
+    if (HEDLEY_UNLIKELY(upd_dirindex_find_by_name(&ctx->index, re->name, re->len))) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
@@ -134,14 +122,22 @@ static bool dir_handle_(upd_req_t* req) {
       req->result = UPD_REQ_NOMEM;
       return false;
     }
+    if (HEDLEY_UNLIKELY(!upd_dirindex_insert(&ctx->index, e))) {
+      entry_delete_(e);
+      req->result = UPD_REQ_NOMEM;
+      return false;
+    }
     if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
+      upd_dirindex_remove(&ctx->index, e);
       entry_delete_(e);
       req->result = UPD_REQ_NOMEM;
       return false;
     }
+    upd_dcache_forget(iso, f, e->name, e->len);
+
     req->dir.entry = *e;
     req->result    = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
   } return true;
 
   case UPD_REQ_DIR_NEWDIR: {
@@ -154,8 +150,7 @@ static bool dir_handle_(upd_req_t* req) {
       return false;
     }
 
-    size_t i;
-    if (HEDLEY_UNLIKELY(entry_find_by_name_(ctx, &i, re.name, re.len))) {
+    if (HEDLEY_UNLIKELY(upd_dirindex_find_by_name(&ctx->index, re.name, re.len))) {
       req->result = UPD_REQ_ABORTED;
       return false;
     }
@@ -175,27 +170,38 @@ static bool dir_handle_(upd_req_t* req) {
       return false;
     }
 
+    if (HEDLEY_UNLIKELY(!upd_dirindex_insert(&ctx->index, e))) {
+      entry_delete_(e);
+      req->result = UPD_REQ_NOMEM;
+      return false;
+    }
     if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
+      upd_dirindex_remove(&ctx->index, e);
       entry_delete_(e);
       req->result = UPD_REQ_NOMEM;
       return false;
     }
+    upd_dcache_forget(iso, f, e->name, e->len);
+
     req->dir.entry = *e;
     req->result    = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
   } return true;
 
   case UPD_REQ_DIR_RM: {
-    size_t i;
-    if (HEDLEY_UNLIKELY(!entry_find_(ctx, &i, &req->dir.entry))) {
+    upd_req_dir_entry_t* e = upd_dirindex_find(&ctx->index, &req->dir.entry);
+    if (HEDLEY_UNLIKELY(e == NULL)) {
       req->result = UPD_REQ_ABORTED;
       req->dir.entry = (upd_req_dir_entry_t) {0};
       return false;
     }
-    upd_req_dir_entry_t* e = upd_array_remove(&ctx->children, i);
+    upd_dirindex_remove(&ctx->index, e);
+    upd_array_find_and_remove(&ctx->children, e);
+    upd_dcache_forget(iso, f, e->name, e->len);
+
     req->dir.entry = *e;
     req->result    = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
     entry_delete_(e);
   } return true;
 
@@ -225,30 +231,3 @@ static void entry_delete_(upd_req_dir_entry_t* e) {
   upd_file_unref(e->file);
   upd_free(&e);
 }
-
-static bool entry_find_(dir_t_* ctx, size_t* i, const upd_req_dir_entry_t* e) {
-  return e->file?
-    entry_find_by_file_(ctx, i, e->file):
-    entry_find_by_name_(ctx, i, e->name, e->len);
-}
-
-static bool entry_find_by_file_(dir_t_* ctx, size_t* i, upd_file_t* f) {
-  for (*i = 0; *i < ctx->children.n; ++*i) {
-    const upd_req_dir_entry_t* e = ctx->children.p[*i];
-    if (HEDLEY_UNLIKELY(e->file == f)) {
-      return true;
-    }
-  }
-  return false;
-}
-
-static bool entry_find_by_name_(
-    dir_t_* ctx, size_t* i, const uint8_t* name, size_t len) {
-  for (*i = 0; *i < ctx->children.n; ++*i) {
-    const upd_req_dir_entry_t* e = ctx->children.p[*i];
-    if (HEDLEY_UNLIKELY(upd_streq(e->name, e->len, name, len))) {
-      return true;
-    }
-  }
-  return false;
-}
@@ -142,6 +142,8 @@ static bool factory_handle_(upd_req_t* req) {
   upd_iso_t*  iso = f->iso;
   ctx_t_*     ctx = f->ctx;
 
+  upd_file_stats_req(req);
+
   if (HEDLEY_UNLIKELY(req->type != UPD_REQ_PROG_EXEC)) {
     req->result = UPD_REQ_INVALID;
     return false;
@@ -82,6 +82,12 @@ void
 tcp_close_(
   upd_file_t* f);
 
+static
+int
+tcp_bind_(
+  upd_file_t*               f,
+  const struct sockaddr_in* addr);
+
 static const upd_driver_t tcp_ = {
   .name   = (uint8_t*) "upd.srv.tcp.internal_",
   .cats   = (upd_req_cat_t[]) {0},
@@ -256,7 +262,8 @@ static bool srv_parse_param_(upd_file_t* f) {
     goto EXIT;
   }
 
-  const bool pf = upd_pathfind_with_dup(&(upd_pathfind_t) {
+  upd_trace(iso, "srv.pathfind", UPD_TRACE_BEGIN, f, f, 0);
+  const bool pf = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
       .iso   = iso,
       .path  = path->data.scalar.value,
       .len   = path->data.scalar.length,
@@ -357,6 +364,43 @@ static void tcp_close_(upd_file_t* f) {
   uv_close((uv_handle_t*) tcp, tcp_close_cb_);
 }
 
+static int tcp_bind_(upd_file_t* f, const struct sockaddr_in* addr) {
+  upd_iso_t* iso = f->iso;
+  uv_tcp_t*  tcp = f->ctx;
+
+  if (HEDLEY_LIKELY(upd_iso_shards(iso) == 1)) {
+    return uv_tcp_bind(tcp, (const struct sockaddr*) addr, 0);
+  }
+
+# if defined(SO_REUSEPORT)
+    /*  All shards bind the same port and the kernel balances
+     * incoming connections between their accept queues. */
+    const uv_os_sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (HEDLEY_UNLIKELY(sock < 0)) {
+      return uv_translate_sys_error(errno);
+    }
+
+    const int on = 1;
+    const bool reuse =
+      0 <= setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (HEDLEY_UNLIKELY(!reuse)) {
+      const int err = uv_translate_sys_error(errno);
+      close(sock);
+      return err;
+    }
+
+    const int open = uv_tcp_open(tcp, sock);
+    if (HEDLEY_UNLIKELY(0 > open)) {
+      close(sock);
+      return open;
+    }
+    return uv_tcp_bind(tcp, (const struct sockaddr*) addr, 0);
+# else
+    /* only the first shard can listen */
+    return uv_tcp_bind(tcp, (const struct sockaddr*) addr, 0);
+# endif
+}
+
 static bool tcp_handle_(upd_req_t* req) {
   (void) req;
   return false;
@@ -379,7 +423,8 @@ static bool cli_init_(upd_file_t* f) {
       .cb    = cli_watch_cb_,
     },
   };
-  if (HEDLEY_UNLIKELY(!upd_file_watch(&cli->watch))) {
+  const uint16_t mask = UPD_FILE_EVENT_BIT(UPD_FILE_SHUTDOWN);
+  if (HEDLEY_UNLIKELY(!upd_file_watch_with_mask(&cli->watch, mask))) {
     upd_free(&cli);
     return false;
   }
@@ -422,6 +467,7 @@ static void cli_close_(upd_file_t* f) {
 static bool cli_pipe_stream_to_tcp_(upd_file_t* f) {
   cli_t_* cli = f->ctx;
 
+  upd_trace(f->iso, "cli.read", UPD_TRACE_BEGIN, f, cli->k.file, 0);
   upd_file_ref(f);
   const bool read = upd_req_with_dup(&(upd_req_t) {
       .file = cli->k.file,
@@ -449,6 +495,8 @@ static void srv_pathfind_cb_(upd_pathfind_t* pf) {
   srv->prog = pf->len? NULL: pf->base;
   upd_iso_unstack(iso, pf);
 
+  upd_trace(iso, "srv.pathfind", UPD_TRACE_END, f, f, !!srv->prog);
+
   if (HEDLEY_UNLIKELY(srv->prog == NULL)) {
     srv_logf_(f, "program pathfind failure");
     return;
@@ -467,7 +515,7 @@ static void srv_pathfind_cb_(upd_pathfind_t* pf) {
   uv_tcp_t* tcp = tcpf->ctx;
   tcp->data = f;
 
-  const int bind = uv_tcp_bind(tcp, (struct sockaddr*) &srv->addr, 0);
+  const int bind = tcp_bind_(tcpf, &srv->addr);
   if (HEDLEY_UNLIKELY(0 > bind)) {
     srv_logf_(f, "tcp bind error: %s", uv_err_name(bind));
     upd_file_unref(tcpf);
@@ -543,6 +591,7 @@ static void cli_lock_prog_cb_(upd_file_lock_t* k) {
     goto ABORT;
   }
 
+  upd_trace(iso, "cli.exec", UPD_TRACE_BEGIN, k, fpro, 0);
   const bool exec = upd_req_with_dup(&(upd_req_t) {
       .file  = fpro,
       .type  = UPD_REQ_PROG_EXEC,
@@ -550,6 +599,7 @@ static void cli_lock_prog_cb_(upd_file_lock_t* k) {
       .cb    = cli_exec_cb_,
     });
   if (HEDLEY_UNLIKELY(!exec)) {
+    upd_trace(iso, "cli.exec", UPD_TRACE_END, k, fpro, 0);
     srv_logf_(cli->srv, "program execution refusal");
     goto ABORT;
   }
@@ -570,6 +620,8 @@ static void cli_exec_cb_(upd_req_t* req) {
   upd_file_t* fst = req->result == UPD_REQ_OK? req->prog.exec: NULL;
   upd_iso_unstack(iso, req);
 
+  upd_trace(iso, "cli.exec", UPD_TRACE_END, kpro, kpro->file, !!fst);
+
   if (HEDLEY_UNLIKELY(fst == NULL)) {
     srv_logf_(cli->srv, "program execution failure");
     goto ABORT;
@@ -609,7 +661,8 @@ static void cli_lock_stream_cb_(upd_file_lock_t* k) {
     .udata = f,
     .cb    = cli_watch_stream_cb_,
   };
-  if (HEDLEY_UNLIKELY(!upd_file_watch(&cli->watchst))) {
+  const uint16_t mask = UPD_FILE_EVENT_BIT(UPD_FILE_UPDATE);
+  if (HEDLEY_UNLIKELY(!upd_file_watch_with_mask(&cli->watchst, mask))) {
     upd_file_unref(f);
     srv_logf_(cli->srv, "stream watch failure");
     goto EXIT;
@@ -632,12 +685,15 @@ EXIT:
 }
 
 static void cli_alloc_cb_(uv_handle_t* handle, size_t n, uv_buf_t* buf) {
-  (void) handle;
+  upd_file_t* f = handle->data;
 
   *buf = (uv_buf_t) {0};
 
-  uint8_t* ptr = NULL;
-  if (HEDLEY_UNLIKELY(!upd_malloc(&ptr, n))) {
+  if (HEDLEY_UNLIKELY(n > UPD_ISO_STACK_BLOCK_MAX)) {
+    n = UPD_ISO_STACK_BLOCK_MAX;
+  }
+  uint8_t* ptr = upd_iso_stack(f->iso, n);
+  if (HEDLEY_UNLIKELY(ptr == NULL)) {
     return;
   }
   *buf = uv_buf_init((char*) ptr, n);
@@ -673,6 +729,7 @@ static void cli_tcp_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf
     goto ABORT;
   }
 
+  upd_trace(f->iso, "cli.write", UPD_TRACE_BEGIN, ptr, cli->k.file, n);
   upd_file_ref(f);
   const bool write = upd_req_with_dup(&(upd_req_t) {
       .file = cli->k.file,
@@ -691,7 +748,9 @@ static void cli_tcp_read_cb_(uv_stream_t* stream, ssize_t n, const uv_buf_t* buf
   return;
 
 ABORT:
-  upd_free(&ptr);
+  if (HEDLEY_LIKELY(ptr)) {
+    upd_iso_unstack(f->iso, ptr);
+  }
   cli_close_(f);
 }
 
@@ -700,6 +759,7 @@ static void cli_tcp_write_cb_(uv_write_t* req, int status) {
   upd_iso_t*  iso = f->iso;
   cli_t_*     cli = f->ctx;
 
+  upd_trace(iso, "cli.tcp_write", UPD_TRACE_END, req, f, 0);
   if (HEDLEY_UNLIKELY(0 > status)) {
     srv_logf_(cli->srv, "tcp write failure: %s", uv_err_name(status));
   }
@@ -712,6 +772,8 @@ static void cli_stream_read_cb_(upd_req_t* req) {
   cli_t_*     cli = f->ctx;
   upd_iso_t*  iso = f->iso;
 
+  upd_trace(iso, "cli.read", UPD_TRACE_END, f, req->file, req->stream.io.size);
+
   if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
     goto EXIT;
   }
@@ -723,7 +785,6 @@ static void cli_stream_read_cb_(upd_req_t* req) {
 
   uv_write_t* w = upd_iso_stack(iso, sizeof(*w)+io->size);
   if (HEDLEY_UNLIKELY(w == NULL)) {
-    upd_iso_unstack(iso, w);
     cli_close_(f);
     srv_logf_(cli->srv, "tcp write req allocation failure");
     goto EXIT;
@@ -733,6 +794,7 @@ static void cli_stream_read_cb_(upd_req_t* req) {
 
   const uv_buf_t buf = uv_buf_init((char*) (w+1), io->size);
 
+  upd_trace(iso, "cli.tcp_write", UPD_TRACE_BEGIN, w, f, io->size);
   upd_file_ref(f);
   const int write = uv_write(
     w, (uv_stream_t*) &cli->tcp, &buf, 1, cli_tcp_write_cb_);
@@ -757,10 +819,12 @@ static void cli_stream_write_cb_(upd_req_t* req) {
   upd_file_t* f   = req->udata;
   upd_iso_t*  iso = f->iso;
 
+  upd_trace(iso, "cli.write", UPD_TRACE_END, req->stream.io.buf, req->file, 0);
+
   if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
     cli_close_(f);
   }
-  upd_free(&req->stream.io.buf);
+  upd_iso_unstack(iso, req->stream.io.buf);
   upd_iso_unstack(iso, req);
   upd_file_unref(f);
 }
@@ -7,28 +7,68 @@
 
 #define RULE_BACKEND_STACK_MAX_ 8
 
+#define DEBOUNCE_ 30  /* ms */
+
+#define LAZY_SWEEP_MIN_ 1000  /* ms */
+#define LAZY_SWEEP_PERIOD_(idle) ((idle) > LAZY_SWEEP_MIN_? (idle): LAZY_SWEEP_MIN_)
+
 
 typedef struct ctx_t_       ctx_t_;
 typedef struct rule_t_      rule_t_;
 typedef struct rule_item_t_ rule_item_t_;
+typedef struct single_t_    single_t_;
+typedef struct entry_t_     entry_t_;
+typedef struct merge_t_     merge_t_;
 
 struct ctx_t_ {
   upd_file_t*      parent;
   upd_file_watch_t watch;
 
   upd_array_of(rule_t_*) rules;
-  upd_array_of(upd_req_dir_entity_t*) children;
+  upd_array_of(rule_t_*) chain;  /* rules including inherited ones */
+  upd_array_of(upd_req_dir_entry_t*) children;
+  upd_dirindex_t index;
 
   upd_file_lock_t          lock;
   upd_array_of(upd_req_t*) reqs;
 
+  /*  In lazy mode, entries are recorded only with names and their files
+   * are created on the first find or list, and released after idle
+   * period of lazy_idle ms (0 to keep forever). */
+  upd_iso_timeout_t sweep;
+  uint64_t          lazy_idle;
+
+  /* changes notified within a debounce period are synced at once */
+  upd_iso_timeout_t debounce;
+  uint8_t*          change;  /* the only entry changed */
+  size_t            changelen;
+
   unsigned selflock : 1;
   unsigned busy     : 1;
+  unsigned again    : 1;  /* sync is requested while busy */
+  unsigned full     : 1;  /* changes cannot be specified */
+  unsigned chained  : 1;  /* chain is up to date */
+  unsigned lazy     : 1;
 };
 
+typedef enum rule_kind_t_ {
+  RULE_ANY_,
+  RULE_EXACT_,
+  RULE_PREFIX_,  /* LIT.* */
+  RULE_SUFFIX_,  /* .*LIT */
+  RULE_REGEX_,
+} rule_kind_t_;
+
 struct rule_t_ {
   uint8_t* pattern;
 
+  /*  Patterns whose only metachars are leading or trailing `.*` are
+   * matched as literals. Others are still matched by re_match, which
+   * compiles the pattern again on each entry. */
+  rule_kind_t_ kind;
+  uint8_t*     lit;
+  size_t       litlen;
+
   upd_array_of(rule_item_t_*) items;
 };
 
@@ -39,6 +79,27 @@ struct rule_item_t_ {
   const upd_driver_t* driver;
 };
 
+struct entry_t_ {
+  upd_req_dir_entry_t super;  /* file is NULL until instantiated */
+  uint64_t            touch;
+};
+
+struct merge_t_ {
+  upd_hmap_t seen;   /* entries which still exist */
+  size_t     prev;   /* number of entries before the merge */
+  uint64_t   begin;  /* hrtime for the lag monitor, 0 if untimed */
+  bool       complete;
+  bool       modified;
+};
+
+struct single_t_ {
+  uv_fs_t     fsreq;
+  upd_file_t* file;
+
+  uint8_t* name;
+  size_t   len;
+};
+
 
 static
 bool
@@ -82,6 +143,28 @@ syncdir_find_(
   upd_file_t*          f,
   upd_req_dir_entry_t* e);
 
+static
+void
+syncdir_compile_rule_(
+  rule_t_* r,
+  size_t   len);
+
+static
+bool
+syncdir_match_rule_(
+  const rule_t_*     r,
+  const uv_dirent_t* e);
+
+static
+bool
+syncdir_build_chain_(
+  upd_file_t* f);
+
+static
+void
+syncdir_invalidate_chain_(
+  upd_file_t* f);
+
 static
 const rule_t_*
 syncdir_select_rule_(
@@ -95,6 +178,57 @@ syncdir_create_file_from_rule_(
   const rule_t_* rule,
   upd_file_t*    proto);
 
+static
+upd_file_t*
+syncdir_create_child_(
+  upd_file_t*    f,
+  const rule_t_* rule,
+  const uint8_t* name,
+  size_t         len);
+
+static
+bool
+syncdir_instantiate_(
+  upd_file_t* f,
+  entry_t_*   e);
+
+static
+bool
+syncdir_list_lazy_(
+  upd_req_t* req);
+
+static
+bool
+syncdir_add_(
+  upd_file_t*        f,
+  const uv_dirent_t* ne);
+
+static
+void
+syncdir_remove_(
+  upd_file_t*          f,
+  upd_req_dir_entry_t* e);
+
+static
+void
+syncdir_merge_(
+  upd_file_t*        f,
+  merge_t_*          m,
+  const uv_dirent_t* ne);
+
+static
+void
+syncdir_merge_end_(
+  upd_file_t* f,
+  merge_t_*   m);
+
+static
+void
+syncdir_note_change_(
+  upd_file_t* f,
+  uint8_t*    name,
+  size_t      len);
+
 HEDLEY_PRINTF_FORMAT(2, 3)
 static
 void
@@ -149,16 +283,37 @@ void
 syncdir_mkdir_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+syncdir_debounce_cb_(
+  upd_iso_timeout_t* t);
+
+static
+void
+syncdir_sweep_cb_(
+  upd_iso_timeout_t* t);
+
 static
 void
 syncdir_sync_n2u_lock_cb_(
   upd_file_lock_t* lock);
 
+static
+void
+syncdir_sync_single_cb_(
+  uv_fs_t* fsreq);
+
 static
 void
 syncdir_sync_n2u_scandir_cb_(
   uv_fs_t* fsreq);
 
+static
+void
+syncdir_prefetch_cb_(
+  upd_prefetch_dir_t* d,
+  void*               udata);
+
 
 static bool syncdir_parse_param_(upd_file_t* f) {
   upd_iso_t* iso = f->iso;
@@ -202,7 +357,7 @@ static bool syncdir_parse_param_(upd_file_t* f) {
     }
 
     rule_t_* rule = NULL;
-    if (HEDLEY_UNLIKELY(!upd_malloc(&rule, sizeof(*rule)+patternlen+1))) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&rule, sizeof(*rule)+(patternlen+1)*2))) {
       syncdir_logf_(f, "rule allocation failure, skipping");
       continue;
     }
@@ -210,6 +365,8 @@ static bool syncdir_parse_param_(upd_file_t* f) {
       .pattern = utf8ncpy(rule+1, pattern, patternlen),
     };
     rule->pattern[patternlen] = 0;
+    rule->lit = rule->pattern + patternlen+1;
+    syncdir_compile_rule_(rule, patternlen);
 
     const yaml_node_item_t* itr = v->data.sequence.items.start;
     const yaml_node_item_t* end = v->data.sequence.items.top;
@@ -319,10 +476,26 @@ static bool syncdir_init_(upd_file_t* f) {
       .udata = f,
       .cb    = syncdir_watch_cb_,
     },
+    .sweep = {
+      .udata = f,
+      .cb    = syncdir_sweep_cb_,
+    },
+    .debounce = {
+      .udata = f,
+      .cb    = syncdir_debounce_cb_,
+    },
+    .full = true,
   };
   f->ctx = ctx;
 
-  if (HEDLEY_UNLIKELY(!upd_file_watch(&ctx->watch))) {
+  const char* lazy = getenv("UPD_SYNCDIR_LAZY_MS");
+  if (HEDLEY_UNLIKELY(lazy && lazy[0])) {
+    ctx->lazy      = true;
+    ctx->lazy_idle = strtoull(lazy, NULL, 10);
+  }
+
+  const uint16_t mask = UPD_FILE_EVENT_BIT(UPD_FILE_UPDATE_N);
+  if (HEDLEY_UNLIKELY(!upd_file_watch_with_mask(&ctx->watch, mask))) {
     upd_free(&ctx);
     return false;
   }
@@ -332,6 +505,9 @@ static bool syncdir_init_(upd_file_t* f) {
     return false;
   }
 
+  if (HEDLEY_LIKELY(!ctx->lazy)) {
+    upd_prefetch_mount(f->iso, f->npath, f->npathlen);
+  }
   if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(f, NULL))) {
     syncdir_logf_(f, "first sync failed");
   }
@@ -341,16 +517,29 @@ static bool syncdir_init_(upd_file_t* f) {
 static void syncdir_deinit_(upd_file_t* f) {
   ctx_t_* ctx = f->ctx;
 
+  upd_iso_timeout_stop(f->iso, &ctx->debounce);
+  upd_iso_timeout_stop(f->iso, &ctx->sweep);
+  if (ctx->change) {
+    upd_free(&ctx->change);
+  }
+
   for (size_t i = 0; i < ctx->children.n; ++i) {
     upd_req_dir_entry_t* e = ctx->children.p[i];
+    if (HEDLEY_UNLIKELY(e->file == NULL)) {
+      upd_free(&e);
+      continue;
+    }
     if (HEDLEY_UNLIKELY(e->file->driver == &upd_driver_syncdir)) {
       ctx_t_* subctx = e->file->ctx;
       subctx->parent = NULL;
+      syncdir_invalidate_chain_(e->file);
     }
     upd_file_unref(e->file);
     upd_free(&e);
   }
   upd_array_clear(&ctx->children);
+  upd_dirindex_clear(&ctx->index);
+  upd_array_clear(&ctx->chain);
 
   for (size_t i = 0; i < ctx->rules.n; ++i) {
     rule_t_* r = ctx->rules.p[i];
@@ -371,21 +560,37 @@ static bool syncdir_handle_(upd_req_t* req) {
   ctx_t_*     ctx = f->ctx;
   upd_iso_t*  iso = f->iso;
 
+  upd_file_stats_req(req);
+
   switch (req->type) {
   case UPD_REQ_DIR_LIST:
     req->dir.entries = (upd_req_dir_entries_t) {
-      .p = (upd_req_dir_entry_t**) ctx->children.p,
       .n = ctx->children.n,
+      .p = (upd_req_dir_entry_t**) ctx->children.p,
     };
+    if (HEDLEY_UNLIKELY(ctx->lazy)) {
+      return syncdir_list_lazy_(req);
+    }
     req->result = UPD_REQ_OK;
-    req->cb(req);
+    upd_file_req_cb(req);
     return true;
 
-  case UPD_REQ_DIR_FIND:
-    syncdir_find_(f, &req->dir.entry);
+  case UPD_REQ_DIR_FIND: {
+    const upd_req_dir_entry_t q = req->dir.entry;
+    if (HEDLEY_UNLIKELY(upd_dcache_is_path(&q))) {
+      return upd_dcache_find_path(req);
+    }
+
+    /* a name failed to be instantiated is not cached as absent */
+    const bool found  = syncdir_find_(f, &req->dir.entry);
+    const bool cached = q.name &&
+      (found || !upd_dirindex_find_by_name(&ctx->index, q.name, q.len));
+    if (HEDLEY_LIKELY(cached)) {
+      upd_dcache_put(iso, f, q.name, q.len, req->dir.entry.file);
+    }
     req->result = UPD_REQ_OK;
-    req->cb(req);
-    return true;
+    upd_file_req_cb(req);
+  } return true;
 
   case UPD_REQ_DIR_NEW:
   case UPD_REQ_DIR_NEWDIR: {
@@ -406,8 +611,8 @@ static bool syncdir_handle_(upd_req_t* req) {
       open = 0 <= uv_fs_mkdir(
         &iso->loop, fsreq, (char*) npath, S_IFDIR, syncdir_mkdir_cb_);
     } else {
-      open = 0 <= uv_fs_open(
-        &iso->loop,
+      open = 0 <= upd_fs_open(
+        iso,
         fsreq,
         (char*) npath,
         O_CREAT | O_EXCL | O_WRONLY,
@@ -474,36 +679,142 @@ static size_t syncdir_stack_child_npath_(
 static bool syncdir_find_(upd_file_t* f, upd_req_dir_entry_t* e) {
   ctx_t_* ctx = f->ctx;
 
-  for (size_t i = 0; i < ctx->children.n; ++i) {
-    const upd_req_dir_entry_t* g = ctx->children.p[i];
-    if (HEDLEY_UNLIKELY(upd_streq(e->name, e->len, g->name, g->len))) {
-      *e = *g;
-      return true;
-    }
+  upd_req_dir_entry_t* g =
+    upd_dirindex_find_by_name(&ctx->index, e->name, e->len);
+  if (HEDLEY_LIKELY(g && syncdir_instantiate_(f, (entry_t_*) g))) {
+    *e = *g;
+    return true;
   }
   *e = (upd_req_dir_entry_t) {0};
   return false;
 }
 
+static void syncdir_compile_rule_(rule_t_* r, size_t len) {
+  const uint8_t* p = r->pattern;
+
+  const bool head = len >= 2 && p[0] == '.' && p[1] == '*';
+  if (head) {
+    p   += 2;
+    len -= 2;
+  }
+  const bool tail =
+    len >= 2 && p[len-2] == '.' && p[len-1] == '*' &&
+    (len == 2 || p[len-3] != '\\');
+  if (tail) {
+    len -= 2;
+  }
+
+  r->kind   = RULE_REGEX_;
+  r->litlen = 0;
+  for (size_t i = 0; i < len; ++i) {
+    uint8_t c = p[i];
+    if (c == '\\') {
+      if (HEDLEY_UNLIKELY(++i >= len)) {
+        return;
+      }
+      c = p[i];
+      if (HEDLEY_UNLIKELY(strchr("dDwWsS", c))) {
+        return;
+      }
+    } else if (HEDLEY_UNLIKELY(strchr("^$.*+?[]|", c))) {
+      return;
+    }
+    r->lit[r->litlen++] = c;
+  }
+  r->lit[r->litlen] = 0;
+
+  if (r->litlen == 0) {
+    r->kind = head || tail || !r->pattern[0]? RULE_ANY_: RULE_REGEX_;
+  } else if (head && tail) {
+    r->kind = RULE_REGEX_;
+  } else if (head) {
+    r->kind = RULE_SUFFIX_;
+  } else if (tail) {
+    r->kind = RULE_PREFIX_;
+  } else {
+    r->kind = RULE_EXACT_;
+  }
+}
+
+static bool syncdir_match_rule_(const rule_t_* r, const uv_dirent_t* e) {
+  const uint8_t* name = (uint8_t*) e->name;
+  const size_t   len  = utf8size_lazy(e->name);
+
+  switch (r->kind) {
+  case RULE_ANY_:
+    return true;
+  case RULE_EXACT_:
+    return upd_streq(r->lit, r->litlen, name, len);
+  case RULE_PREFIX_:
+    return len >= r->litlen && memcmp(name, r->lit, r->litlen) == 0;
+  case RULE_SUFFIX_:
+    return len >= r->litlen &&
+      memcmp(name+len-r->litlen, r->lit, r->litlen) == 0;
+  case RULE_REGEX_:
+    break;
+  }
+
+  /* tiny-regex-c compiles the pattern into a static buffer on each call */
+  int matchlen = 0;
+  re_match((char*) r->pattern, e->name, &matchlen);
+  return e->name[matchlen] == 0;
+}
+
+static bool syncdir_build_chain_(upd_file_t* f) {
+  ctx_t_* ctx = f->ctx;
+
+  upd_array_clear(&ctx->chain);
+  for (upd_file_t* g = f; g; g = ((ctx_t_*) g->ctx)->parent) {
+    ctx_t_* gctx = g->ctx;
+    for (size_t i = 0; i < gctx->rules.n; ++i) {
+      if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->chain, gctx->rules.p[i], SIZE_MAX))) {
+        upd_array_clear(&ctx->chain);
+        return false;
+      }
+    }
+  }
+  ctx->chained = true;
+  return true;
+}
+
+static void syncdir_invalidate_chain_(upd_file_t* f) {
+  ctx_t_* ctx = f->ctx;
+
+  ctx->chained = false;
+  upd_array_clear(&ctx->chain);
+
+  for (size_t i = 0; i < ctx->children.n; ++i) {
+    const upd_req_dir_entry_t* e = ctx->children.p[i];
+    if (HEDLEY_UNLIKELY(e->file == NULL)) {
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(e->file->driver == &upd_driver_syncdir)) {
+      syncdir_invalidate_chain_(e->file);
+    }
+  }
+}
+
 static const rule_t_* syncdir_select_rule_(
     upd_file_t* f, const uv_dirent_t* e) {
   ctx_t_* ctx = f->ctx;
 
-  for (size_t i = 0; i < ctx->rules.n; ++i) {
-    const rule_t_* r = ctx->rules.p[i];
-
-    if (HEDLEY_LIKELY(r->pattern[0])) {
-      int matchlen = 0;
-      re_match((char*) r->pattern, e->name, &matchlen);
-      if (HEDLEY_UNLIKELY(e->name[matchlen] == 0)) {
-        return r;
+  if (HEDLEY_UNLIKELY(!ctx->chained && !syncdir_build_chain_(f))) {
+    for (upd_file_t* g = f; g; g = ((ctx_t_*) g->ctx)->parent) {
+      ctx_t_* gctx = g->ctx;
+      for (size_t i = 0; i < gctx->rules.n; ++i) {
+        if (syncdir_match_rule_(gctx->rules.p[i], e)) {
+          return gctx->rules.p[i];
+        }
       }
-    } else {
-      return r;
     }
+    return NULL;
   }
-  if (HEDLEY_UNLIKELY(ctx->parent)) {
-    return syncdir_select_rule_(ctx->parent, e);
+
+  for (size_t i = 0; i < ctx->chain.n; ++i) {
+    const rule_t_* r = ctx->chain.p[i];
+    if (syncdir_match_rule_(r, e)) {
+      return r;
+    }
   }
   return NULL;
 }
@@ -520,20 +831,278 @@ static upd_file_t* syncdir_create_file_from_rule_(
     proto->backend  = fc;
 
     upd_file_t* temp = upd_file_new(proto);
-    if (fc) upd_file_unref(fc);
+    if (fc) {
+      upd_file_unref(fc);
+    }
 
     if (HEDLEY_UNLIKELY(temp == NULL)) {
       return NULL;
     }
     if (HEDLEY_UNLIKELY(temp->driver == &upd_driver_syncdir)) {
-      ctx_t_* subctx = fc->ctx;
+      ctx_t_* subctx = temp->ctx;
       subctx->parent = f;
+      syncdir_invalidate_chain_(temp);
     }
     fc = temp;
   }
   return fc;
 }
 
+static upd_file_t* syncdir_create_child_(
+    upd_file_t* f, const rule_t_* rule, const uint8_t* name, size_t len) {
+  upd_iso_t* iso = f->iso;
+
+  uint8_t* path;
+  const size_t pathlen = syncdir_stack_child_path_(f, &path, name, len);
+  if (HEDLEY_UNLIKELY(pathlen == 0)) {
+    syncdir_logf_(f, "path allocation failure, '%.*s' is ignored", (int) len, name);
+    return NULL;
+  }
+
+  uint8_t* npath;
+  const size_t npathlen = syncdir_stack_child_npath_(f, &npath, name, len);
+  if (HEDLEY_UNLIKELY(npathlen == 0)) {
+    upd_iso_unstack(iso, path);
+    syncdir_logf_(f, "npath allocation failure, '%.*s' is ignored", (int) len, name);
+    return NULL;
+  }
+
+  upd_file_t* fc = syncdir_create_file_from_rule_(f, rule, &(upd_file_t) {
+      .iso      = iso,
+      .path     = path,
+      .pathlen  = pathlen,
+      .npath    = npath,
+      .npathlen = npathlen,
+    });
+  upd_iso_unstack(iso, path);
+  upd_iso_unstack(iso, npath);
+
+  if (HEDLEY_UNLIKELY(fc == NULL)) {
+    syncdir_logf_(f, "file creation failed, '%.*s' is ignored", (int) len, name);
+    return NULL;
+  }
+  return fc;
+}
+
+static bool syncdir_instantiate_(upd_file_t* f, entry_t_* e) {
+  upd_iso_t* iso = f->iso;
+  ctx_t_*    ctx = f->ctx;
+
+  e->touch = upd_iso_now(iso);
+  if (HEDLEY_LIKELY(e->super.file)) {
+    return true;
+  }
+
+  const rule_t_* rule = syncdir_select_rule_(f, &(uv_dirent_t) {
+      .name = (char*) e->super.name,
+    });
+  if (HEDLEY_UNLIKELY(rule == NULL)) {
+    return false;
+  }
+
+  upd_file_t* fc = syncdir_create_child_(f, rule, e->super.name, e->super.len);
+  if (HEDLEY_UNLIKELY(fc == NULL)) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!upd_dirindex_set_file(&ctx->index, &e->super, fc))) {
+    upd_file_unref(fc);
+    return false;
+  }
+
+  if (ctx->lazy_idle && ctx->sweep.head == NULL) {
+    upd_iso_timeout_start(iso, &ctx->sweep, LAZY_SWEEP_PERIOD_(ctx->lazy_idle));
+  }
+  return true;
+}
+
+static bool syncdir_list_lazy_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  upd_iso_t*  iso = f->iso;
+
+  const size_t n = req->dir.entries.n;
+
+  /* entries failed to instantiate are skipped in a copy of the page */
+  upd_req_dir_entry_t** kept  = NULL;
+  size_t                nkept = 0;
+  for (size_t i = 0; i < n; ++i) {
+    entry_t_* e = (entry_t_*) req->dir.entries.p[i];
+    if (HEDLEY_LIKELY(syncdir_instantiate_(f, e))) {
+      if (HEDLEY_UNLIKELY(kept)) {
+        kept[nkept++] = &e->super;
+      }
+      continue;
+    }
+    syncdir_logf_(f, "instantiation failed, '%s' is skipped", e->super.name);
+
+    if (HEDLEY_UNLIKELY(kept == NULL)) {
+      kept = upd_iso_stack(iso, sizeof(*kept)*n);
+      if (HEDLEY_UNLIKELY(kept == NULL)) {
+        req->dir.entries = (upd_req_dir_entries_t) {0};
+        req->result      = UPD_REQ_NOMEM;
+        return false;
+      }
+      memcpy(kept, req->dir.entries.p, sizeof(*kept)*i);
+      nkept = i;
+    }
+  }
+  if (HEDLEY_UNLIKELY(kept)) {
+    req->dir.entries = (upd_req_dir_entries_t) {
+      .n = nkept,
+      .p = kept,
+    };
+  }
+
+  req->result = UPD_REQ_OK;
+  upd_file_req_cb(req);
+
+  if (HEDLEY_UNLIKELY(kept)) {
+    upd_iso_unstack(iso, kept);
+  }
+  return true;
+}
+
+static bool syncdir_add_(upd_file_t* f, const uv_dirent_t* ne) {
+  ctx_t_* ctx = f->ctx;
+
+  const rule_t_* rule = syncdir_select_rule_(f, ne);
+  if (HEDLEY_UNLIKELY(rule == NULL)) {
+    syncdir_logf_(f, "no pattern matched, '%s' is ignored", ne->name);
+    return false;
+  }
+
+  const uint8_t* name = (uint8_t*) ne->name;
+  const size_t   len  = utf8size_lazy(ne->name);
+
+  upd_file_t* fc = NULL;
+  if (HEDLEY_LIKELY(!ctx->lazy)) {
+    fc = syncdir_create_child_(f, rule, name, len);
+    if (HEDLEY_UNLIKELY(fc == NULL)) {
+      return false;
+    }
+  }
+
+  entry_t_* e = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len+1))) {
+    if (fc) {
+      upd_file_unref(fc);
+    }
+    syncdir_logf_(f, "entry allocation failed, '%s' is ignored", ne->name);
+    return false;
+  }
+  *e = (entry_t_) {
+    .super = {
+      .name = (uint8_t*) (e+1),
+      .len  = len,
+      .file = fc,
+    },
+  };
+  utf8ncpy(e->super.name, name, len);
+  e->super.name[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!upd_dirindex_insert(&ctx->index, &e->super))) {
+    if (fc) {
+      upd_file_unref(fc);
+    }
+    upd_free(&e);
+    syncdir_logf_(f, "entry indexing failed, '%s' is ignored", ne->name);
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, &e->super, SIZE_MAX))) {
+    upd_dirindex_remove(&ctx->index, &e->super);
+    if (fc) {
+      upd_file_unref(fc);
+    }
+    upd_free(&e);
+    syncdir_logf_(f, "entry insertion failed, '%s' is ignored", ne->name);
+    return false;
+  }
+  return true;
+}
+
+static void syncdir_remove_(upd_file_t* f, upd_req_dir_entry_t* e) {
+  ctx_t_* ctx = f->ctx;
+
+  upd_dirindex_remove(&ctx->index, e);
+  upd_array_find_and_remove(&ctx->children, e);
+  if (e->file) {
+    upd_file_unref(e->file);
+  }
+  upd_free(&e);
+}
+
+static void syncdir_note_change_(upd_file_t* f, uint8_t* name, size_t len) {
+  ctx_t_* ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(name && !ctx->full)) {
+    if (ctx->change == NULL) {
+      ctx->change    = name;
+      ctx->changelen = len;
+      return;
+    }
+    if (upd_streq(ctx->change, ctx->changelen, name, len)) {
+      upd_free(&name);
+      return;
+    }
+  }
+  if (name) {
+    upd_free(&name);
+  }
+  if (ctx->change) {
+    upd_free(&ctx->change);
+  }
+  ctx->changelen = 0;
+  ctx->full      = true;
+}
+
+static void syncdir_merge_(
+    upd_file_t* f, merge_t_* m, const uv_dirent_t* ne) {
+  ctx_t_* ctx = f->ctx;
+
+  const bool dir = ne->type == UV_DIRENT_DIR;
+  if (HEDLEY_UNLIKELY(!dir && ne->type != UV_DIRENT_FILE)) {
+    syncdir_logf_(f, "'%s' is ignored because of unknown file type", ne->name);
+    return;
+  }
+
+  upd_req_dir_entry_t* e = upd_dirindex_find_by_name(
+    &ctx->index, (uint8_t*) ne->name, utf8size_lazy(ne->name));
+  if (HEDLEY_LIKELY(e)) {
+    if (HEDLEY_UNLIKELY(!upd_hmap_insert(&m->seen, upd_hmap_hash_ptr(e), e))) {
+      m->complete = false;
+    }
+  } else if (syncdir_add_(f, ne)) {
+    m->modified = true;
+  }
+}
+
+static void syncdir_merge_end_(upd_file_t* f, merge_t_* m) {
+  ctx_t_* ctx = f->ctx;
+
+  if (HEDLEY_LIKELY(m->complete)) {
+    for (size_t i = m->prev; i > 0;) {
+      --i;
+      upd_req_dir_entry_t* e = ctx->children.p[i];
+      if (HEDLEY_UNLIKELY(!upd_hmap_find(&m->seen,
+          upd_hmap_hash_ptr(e), upd_hmap_eq_ptr, e))) {
+        syncdir_remove_(f, e);
+        m->modified = true;
+      }
+    }
+  } else {
+    syncdir_logf_(f, "scan failure, removal is deferred to the next sync");
+  }
+  upd_hmap_clear(&m->seen);
+
+  /* watchers of the update are timed on their own */
+  if (m->begin) {
+    upd_lag_check_(f->iso, f->driver, f->id, "merge", ctx->children.n, m->begin);
+  }
+  if (m->modified) {
+    upd_dcache_forget_dir(f);
+    upd_file_trigger(f, UPD_FILE_UPDATE);
+  }
+}
+
 static void syncdir_logf_(upd_file_t* f, const char* fmt, ...) {
   uint8_t msg[256];
 
@@ -553,8 +1122,10 @@ static bool syncdir_sync_n2u_(upd_file_t* f, upd_req_t* req) {
       syncdir_logf_(f, "req insertion failure");
       return false;
     }
+    syncdir_note_change_(f, NULL, 0);
   }
   if (HEDLEY_UNLIKELY(ctx->busy)) {
+    ctx->again = true;
     return true;
   }
 
@@ -563,7 +1134,8 @@ static bool syncdir_sync_n2u_(upd_file_t* f, upd_req_t* req) {
     .udata = f,
     .cb    = syncdir_sync_n2u_lock_cb_,
   };
-  ctx->selflock = !req;
+  /* pending reqs are from whom holds the lock */
+  ctx->selflock = !ctx->reqs.n;
   ctx->busy     = true;
 
   if (ctx->selflock) {
@@ -587,6 +1159,14 @@ static void syncdir_finalize_sync_(upd_file_t* f) {
     upd_file_unlock(&ctx->lock);
   }
 
+  /* pending reqs wait for the sync including changes made during this */
+  if (HEDLEY_UNLIKELY(ctx->again)) {
+    ctx->again = false;
+    if (HEDLEY_LIKELY(syncdir_sync_n2u_(f, NULL))) {
+      return;
+    }
+  }
+
   for (size_t i = 0; i < ctx->reqs.n; ++i) {
     upd_req_t* req = ctx->reqs.p[i];
     syncdir_find_(f, &req->dir.entry);
@@ -596,23 +1176,81 @@ static void syncdir_finalize_sync_(upd_file_t* f) {
     } else {
       req->result = req->dir.entry.file? UPD_REQ_OK: UPD_REQ_ABORTED;
     }
-    req->cb(req);
+    upd_file_req_cb(req);
   }
   upd_array_clear(&ctx->reqs);
 }
 
 
 static void syncdir_watch_cb_(upd_file_watch_t* w) {
-  upd_file_t* f = w->udata;
+  upd_file_t*  f   = w->udata;
+  upd_file_t_* f_  = (upd_file_t_*) f;
+  upd_iso_t*   iso = f->iso;
+  ctx_t_*      ctx = f->ctx;
 
   if (HEDLEY_UNLIKELY(w->event == UPD_FILE_UPDATE_N)) {
-    if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(f, NULL))) {
-      syncdir_logf_(f, "auto sync failure");
-      return;
+    uint8_t* name;
+    size_t   len;
+    if (upd_watch_take_change(&f_->npoll, &name, &len)) {
+      syncdir_note_change_(f, name, len);
+    } else {
+      syncdir_note_change_(f, NULL, 0);
+    }
+    if (ctx->debounce.head == NULL) {
+      upd_iso_timeout_start(iso, &ctx->debounce, DEBOUNCE_);
     }
   }
 }
 
+static void syncdir_debounce_cb_(upd_iso_timeout_t* t) {
+  upd_file_t* f = t->udata;
+
+  if (HEDLEY_UNLIKELY(!syncdir_sync_n2u_(f, NULL))) {
+    syncdir_logf_(f, "auto sync failure");
+  }
+}
+
+static void syncdir_sweep_cb_(upd_iso_timeout_t* t) {
+  upd_file_t* f   = t->udata;
+  upd_iso_t*  iso = f->iso;
+  ctx_t_*     ctx = f->ctx;
+
+  const uint64_t now = upd_iso_now(iso);
+
+  bool remain = false;
+  for (size_t i = 0; i < ctx->children.n; ++i) {
+    entry_t_*    e   = ctx->children.p[i];
+    upd_file_t*  fc  = e->super.file;
+    upd_file_t_* fc_ = (upd_file_t_*) fc;
+    if (fc == NULL) {
+      continue;
+    }
+
+    const uint64_t touch =
+      e->touch > fc->last_touch? e->touch: fc->last_touch;
+    const bool idle =
+      fc->refcnt       == 1    &&
+      fc_->lock.refcnt == 0    &&
+      fc_->lock.head   == NULL &&
+      now >= touch + ctx->lazy_idle;
+    if (HEDLEY_UNLIKELY(!idle)) {
+      remain = true;
+      continue;
+    }
+
+    upd_dcache_forget(iso, f, e->super.name, e->super.len);
+    upd_dirindex_set_file(&ctx->index, &e->super, NULL);
+    if (HEDLEY_UNLIKELY(fc->driver == &upd_driver_syncdir)) {
+      ctx_t_* subctx = fc->ctx;
+      subctx->parent = NULL;
+    }
+    upd_file_unref(fc);
+  }
+  if (remain) {
+    upd_iso_timeout_start(iso, &ctx->sweep, LAZY_SWEEP_PERIOD_(ctx->lazy_idle));
+  }
+}
+
 static void syncdir_open_cb_(uv_fs_t* fsreq) {
   upd_req_t*  req = fsreq->data;
   upd_file_t* f   = req->file;
@@ -627,8 +1265,8 @@ static void syncdir_open_cb_(uv_fs_t* fsreq) {
   }
 
   fsreq->data = f;
-  const int close = uv_fs_close(
-    &iso->loop, fsreq, result, syncdir_close_cb_);
+  const int close = upd_fs_close(
+    iso, fsreq, result, syncdir_close_cb_);
   if (HEDLEY_UNLIKELY(close < 0)) {
     upd_iso_unstack(iso, fsreq);
     goto ABORT;
@@ -641,7 +1279,7 @@ static void syncdir_open_cb_(uv_fs_t* fsreq) {
 
 ABORT:
   req->result = UPD_REQ_ABORTED;
-  req->cb(req);
+  upd_file_req_cb(req);
 }
 
 static void syncdir_close_cb_(uv_fs_t* fsreq) {
@@ -669,7 +1307,7 @@ static void syncdir_mkdir_cb_(uv_fs_t* fsreq) {
 
 ABORT:
   req->result = UPD_REQ_ABORTED;
-  req->cb(req);
+  upd_file_req_cb(req);
 
 EXIT:
   upd_iso_unstack(iso, fsreq);
@@ -684,6 +1322,46 @@ static void syncdir_sync_n2u_lock_cb_(upd_file_lock_t* k) {
     goto ABORT;
   }
 
+  if (HEDLEY_LIKELY(ctx->change && !ctx->full)) {
+    single_t_* s = upd_iso_stack(iso, sizeof(*s));
+    if (HEDLEY_UNLIKELY(s == NULL)) {
+      goto ABORT;
+    }
+    *s = (single_t_) {
+      .fsreq = { .data = s, },
+      .file  = f,
+      .name  = ctx->change,
+      .len   = ctx->changelen,
+    };
+    ctx->change    = NULL;
+    ctx->changelen = 0;
+
+    uint8_t* npath;
+    if (HEDLEY_UNLIKELY(!syncdir_stack_child_npath_(f, &npath, s->name, s->len))) {
+      upd_free(&s->name);
+      upd_iso_unstack(iso, s);
+      goto ABORT;
+    }
+    const int lstat = upd_fs_lstat(
+      iso, &s->fsreq, (char*) npath, syncdir_sync_single_cb_);
+    upd_iso_unstack(iso, npath);
+    if (HEDLEY_UNLIKELY(lstat < 0)) {
+      upd_free(&s->name);
+      upd_iso_unstack(iso, s);
+      goto ABORT;
+    }
+    return;
+  }
+  if (ctx->change) {
+    upd_free(&ctx->change);
+  }
+  ctx->changelen = 0;
+  ctx->full      = false;
+
+  if (upd_prefetch_take(iso, f->npath, f->npathlen, syncdir_prefetch_cb_, f)) {
+    return;
+  }
+
   uv_fs_t* fsreq = upd_iso_stack(iso, sizeof(*fsreq));
   if (HEDLEY_UNLIKELY(fsreq == NULL)) {
     goto ABORT;
@@ -702,141 +1380,80 @@ ABORT:
   syncdir_finalize_sync_(f);
 }
 
-static void syncdir_sync_n2u_scandir_cb_(uv_fs_t* fsreq) {
-  upd_file_t* f   = fsreq->data;
+static void syncdir_sync_single_cb_(uv_fs_t* fsreq) {
+  single_t_*  s   = fsreq->data;
+  upd_file_t* f   = s->file;
   upd_iso_t*  iso = f->iso;
   ctx_t_*     ctx = f->ctx;
 
-  bool* rm       = NULL;
-  bool  modified = false;
+  const bool exists =
+    fsreq->result >= 0 &&
+    (S_ISDIR(fsreq->statbuf.st_mode) || S_ISREG(fsreq->statbuf.st_mode));
+  const bool dir = exists && S_ISDIR(fsreq->statbuf.st_mode);
+  uv_fs_req_cleanup(fsreq);
 
-  if (HEDLEY_UNLIKELY(fsreq->result < 0)) {
-    goto EXIT;
+  bool modified = false;
+
+  upd_req_dir_entry_t* e = upd_dirindex_find_by_name(&ctx->index, s->name, s->len);
+  if (exists && e == NULL) {
+    modified = syncdir_add_(f, &(uv_dirent_t) {
+        .name = (char*) s->name,
+        .type = dir? UV_DIRENT_DIR: UV_DIRENT_FILE,
+      });
+  } else if (!exists && e) {
+    syncdir_remove_(f, e);
+    modified = true;
   }
 
-  const size_t prev_un = ctx->children.n;
-
-  rm = prev_un? upd_iso_stack(iso, sizeof(*rm)*prev_un): NULL;
-  if (HEDLEY_UNLIKELY(prev_un && rm == NULL)) {
-    goto EXIT;
+  if (modified) {
+    upd_dcache_forget(iso, f, s->name, s->len);
   }
-  for (size_t i = 0; i < prev_un; ++i) {
-    rm[i] = true;
+  upd_free(&s->name);
+  upd_iso_unstack(iso, s);
+
+  if (modified) {
+    upd_file_trigger(f, UPD_FILE_UPDATE);
   }
+  syncdir_finalize_sync_(f);
+}
 
-  for (size_t n = 0; n < (size_t) fsreq->result; ++n) {
+static void syncdir_sync_n2u_scandir_cb_(uv_fs_t* fsreq) {
+  upd_file_t* f   = fsreq->data;
+  upd_iso_t*  iso = f->iso;
+  ctx_t_*     ctx = f->ctx;
+
+  merge_t_ m = {
+    .prev     = ctx->children.n,
+    .begin    = iso->lag.slow? uv_hrtime(): 0,
+    .complete = fsreq->result >= 0,
+  };
+  for (size_t n = 0; m.complete && n < (size_t) fsreq->result; ++n) {
     uv_dirent_t ne;
     if (HEDLEY_UNLIKELY(0 > uv_fs_scandir_next(fsreq, &ne))) {
       break;
     }
-
-    const bool dir = ne.type == UV_DIRENT_DIR;
-    if (HEDLEY_UNLIKELY(!dir && ne.type != UV_DIRENT_FILE)) {
-      syncdir_logf_(f, "'%s' is ignored because of unknown file type", ne.name);
-      continue;
-    }
-
-    bool found = false;
-    for (size_t u = 0; u < ctx->children.n; ++u) {
-      upd_req_dir_entry_t* ue = ctx->children.p[u];
-      if (HEDLEY_UNLIKELY(utf8cmp(ne.name, ue->name) == 0)) {
-        found = true;
-        if (HEDLEY_LIKELY(u < prev_un)) {
-          rm[u] = false;
-        }
-        break;
-      }
-    }
-
-    if (HEDLEY_UNLIKELY(!found)) {
-      const rule_t_* rule = NULL;
-      rule = syncdir_select_rule_(f, &ne);
-      if (HEDLEY_UNLIKELY(rule == NULL)) {
-        syncdir_logf_(f, "no pattern matched, '%s' is ignored", ne.name);
-        continue;
-      }
-
-      uint8_t* path;
-      const size_t pathlen = syncdir_stack_child_path_(
-        f, &path, (uint8_t*) ne.name, utf8size_lazy(ne.name));
-      if (HEDLEY_UNLIKELY(pathlen == 0)) {
-        syncdir_logf_(f, "path allocation failure, '%s' is ignored", ne.name);
-        continue;
-      }
-
-      uint8_t* npath;
-      const size_t npathlen = syncdir_stack_child_npath_(
-        f, &npath, (uint8_t*) ne.name, utf8size_lazy(ne.name));
-      if (HEDLEY_UNLIKELY(npathlen == 0)) {
-        upd_iso_unstack(iso, path);
-        syncdir_logf_(f, "npath allocation failure, '%s' is ignored", ne.name);
-        continue;
-      }
-
-      upd_file_t* fc = syncdir_create_file_from_rule_(f, rule, &(upd_file_t) {
-          .iso      = iso,
-          .path     = path,
-          .pathlen  = pathlen,
-          .npath    = npath,
-          .npathlen = npathlen,
-        });
-      upd_iso_unstack(iso, path);
-      upd_iso_unstack(iso, npath);
-
-      if (HEDLEY_UNLIKELY(fc == NULL)) {
-        syncdir_logf_(f, "file creation failed, '%s' is ignored", ne.name);
-        continue;
-      }
-
-      const size_t         len = utf8size_lazy(ne.name);
-      upd_req_dir_entry_t* e   = NULL;
-      if (HEDLEY_UNLIKELY(!upd_malloc(&e, sizeof(*e)+len+1))) {
-        upd_file_unref(fc);
-        syncdir_logf_(f, "entry allocation failed, '%s' is ignored", ne.name);
-        continue;
-      }
-      *e = (upd_req_dir_entry_t) {
-        .name = (uint8_t*) (e+1),
-        .len  = len,
-        .file = fc,
-      };
-      utf8ncpy(e->name, ne.name, len);
-      e->name[len] = 0;
-
-      if (HEDLEY_UNLIKELY(!upd_array_insert(&ctx->children, e, SIZE_MAX))) {
-        upd_file_unref(fc);
-        upd_free(&e);
-        syncdir_logf_(f, "entry insertion failed, '%s' is ignored", ne.name);
-        continue;
-      }
-      modified = true;
-    }
-  }
-
-  for (size_t i = prev_un; i > 0;) {
-    --i;
-    if (HEDLEY_UNLIKELY(rm[i])) {
-      upd_req_dir_entry_t* e = upd_array_remove(&ctx->children, i);
-      if (HEDLEY_UNLIKELY(e == NULL)) {
-        continue;
-      }
-      upd_file_unref(e->file);
-      upd_free(&e);
-      modified = true;
-    }
-  }
-
-EXIT:
-  if (HEDLEY_LIKELY(rm)) {
-    upd_iso_unstack(iso, rm);
+    syncdir_merge_(f, &m, &ne);
   }
-
   uv_fs_req_cleanup(fsreq);
   upd_iso_unstack(iso, fsreq);
 
-  if (modified) {
-    upd_file_trigger(f, UPD_FILE_UPDATE);
-  }
+  syncdir_merge_end_(f, &m);
+  syncdir_finalize_sync_(f);
+}
 
+static void syncdir_prefetch_cb_(upd_prefetch_dir_t* d, void* udata) {
+  upd_file_t* f   = udata;
+  upd_iso_t*  iso = f->iso;
+  ctx_t_*     ctx = f->ctx;
+
+  merge_t_ m = {
+    .prev     = ctx->children.n,
+    .begin    = iso->lag.slow? uv_hrtime(): 0,
+    .complete = d->result >= 0,
+  };
+  for (size_t i = 0; m.complete && i < d->n; ++i) {
+    syncdir_merge_(f, &m, &d->ents[i]);
+  }
+  syncdir_merge_end_(f, &m);
   syncdir_finalize_sync_(f);
 }
@@ -0,0 +1,536 @@
+#include "common.h"
+
+
+#define LOG_PREFIX_ "upd.sys: "
+
+#define USAGE_MAX_ 64
+
+
+typedef struct sys_t_    sys_t_;
+typedef struct report_t_ report_t_;
+typedef struct usage_t_  usage_t_;
+
+typedef struct req_name_t_ req_name_t_;
+
+
+struct sys_t_ {
+  const report_t_* report;
+
+  uint8_t* buf;
+  size_t   len;
+  size_t   cap;
+};
+
+struct usage_t_ {
+  const upd_driver_t* driver;
+  size_t              files;
+  size_t              bytes;
+};
+
+struct req_name_t_ {
+  upd_req_type_t type;
+  const char*    name;
+};
+
+struct report_t_ {
+  const char* name;
+
+  bool
+  (*write)(
+    upd_file_t* f);
+};
+
+
+static
+bool
+sys_init_(
+  upd_file_t* f);
+
+static
+void
+sys_deinit_(
+  upd_file_t* f);
+
+static
+bool
+sys_handle_(
+  upd_req_t* req);
+
+const upd_driver_t upd_driver_sys = {
+  .name = (uint8_t*) "upd.sys",
+  .cats = (upd_req_cat_t[]) {
+    UPD_REQ_STREAM,
+    0,
+  },
+  .init   = sys_init_,
+  .deinit = sys_deinit_,
+  .handle = sys_handle_,
+};
+
+
+HEDLEY_PRINTF_FORMAT(2, 3)
+static
+bool
+sys_printf_(
+  upd_file_t* f,
+  const char* fmt,
+  ...);
+
+
+static
+bool
+report_cache_(
+  upd_file_t* f);
+
+static
+bool
+report_lock_(
+  upd_file_t* f);
+
+static
+bool
+report_stats_(
+  upd_file_t* f);
+
+static
+bool
+report_trace_(
+  upd_file_t* f);
+
+static
+bool
+report_lag_(
+  upd_file_t* f);
+
+static
+bool
+report_mount_(
+  upd_file_t* f);
+
+static
+bool
+report_lag_hist_(
+  upd_file_t*           f,
+  const char*           name,
+  const upd_lag_hist_t* h);
+
+static
+bool
+report_trace_write_(
+  void*       udata,
+  const char* str,
+  size_t      len);
+
+static const req_name_t_ req_names_[] = {
+  { UPD_REQ_DIR_LIST,         "DIR_LIST",         },
+  { UPD_REQ_DIR_FIND,         "DIR_FIND",         },
+  { UPD_REQ_DIR_ADD,          "DIR_ADD",          },
+  { UPD_REQ_DIR_NEW,          "DIR_NEW",          },
+  { UPD_REQ_DIR_NEWDIR,       "DIR_NEWDIR",       },
+  { UPD_REQ_DIR_RM,           "DIR_RM",           },
+  { UPD_REQ_STREAM_READ,      "STREAM_READ",      },
+  { UPD_REQ_STREAM_WRITE,     "STREAM_WRITE",     },
+  { UPD_REQ_STREAM_TRUNCATE,  "STREAM_TRUNCATE",  },
+  { UPD_REQ_DSTREAM_READ,     "DSTREAM_READ",     },
+  { UPD_REQ_DSTREAM_WRITE,    "DSTREAM_WRITE",    },
+  { UPD_REQ_PROG_EXEC,        "PROG_EXEC",        },
+  { UPD_REQ_TENSOR_META,      "TENSOR_META",      },
+  { UPD_REQ_TENSOR_FETCH,     "TENSOR_FETCH",     },
+  { UPD_REQ_TENSOR_FLUSH,     "TENSOR_FLUSH",     },
+  { 0, NULL, },
+};
+
+static const report_t_ reports_[] = {
+  { .name = "cache", .write = report_cache_, },
+  { .name = "lock",  .write = report_lock_,  },
+  { .name = "stats", .write = report_stats_, },
+  { .name = "trace", .write = report_trace_, },
+  { .name = "lag",   .write = report_lag_,   },
+  { .name = "mount", .write = report_mount_, },
+  { NULL, },
+};
+
+
+static bool sys_init_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  const report_t_* report = reports_;
+  for (; report->name; ++report) {
+    if (upd_streq_c(report->name, f->param, f->paramlen)) {
+      break;
+    }
+  }
+  if (HEDLEY_UNLIKELY(report->name == NULL)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"unknown report: %.*s\n",
+      (int) f->paramlen, f->param);
+    return false;
+  }
+
+  sys_t_* ctx = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&ctx, sizeof(*ctx)))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"context allocation failure\n");
+    return false;
+  }
+  *ctx = (sys_t_) {
+    .report = report,
+  };
+
+  f->ctx      = ctx;
+  f->mimetype = (uint8_t*) "text/plain";
+  return true;
+}
+
+static void sys_deinit_(upd_file_t* f) {
+  sys_t_* ctx = f->ctx;
+  upd_free(&ctx->buf);
+  upd_free(&ctx);
+}
+
+static bool sys_handle_(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  sys_t_*     ctx = f->ctx;
+
+  upd_file_stats_req(req);
+
+  switch (req->type) {
+  case UPD_REQ_STREAM_READ: {
+    const size_t off = req->stream.io.offset;
+
+    /* takes a new snapshot when a reader starts from the head */
+    if (off == 0 || ctx->buf == NULL) {
+      ctx->len = 0;
+      if (HEDLEY_UNLIKELY(!ctx->report->write(f))) {
+        req->result = UPD_REQ_NOMEM;
+        return false;
+      }
+    }
+
+    size_t sz = req->stream.io.size;
+    if (HEDLEY_LIKELY(sz+off > ctx->len)) {
+      sz = ctx->len > off? ctx->len-off: 0;
+    }
+    req->stream.io = (upd_req_stream_io_t) {
+      .offset = off,
+      .size   = sz,
+      .buf    = ctx->buf + off,
+      .tail   = off+sz >= ctx->len,
+    };
+    req->result = UPD_REQ_OK;
+    req->cb(req);
+  } return true;
+
+  default:
+    req->result = UPD_REQ_INVALID;
+    return false;
+  }
+}
+
+
+static bool sys_printf_(upd_file_t* f, const char* fmt, ...) {
+  sys_t_* ctx = f->ctx;
+
+  va_list args, copy;
+  va_start(args, fmt);
+  va_copy(copy, args);
+
+  bool ok = false;
+
+  const int n = vsnprintf(NULL, 0, fmt, args);
+  if (HEDLEY_UNLIKELY(n < 0)) {
+    goto EXIT;
+  }
+
+  const size_t need = ctx->len + n + 1;
+  if (HEDLEY_UNLIKELY(need > ctx->cap)) {
+    size_t cap = ctx->cap? ctx->cap: 1024;
+    while (cap < need) {
+      cap *= 2;
+    }
+    if (HEDLEY_UNLIKELY(!upd_malloc(&ctx->buf, cap))) {
+      goto EXIT;
+    }
+    ctx->cap = cap;
+  }
+  vsnprintf((char*) ctx->buf + ctx->len, n+1, fmt, copy);
+  ctx->len += n;
+
+  ok = true;
+
+EXIT:
+  va_end(copy);
+  va_end(args);
+  return ok;
+}
+
+
+static bool report_cache_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  usage_t_ usage[USAGE_MAX_];
+  size_t   n = 0;
+
+  for (upd_file_t* p = iso->cache.head; p; p = ((upd_file_t_*) p)->lru.next) {
+    const size_t bytes = ((upd_file_t_*) p)->lru.bytes;
+
+    size_t i = 0;
+    while (i < n && usage[i].driver != p->driver) {
+      ++i;
+    }
+    if (HEDLEY_UNLIKELY(i == n)) {
+      if (HEDLEY_UNLIKELY(n >= USAGE_MAX_)) {
+        continue;
+      }
+      usage[n++] = (usage_t_) { .driver = p->driver, };
+    }
+    ++usage[i].files;
+    usage[i].bytes += bytes;
+  }
+
+  bool ok = sys_printf_(f,
+    "budget  %zu\n"
+    "total   %zu\n"
+    "files   %zu\n"
+    "evicted %"PRIu64"\n"
+    "\n"
+    "%-32s %8s %16s\n",
+    iso->cache.budget,
+    iso->cache.total,
+    iso->cache.files,
+    iso->cache.evicted,
+    "driver", "files", "bytes");
+  for (size_t i = 0; ok && i < n; ++i) {
+    ok = sys_printf_(f, "%-32s %8zu %16zu\n",
+      (const char*) usage[i].driver->name, usage[i].files, usage[i].bytes);
+  }
+  return ok;
+}
+
+static bool report_lock_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  bool ok = sys_printf_(f, "%-20s %8s %8s %8s %10s %10s %s\n",
+    "id", "pending", "waits", "timeouts", "avg(ms)", "max(ms)", "path");
+
+  /* lists only files which have ever been waited for */
+  for (size_t i = 0; ok && i < iso->files.used; ++i) {
+    const upd_file_t_* p = (void*) iso->files.slots[i].file;
+    if (p == NULL || (p->lock.stats.waits == 0 && p->lock.pending == 0)) {
+      continue;
+    }
+    const uint64_t waits = p->lock.stats.waits;
+    ok = sys_printf_(f,
+      "%-20"PRIu64" %8zu %8"PRIu64" %8"PRIu64" %10"PRIu64" %10"PRIu64" %.*s\n",
+      p->super.id,
+      p->lock.pending,
+      waits,
+      p->lock.stats.timeouts,
+      waits? p->lock.stats.total/waits: 0,
+      p->lock.stats.max,
+      (int) p->super.pathlen, p->super.path);
+  }
+  return ok;
+}
+
+static bool report_stats_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  bool ok = sys_printf_(f,
+    "[files]\n"
+    "live     %zu\n"
+    "slots    %zu\n"
+    "watchers %zu\n"
+    "\n"
+    "[lock]\n"
+    "pending  %zu\n"
+    "\n"
+    "[stack]\n"
+    "used     %zu/%zu\n"
+    "blocks   %zu\n"
+    "hit      %"PRIu64"\n"
+    "carve    %"PRIu64"\n"
+    "slab     %"PRIu64"\n"
+    "large    %"PRIu64"\n"
+    "\n"
+    "[async]\n"
+    "depth    %zu\n"
+    "peak     %zu\n"
+    "enqueued %"PRIu64"\n"
+    "drained  %"PRIu64"\n"
+    "merged   %"PRIu64"\n"
+    "\n"
+    "[dcache]\n"
+    "entries  %zu/%zu\n"
+    "hits     %"PRIu64"\n"
+    "misses   %"PRIu64"\n"
+    "\n"
+    "[bcache]\n"
+    "bytes    %zu/%zu\n"
+    "hits     %"PRIu64"\n"
+    "misses   %"PRIu64"\n"
+    "ahead    %"PRIu64"\n"
+    "\n"
+    "[fdcache]\n"
+    "open     %zu/%zu\n"
+    "evicted  %"PRIu64"\n"
+    "kept     %"PRIu64"\n"
+    "\n"
+    "[fs]\n"
+    "backend  %s\n"
+    "ops      %"PRIu64"\n"
+    "submits  %"PRIu64"\n"
+    "fallback %"PRIu64"\n"
+    "\n"
+    "[walker]\n"
+    "part     %zu\n"
+    "whole    %zu\n"
+    "avg      %zu\n"
+    "thresh   %zu\n"
+    "\n",
+    iso->files.n,
+    iso->files.used,
+    iso->watchers.n,
+    iso->lock_waits.n,
+    iso->stack.used, iso->stack.size,
+    iso->stack.refcnt,
+    iso->stack.stats.hit,
+    iso->stack.stats.carve,
+    iso->stack.stats.slab,
+    iso->stack.stats.large,
+    atomic_load_explicit(&iso->async.depth, memory_order_relaxed),
+    iso->async.peak,
+    (uint64_t) atomic_load_explicit(&iso->async.enqueued, memory_order_relaxed),
+    iso->async.drained,
+    iso->async.merged,
+    iso->dcache.n, iso->dcache.max,
+    iso->dcache.hits,
+    iso->dcache.misses,
+    iso->bcache.bytes, iso->bcache.budget,
+    iso->bcache.hits,
+    iso->bcache.misses,
+    iso->bcache.readahead,
+    iso->fdcache.n, iso->fdcache.max,
+    iso->fdcache.evicted,
+    iso->fdcache.kept,
+    iso->fs.ok? "io_uring": "threadpool",
+    iso->fs.ops,
+    iso->fs.submits,
+    iso->fs.fallback,
+    iso->walker.cache.part,
+    iso->walker.cache.whole,
+    iso->walker.cache.avg,
+    iso->walker.cache.thresh);
+
+  for (size_t i = 0; ok && i < iso->drivers.n; ++i) {
+    const upd_driver_t* d = iso->drivers.p[i];
+    const upd_driver_stats_t* s = upd_driver_stats(iso, d);
+    if (HEDLEY_UNLIKELY(s == NULL)) {
+      continue;
+    }
+    ok = sys_printf_(f, "[driver %s]\nfiles    %zu\n",
+      (const char*) d->name, s->files);
+
+    for (const req_name_t_* r = req_names_; ok && r->name; ++r) {
+      const size_t cat  = r->type >> 16;
+      const size_t type = r->type & UINT16_MAX;
+      if (HEDLEY_UNLIKELY(cat >= UPD_DRIVER_STATS_CATS || type >= UPD_DRIVER_STATS_TYPES)) {
+        continue;  /* never counted by upd_file_stats_req */
+      }
+      const uint64_t n = s->reqs[cat][type];
+      if (n) {
+        ok = sys_printf_(f, "req      %-16s %"PRIu64"\n", r->name, n);
+      }
+    }
+
+    /* bucket i counts latencies under 2^i us */
+    for (size_t j = 0; ok && j < UPD_DRIVER_STATS_BUCKETS; ++j) {
+      if (s->latency[j]) {
+        ok = sys_printf_(f, "latency  <%-15"PRIu64" %"PRIu64"\n",
+          (uint64_t) 1 << j, s->latency[j]);
+      }
+    }
+    ok = ok && sys_printf_(f, "\n");
+  }
+  return ok;
+}
+
+static bool report_trace_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(iso->trace.ring == NULL)) {
+    return sys_printf_(f, "[]\n");
+  }
+  return upd_trace_dump(iso, report_trace_write_, f);
+}
+
+static bool report_trace_write_(void* udata, const char* str, size_t len) {
+  return sys_printf_(udata, "%.*s", (int) len, str);
+}
+
+static bool report_lag_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  bool ok =
+    sys_printf_(f,
+      "unit      us\n"
+      "max       %"PRIu64"\n"
+      "threshold %"PRIu64"\n"
+      "slows     %"PRIu64"\n"
+      "\n"
+      "%-8s %10s %10s %10s %10s\n",
+      iso->lag.max,
+      iso->lag.slow,
+      iso->lag.nslow,
+      "window", "iters", "p50", "p99", "max") &&
+    report_lag_hist_(f, "current", &iso->lag.curr) &&
+    report_lag_hist_(f, "last",    &iso->lag.prev) &&
+    sys_printf_(f, "\n%-12s %10s %-6s %8s %-24s %s\n",
+      "at(ms)", "dur(us)", "what", "arg", "driver", "path");
+
+  /* from the oldest */
+  const uint64_t n     = iso->lag.nslow;
+  const uint64_t first = n > UPD_LAG_SLOWS? n-UPD_LAG_SLOWS: 0;
+  for (uint64_t i = first; ok && i < n; ++i) {
+    const upd_lag_slow_t* s = &iso->lag.slows[i%UPD_LAG_SLOWS];
+    ok = sys_printf_(f, "%-12"PRIu64" %10"PRIu64" %-6s %#8"PRIx32" %-24s %s\n",
+      s->at, s->dur, s->what, s->arg, (const char*) s->driver->name, s->path);
+  }
+  return ok;
+}
+
+static bool report_mount_(upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  const uint64_t now = uv_hrtime();
+
+  bool ok = sys_printf_(f,
+    "concurrency %zu\n"
+    "\n"
+    "%-8s %10s %10s %10s %10s %s\n",
+    iso->prefetch.max,
+    "state", "dirs", "files", "taken", "ms", "path");
+  for (size_t i = 0; ok && i < iso->prefetch.mounts.n; ++i) {
+    const upd_prefetch_t* m = iso->prefetch.mounts.p[i];
+
+    const uint64_t end = m->end? m->end: now;
+    ok = sys_printf_(f,
+      "%-8s %10"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64" %.*s\n",
+      m->end? "done": "running",
+      m->ndirs,
+      m->nfiles,
+      m->taken,
+      (end - m->begin) / 1000000,
+      (int) m->len, m->path);
+  }
+  return ok;
+}
+
+static bool report_lag_hist_(
+    upd_file_t* f, const char* name, const upd_lag_hist_t* h) {
+  return sys_printf_(f,
+    "%-8s %10"PRIu64" %10"PRIu64" %10"PRIu64" %10"PRIu64"\n",
+    name,
+    h->n,
+    upd_lag_percentile(h, 50),
+    upd_lag_percentile(h, 99),
+    h->max);
+}
@@ -0,0 +1,95 @@
+#include "common.h"
+
+
+static
+void
+fdcache_link_(
+  upd_iso_t*           iso,
+  upd_fdcache_entry_t* e);
+
+static
+void
+fdcache_unlink_(
+  upd_iso_t*           iso,
+  upd_fdcache_entry_t* e);
+
+static
+void
+fdcache_shrink_(
+  upd_iso_t* iso);
+
+
+void upd_fdcache_add(upd_iso_t* iso, upd_fdcache_entry_t* e) {
+  assert(!e->linked);
+
+  fdcache_link_(iso, e);
+  e->linked = true;
+  ++iso->fdcache.n;
+
+  fdcache_shrink_(iso);
+}
+
+void upd_fdcache_touch(upd_iso_t* iso, upd_fdcache_entry_t* e) {
+  if (HEDLEY_UNLIKELY(!e->linked || iso->fdcache.head == e)) {
+    return;
+  }
+  fdcache_unlink_(iso, e);
+  fdcache_link_(iso, e);
+}
+
+void upd_fdcache_remove(upd_iso_t* iso, upd_fdcache_entry_t* e) {
+  if (HEDLEY_UNLIKELY(!e->linked)) {
+    return;
+  }
+  fdcache_unlink_(iso, e);
+  e->linked = false;
+
+  assert(iso->fdcache.n);
+  --iso->fdcache.n;
+}
+
+
+static void fdcache_link_(upd_iso_t* iso, upd_fdcache_entry_t* e) {
+  e->prev = NULL;
+  e->next = iso->fdcache.head;
+  if (iso->fdcache.head) {
+    iso->fdcache.head->prev = e;
+  } else {
+    iso->fdcache.tail = e;
+  }
+  iso->fdcache.head = e;
+}
+
+static void fdcache_unlink_(upd_iso_t* iso, upd_fdcache_entry_t* e) {
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    iso->fdcache.head = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    iso->fdcache.tail = e->prev;
+  }
+}
+
+static void fdcache_shrink_(upd_iso_t* iso) {
+  if (HEDLEY_UNLIKELY(iso->fdcache.max == 0)) {
+    return;
+  }
+
+  /* each entry is asked at most once, busy ones are retried later */
+  size_t tries = iso->fdcache.n;
+  while (iso->fdcache.n > iso->fdcache.max && tries--) {
+    upd_fdcache_entry_t* e = iso->fdcache.tail;
+    upd_fdcache_remove(iso, e);
+
+    if (HEDLEY_LIKELY(e->evict(e))) {
+      ++iso->fdcache.evicted;
+      continue;
+    }
+    fdcache_link_(iso, e);
+    e->linked = true;
+    ++iso->fdcache.n;
+  }
+}
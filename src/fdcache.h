@@ -0,0 +1,49 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Isolate-wide LRU of file descriptors kept open by drivers (e.g.
+ * upd.bin), bounded to UPD_FDCACHE_MAX entries (0 disables the bound).
+ * Entries are embedded in the owners, and the least recently used one
+ * is asked to close its fd when the number exceeds the bound. An owner
+ * which cannot close right now (e.g. busy with tasks) refuses the
+ * eviction and is moved to the head instead. */
+
+
+#define UPD_FDCACHE_DEFAULT_MAX 256
+
+
+struct upd_fdcache_entry_t {
+  upd_fdcache_entry_t* prev;  /* LRU, head is the most recent */
+  upd_fdcache_entry_t* next;
+
+  void* udata;
+  bool  linked;
+
+  /*  Returns false to refuse the eviction. The entry is already
+   * unlinked when called, so the owner may remove it again. */
+  bool
+  (*evict)(
+    upd_fdcache_entry_t* e);
+};
+
+
+HEDLEY_NON_NULL(1, 2)
+void
+upd_fdcache_add(
+  upd_iso_t*           iso,
+  upd_fdcache_entry_t* e);
+
+HEDLEY_NON_NULL(1, 2)
+void
+upd_fdcache_touch(
+  upd_iso_t*           iso,
+  upd_fdcache_entry_t* e);
+
+/*  Does nothing if the entry is not linked. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_fdcache_remove(
+  upd_iso_t*           iso,
+  upd_fdcache_entry_t* e);
@@ -1,29 +1,61 @@
 #include "common.h"
 
 
-#define FILE_NPOLL_INTERVAL_ 1500
+#define FILE_SLOTS_MIN_ 256
 
 
 static
 bool
-file_init_npoll_(
+file_slot_alloc_(
   upd_file_t_* f);
 
 static
-bool
-file_init_mutex_(
+void
+file_slot_free_(
+  upd_file_t_* f);
+
+static
+void
+file_unwatch_all_(
+  upd_file_t_* f);
+
+static
+void
+file_cache_link_(
+  upd_file_t_* f);
+
+static
+void
+file_cache_unlink_(
+  upd_file_t_* f);
+
+static
+void
+file_cache_sync_(
   upd_file_t_* f);
 
+static
+void
+file_cache_evict_(
+  upd_iso_t* iso);
+
 static
 bool
-file_init_prepare_(
+file_init_npoll_(
   upd_file_t_* f);
 
 static
 bool
-file_init_check_(
+file_init_mutex_(
   upd_file_t_* f);
 
+static
+void
+file_proc_set_(
+  upd_file_t_* f,
+  bool         post,
+  bool         enable);
+
 static
 bool
 file_init_timer_(
@@ -35,13 +67,13 @@ file_close_all_handlers_(
   upd_file_t_* f);
 
 
+
 static
 void
-file_npoll_cb_(
-  uv_fs_poll_t*    npoll,
-  int              status,
-  const uv_stat_t* prev,
-  const uv_stat_t* curr);
+file_proc_dispatch_(
+  upd_iso_proc_t*  list,
+  bool             post,
+  upd_file_event_t e);
 
 static
 void
@@ -78,11 +110,11 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
     .super = {
       .iso      = iso,
       .driver   = d,
-      .id       = iso->files_created++,
       .refcnt   = 1,
 
       .backend  = backend,
     },
+    .stats = upd_driver_stats(iso, d),
   };
 
   size_t offset = 0;
@@ -103,20 +135,24 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
 # undef assign_
 
   const bool ok =
-    (!d->flags.npoll || !npathlen || file_init_npoll_(f))   &&
-    (!d->flags.mutex              || file_init_mutex_(f))   &&
-    (!d->flags.preproc            || file_init_prepare_(f)) &&
-    (!d->flags.postproc           || file_init_check_(f))   &&
-    (!d->flags.timer              || file_init_timer_(f))   &&
-    upd_array_insert(&iso->files, f, SIZE_MAX);
+    (!d->flags.npoll || !npathlen || file_init_npoll_(f)) &&
+    (!d->flags.mutex              || file_init_mutex_(f)) &&
+    (!d->flags.timer              || file_init_timer_(f)) &&
+    file_slot_alloc_(f);
 
   if (HEDLEY_UNLIKELY(!ok)) {
     file_close_all_handlers_(f);
     upd_free(&f);
     return NULL;
   }
+  if (d->flags.preproc) {
+    file_proc_set_(f, false, true);
+  }
+  if (d->flags.postproc) {
+    file_proc_set_(f, true, true);
+  }
   if (HEDLEY_UNLIKELY(!d->init(&f->super))) {
-    upd_array_find_and_remove(&iso->files, f);
+    file_slot_free_(f);
     file_close_all_handlers_(f);
     upd_free(&f);
     return NULL;
@@ -125,6 +161,9 @@ upd_file_t* upd_file_new_(const upd_file_t* src) {
   if (backend) {
     upd_file_ref(backend);
   }
+  if (HEDLEY_LIKELY(f->stats)) {
+    ++f->stats->files;
+  }
   return &f->super;
 }
 
@@ -132,15 +171,25 @@ void upd_file_delete(upd_file_t* f) {
   assert(!f->refcnt);
 
   upd_file_t_* f_ = (void*) f;
-  assert(!f_->lock.pending.n);
+  assert(!f_->lock.head);
   assert(!f_->lock.refcnt);
 
   upd_file_trigger(f, UPD_FILE_DELETE);
-  upd_array_clear(&f_->watch);
+  file_unwatch_all_(f_);
+
+  if (f_->lru.linked) {
+    file_cache_unlink_(f_);
+  }
+  f->iso->cache.total -= f_->lru.bytes;
 
-  upd_array_find_and_remove(&f->iso->files, f);
+  file_slot_free_(f_);
   f->driver->deinit(f);
 
+  if (HEDLEY_LIKELY(f_->stats)) {
+    assert(f_->stats->files);
+    --f_->stats->files;
+  }
+
   file_close_all_handlers_(f_);
 
   if (f->backend) {
@@ -149,85 +198,280 @@ void upd_file_delete(upd_file_t* f) {
   upd_free(&f_);
 }
 
+void upd_file_cache_update(upd_file_t* f) {
+  file_cache_sync_((void*) f);
+  file_cache_evict_(f->iso);
+}
 
-static bool file_init_npoll_(upd_file_t_* f) {
-  upd_iso_t* iso = f->super.iso;
+void upd_file_cache_touch(upd_file_t* f) {
+  upd_file_t_* f_ = (void*) f;
 
-  if (HEDLEY_UNLIKELY(!upd_malloc(&f->npoll, sizeof(*f->npoll)))) {
-    return false;
+  file_cache_sync_(f_);
+  if (f_->lru.linked && f->iso->cache.head != f) {
+    file_cache_unlink_(f_);
+    file_cache_link_(f_);
   }
+  file_cache_evict_(f->iso);
+}
 
-  *f->npoll = (uv_fs_poll_t) { .data = f, };
-  if (HEDLEY_UNLIKELY(0 > uv_fs_poll_init(&iso->loop, f->npoll))) {
-    upd_free(&f->npoll);
-    return false;
-  }
-  uv_unref((uv_handle_t*) f->npoll);
+void upd_file_set_preproc(upd_file_t* f, bool enable) {
+  file_proc_set_((void*) f, false, enable);
+}
 
-  const bool start = 0 <= uv_fs_poll_start(
-    f->npoll, file_npoll_cb_, (char*) f->super.npath, FILE_NPOLL_INTERVAL_);
-  if (HEDLEY_UNLIKELY(!start)) {
-    uv_close((uv_handle_t*) f->npoll, file_handle_close_cb_);
-    f->npoll = NULL;
-    return false;
+void upd_file_set_postproc(upd_file_t* f, bool enable) {
+  file_proc_set_((void*) f, true, enable);
+}
+
+
+static bool file_slot_alloc_(upd_file_t_* f) {
+  upd_iso_t* iso = f->super.iso;
+
+  uint32_t index = iso->files.free_head;
+  if (HEDLEY_LIKELY(index != UPD_FILE_SLOT_NONE)) {
+    upd_file_slot_t* s = &iso->files.slots[index];
+
+    iso->files.free_head = s->next;
+    if (HEDLEY_UNLIKELY(iso->files.free_head == UPD_FILE_SLOT_NONE)) {
+      iso->files.free_tail = UPD_FILE_SLOT_NONE;
+    }
+
+  } else {
+    if (HEDLEY_UNLIKELY(iso->files.used >= UPD_FILE_SLOT_NONE)) {
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(iso->files.used >= iso->files.cap)) {
+      const size_t cap = iso->files.cap? iso->files.cap*2: FILE_SLOTS_MIN_;
+
+      upd_file_slot_t* slots = iso->files.slots;
+      if (HEDLEY_UNLIKELY(!upd_malloc(&slots, sizeof(*slots)*cap))) {
+        return false;
+      }
+      iso->files.slots = slots;
+      iso->files.cap   = cap;
+    }
+    index = iso->files.used++;
+    iso->files.slots[index] = (upd_file_slot_t) {0};
   }
+
+  upd_file_slot_t* s = &iso->files.slots[index];
+  s->file = &f->super;
+  s->next = UPD_FILE_SLOT_NONE;
+
+  f->super.id = (upd_file_id_t) s->gen << 32 | index;
+  ++iso->files.n;
   return true;
 }
 
-static bool file_init_mutex_(upd_file_t_* f) {
-  uv_mutex_t* mtx = NULL;
-  if (HEDLEY_UNLIKELY(!upd_malloc(&mtx, sizeof(*mtx)))) {
-    return false;
+static void file_slot_free_(upd_file_t_* f) {
+  upd_iso_t* iso = f->super.iso;
+
+  const uint32_t   index = f->super.id & UINT32_MAX;
+  upd_file_slot_t* s     = &iso->files.slots[index];
+  assert(s->file == &f->super);
+
+  *s = (upd_file_slot_t) {
+    .gen  = s->gen+1,
+    .next = UPD_FILE_SLOT_NONE,
+  };
+  if (HEDLEY_LIKELY(iso->files.free_tail != UPD_FILE_SLOT_NONE)) {
+    iso->files.slots[iso->files.free_tail].next = index;
+  } else {
+    iso->files.free_head = index;
   }
-  if (HEDLEY_UNLIKELY(0 > uv_mutex_init(mtx))) {
-    upd_free(&mtx);
-    return false;
+  iso->files.free_tail = index;
+
+  assert(iso->files.n);
+  --iso->files.n;
+}
+
+
+static void file_unwatch_all_(upd_file_t_* f) {
+  if (HEDLEY_LIKELY(f->watch == NULL)) {
+    return;
   }
-  f->mutex = mtx;
-  return true;
+  for (size_t e = 0; e < UPD_FILE_EVENTS; ++e) {
+    while (f->watch[e].head) {
+      upd_file_unwatch(f->watch[e].head->w);
+    }
+  }
+  upd_free(&f->watch);
 }
 
-static bool file_init_prepare_(upd_file_t_* f) {
+
+static void file_cache_link_(upd_file_t_* f) {
   upd_iso_t* iso = f->super.iso;
+  assert(!f->lru.linked);
 
-  if (HEDLEY_UNLIKELY(!upd_malloc(&f->prepare, sizeof(*f->prepare)))) {
-    return false;
+  f->lru.prev   = NULL;
+  f->lru.next   = iso->cache.head;
+  f->lru.linked = true;
+
+  if (iso->cache.head) {
+    ((upd_file_t_*) iso->cache.head)->lru.prev = &f->super;
+  } else {
+    iso->cache.tail = &f->super;
   }
+  iso->cache.head = &f->super;
+  ++iso->cache.files;
+}
 
-  *f->prepare = (uv_prepare_t) { .data = f, };
-  if (HEDLEY_UNLIKELY(0 > uv_prepare_init(&iso->loop, f->prepare))) {
-    upd_free(&f->prepare);
-    return false;
+static void file_cache_unlink_(upd_file_t_* f) {
+  upd_iso_t* iso = f->super.iso;
+  assert(f->lru.linked);
+
+  upd_file_t* prev = f->lru.prev;
+  upd_file_t* next = f->lru.next;
+  if (prev) {
+    ((upd_file_t_*) prev)->lru.next = next;
+  } else {
+    iso->cache.head = next;
+  }
+  if (next) {
+    ((upd_file_t_*) next)->lru.prev = prev;
+  } else {
+    iso->cache.tail = prev;
   }
-  uv_unref((uv_handle_t*) f->prepare);
+  f->lru.prev   = NULL;
+  f->lru.next   = NULL;
+  f->lru.linked = false;
 
-  if (HEDLEY_UNLIKELY(0 > uv_prepare_start(f->prepare, file_prepare_cb_))) {
-    uv_close((uv_handle_t*) f->prepare, file_handle_close_cb_);
-    f->prepare = NULL;
-    return false;
+  assert(iso->cache.files);
+  --iso->cache.files;
+}
+
+static void file_cache_sync_(upd_file_t_* f) {
+  upd_iso_t*   iso   = f->super.iso;
+  const size_t bytes = f->super.cache;
+
+  iso->cache.total = iso->cache.total - f->lru.bytes + bytes;
+  f->lru.bytes     = bytes;
+
+  if (bytes && !f->lru.linked) {
+    file_cache_link_(f);
+  } else if (!bytes && f->lru.linked) {
+    file_cache_unlink_(f);
   }
-  return true;
 }
 
-static bool file_init_check_(upd_file_t_* f) {
+static void file_cache_evict_(upd_iso_t* iso) {
+  const size_t budget = iso->cache.budget;
+  if (HEDLEY_LIKELY(!budget || iso->cache.total <= budget)) {
+    return;
+  }
+  /* uncache handlers may touch other files */
+  if (HEDLEY_UNLIKELY(iso->cache.evicting)) {
+    return;
+  }
+  iso->cache.evicting = true;
+
+  /*  Drivers may release their cache asynchronously,
+   * so the uncached bytes are estimated by the accounted size. */
+  size_t over = iso->cache.total - budget;
+
+  upd_file_t_* f = (void*) iso->cache.tail;
+  while (f && over) {
+    upd_file_t_* prev = (void*) f->lru.prev;
+
+    const bool busy = f->lock.refcnt || f->lock.head;
+    if (HEDLEY_LIKELY(!busy)) {
+      const size_t bytes = f->lru.bytes;
+
+      /* handlers may drop the last refs of both */
+      upd_file_ref(&f->super);
+      if (prev) {
+        upd_file_ref(&prev->super);
+      }
+      upd_file_trigger(&f->super, UPD_FILE_UNCACHE);
+      file_cache_sync_(f);
+      upd_file_unref(&f->super);
+      ++iso->cache.evicted;
+
+      over = over > bytes? over-bytes: 0;
+
+      /* the prev may be deleted, moved or unlinked in the handlers */
+      if (prev) {
+        const bool deleted = upd_file_unref(&prev->super);
+        if (HEDLEY_UNLIKELY(deleted || !prev->lru.linked)) {
+          f = (void*) iso->cache.tail;
+          continue;
+        }
+      }
+    }
+    f = prev;
+  }
+  iso->cache.evicting = false;
+}
+
+
+static void file_proc_set_(upd_file_t_* f, bool post, bool enable) {
   upd_iso_t* iso = f->super.iso;
 
-  if (HEDLEY_UNLIKELY(!upd_malloc(&f->check, sizeof(*f->check)))) {
-    return false;
+  struct upd_file_proc_link_t_* k    = post? &f->postproc: &f->preproc;
+  upd_iso_proc_t*               list = post? &iso->proc.post: &iso->proc.pre;
+  if (HEDLEY_UNLIKELY(k->linked == enable)) {
+    return;
   }
 
-  *f->check = (uv_check_t) { .data = f, };
-  if (HEDLEY_UNLIKELY(0 > uv_check_init(&iso->loop, f->check))) {
-    upd_free(&f->check);
-    return false;
+  if (enable) {
+    k->prev   = NULL;
+    k->next   = list->head;
+    k->linked = true;
+    if (k->next) {
+      upd_file_t_* next = (void*) k->next;
+      (post? &next->postproc: &next->preproc)->prev = &f->super;
+    }
+    list->head = &f->super;
+
+    if (list->n++ == 0) {
+      if (post) {
+        uv_check_start(&iso->proc.check, file_check_cb_);
+      } else {
+        uv_prepare_start(&iso->proc.prepare, file_prepare_cb_);
+      }
+    }
+    return;
   }
-  uv_unref((uv_handle_t*) f->check);
 
-  if (HEDLEY_UNLIKELY(0 > uv_check_start(f->check, file_check_cb_))) {
-    uv_close((uv_handle_t*) f->check, file_handle_close_cb_);
-    f->check = NULL;
+  if (list->cursor == &f->super) {
+    list->cursor = k->next;
+  }
+  if (k->prev) {
+    upd_file_t_* prev = (void*) k->prev;
+    (post? &prev->postproc: &prev->preproc)->next = k->next;
+  } else {
+    list->head = k->next;
+  }
+  if (k->next) {
+    upd_file_t_* next = (void*) k->next;
+    (post? &next->postproc: &next->preproc)->prev = k->prev;
+  }
+  *k = (struct upd_file_proc_link_t_) {0};
+
+  assert(list->n);
+  if (--list->n == 0) {
+    if (post) {
+      uv_check_stop(&iso->proc.check);
+    } else {
+      uv_prepare_stop(&iso->proc.prepare);
+    }
+  }
+}
+
+
+static bool file_init_npoll_(upd_file_t_* f) {
+  return upd_watch_start(&f->npoll, &f->super);
+}
+
+static bool file_init_mutex_(upd_file_t_* f) {
+  uv_mutex_t* mtx = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&mtx, sizeof(*mtx)))) {
     return false;
   }
+  if (HEDLEY_UNLIKELY(0 > uv_mutex_init(mtx))) {
+    upd_free(&mtx);
+    return false;
+  }
+  f->mutex = mtx;
   return true;
 }
 
@@ -248,25 +492,13 @@ static bool file_init_timer_(upd_file_t_* f) {
 }
 
 static void file_close_all_handlers_(upd_file_t_* f) {
-  if (HEDLEY_UNLIKELY(f->npoll)) {
-    uv_fs_poll_stop(f->npoll);
-    uv_close((uv_handle_t*) f->npoll, file_handle_close_cb_);
-    f->npoll = NULL;
-  }
+  upd_watch_stop(&f->npoll);
   if (HEDLEY_UNLIKELY(f->mutex)) {
     uv_mutex_destroy(f->mutex);
     f->mutex = NULL;
   }
-  if (HEDLEY_UNLIKELY(f->prepare)) {
-    uv_prepare_stop(f->prepare);
-    uv_close((uv_handle_t*) f->prepare, file_handle_close_cb_);
-    f->prepare = NULL;
-  }
-  if (HEDLEY_UNLIKELY(f->check)) {
-    uv_check_stop(f->check);
-    uv_close((uv_handle_t*) f->check, file_handle_close_cb_);
-    f->check = NULL;
-  }
+  file_proc_set_(f, false, false);
+  file_proc_set_(f, true,  false);
   if (f->timer) {
     uv_close((uv_handle_t*) f->timer, file_handle_close_cb_);
     f->timer = NULL;
@@ -274,31 +506,27 @@ static void file_close_all_handlers_(upd_file_t_* f) {
 }
 
 
-static void file_npoll_cb_(
-    uv_fs_poll_t*    npoll,
-    int              status,
-    const uv_stat_t* prev,
-    const uv_stat_t* curr) {
-  (void) prev;
-  (void) curr;
-
-  upd_file_t* f = npoll->data;
 
-  if (HEDLEY_UNLIKELY(status < 0)) {
-    upd_file_trigger(f, UPD_FILE_DELETE_N);
-    return;
+static void file_proc_dispatch_(
+    upd_iso_proc_t* list, bool post, upd_file_event_t e) {
+  /*  The cursor is moved forward when the next file unsubscribes,
+   * and files subscribing while dispatching wait for the next turn. */
+  list->cursor = list->head;
+  while (list->cursor) {
+    upd_file_t_* f = (void*) list->cursor;
+    list->cursor = (post? &f->postproc: &f->preproc)->next;
+    upd_file_trigger(&f->super, e);
   }
-  upd_file_trigger(f, UPD_FILE_UPDATE_N);
 }
 
 static void file_prepare_cb_(uv_prepare_t* handle) {
-  upd_file_t* f = handle->data;
-  upd_file_trigger(f, UPD_FILE_PREPROC);
+  upd_iso_t* iso = handle->data;
+  file_proc_dispatch_(&iso->proc.pre, false, UPD_FILE_PREPROC);
 }
 
 static void file_check_cb_(uv_check_t* handle) {
-  upd_file_t* f = handle->data;
-  upd_file_trigger(f, UPD_FILE_POSTPROC);
+  upd_iso_t* iso = handle->data;
+  file_proc_dispatch_(&iso->proc.post, true, UPD_FILE_POSTPROC);
 }
 
 static void file_handle_close_cb_(uv_handle_t* handle) {
@@ -3,22 +3,103 @@
 #include "common.h"
 
 
+#define UPD_FILE_SLOT_NONE UINT32_MAX
+
+#define UPD_FILE_EVENTS       (UPD_FILE_ASYNC+1)
+#define UPD_FILE_EVENT_BIT(e) (1u << (e))
+#define UPD_FILE_EVENT_ALL    (UPD_FILE_EVENT_BIT(UPD_FILE_EVENTS)-1)
+
+
+typedef struct upd_file_watcher_t    upd_file_watcher_t;
+typedef struct upd_file_watch_iter_t upd_file_watch_iter_t;
+typedef struct upd_file_lock_wait_t  upd_file_lock_wait_t;
+
+
+struct upd_file_slot_t {
+  upd_file_t* file;
+  uint32_t    gen;
+  uint32_t    next;  /* next free slot if the slot is free */
+};
+
+/* iso->watchers maps upd_file_watch_t* to this */
+struct upd_file_watcher_t {
+  upd_file_watch_t* w;
+  uint16_t          mask;
+
+  /* only links of events in the mask are used */
+  struct {
+    upd_file_watcher_t* prev;
+    upd_file_watcher_t* next;
+  } link[UPD_FILE_EVENTS];
+};
+
+/* iso->lock_waits maps upd_file_lock_t* to this */
+struct upd_file_lock_wait_t {
+  upd_iso_timeout_t timeout;  /* udata is this */
+
+  upd_file_lock_t*      lock;
+  upd_file_lock_wait_t* prev;
+  upd_file_lock_wait_t* next;
+};
+
+/* a trigger in progress, which is fixed up when the next watcher leaves */
+struct upd_file_watch_iter_t {
+  upd_file_watch_iter_t* outer;
+  upd_file_watcher_t*    next;
+  upd_file_event_t       event;
+};
+
 typedef struct upd_file_t_ {
   upd_file_t super;
 
-  upd_array_of(upd_file_watch_t*) watch;
+  /* watchers of each event, allocated on the first watch */
+  struct upd_file_watch_list_t_ {
+    upd_file_watcher_t* head;
+    upd_file_watcher_t* tail;
+  }* watch;
+  upd_file_watch_iter_t* watch_iter;  /* the innermost trigger */
 
-  uv_fs_poll_t* npoll;
-  uv_mutex_t*   mutex;
-  uv_prepare_t* prepare;
-  uv_check_t*   check;
-  uv_timer_t*   timer;
+  upd_watch_sub_t npoll;
+  uv_mutex_t*     mutex;
+  uv_timer_t*     timer;
+
+  struct upd_file_proc_link_t_ {
+    upd_file_t* prev;
+    upd_file_t* next;
+    bool        linked;
+  } preproc, postproc;
 
   struct {
     size_t refcnt;
     bool   ex;
-    upd_array_of(upd_file_lock_t*) pending;
+
+    /* FIFO of waiters, granted from the head */
+    upd_file_lock_wait_t* head;
+    upd_file_lock_wait_t* tail;
+    size_t                pending;
+
+    /* wait time is in milliseconds */
+    struct {
+      uint64_t waits;
+      uint64_t timeouts;
+      uint64_t total;
+      uint64_t max;
+    } stats;
   } lock;
+
+  upd_driver_stats_t* stats;  /* NULL if the driver is not registered */
+
+  uint32_t dcache_gen;  /* bumped to forget all cached children */
+
+  /* round of async queue drain which has already triggered this */
+  uint64_t async_round;
+
+  struct {
+    upd_file_t* prev;
+    upd_file_t* next;
+    size_t      bytes;  /* f->cache which is already accounted */
+    bool        linked;
+  } lru;
 } upd_file_t_;
 
 
@@ -32,6 +113,50 @@ void
 upd_file_delete(
   upd_file_t* f);
 
+/*  Subscribes to (or unsubscribes from) UPD_FILE_PREPROC/POSTPROC.
+ * Files whose driver has flags.preproc/postproc are subscribed on creation,
+ * and drivers may unsubscribe them while they have nothing to do. */
+HEDLEY_NON_NULL(1)
+void
+upd_file_set_preproc(
+  upd_file_t* f,
+  bool        enable);
+
+HEDLEY_NON_NULL(1)
+void
+upd_file_set_postproc(
+  upd_file_t* f,
+  bool        enable);
+
+/*  Reconciles f->cache with the isolate-wide accounting, and uncaches
+ * the coldest files if the total exceeds the budget.
+ * Drivers should call this after changing f->cache. */
+HEDLEY_NON_NULL(1)
+void
+upd_file_cache_update(
+  upd_file_t* f);
+
+/* Same as upd_file_cache_update but also marks the file as the hottest. */
+HEDLEY_NON_NULL(1)
+void
+upd_file_cache_touch(
+  upd_file_t* f);
+
+/* Counts the request, drivers in core call this on their handler. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_file_stats_req(
+  const upd_req_t* req);
+
+/* Records latency of a request which was submitted at the hrtime. */
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_file_stats_done(
+  upd_file_t* f,
+  uint64_t    since);
+
 HEDLEY_NON_NULL(1)
 HEDLEY_WARN_UNUSED_RESULT
 static inline
@@ -39,28 +164,25 @@ bool
 upd_file_try_lock(
   upd_file_lock_t* lock);
 
+HEDLEY_NON_NULL(1)
+static inline
+void
+upd_file_unlock(
+  upd_file_lock_t* lock);
+
 
 static inline upd_file_t* upd_file_new(const upd_file_t* src) {
   return upd_file_new_(src);
 }
 
 static inline upd_file_t* upd_file_get(upd_iso_t* iso, upd_file_id_t id) {
-  upd_file_t** f = (upd_file_t**) iso->files.p;
-
-  ssize_t l = 0;
-  ssize_t r = (ssize_t) iso->files.n - 1;
-  while (l <= r) {
-    const size_t i = (l+r)/2;
-    if (HEDLEY_UNLIKELY(f[i]->id == id)) {
-      return f[i];
-    }
-    if (f[i]->id > id) {
-      r = i-1;
-    } else {
-      l = i+1;
-    }
+  const size_t   index = id & UINT32_MAX;
+  const uint32_t gen   = id >> 32;
+  if (HEDLEY_UNLIKELY(index >= iso->files.used)) {
+    return NULL;
   }
-  return NULL;
+  const upd_file_slot_t* s = &iso->files.slots[index];
+  return HEDLEY_LIKELY(s->gen == gen)? s->file: NULL;
 }
 
 
@@ -78,51 +200,209 @@ static inline bool upd_file_unref(upd_file_t* f) {
 }
 
 
-static inline bool upd_file_watch(upd_file_watch_t* w) {
-  upd_file_t_* f = (void*) w->file;
-  if (HEDLEY_UNLIKELY(!upd_array_insert(&f->watch, w, SIZE_MAX))) {
+static inline void upd_file_stats_req(const upd_req_t* req) {
+  upd_driver_stats_t* s = ((upd_file_t_*) req->file)->stats;
+  if (HEDLEY_UNLIKELY(s == NULL)) {
+    return;
+  }
+  upd_trace(req->file->iso, "req", UPD_TRACE_INSTANT, req, req->file, req->type);
+
+  const size_t cat  = req->type >> 16;
+  const size_t type = req->type & UINT16_MAX;
+  if (HEDLEY_LIKELY(cat < UPD_DRIVER_STATS_CATS && type < UPD_DRIVER_STATS_TYPES)) {
+    ++s->reqs[cat][type];
+  }
+}
+
+/* Calls the callback of the req handled by its file, timed by the lag monitor. */
+static inline void upd_file_req_cb(upd_req_t* req) {
+  upd_file_t* f   = req->file;
+  upd_iso_t*  iso = f->iso;
+  if (HEDLEY_LIKELY(iso->lag.slow == 0)) {
+    req->cb(req);
+    return;
+  }
+
+  /* the req and the file may be gone after the callback */
+  const upd_driver_t*  driver = f->driver;
+  const upd_file_id_t  id     = f->id;
+  const upd_req_type_t type   = req->type;
+
+  const uint64_t begin = uv_hrtime();
+  req->cb(req);
+  upd_lag_check_(iso, driver, id, "req", type, begin);
+}
+
+static inline void upd_file_stats_done(upd_file_t* f, uint64_t since) {
+  upd_driver_stats_t* s = ((upd_file_t_*) f)->stats;
+  if (HEDLEY_UNLIKELY(s == NULL)) {
+    return;
+  }
+  uint64_t us = (uv_hrtime() - since) / 1000;
+
+  size_t i = 0;
+  for (; us && i+1 < UPD_DRIVER_STATS_BUCKETS; us >>= 1) {
+    ++i;
+  }
+  ++s->latency[i];
+}
+
+
+static inline bool upd_file_watcher_eq_(const void* item, const void* w) {
+  const upd_file_watcher_t* x = item;
+  return x->w == w;
+}
+
+/*  Subscribes only to events whose UPD_FILE_EVENT_BIT is in the mask.
+ * This is for drivers in core, and upd_file_watch() of libupd
+ * subscribes to all events. */
+static inline bool upd_file_watch_with_mask(
+    upd_file_watch_t* w, uint16_t mask) {
+  upd_file_t_* f   = (void*) w->file;
+  upd_iso_t*   iso = f->super.iso;
+
+  const uint64_t hash = upd_hmap_hash_ptr(w);
+  assert(!upd_hmap_find(&iso->watchers, hash, upd_file_watcher_eq_, w));
+
+  if (HEDLEY_UNLIKELY(f->watch == NULL)) {
+    const size_t sz = sizeof(*f->watch)*UPD_FILE_EVENTS;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&f->watch, sz))) {
+      return false;
+    }
+    memset(f->watch, 0, sz);
+  }
+
+  upd_file_watcher_t* x = upd_iso_stack(iso, sizeof(*x));
+  if (HEDLEY_UNLIKELY(x == NULL)) {
     return false;
   }
+  *x = (upd_file_watcher_t) {
+    .w    = w,
+    .mask = mask & UPD_FILE_EVENT_ALL,
+  };
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->watchers, hash, x))) {
+    upd_iso_unstack(iso, x);
+    return false;
+  }
+
+  for (size_t e = 0; e < UPD_FILE_EVENTS; ++e) {
+    if (!(x->mask & UPD_FILE_EVENT_BIT(e))) {
+      continue;
+    }
+    struct upd_file_watch_list_t_* ls = &f->watch[e];
+    x->link[e].prev = ls->tail;
+    if (ls->tail) {
+      ls->tail->link[e].next = x;
+    } else {
+      ls->head = x;
+    }
+    ls->tail = x;
+  }
   return true;
 }
 
+static inline bool upd_file_watch(upd_file_watch_t* w) {
+  return upd_file_watch_with_mask(w, UPD_FILE_EVENT_ALL);
+}
+
 static inline void upd_file_unwatch(upd_file_watch_t* w) {
-  upd_file_t_* f = (void*) w->file;
-  upd_array_find_and_remove(&f->watch, w);
+  upd_file_t_* f   = (void*) w->file;
+  upd_iso_t*   iso = f->super.iso;
+
+  upd_file_watcher_t* x = upd_hmap_remove(
+    &iso->watchers, upd_hmap_hash_ptr(w), upd_file_watcher_eq_, w);
+  if (HEDLEY_UNLIKELY(x == NULL)) {
+    return;
+  }
+
+  for (size_t e = 0; e < UPD_FILE_EVENTS; ++e) {
+    if (!(x->mask & UPD_FILE_EVENT_BIT(e))) {
+      continue;
+    }
+    upd_file_watcher_t* prev = x->link[e].prev;
+    upd_file_watcher_t* next = x->link[e].next;
+
+    for (upd_file_watch_iter_t* it = f->watch_iter; it; it = it->outer) {
+      if (HEDLEY_UNLIKELY(it->event == e && it->next == x)) {
+        it->next = next;
+      }
+    }
+
+    struct upd_file_watch_list_t_* ls = &f->watch[e];
+    if (prev) {
+      prev->link[e].next = next;
+    } else {
+      ls->head = next;
+    }
+    if (next) {
+      next->link[e].prev = prev;
+    } else {
+      ls->tail = prev;
+    }
+  }
+  upd_iso_unstack(iso, x);
 }
 
 static inline void upd_file_trigger(upd_file_t* f, upd_file_event_t e) {
+  upd_file_t_* f_ = (void*) f;
+  assert(e < UPD_FILE_EVENTS);
+
+  if (HEDLEY_LIKELY(f_->watch == NULL || f_->watch[e].head == NULL)) {
+    return;
+  }
   if (HEDLEY_UNLIKELY(e != UPD_FILE_DELETE)) {
     upd_file_ref(f);
   }
-  upd_file_t_* f_ = (void*) f;
-  for (size_t i = 0; i < f_->watch.n; ++i) {
-    upd_file_watch_t* w = f_->watch.p[i];
+
+  /*  Watchers may unwatch themselves or others in their callbacks,
+   * so the iterator is registered to the file to be fixed up. */
+  upd_file_watch_iter_t it = {
+    .outer = f_->watch_iter,
+    .next  = f_->watch[e].head,
+    .event = e,
+  };
+  f_->watch_iter = &it;
+
+  const bool timed = f->iso->lag.slow;
+  while (it.next) {
+    upd_file_watch_t* w = it.next->w;
+    it.next = it.next->link[e].next;
+
+    const uint64_t begin = timed? uv_hrtime(): 0;
     w->event = e;
     w->cb(w);
+    if (timed) {
+      upd_lag_check_(f->iso, f->driver, f->id, "watch", e, begin);
+    }
   }
+  f_->watch_iter = it.outer;
+
   if (HEDLEY_UNLIKELY(e != UPD_FILE_DELETE)) {
     upd_file_unref(f);
   }
 }
 
 static inline bool upd_file_trigger_async(upd_iso_t* iso, upd_file_id_t id) {
-  bool ret = false;
-
-  uv_mutex_lock(&iso->mtx);
-
-  if (HEDLEY_UNLIKELY(iso->async.n >= UPD_ISO_ASYNC_MAX)) {
-    goto EXIT;
+  /*  Files cannot be looked up from other threads, so duplicated ids
+   * are merged by the loop thread when the queue is drained. */
+  /*  Implementations of upd_malloc and upd_free have no
+   * guarantee that they're thread safe */
+  upd_iso_async_t* node = malloc(sizeof(*node));
+  if (HEDLEY_UNLIKELY(node == NULL)) {
+    return false;
   }
-  iso->async.id[iso->async.n++] = id;
+  atomic_init(&node->next, NULL);
+  node->id = id;
 
-  ret = true;
+  atomic_fetch_add_explicit(&iso->async.depth,    1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&iso->async.enqueued, 1, memory_order_relaxed);
 
-EXIT:
-  uv_mutex_unlock(&iso->mtx);
-  uv_async_send(&iso->async.uv);
+  upd_iso_async_t* prev =
+    atomic_exchange_explicit(&iso->async.head, node, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, node, memory_order_release);
 
-  return ret;
+  uv_async_send(&iso->async.uv);
+  return true;
 }
 
 static inline void upd_file_trigger_timer_cb_(uv_timer_t* timer) {
@@ -159,29 +439,99 @@ static inline void upd_file_end_sync(upd_file_t* f) {
 }
 
 
-static inline bool upd_file_try_lock(upd_file_lock_t* l) {
+static inline void upd_file_lock_grant_(upd_file_lock_t* l) {
   upd_file_t_* f = (void*) l->file;
 
-  if (HEDLEY_UNLIKELY(f->lock.refcnt)) {
-    if (HEDLEY_UNLIKELY(f->lock.ex || l->ex || f->lock.pending.n)) {
-      return false;
-    }
-  }
-
   if (HEDLEY_LIKELY(f->lock.refcnt++ == 0)) {
     upd_file_ref(&f->super);  /* for locking */
   }
-
   f->lock.ex = l->ex;
   l->ok = true;
 
   /* be careful that the lock may be deleted in this callback */
   l->cb(l);
+}
+
+static inline bool upd_file_try_lock(upd_file_lock_t* l) {
+  upd_file_t_* f = (void*) l->file;
+
+  if (HEDLEY_UNLIKELY(f->lock.refcnt)) {
+    if (HEDLEY_UNLIKELY(f->lock.ex || l->ex || f->lock.head)) {
+      return false;
+    }
+  }
+  upd_file_lock_grant_(l);
   return true;
 }
 
+static inline bool upd_file_lock_wait_eq_(const void* item, const void* l) {
+  const upd_file_lock_wait_t* x = item;
+  return x->lock == l;
+}
+
+/* Removes the waiter from the queue, and returns its lock. */
+static inline upd_file_lock_t* upd_file_lock_dequeue_(upd_file_lock_wait_t* x) {
+  upd_file_lock_t* l   = x->lock;
+  upd_file_t_*     f   = (void*) l->file;
+  upd_iso_t*       iso = f->super.iso;
+
+  upd_hmap_remove(&iso->lock_waits,
+    upd_hmap_hash_ptr(l), upd_file_lock_wait_eq_, l);
+
+  if (x->prev) {
+    x->prev->next = x->next;
+  } else {
+    f->lock.head = x->next;
+  }
+  if (x->next) {
+    x->next->prev = x->prev;
+  } else {
+    f->lock.tail = x->prev;
+  }
+  assert(f->lock.pending);
+  --f->lock.pending;
+
+  upd_trace(iso, "lock.wait", UPD_TRACE_END, l, &f->super, l->ok);
+
+  const uint64_t wait = upd_iso_now(iso) - l->basetime;
+  ++f->lock.stats.waits;
+  f->lock.stats.total += wait;
+  if (HEDLEY_UNLIKELY(f->lock.stats.max < wait)) {
+    f->lock.stats.max = wait;
+  }
+
+  upd_iso_timeout_stop(iso, &x->timeout);
+  upd_iso_unstack(iso, x);
+  return l;
+}
+
+/*  Grants waiters from the head while they are compatible, so all
+ * consecutive shared waiters are granted at once but none of them
+ * can overtake an exclusive waiter queued before. Callbacks may
+ * lock or unlock recursively, so the head is read again each time.
+ * The caller must hold a ref of the file. */
+static inline void upd_file_lock_grant_waiters_(upd_file_t_* f) {
+  while (f->lock.head) {
+    const upd_file_lock_t* k = f->lock.head->lock;
+    if (HEDLEY_UNLIKELY(f->lock.refcnt && (f->lock.ex || k->ex))) {
+      break;
+    }
+    upd_file_lock_grant_(upd_file_lock_dequeue_(f->lock.head));
+    upd_file_unref(&f->super);  /* for dequeing */
+  }
+}
+
+static inline void upd_file_lock_timeout_cb_(upd_iso_timeout_t* t) {
+  upd_file_lock_wait_t* x = t->udata;
+  upd_file_t_*          f = (void*) x->lock->file;
+
+  ++f->lock.stats.timeouts;
+  upd_file_unlock(x->lock);
+}
+
 static inline bool upd_file_lock(upd_file_lock_t* l) {
-  upd_file_t_* f = (void*) l->file;
+  upd_file_t_* f   = (void*) l->file;
+  upd_iso_t*   iso = f->super.iso;
 
   if (HEDLEY_LIKELY(upd_file_try_lock(l))) {
     return true;
@@ -190,26 +540,61 @@ static inline bool upd_file_lock(upd_file_lock_t* l) {
     return false;
   }
   l->ok = false;
-  if (HEDLEY_UNLIKELY(!upd_array_insert(&f->lock.pending, l, SIZE_MAX))) {
+
+  upd_file_lock_wait_t* x = upd_iso_stack(iso, sizeof(*x));
+  if (HEDLEY_UNLIKELY(x == NULL)) {
+    return false;
+  }
+  *x = (upd_file_lock_wait_t) {
+    .timeout = {
+      .udata = x,
+      .cb    = upd_file_lock_timeout_cb_,
+    },
+    .lock = l,
+    .prev = f->lock.tail,
+  };
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->lock_waits, upd_hmap_hash_ptr(l), x))) {
+    upd_iso_unstack(iso, x);
     return false;
   }
+  if (f->lock.tail) {
+    f->lock.tail->next = x;
+  } else {
+    f->lock.head = x;
+  }
+  f->lock.tail = x;
+  ++f->lock.pending;
+
+  upd_trace(iso, "lock.wait", UPD_TRACE_BEGIN, l, &f->super, l->ex);
 
-  l->basetime = upd_iso_now(f->super.iso);
+  l->basetime = upd_iso_now(iso);
   if (HEDLEY_UNLIKELY(l->timeout == 0)) {
     l->timeout = UPD_FILE_LOCK_DEFAULT_TIMEOUT;
   }
+  upd_iso_timeout_start(iso, &x->timeout, l->timeout);
+
   upd_file_ref(&f->super);  /* for queing */
   return true;
 }
 
 static inline void upd_file_unlock(upd_file_lock_t* l) {
-  upd_file_t_* f = (void*) l->file;
-
-  if (HEDLEY_LIKELY(upd_array_find_and_remove(&f->lock.pending, l))) {
-    l->ok = false;
-    l->cb(l);
-    upd_file_unref(&f->super);  /* for dequeing */
-    return;
+  upd_file_t_* f   = (void*) l->file;
+  upd_iso_t*   iso = f->super.iso;
+
+  if (HEDLEY_UNLIKELY(f->lock.head)) {
+    upd_file_lock_wait_t* x = upd_hmap_find(&iso->lock_waits,
+      upd_hmap_hash_ptr(l), upd_file_lock_wait_eq_, l);
+    if (HEDLEY_UNLIKELY(x)) {
+      upd_file_lock_dequeue_(x);
+
+      l->ok = false;
+      l->cb(l);
+
+      /* waiters blocked by the cancelled one may be granted now */
+      upd_file_lock_grant_waiters_(f);
+      upd_file_unref(&f->super);  /* for dequeing */
+      return;
+    }
   }
   if (HEDLEY_UNLIKELY(!l->ok)) {
     return;
@@ -220,17 +605,9 @@ static inline void upd_file_unlock(upd_file_lock_t* l) {
   if (HEDLEY_UNLIKELY(--f->lock.refcnt)) {
     return;
   }
-  f->super.last_touch = upd_iso_now(f->super.iso);
-
-  upd_array_t* pen = &f->lock.pending;
+  f->super.last_touch = upd_iso_now(iso);
+  upd_file_cache_touch(&f->super);
 
-  upd_file_lock_t* k;
-  while (k = upd_array_remove(pen, 0), k && upd_file_try_lock(k)) {
-    upd_file_unref(&f->super);  /* for dequeing */
-  }
-  if (HEDLEY_UNLIKELY(k && !upd_array_insert(&f->lock.pending, k, 0))) {
-    k->ok = false;
-    k->cb(k);
-  }
+  upd_file_lock_grant_waiters_(f);
   upd_file_unref(&f->super);  /* for unlocking */
 }
@@ -0,0 +1,466 @@
+#if UPD_USE_IO_URING && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE  /* for statx and cpu_set_t used by liburing */
+#endif
+
+#include "common.h"
+
+#if UPD_USE_IO_URING
+# include <liburing.h>
+# include <sys/eventfd.h>
+# include <sys/sysmacros.h>
+#endif
+
+
+#define LOG_PREFIX_ "upd.fs: "
+
+
+#if UPD_USE_IO_URING
+
+typedef struct op_t_ op_t_;
+
+struct op_t_ {
+  upd_iso_t* iso;
+  uv_fs_t*   req;
+  uv_fs_cb   cb;
+
+  struct statx stx;
+
+  /* followed by a copy of path, both live until the completion */
+  struct iovec iov[];
+};
+
+
+static
+void
+fs_probe_(
+  upd_iso_t* iso);
+
+static
+op_t_*
+fs_prep_(
+  upd_iso_t*            iso,
+  uv_fs_t*              req,
+  int                   opcode,
+  uv_fs_type            type,
+  uv_fs_cb              cb,
+  size_t                nbufs,
+  const char*           path,
+  struct io_uring_sqe** sqe);
+
+static
+void
+fs_queue_(
+  upd_iso_t*           iso,
+  struct io_uring_sqe* sqe,
+  op_t_*               op);
+
+static
+void
+fs_complete_(
+  op_t_* op,
+  int    res);
+
+static
+int
+fs_stat_(
+  upd_iso_t*  iso,
+  uv_fs_t*    req,
+  const char* path,
+  bool        link,
+  uv_fs_cb    cb);
+
+
+static
+void
+fs_prepare_cb_(
+  uv_prepare_t* prepare);
+
+static
+void
+fs_poll_cb_(
+  uv_poll_t* poll,
+  int        status,
+  int        events);
+
+static
+void
+fs_poll_close_cb_(
+  uv_handle_t* handle);
+
+#endif  /* UPD_USE_IO_URING */
+
+
+bool upd_fs_init(upd_iso_t* iso) {
+#if UPD_USE_IO_URING
+  iso->fs.efd = -1;
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&iso->fs.ring, sizeof(*iso->fs.ring)))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"io_uring allocation failure, "
+      "falls back to threadpool\n");
+    return true;
+  }
+  const int ring = io_uring_queue_init(UPD_FS_RING_ENTRIES, iso->fs.ring, 0);
+  if (HEDLEY_UNLIKELY(ring < 0)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"io_uring is unavailable, "
+      "falls back to threadpool (%s)\n", uv_strerror(ring));
+    upd_free(&iso->fs.ring);
+    return true;
+  }
+
+  iso->fs.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  const bool ring_ok =
+    iso->fs.efd >= 0 &&
+    0 <= io_uring_register_eventfd(iso->fs.ring, iso->fs.efd);
+  if (HEDLEY_UNLIKELY(!ring_ok)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"io_uring setup failure, "
+      "falls back to threadpool\n");
+    if (iso->fs.efd >= 0) {
+      close(iso->fs.efd);
+      iso->fs.efd = -1;
+    }
+    io_uring_queue_exit(iso->fs.ring);
+    upd_free(&iso->fs.ring);
+    return true;
+  }
+
+  const bool uv_ok =
+    0 <= uv_prepare_init(&iso->loop, &iso->fs.prepare) &&
+    0 <= uv_poll_init(&iso->loop, &iso->fs.poll, iso->fs.efd);
+  if (HEDLEY_UNLIKELY(!uv_ok)) {
+    return false;
+  }
+  iso->fs.prepare.data = iso;
+  iso->fs.poll.data    = iso;
+  iso->fs.ok           = true;
+  fs_probe_(iso);
+#else
+  (void) iso;
+#endif
+  return true;
+}
+
+void upd_fs_deinit(upd_iso_t* iso) {
+#if UPD_USE_IO_URING
+  if (HEDLEY_UNLIKELY(!iso->fs.ok)) {
+    return;
+  }
+  assert(iso->fs.inflight == 0);
+
+  /* the eventfd is closed after the handle watching it */
+  uv_close((uv_handle_t*) &iso->fs.prepare, NULL);
+  uv_close((uv_handle_t*) &iso->fs.poll,    fs_poll_close_cb_);
+  iso->fs.ok = false;
+#else
+  (void) iso;
+#endif
+}
+
+int upd_fs_open(
+    upd_iso_t*  iso,
+    uv_fs_t*    req,
+    const char* path,
+    int         flags,
+    int         mode,
+    uv_fs_cb    cb) {
+#if UPD_USE_IO_URING
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req, IORING_OP_OPENAT, UV_FS_OPEN, cb, 0, path, &sqe);
+  if (HEDLEY_LIKELY(op)) {
+    io_uring_prep_openat(sqe,
+      AT_FDCWD, (char*) op->iov, flags | O_CLOEXEC, mode);
+    fs_queue_(iso, sqe, op);
+    return 0;
+  }
+#endif
+  return uv_fs_open(&iso->loop, req, path, flags, mode, cb);
+}
+
+int upd_fs_close(upd_iso_t* iso, uv_fs_t* req, uv_file fd, uv_fs_cb cb) {
+#if UPD_USE_IO_URING
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req, IORING_OP_CLOSE, UV_FS_CLOSE, cb, 0, NULL, &sqe);
+  if (HEDLEY_LIKELY(op)) {
+    io_uring_prep_close(sqe, fd);
+    fs_queue_(iso, sqe, op);
+    return 0;
+  }
+#endif
+  return uv_fs_close(&iso->loop, req, fd, cb);
+}
+
+int upd_fs_read(
+    upd_iso_t*     iso,
+    uv_fs_t*       req,
+    uv_file        fd,
+    const uv_buf_t bufs[],
+    unsigned       nbufs,
+    int64_t        off,
+    uv_fs_cb       cb) {
+#if UPD_USE_IO_URING
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req, IORING_OP_READV, UV_FS_READ, cb, nbufs, NULL, &sqe);
+  if (HEDLEY_LIKELY(op)) {
+    for (unsigned i = 0; i < nbufs; ++i) {
+      op->iov[i] = (struct iovec) { .iov_base = bufs[i].base, .iov_len = bufs[i].len, };
+    }
+    io_uring_prep_readv(sqe, fd, op->iov, nbufs, off);
+    fs_queue_(iso, sqe, op);
+    return 0;
+  }
+#endif
+  return uv_fs_read(&iso->loop, req, fd, bufs, nbufs, off, cb);
+}
+
+int upd_fs_write(
+    upd_iso_t*     iso,
+    uv_fs_t*       req,
+    uv_file        fd,
+    const uv_buf_t bufs[],
+    unsigned       nbufs,
+    int64_t        off,
+    uv_fs_cb       cb) {
+#if UPD_USE_IO_URING
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req, IORING_OP_WRITEV, UV_FS_WRITE, cb, nbufs, NULL, &sqe);
+  if (HEDLEY_LIKELY(op)) {
+    for (unsigned i = 0; i < nbufs; ++i) {
+      op->iov[i] = (struct iovec) { .iov_base = bufs[i].base, .iov_len = bufs[i].len, };
+    }
+    io_uring_prep_writev(sqe, fd, op->iov, nbufs, off);
+    fs_queue_(iso, sqe, op);
+    return 0;
+  }
+#endif
+  return uv_fs_write(&iso->loop, req, fd, bufs, nbufs, off, cb);
+}
+
+int upd_fs_stat(upd_iso_t* iso, uv_fs_t* req, const char* path, uv_fs_cb cb) {
+#if UPD_USE_IO_URING
+  return fs_stat_(iso, req, path, false, cb);
+#else
+  return uv_fs_stat(&iso->loop, req, path, cb);
+#endif
+}
+
+int upd_fs_lstat(upd_iso_t* iso, uv_fs_t* req, const char* path, uv_fs_cb cb) {
+#if UPD_USE_IO_URING
+  return fs_stat_(iso, req, path, true, cb);
+#else
+  return uv_fs_lstat(&iso->loop, req, path, cb);
+#endif
+}
+
+int upd_fs_fdatasync(upd_iso_t* iso, uv_fs_t* req, uv_file fd, uv_fs_cb cb) {
+#if UPD_USE_IO_URING
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req, IORING_OP_FSYNC, UV_FS_FDATASYNC, cb, 0, NULL, &sqe);
+  if (HEDLEY_LIKELY(op)) {
+    io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+    fs_queue_(iso, sqe, op);
+    return 0;
+  }
+#endif
+  return uv_fs_fdatasync(&iso->loop, req, fd, cb);
+}
+
+
+#if UPD_USE_IO_URING
+
+static void fs_probe_(upd_iso_t* iso) {
+  static const int ops[] = {
+    IORING_OP_OPENAT,
+    IORING_OP_CLOSE,
+    IORING_OP_READV,
+    IORING_OP_WRITEV,
+    IORING_OP_FSYNC,
+    IORING_OP_STATX,
+  };
+
+  /*  Kernels without probe (before 5.6) accept the ring but reject
+   * OPENAT, CLOSE and STATX, so only the ops of 5.1 are used there. */
+  struct io_uring_probe* probe = io_uring_get_probe_ring(iso->fs.ring);
+  if (HEDLEY_UNLIKELY(probe == NULL)) {
+    iso->fs.probe =
+      (UINT64_C(1) << IORING_OP_READV)  |
+      (UINT64_C(1) << IORING_OP_WRITEV) |
+      (UINT64_C(1) << IORING_OP_FSYNC);
+    upd_iso_msgf(iso, LOG_PREFIX_"io_uring probe is unavailable, "
+      "open, close and stat fall back to threadpool\n");
+    return;
+  }
+  for (size_t i = 0; i < sizeof(ops)/sizeof(ops[0]); ++i) {
+    if (io_uring_opcode_supported(probe, ops[i])) {
+      iso->fs.probe |= UINT64_C(1) << ops[i];
+    }
+  }
+  io_uring_free_probe(probe);
+}
+
+static op_t_* fs_prep_(
+    upd_iso_t*            iso,
+    uv_fs_t*              req,
+    int                   opcode,
+    uv_fs_type            type,
+    uv_fs_cb              cb,
+    size_t                nbufs,
+    const char*           path,
+    struct io_uring_sqe** sqe) {
+  if (HEDLEY_UNLIKELY(!iso->fs.ok)) {
+    return NULL;
+  }
+  if (HEDLEY_UNLIKELY(!(iso->fs.probe & (UINT64_C(1) << opcode)))) {
+    ++iso->fs.fallback;
+    return NULL;
+  }
+
+  const size_t pathlen = path? utf8size_lazy(path)+1: 0;
+
+  op_t_* op = upd_iso_stack(iso,
+    sizeof(*op) + nbufs*sizeof(op->iov[0]) + pathlen);
+  if (HEDLEY_UNLIKELY(op == NULL)) {
+    ++iso->fs.fallback;
+    return NULL;
+  }
+
+  *sqe = io_uring_get_sqe(iso->fs.ring);
+  if (HEDLEY_UNLIKELY(*sqe == NULL)) {
+    /* the queue is full within this iteration */
+    io_uring_submit(iso->fs.ring);
+    iso->fs.pending = 0;
+    *sqe = io_uring_get_sqe(iso->fs.ring);
+    if (HEDLEY_UNLIKELY(*sqe == NULL)) {
+      upd_iso_unstack(iso, op);
+      ++iso->fs.fallback;
+      return NULL;
+    }
+  }
+
+  *op = (op_t_) {
+    .iso = iso,
+    .req = req,
+    .cb  = cb,
+  };
+  if (path) {
+    memcpy((uint8_t*) (op->iov+nbufs), path, pathlen);
+  }
+
+  /* looks like a request completed by libuv, to be cleaned up as usual */
+  void* data = req->data;
+  *req = (uv_fs_t) {
+    .data    = data,
+    .type    = UV_FS,
+    .fs_type = type,
+    .loop    = &iso->loop,
+    .cb      = cb,
+  };
+  return op;
+}
+
+static void fs_queue_(upd_iso_t* iso, struct io_uring_sqe* sqe, op_t_* op) {
+  io_uring_sqe_set_data(sqe, op);
+  ++iso->fs.ops;
+
+  if (HEDLEY_UNLIKELY(iso->fs.pending++ == 0)) {
+    uv_prepare_start(&iso->fs.prepare, fs_prepare_cb_);
+  }
+  if (HEDLEY_UNLIKELY(iso->fs.inflight++ == 0)) {
+    uv_poll_start(&iso->fs.poll, UV_READABLE, fs_poll_cb_);
+  }
+}
+
+static void fs_complete_(op_t_* op, int res) {
+  upd_iso_t* iso = op->iso;
+  uv_fs_t*   req = op->req;
+  uv_fs_cb   cb  = op->cb;
+
+  req->result = res;
+
+  const bool stat = req->fs_type == UV_FS_STAT || req->fs_type == UV_FS_LSTAT;
+  if (stat && HEDLEY_LIKELY(res >= 0)) {
+    const struct statx* x = &op->stx;
+
+    req->result  = 0;
+    req->ptr     = &req->statbuf;
+    req->statbuf = (uv_stat_t) {
+      .st_dev      = makedev(x->stx_dev_major, x->stx_dev_minor),
+      .st_mode     = x->stx_mode,
+      .st_nlink    = x->stx_nlink,
+      .st_uid      = x->stx_uid,
+      .st_gid      = x->stx_gid,
+      .st_rdev     = makedev(x->stx_rdev_major, x->stx_rdev_minor),
+      .st_ino      = x->stx_ino,
+      .st_size     = x->stx_size,
+      .st_blksize  = x->stx_blksize,
+      .st_blocks   = x->stx_blocks,
+      .st_atim     = { x->stx_atime.tv_sec, x->stx_atime.tv_nsec, },
+      .st_mtim     = { x->stx_mtime.tv_sec, x->stx_mtime.tv_nsec, },
+      .st_ctim     = { x->stx_ctime.tv_sec, x->stx_ctime.tv_nsec, },
+      .st_birthtim = { x->stx_btime.tv_sec, x->stx_btime.tv_nsec, },
+    };
+  }
+  upd_iso_unstack(iso, op);
+  cb(req);
+}
+
+static int fs_stat_(
+    upd_iso_t* iso, uv_fs_t* req, const char* path, bool link, uv_fs_cb cb) {
+  struct io_uring_sqe* sqe;
+  op_t_* op = fs_prep_(iso, req,
+    IORING_OP_STATX, link? UV_FS_LSTAT: UV_FS_STAT, cb, 0, path, &sqe);
+  if (HEDLEY_UNLIKELY(op == NULL)) {
+    return link?
+      uv_fs_lstat(&iso->loop, req, path, cb):
+      uv_fs_stat(&iso->loop, req, path, cb);
+  }
+  io_uring_prep_statx(sqe, AT_FDCWD, (char*) op->iov,
+    link? AT_SYMLINK_NOFOLLOW: 0, STATX_BASIC_STATS | STATX_BTIME, &op->stx);
+  fs_queue_(iso, sqe, op);
+  return 0;
+}
+
+
+static void fs_prepare_cb_(uv_prepare_t* prepare) {
+  upd_iso_t* iso = prepare->data;
+
+  /* everything queued in this iteration goes by a single syscall */
+  io_uring_submit(iso->fs.ring);
+  iso->fs.pending = 0;
+  ++iso->fs.submits;
+  uv_prepare_stop(prepare);
+}
+
+static void fs_poll_cb_(uv_poll_t* poll, int status, int events) {
+  upd_iso_t* iso = poll->data;
+  (void) events;
+
+  if (HEDLEY_UNLIKELY(status < 0)) {
+    return;
+  }
+
+  uint64_t n;
+  while (read(iso->fs.efd, &n, sizeof(n)) > 0);
+
+  struct io_uring_cqe* cqe;
+  while (0 == io_uring_peek_cqe(iso->fs.ring, &cqe)) {
+    op_t_*    op  = io_uring_cqe_get_data(cqe);
+    const int res = cqe->res;
+    io_uring_cqe_seen(iso->fs.ring, cqe);
+
+    assert(iso->fs.inflight);
+    if (HEDLEY_UNLIKELY(--iso->fs.inflight == 0)) {
+      uv_poll_stop(&iso->fs.poll);
+    }
+    /* may queue the next op, which restarts the poll */
+    fs_complete_(op, res);
+  }
+}
+
+static void fs_poll_close_cb_(uv_handle_t* handle) {
+  upd_iso_t* iso = handle->data;
+  close(iso->fs.efd);
+  iso->fs.efd = -1;
+  io_uring_queue_exit(iso->fs.ring);
+  upd_free(&iso->fs.ring);
+}
+
+#endif  /* UPD_USE_IO_URING */
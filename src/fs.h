@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  File operations of core, in the same form as uv_fs_*.
+ * When built with UPD_USE_IO_URING, they are queued to an io_uring
+ * instead of the libuv threadpool. Queued operations are submitted at
+ * once before the loop polls, and completions are notified through an
+ * eventfd polled by the loop. Any operation which cannot go through the
+ * ring (unavailable kernel, opcode rejected by the kernel's probe, full
+ * queue) falls back to uv_fs_*.
+ * Requests completed by the ring can be cleaned up by
+ * uv_fs_req_cleanup() as usual. */
+
+
+#define UPD_FS_RING_ENTRIES 256
+
+
+HEDLEY_NON_NULL(1)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_fs_init(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1)
+void
+upd_fs_deinit(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1, 2, 3)
+int
+upd_fs_open(
+  upd_iso_t*  iso,
+  uv_fs_t*    req,
+  const char* path,
+  int         flags,
+  int         mode,
+  uv_fs_cb    cb);
+
+HEDLEY_NON_NULL(1, 2)
+int
+upd_fs_close(
+  upd_iso_t* iso,
+  uv_fs_t*   req,
+  uv_file    fd,
+  uv_fs_cb   cb);
+
+HEDLEY_NON_NULL(1, 2, 4)
+int
+upd_fs_read(
+  upd_iso_t*     iso,
+  uv_fs_t*       req,
+  uv_file        fd,
+  const uv_buf_t bufs[],
+  unsigned       nbufs,
+  int64_t        off,
+  uv_fs_cb       cb);
+
+HEDLEY_NON_NULL(1, 2, 4)
+int
+upd_fs_write(
+  upd_iso_t*     iso,
+  uv_fs_t*       req,
+  uv_file        fd,
+  const uv_buf_t bufs[],
+  unsigned       nbufs,
+  int64_t        off,
+  uv_fs_cb       cb);
+
+HEDLEY_NON_NULL(1, 2, 3)
+int
+upd_fs_stat(
+  upd_iso_t*  iso,
+  uv_fs_t*    req,
+  const char* path,
+  uv_fs_cb    cb);
+
+HEDLEY_NON_NULL(1, 2, 3)
+int
+upd_fs_lstat(
+  upd_iso_t*  iso,
+  uv_fs_t*    req,
+  const char* path,
+  uv_fs_cb    cb);
+
+HEDLEY_NON_NULL(1, 2)
+int
+upd_fs_fdatasync(
+  upd_iso_t* iso,
+  uv_fs_t*   req,
+  uv_file    fd,
+  uv_fs_cb   cb);
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Open addressing hash table with linear probing.
+ * Items are pointers owned by the caller, and a table only keeps
+ * them with their hashes. Keys are compared by the eq callback,
+ * so any structure can be a key. Deletion shifts the following
+ * items backward, so no tombstone is left. */
+
+
+#define UPD_HMAP_MIN 16
+
+
+typedef struct upd_hmap_t      upd_hmap_t;
+typedef struct upd_hmap_item_t upd_hmap_item_t;
+
+typedef
+bool
+(*upd_hmap_eq_t)(
+  const void* item,
+  const void* key);
+
+
+struct upd_hmap_t {
+  upd_hmap_item_t* items;
+  size_t           n;
+  size_t           cap;  /* zero or power of two */
+};
+
+struct upd_hmap_item_t {
+  uint64_t hash;
+  void*    ptr;  /* NULL if empty */
+};
+
+
+static inline uint64_t upd_hmap_hash_ptr(const void* p) {
+  /* splitmix64 finalizer */
+  uint64_t x = (uintptr_t) p;
+  x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+static inline uint64_t upd_hmap_hash_str(
+    uint64_t seed, const uint8_t* str, size_t len) {
+  /* FNV-1a */
+  uint64_t x = UINT64_C(0xcbf29ce484222325) ^ seed;
+  for (size_t i = 0; i < len; ++i) {
+    x ^= str[i];
+    x *= UINT64_C(0x100000001b3);
+  }
+  return x;
+}
+
+static inline bool upd_hmap_eq_ptr(const void* item, const void* key) {
+  return item == key;
+}
+
+
+static inline void upd_hmap_clear(upd_hmap_t* m) {
+  upd_free(&m->items);
+  *m = (upd_hmap_t) {0};
+}
+
+static inline void* upd_hmap_find(
+    const upd_hmap_t* m, uint64_t hash, upd_hmap_eq_t eq, const void* key) {
+  if (HEDLEY_UNLIKELY(m->cap == 0)) {
+    return NULL;
+  }
+  const size_t mask = m->cap - 1;
+  for (size_t i = hash & mask; m->items[i].ptr; i = (i+1) & mask) {
+    const upd_hmap_item_t* item = &m->items[i];
+    if (item->hash == hash && eq(item->ptr, key)) {
+      return item->ptr;
+    }
+  }
+  return NULL;
+}
+
+static inline void upd_hmap_insert_(upd_hmap_t* m, uint64_t hash, void* ptr) {
+  const size_t mask = m->cap - 1;
+
+  size_t i = hash & mask;
+  while (m->items[i].ptr) {
+    i = (i+1) & mask;
+  }
+  m->items[i] = (upd_hmap_item_t) {
+    .hash = hash,
+    .ptr  = ptr,
+  };
+  ++m->n;
+}
+
+/* The caller must ensure that no same key exists. */
+static inline bool upd_hmap_insert(upd_hmap_t* m, uint64_t hash, void* ptr) {
+  assert(ptr);
+
+  /* keeps load factor under 1/2 */
+  if (HEDLEY_UNLIKELY((m->n+1)*2 > m->cap)) {
+    const size_t cap = m->cap? m->cap*2: UPD_HMAP_MIN;
+
+    upd_hmap_item_t* items = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&items, sizeof(*items)*cap))) {
+      return false;
+    }
+    memset(items, 0, sizeof(*items)*cap);
+
+    upd_hmap_t old = *m;
+    *m = (upd_hmap_t) {
+      .items = items,
+      .cap   = cap,
+    };
+    for (size_t i = 0; i < old.cap; ++i) {
+      if (old.items[i].ptr) {
+        upd_hmap_insert_(m, old.items[i].hash, old.items[i].ptr);
+      }
+    }
+    upd_free(&old.items);
+  }
+  upd_hmap_insert_(m, hash, ptr);
+  return true;
+}
+
+static inline void* upd_hmap_remove(
+    upd_hmap_t* m, uint64_t hash, upd_hmap_eq_t eq, const void* key) {
+  if (HEDLEY_UNLIKELY(m->cap == 0)) {
+    return NULL;
+  }
+  const size_t mask = m->cap - 1;
+
+  size_t i = hash & mask;
+  for (;; i = (i+1) & mask) {
+    const upd_hmap_item_t* item = &m->items[i];
+    if (HEDLEY_UNLIKELY(item->ptr == NULL)) {
+      return NULL;
+    }
+    if (item->hash == hash && eq(item->ptr, key)) {
+      break;
+    }
+  }
+  void* ret = m->items[i].ptr;
+
+  /* backward shift deletion */
+  for (size_t j = (i+1) & mask; m->items[j].ptr; j = (j+1) & mask) {
+    const size_t home = m->items[j].hash & mask;
+
+    /* moves j to i unless its home lies cyclically in (i, j] */
+    const bool stay = i < j? (i < home && home <= j): (i < home || home <= j);
+    if (!stay) {
+      m->items[i] = m->items[j];
+      i = j;
+    }
+  }
+  m->items[i] = (upd_hmap_item_t) {0};
+  --m->n;
+  return ret;
+}
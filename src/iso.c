@@ -7,6 +7,7 @@
 
 #define WALKER_PERIOD_               1000
 #define WALKER_FILES_PER_PERIOD_     1000
+#define WALKER_SLOTS_PER_PERIOD_     4000
 #define WALKER_FILES_UNCACHE_DELAY_ 10000
 
 
@@ -25,6 +26,18 @@ typedef struct curl_sock_t_ {
 } curl_sock_t_;
 
 
+static
+size_t
+iso_get_size_env_(
+  const char* name,
+  size_t      def);
+
+static
+size_t
+iso_get_count_env_(
+  const char* name,
+  size_t      def);
+
 static
 bool
 iso_get_paths_(
@@ -37,6 +50,51 @@ iso_create_dir_(
   const char* path);
 
 
+static
+void
+iso_leave_group_(
+  upd_iso_t* iso);
+
+static
+void
+iso_consume_posts_(
+  upd_iso_t* iso);
+
+
+static
+void
+wheel_insert_(
+  upd_iso_t*         iso,
+  upd_iso_timeout_t* t,
+  uint64_t           floor);
+
+static
+void
+wheel_unlink_(
+  upd_iso_t*         iso,
+  upd_iso_timeout_t* t);
+
+static
+uint64_t
+wheel_next_(
+  upd_iso_t* iso);
+
+static
+void
+wheel_advance_(
+  upd_iso_t* iso,
+  uint64_t   target);
+
+static
+void
+wheel_schedule_(
+  upd_iso_t* iso);
+
+static
+void
+wheel_cb_(
+  uv_timer_t* timer);
+
 static
 void
 walker_handle_(
@@ -65,11 +123,21 @@ void
 iso_shutdown_timer_cb_(
   uv_timer_t* timer);
 
+static
+upd_iso_async_t*
+iso_async_pop_(
+  upd_iso_t* iso);
+
 static
 void
 iso_async_cb_(
   uv_async_t* async);
 
+static
+void
+iso_post_cb_(
+  uv_async_t* async);
+
 
 static
 void
@@ -122,6 +190,13 @@ upd_iso_t* upd_iso_new(size_t stacksz) {
    * because app exits immediately. */
 
   upd_iso_t* iso = NULL;
+  /* nodes of the async queue come from any thread, see upd_file_trigger_async */
+  upd_iso_async_t* stub = malloc(sizeof(*stub));
+  if (HEDLEY_UNLIKELY(stub == NULL)) {
+    return NULL;
+  }
+  atomic_init(&stub->next, NULL);
+
   if (HEDLEY_UNLIKELY(!upd_malloc(&iso, sizeof(*iso)+stacksz))) {
     return NULL;
   }
@@ -140,13 +215,48 @@ upd_iso_t* upd_iso_new(size_t stacksz) {
     .walker = {
       .timer = { .data = iso, },
     },
+    .proc = {
+      .prepare = { .data = iso, },
+      .check   = { .data = iso, },
+    },
+    .wheel = {
+      .uv   = { .data = iso, },
+      .next = UINT64_MAX,
+    },
     .curl = {
       .timer = { .data = iso, },
     },
     .async = {
+      .uv   = { .data = iso, },
+      .tail = stub,
+      .stub = stub,
+    },
+    .post = {
       .uv = { .data = iso, },
     },
+    .cache = {
+      .budget = iso_get_size_env_("UPD_CACHE_BUDGET", 0),
+    },
+    .dcache = {
+      .max = iso_get_count_env_("UPD_DCACHE_MAX", UPD_DCACHE_DEFAULT_MAX),
+    },
+    .bcache = {
+      .budget = iso_get_size_env_("UPD_BCACHE_BUDGET", UPD_BCACHE_DEFAULT_BUDGET),
+    },
+    .fdcache = {
+      .max = iso_get_count_env_("UPD_FDCACHE_MAX", UPD_FDCACHE_DEFAULT_MAX),
+    },
+    .prefetch = {
+      .max = iso_get_count_env_("UPD_PREFETCH", UPD_PREFETCH_DEFAULT),
+    },
+    .files = {
+      .free_head = UPD_FILE_SLOT_NONE,
+      .free_tail = UPD_FILE_SLOT_NONE,
+    },
   };
+  atomic_init(&iso->async.head,     stub);
+  atomic_init(&iso->async.depth,    0);
+  atomic_init(&iso->async.enqueued, 0);
 
   /* init uv handles */
   const bool uv_ok =
@@ -158,17 +268,30 @@ upd_iso_t* upd_iso_new(size_t stacksz) {
     0 <= uv_timer_init(&iso->loop, &iso->shutdown_timer) &&
     0 <= uv_timer_init(&iso->loop, &iso->destroyer) &&
     0 <= uv_timer_init(&iso->loop, &iso->walker.timer) &&
+    0 <= uv_timer_init(&iso->loop, &iso->wheel.uv) &&
+    0 <= uv_prepare_init(&iso->loop, &iso->proc.prepare) &&
+    0 <= uv_check_init(&iso->loop, &iso->proc.check) &&
     0 <= uv_async_init(&iso->loop, &iso->async.uv, iso_async_cb_) &&
+    0 <= uv_async_init(&iso->loop, &iso->post.uv, iso_post_cb_) &&
     0 <= uv_signal_start(&iso->sigint, iso_signal_cb_, SIGINT) &&
     0 <= uv_signal_start(&iso->sighup, iso_signal_cb_, SIGHUP) &&
     0 <= uv_timer_start(
       &iso->walker.timer, walker_cb_, WALKER_PERIOD_, WALKER_PERIOD_) &&
-    0 <= uv_mutex_init(&iso->mtx);
+    0 <= uv_mutex_init(&iso->mtx) &&
+    upd_watch_init(iso) &&
+    upd_fs_init(iso) &&
+    upd_trace_init(iso) &&
+    upd_lag_init(iso);
   if (HEDLEY_UNLIKELY(!uv_ok)) {
     return NULL;
   }
   uv_unref((uv_handle_t*) &iso->walker.timer);
+  uv_unref((uv_handle_t*) &iso->wheel.uv);
+  uv_unref((uv_handle_t*) &iso->proc.prepare);
+  uv_unref((uv_handle_t*) &iso->proc.check);
+  iso->wheel.now = uv_now(&iso->loop);
   uv_unref((uv_handle_t*) &iso->async.uv);
+  uv_unref((uv_handle_t*) &iso->post.uv);
 
   /* init curl */
   iso->curl.ctx = curl_multi_init();
@@ -212,17 +335,16 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
   uv_signal_stop(&iso->sigint);
   uv_signal_stop(&iso->sighup);
 
+  /* refuse posts from other shards */
+  iso_leave_group_(iso);
+
   /* trigger shutdown event */
-  upd_file_unref(iso->files.p[0]);
-  for (size_t i = iso->files.n; ;) {
-    if (HEDLEY_UNLIKELY(i > iso->files.n)) {
-      i = iso->files.n;
+  upd_file_unref(upd_file_get(iso, UPD_FILE_ID_ROOT));
+  for (size_t i = iso->files.used; i > 0;) {
+    upd_file_t* f = iso->files.slots[--i].file;
+    if (HEDLEY_LIKELY(f)) {
+      upd_file_trigger(f, UPD_FILE_SHUTDOWN);
     }
-    if (HEDLEY_UNLIKELY(i == 0)) {
-      break;
-    }
-    upd_file_t* f = iso->files.p[--i];
-    upd_file_trigger(f, UPD_FILE_SHUTDOWN);
   }
 
   /* start destroyer */
@@ -235,6 +357,9 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
     return UPD_ISO_PANIC;
   }
 
+  /* posts queued while leaving must be consumed before closing */
+  iso_consume_posts_(iso);
+
   /* close all system handlers */
   uv_close((uv_handle_t*) &iso->out,            NULL);
   uv_close((uv_handle_t*) &iso->sigint,         NULL);
@@ -242,16 +367,53 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
   uv_close((uv_handle_t*) &iso->shutdown_timer, NULL);
   uv_close((uv_handle_t*) &iso->destroyer,      NULL);
   uv_close((uv_handle_t*) &iso->walker.timer,   NULL);
+  uv_close((uv_handle_t*) &iso->wheel.uv,       NULL);
+  uv_close((uv_handle_t*) &iso->proc.prepare,   NULL);
+  uv_close((uv_handle_t*) &iso->proc.check,     NULL);
   uv_close((uv_handle_t*) &iso->curl.timer,     NULL);
   uv_close((uv_handle_t*) &iso->async.uv,       NULL);
+  uv_close((uv_handle_t*) &iso->post.uv,        NULL);
+  upd_watch_deinit(iso);
+  upd_trace_deinit(iso);
+  upd_lag_deinit(iso);
+  upd_prefetch_deinit(iso);
+  upd_fs_deinit(iso);
   if (HEDLEY_UNLIKELY(0 > uv_run(&iso->loop, UV_RUN_DEFAULT))) {
     return UPD_ISO_PANIC;
   }
   assert(iso->stack.refcnt == 0);
   assert(iso->files.n      == 0);
+  assert(iso->wheel.n      == 0);
+  assert(iso->proc.pre.n   == 0);
+  assert(iso->proc.post.n  == 0);
   assert(iso->threads.n    == 0);
+  assert(iso->post.items.n == 0);
+  assert(iso->watchers.n   == 0);
+  assert(iso->lock_waits.n == 0);
 
   uv_mutex_destroy(&iso->mtx);
+  upd_free(&iso->files.slots);
+  upd_hmap_clear(&iso->watchers);
+  upd_dcache_deinit(iso);
+  upd_bcache_deinit(iso);
+  upd_hmap_clear(&iso->lock_waits);
+
+  /* release all slabs of stack allocator */
+  while (iso->stack.slabs) {
+    void* slab = iso->stack.slabs;
+    iso->stack.slabs = *(void**) slab;
+    upd_free(&slab);
+  }
+
+  /* discard async triggers which have never been consumed */
+  for (;;) {
+    upd_iso_async_t* node = iso_async_pop_(iso);
+    if (HEDLEY_LIKELY(node == NULL)) {
+      break;
+    }
+    free(node);
+  }
+  free(iso->async.stub);
 
   /* cleanup curl */
   curl_multi_cleanup(iso->curl.ctx);
@@ -271,6 +433,10 @@ upd_iso_status_t upd_iso_run(upd_iso_t* iso) {
 
   /* forget all drivers */
   upd_array_clear(&iso->drivers);
+  for (size_t i = 0; i < iso->driver_stats.cap; ++i) {
+    upd_free(&iso->driver_stats.items[i].ptr);
+  }
+  upd_hmap_clear(&iso->driver_stats);
 
   const upd_iso_status_t ret = iso->status;
   upd_free(&iso);
@@ -287,6 +453,111 @@ void upd_iso_exit(upd_iso_t* iso, upd_iso_status_t status) {
 }
 
 
+bool upd_iso_group_init(upd_iso_group_t* group, size_t n) {
+  if (HEDLEY_UNLIKELY(n == 0 || n > UPD_ISO_SHARD_MAX)) {
+    return false;
+  }
+  *group = (upd_iso_group_t) {
+    .n = n,
+  };
+  return 0 <= uv_mutex_init(&group->mtx);
+}
+
+void upd_iso_group_deinit(upd_iso_group_t* group) {
+  uv_mutex_destroy(&group->mtx);
+}
+
+bool upd_iso_join(upd_iso_t* iso, upd_iso_group_t* group, size_t index) {
+  if (HEDLEY_UNLIKELY(index >= group->n || iso->shard.group)) {
+    return false;
+  }
+
+  bool ret = false;
+  uv_mutex_lock(&group->mtx);
+  if (HEDLEY_LIKELY(group->shards[index] == NULL)) {
+    group->shards[index] = iso;
+    iso->shard.group = group;
+    iso->shard.index = index;
+    ret = true;
+  }
+  uv_mutex_unlock(&group->mtx);
+  return ret;
+}
+
+bool upd_iso_post(
+    upd_iso_t* iso, size_t shard, upd_iso_post_cb_t cb, void* udata) {
+  upd_iso_group_t* group = iso->shard.group;
+  if (HEDLEY_UNLIKELY(group == NULL && shard != 0)) {
+    return false;
+  }
+
+  /*  Implementations of upd_malloc and upd_free have no
+   * guarantee that they're thread safe */
+  upd_iso_post_t* post = malloc(sizeof(*post));
+  if (HEDLEY_UNLIKELY(post == NULL)) {
+    return false;
+  }
+  *post = (upd_iso_post_t) {
+    .udata = udata,
+    .cb    = cb,
+  };
+
+  if (HEDLEY_LIKELY(group)) {
+    uv_mutex_lock(&group->mtx);
+  }
+
+  upd_iso_t* dst = group? (shard < group->n? group->shards[shard]: NULL): iso;
+
+  bool ret = false;
+  if (HEDLEY_LIKELY(dst)) {
+    uv_mutex_lock(&dst->mtx);
+    ret = upd_array_insert(&dst->post.items, post, SIZE_MAX);
+    uv_mutex_unlock(&dst->mtx);
+
+    /* dst is never deleted while the group is locked */
+    if (HEDLEY_LIKELY(ret)) {
+      uv_async_send(&dst->post.uv);
+    }
+  }
+
+  if (HEDLEY_LIKELY(group)) {
+    uv_mutex_unlock(&group->mtx);
+  }
+
+  if (HEDLEY_UNLIKELY(!ret)) {
+    free(post);
+  }
+  return ret;
+}
+
+
+void upd_iso_timeout_start(
+    upd_iso_t* iso, upd_iso_timeout_t* t, uint64_t dur) {
+  assert(t->head == NULL);
+
+  /* an empty wheel can jump to the current time freely */
+  if (HEDLEY_UNLIKELY(iso->wheel.n == 0)) {
+    iso->wheel.now = upd_iso_now(iso);
+  }
+
+  t->expire = upd_iso_now(iso) + dur;
+  wheel_insert_(iso, t, iso->wheel.now+1);
+
+  if (HEDLEY_UNLIKELY(t->expire < iso->wheel.next)) {
+    wheel_schedule_(iso);
+  }
+}
+
+void upd_iso_timeout_stop(upd_iso_t* iso, upd_iso_timeout_t* t) {
+  if (HEDLEY_UNLIKELY(t->head == NULL)) {
+    return;
+  }
+  wheel_unlink_(iso, t);
+  assert(iso->wheel.n);
+  --iso->wheel.n;
+}
+
+
 bool upd_iso_curl_perform(
     upd_iso_t* iso, CURL* curl, upd_iso_curl_cb_t cb, void* udata) {
   curl_t_* ctx = upd_iso_stack(iso, sizeof(*ctx));
@@ -309,6 +580,30 @@ bool upd_iso_curl_perform(
 }
 
 
+static size_t iso_get_size_env_(const char* name, size_t def) {
+  const char* env = getenv(name);
+  if (HEDLEY_LIKELY(env == NULL || env[0] == 0)) {
+    return def;
+  }
+
+  char*  end;
+  size_t n = strtoull(env, &end, 10);
+  switch (*end) {
+  case 'g': case 'G': n *= 1024;  /* fallthrough */
+  case 'm': case 'M': n *= 1024;  /* fallthrough */
+  case 'k': case 'K': n *= 1024;  break;
+  }
+  return n;
+}
+
+static size_t iso_get_count_env_(const char* name, size_t def) {
+  const char* env = getenv(name);
+  if (HEDLEY_LIKELY(env == NULL || env[0] == 0)) {
+    return def;
+  }
+  return strtoull(env, NULL, 10);
+}
+
 static bool iso_get_paths_(upd_iso_t* iso) {
   uint8_t cwd[UPD_PATH_MAX];
   size_t  cwdlen = UPD_PATH_MAX;
@@ -353,7 +648,7 @@ static bool iso_get_paths_(upd_iso_t* iso) {
 
 
 static void iso_create_dir_(upd_iso_t* iso, const char* path) {
-  const bool ok = upd_pathfind_with_dup(&(upd_pathfind_t) {
+  const bool ok = upd_dcache_pathfind_with_dup(&(upd_pathfind_t) {
       .iso    = iso,
       .path   = (uint8_t*) path,
       .len    = utf8size_lazy(path),
@@ -368,22 +663,216 @@ static void iso_create_dir_(upd_iso_t* iso, const char* path) {
 }
 
 
+static void iso_leave_group_(upd_iso_t* iso) {
+  upd_iso_group_t* group = iso->shard.group;
+  if (HEDLEY_UNLIKELY(group == NULL)) {
+    return;
+  }
+  uv_mutex_lock(&group->mtx);
+  assert(group->shards[iso->shard.index] == iso);
+  group->shards[iso->shard.index] = NULL;
+  uv_mutex_unlock(&group->mtx);
+}
+
+static void iso_consume_posts_(upd_iso_t* iso) {
+  for (;;) {
+    uv_mutex_lock(&iso->mtx);
+    upd_array_t items = iso->post.items;
+    iso->post.items = (upd_array_t) {0};
+    uv_mutex_unlock(&iso->mtx);
+
+    if (HEDLEY_LIKELY(items.n == 0)) {
+      upd_array_clear(&items);
+      return;
+    }
+    for (size_t i = 0; i < items.n; ++i) {
+      upd_iso_post_t* post = items.p[i];
+      post->cb(iso, post->udata);
+      free(post);
+    }
+    upd_array_clear(&items);
+  }
+}
+
+
+static inline unsigned wheel_ctz_(uint64_t v) {
+# if defined(__GNUC__)
+    return __builtin_ctzll(v);
+# else
+    unsigned n = 0;
+    while (!(v & 1)) {
+      v >>= 1;
+      ++n;
+    }
+    return n;
+# endif
+}
+
+static void wheel_insert_(
+    upd_iso_t* iso, upd_iso_timeout_t* t, uint64_t floor) {
+  const uint64_t now = iso->wheel.now;
+  const uint64_t e   = t->expire > floor? t->expire: floor;
+
+  /*  The timeout goes to the lowest level whose upper bits are same
+   * as the current tick, so it's always ahead of the level's cursor. */
+  upd_iso_timeout_t** head = &iso->wheel.overflow;
+  for (size_t l = 0; l < UPD_ISO_WHEEL_LEVELS; ++l) {
+    const size_t sh = UPD_ISO_WHEEL_BITS*(l+1);
+    if (HEDLEY_LIKELY((e >> sh) == (now >> sh))) {
+      const size_t idx = (e >> (sh-UPD_ISO_WHEEL_BITS)) % UPD_ISO_WHEEL_SLOTS;
+      head = &iso->wheel.slots[l][idx];
+      iso->wheel.bits[l] |= UINT64_C(1) << idx;
+      break;
+    }
+  }
+
+  t->prev = NULL;
+  t->next = *head;
+  t->head = head;
+  if (t->next) {
+    t->next->prev = t;
+  }
+  *head = t;
+  ++iso->wheel.n;
+}
+
+static void wheel_unlink_(upd_iso_t* iso, upd_iso_timeout_t* t) {
+  upd_iso_timeout_t** head = t->head;
+
+  if (t->prev) {
+    t->prev->next = t->next;
+  } else {
+    *head = t->next;
+  }
+  if (t->next) {
+    t->next->prev = t->prev;
+  }
+  t->prev = t->next = NULL;
+  t->head = NULL;
+
+  if (*head == NULL && head != &iso->wheel.overflow) {
+    const size_t i = head - &iso->wheel.slots[0][0];
+    iso->wheel.bits[i/UPD_ISO_WHEEL_SLOTS] &=
+      ~(UINT64_C(1) << i%UPD_ISO_WHEEL_SLOTS);
+  }
+}
+
+static uint64_t wheel_next_(upd_iso_t* iso) {
+  const uint64_t now = iso->wheel.now;
+
+  uint64_t ret = UINT64_MAX;
+  for (size_t l = 0; l < UPD_ISO_WHEEL_LEVELS; ++l) {
+    const size_t sh  = UPD_ISO_WHEEL_BITS*l;
+    const size_t idx = (now >> sh) % UPD_ISO_WHEEL_SLOTS;
+    if (HEDLEY_UNLIKELY(idx+1 >= UPD_ISO_WHEEL_SLOTS)) {
+      continue;
+    }
+    const uint64_t bits = iso->wheel.bits[l] & (UINT64_MAX << (idx+1));
+    if (HEDLEY_LIKELY(bits == 0)) {
+      continue;
+    }
+    const size_t   upper = sh+UPD_ISO_WHEEL_BITS;
+    const uint64_t t     =
+      (now >> upper << upper) | ((uint64_t) wheel_ctz_(bits) << sh);
+    if (t < ret) {
+      ret = t;
+    }
+  }
+  if (HEDLEY_UNLIKELY(iso->wheel.overflow)) {
+    const size_t   sh = UPD_ISO_WHEEL_BITS*UPD_ISO_WHEEL_LEVELS;
+    const uint64_t t  = ((now >> sh) + 1) << sh;
+    if (t < ret) {
+      ret = t;
+    }
+  }
+  return ret;
+}
+
+static void wheel_advance_(upd_iso_t* iso, uint64_t target) {
+  for (;;) {
+    /* jumps to the next occupied slot, so empty ticks cost nothing */
+    const uint64_t now = wheel_next_(iso);
+    if (HEDLEY_LIKELY(now > target)) {
+      break;
+    }
+    iso->wheel.now = now;
+
+    /* cascades upper levels into lower ones */
+    for (size_t l = UPD_ISO_WHEEL_LEVELS+1; l-- > 1;) {
+      const uint64_t mask = (UINT64_C(1) << (UPD_ISO_WHEEL_BITS*l)) - 1;
+      if (now & mask) {
+        continue;
+      }
+
+      upd_iso_timeout_t** head = &iso->wheel.overflow;
+      if (HEDLEY_LIKELY(l < UPD_ISO_WHEEL_LEVELS)) {
+        const size_t idx =
+          (now >> (UPD_ISO_WHEEL_BITS*l)) % UPD_ISO_WHEEL_SLOTS;
+        head = &iso->wheel.slots[l][idx];
+        iso->wheel.bits[l] &= ~(UINT64_C(1) << idx);
+      }
+
+      /* detaches first because overflowed ones may come back */
+      upd_iso_timeout_t* t = *head;
+      *head = NULL;
+      while (t) {
+        upd_iso_timeout_t* next = t->next;
+        --iso->wheel.n;
+        wheel_insert_(iso, t, now);
+        t = next;
+      }
+    }
+
+    /* be careful that the callbacks may start or stop any timeouts */
+    upd_iso_timeout_t** head =
+      &iso->wheel.slots[0][now % UPD_ISO_WHEEL_SLOTS];
+    while (*head) {
+      upd_iso_timeout_t* t = *head;
+      upd_iso_timeout_stop(iso, t);
+      t->cb(t);
+    }
+  }
+  iso->wheel.now = target;
+}
+
+static void wheel_schedule_(upd_iso_t* iso) {
+  if (HEDLEY_UNLIKELY(iso->wheel.n == 0)) {
+    uv_timer_stop(&iso->wheel.uv);
+    iso->wheel.next = UINT64_MAX;
+    return;
+  }
+
+  const uint64_t next = wheel_next_(iso);
+  const uint64_t now  = upd_iso_now(iso);
+
+  const int err = uv_timer_start(
+    &iso->wheel.uv, wheel_cb_, next > now? next-now: 0, 0);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_msgf(iso, "failed to schedule timing wheel\n");
+    return;
+  }
+  iso->wheel.next = next;
+}
+
+static void wheel_cb_(uv_timer_t* timer) {
+  upd_iso_t* iso = timer->data;
+
+  iso->wheel.next = UINT64_MAX;
+  wheel_advance_(iso, upd_iso_now(iso));
+  wheel_schedule_(iso);
+}
+
+
 static void walker_handle_(upd_file_t* f) {
   upd_file_t_* f_  = (void*) f;
   upd_iso_t*   iso = f->iso;
 
   const uint64_t now = upd_iso_now(f->iso);
 
-  /* lock timeout handling */
-  for (size_t i = 0; i < f_->lock.pending.n;) {
-    upd_file_lock_t* k = f_->lock.pending.p[i];
-
-    const uint64_t thresh = k->basetime + k->timeout;
-    if (HEDLEY_UNLIKELY(now >= thresh)) {
-      upd_file_unlock(k);
-      continue;
-    }
-    ++i;
+  /* picks up cache changes which drivers haven't reported */
+  upd_file_cache_update(f);
+  if (HEDLEY_LIKELY(iso->cache.budget)) {
+    return;
   }
 
   /* trigger uncache event */
@@ -465,32 +954,93 @@ static void iso_shutdown_timer_cb_(uv_timer_t* timer) {
   upd_iso_exit(iso, UPD_ISO_SHUTDOWN);
 }
 
+static upd_iso_async_t* iso_async_pop_(upd_iso_t* iso) {
+  upd_iso_async_t* stub = iso->async.stub;
+  upd_iso_async_t* tail = iso->async.tail;
+  upd_iso_async_t* next =
+    atomic_load_explicit(&tail->next, memory_order_acquire);
+
+  if (tail == stub) {
+    if (HEDLEY_UNLIKELY(next == NULL)) {
+      return NULL;
+    }
+    iso->async.tail = tail = next;
+    next = atomic_load_explicit(&next->next, memory_order_acquire);
+  }
+  if (HEDLEY_LIKELY(next)) {
+    iso->async.tail = next;
+    return tail;
+  }
+
+  /*  A producer is in the middle of pushing, its uv_async_send()
+   * will wake us up again later. */
+  upd_iso_async_t* head =
+    atomic_load_explicit(&iso->async.head, memory_order_acquire);
+  if (HEDLEY_UNLIKELY(tail != head)) {
+    return NULL;
+  }
+
+  /* push the stub back to detach the last node */
+  atomic_store_explicit(&stub->next, NULL, memory_order_relaxed);
+  upd_iso_async_t* prev =
+    atomic_exchange_explicit(&iso->async.head, stub, memory_order_acq_rel);
+  atomic_store_explicit(&prev->next, stub, memory_order_release);
+
+  next = atomic_load_explicit(&tail->next, memory_order_acquire);
+  if (HEDLEY_LIKELY(next)) {
+    iso->async.tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
 static void iso_async_cb_(uv_async_t* async) {
   upd_iso_t* iso = async->data;
 
-  uv_mutex_lock(&iso->mtx);
+  /*  Nodes pushed while draining are left for the next callback
+   * to keep the loop from being starved by busy producers. */
+  const size_t n =
+    atomic_load_explicit(&iso->async.depth, memory_order_relaxed);
+  if (HEDLEY_UNLIKELY(n > iso->async.peak)) {
+    iso->async.peak = n;
+  }
 
-  const size_t n = iso->async.n;
-  upd_file_id_t id[UPD_ISO_ASYNC_MAX];
+  const uint64_t round = ++iso->async.round;
 
-  memcpy(id, iso->async.id, n*sizeof(*id));
-  iso->async.n = 0;
+  size_t i = 0;
+  for (; i < n; ++i) {
+    upd_iso_async_t* node = iso_async_pop_(iso);
+    if (HEDLEY_UNLIKELY(node == NULL)) {
+      break;
+    }
+    const upd_file_id_t id = node->id;
+    free(node);
 
-  uv_mutex_unlock(&iso->mtx);
+    atomic_fetch_sub_explicit(&iso->async.depth, 1, memory_order_relaxed);
+    ++iso->async.drained;
 
-  for (size_t i = 0; i < n; ++i) {
-    bool dup = false;
-    for (size_t j = 0; j < i; ++j) {
-      if (HEDLEY_UNLIKELY(id[i] == id[j])) {
-        dup = true;
-        break;
-      }
+    upd_file_t_* f = (void*) upd_file_get(iso, id);
+    if (HEDLEY_UNLIKELY(f == NULL)) {
+      continue;
     }
-    if (HEDLEY_LIKELY(!dup)) {
-      upd_file_t* f = upd_file_get(iso, id[i]);
-      upd_file_trigger(f, UPD_FILE_ASYNC);
+    if (HEDLEY_UNLIKELY(f->async_round == round)) {
+      ++iso->async.merged;
+      continue;
     }
+    f->async_round = round;
+    upd_file_trigger(&f->super, UPD_FILE_ASYNC);
   }
+  const size_t left =
+    atomic_load_explicit(&iso->async.depth, memory_order_relaxed);
+  if (HEDLEY_UNLIKELY(i == n && left)) {
+    uv_async_send(async);
+  }
+}
+
+
+static void iso_post_cb_(uv_async_t* async) {
+  upd_iso_t* iso = async->data;
+  iso_consume_posts_(iso);
 }
 
 
@@ -504,34 +1054,23 @@ static void destroyer_cb_(uv_timer_t* timer) {
 
 
 static void walker_cb_(uv_timer_t* timer) {
-  upd_iso_t*   iso   = timer->data;
-  upd_file_t** files = (void*) iso->files.p;
+  upd_iso_t* iso = timer->data;
 
   if (HEDLEY_UNLIKELY(iso->files.n == 0)) {
     return;
   }
 
-  const upd_file_id_t needle = iso->walker.last_seen;
-
-  ssize_t i = 0, l = 0, r = (ssize_t) iso->files.n - 1;
-  while (l < r) {
-    i = (l+r)/2;
-    if (HEDLEY_UNLIKELY(files[i]->id == needle)) {
-      break;
-    }
-    if (files[i]->id > needle) {
-      r = i-1;
-    } else {
-      l = i+1;
-    }
-  }
-  if (files[i]->id <= needle) {
-    ++i;
-  }
+  /*  Empty slots are skipped without being counted as walked files,
+   * but the number of visited slots is bounded too. */
+  size_t visited = 0, walked = 0;
+  while (
+      walked  < iso->files.n &&
+      walked  < WALKER_FILES_PER_PERIOD_ &&
+      visited < WALKER_SLOTS_PER_PERIOD_) {
+    ++visited;
 
-  for (size_t j = 0; j < iso->files.n && j < WALKER_FILES_PER_PERIOD_; ++j) {
-    if (HEDLEY_UNLIKELY((size_t) i >= iso->files.n)) {
-      i = 0;
+    if (HEDLEY_UNLIKELY(iso->walker.next >= iso->files.used)) {
+      iso->walker.next = 0;
 
       const size_t cache = iso->walker.cache.part;
       const size_t avg   = cache / iso->files.n;
@@ -542,11 +1081,14 @@ static void walker_cb_(uv_timer_t* timer) {
       iso->walker.cache.thresh = pth/10*2 + avg/10*6;
       iso->walker.cache.part   = 0;
     }
-    upd_file_t* f = iso->files.p[i++];
-    walker_handle_(f);
+    upd_file_t* f = iso->files.slots[iso->walker.next++].file;
+    if (HEDLEY_UNLIKELY(f == NULL)) {
+      continue;
+    }
+    ++walked;
 
     iso->walker.cache.part += f->cache;
-    iso->walker.last_seen   = f->id;
+    walker_handle_(f);
   }
 }
 
@@ -3,11 +3,55 @@
 #include "common.h"
 
 
-#define UPD_ISO_ASYNC_MAX 64
+#define UPD_ISO_SHARD_MAX 64
+
+#define UPD_ISO_STACK_CLASS_MIN 32
+#define UPD_ISO_STACK_CLASSES   12  /* = 32 B ~ 64 KiB */
+#define UPD_ISO_STACK_SLAB      (1024*256)
+
+#define UPD_ISO_WHEEL_LEVELS 4   /* covers about 4.6 hours */
+#define UPD_ISO_WHEEL_BITS   6
+#define UPD_ISO_WHEEL_SLOTS  (1 << UPD_ISO_WHEEL_BITS)
+
+/* max size of a block which never falls back to malloc */
+#define UPD_ISO_STACK_BLOCK_MAX  \
+  ((UPD_ISO_STACK_CLASS_MIN << (UPD_ISO_STACK_CLASSES-1)) - 16)
 
 
 typedef struct upd_iso_thread_t upd_iso_thread_t;
 typedef struct upd_iso_work_t   upd_iso_work_t;
+typedef struct upd_iso_group_t  upd_iso_group_t;
+typedef struct upd_iso_post_t   upd_iso_post_t;
+typedef struct upd_iso_async_t  upd_iso_async_t;
+
+typedef struct upd_iso_stack_head_t upd_iso_stack_head_t;
+typedef struct upd_iso_timeout_t    upd_iso_timeout_t;
+
+typedef struct upd_file_slot_t upd_file_slot_t;
+
+typedef struct upd_iso_proc_t upd_iso_proc_t;
+
+typedef struct upd_trace_event_t   upd_trace_event_t;
+typedef struct upd_dcache_entry_t  upd_dcache_entry_t;
+typedef struct upd_bcache_block_t  upd_bcache_block_t;
+typedef struct upd_fdcache_entry_t upd_fdcache_entry_t;
+typedef struct upd_prefetch_t      upd_prefetch_t;
+typedef struct upd_prefetch_dir_t  upd_prefetch_dir_t;
+
+typedef struct upd_watch_t     upd_watch_t;
+typedef struct upd_watch_sub_t upd_watch_sub_t;
+
+
+typedef
+void
+(*upd_iso_post_cb_t)(
+  upd_iso_t* iso,
+  void*      udata);
+
+typedef
+void
+(*upd_iso_timeout_cb_t)(
+  upd_iso_timeout_t* t);
 
 
 struct upd_iso_t {
@@ -29,20 +73,63 @@ struct upd_iso_t {
   upd_array_of(uv_lib_t*)         libs;
 
   upd_array_of(const upd_driver_t*) drivers;
-  upd_array_of(upd_file_t*)         files;
-
-  size_t files_created;
+  upd_hmap_t                        driver_stats;  /* of upd_driver_stats_t* */
 
+  /*  Files are stored in a generational slot table. A file id is
+   * a pair of a slot index (lower 32 bits) and the slot generation
+   * (upper 32 bits), so lookup, insertion and deletion are O(1) and
+   * ids of deleted files are never confused with new ones. */
+  struct {
+    upd_file_slot_t* slots;
+    size_t           n;     /* number of living files */
+    size_t           used;  /* number of slots ever used */
+    size_t           cap;
+
+    /* FIFO of free slots to delay reuse of the same index */
+    uint32_t free_head;
+    uint32_t free_tail;
+  } files;
+
+  /*  Blocks are carved from the preallocated region (and then from
+   * malloc'd slabs when it runs out) and are recycled through
+   * per-size-class freelists as soon as they are unstacked. */
   struct {
     size_t   used;
     size_t   size;
     size_t   refcnt;
     uint8_t* ptr;
+
+    uint8_t* slab;
+    size_t   slab_used;
+    void*    slabs;  /* linked list of all slabs */
+
+    upd_iso_stack_head_t* free[UPD_ISO_STACK_CLASSES];
+
+    struct {
+      uint64_t hit;    /* reused from freelists */
+      uint64_t carve;  /* newly carved from the region or slabs */
+      uint64_t slab;   /* slabs allocated by malloc */
+      uint64_t large;  /* too large blocks allocated by malloc */
+    } stats;
   } stack;
 
+  /*  Files holding cache are linked in LRU order (head is the most
+   * recently touched one), and the coldest ones are uncached
+   * synchronously when the total exceeds the budget. */
+  struct {
+    size_t   budget;  /* 0 means unlimited */
+    size_t   total;
+    size_t   files;
+    uint64_t evicted;
+    bool     evicting;
+
+    upd_file_t* head;
+    upd_file_t* tail;
+  } cache;
+
   struct {
-    uv_timer_t    timer;
-    upd_file_id_t last_seen;
+    uv_timer_t timer;
+    size_t     next;
 
     struct {
       size_t part;
@@ -52,17 +139,172 @@ struct upd_iso_t {
     } cache;
   } walker;
 
+  /*  Hierarchical timing wheel with 1 ms ticks driven by a single
+   * timer, which is scheduled for the nearest occupied slot. */
+  struct {
+    uv_timer_t uv;
+    uint64_t   now;   /* the last tick processed */
+    uint64_t   next;  /* the tick the timer is scheduled for */
+    size_t     n;
+
+    uint64_t           bits[UPD_ISO_WHEEL_LEVELS];
+    upd_iso_timeout_t* slots[UPD_ISO_WHEEL_LEVELS][UPD_ISO_WHEEL_SLOTS];
+    upd_iso_timeout_t* overflow;
+  } wheel;
+
+  /*  Files subscribing UPD_FILE_PREPROC and UPD_FILE_POSTPROC are
+   * dispatched by the single prepare/check handle, which is active
+   * only while anyone subscribes. */
+  struct {
+    uv_prepare_t prepare;
+    uv_check_t   check;
+
+    struct upd_iso_proc_t {
+      upd_file_t* head;
+      upd_file_t* cursor;  /* the next file to be dispatched */
+      size_t      n;
+    } pre, post;
+  } proc;
+
+  struct {
+    upd_array_of(upd_watch_t*) dirs;  /* sorted by path */
+
+    upd_watch_sub_t* dirty;
+    uv_check_t       check;
+    bool             rearm;  /* some dirs need to be rearmed */
+
+    uint64_t events;
+    uint64_t flushes;
+    uint64_t fallbacks;
+  } watch;
+
+  struct {
+    uv_check_t check;
+    uint64_t   last;   /* hrtime of the last check */
+    uint64_t   idle;   /* loop idle time at the last check */
+    uint64_t   since;  /* hrtime when the current window started */
+    uint64_t   max;    /* us, since the isolate started */
+
+    upd_lag_hist_t curr;
+    upd_lag_hist_t prev;  /* the last completed window */
+
+    uint64_t       slow;   /* threshold in us, 0 disables */
+    uint64_t       nslow;
+    upd_lag_slow_t slows[UPD_LAG_SLOWS];  /* ring */
+  } lag;
+
+  struct {
+    upd_trace_event_t* ring;  /* NULL if disabled */
+    size_t             cap;
+    size_t             head;  /* the next slot to be written */
+    size_t             n;
+    uint64_t           base;  /* hrtime when tracing started */
+
+    uv_signal_t sig;
+  } trace;
+
+  struct {
+    upd_hmap_t          map;
+    upd_dcache_entry_t* head;
+    upd_dcache_entry_t* tail;
+    size_t              n;
+    size_t              max;
+
+    uint64_t hits;
+    uint64_t misses;
+  } dcache;
+
+  struct {
+    upd_hmap_t          map;
+    upd_bcache_block_t* head;
+    upd_bcache_block_t* tail;
+    size_t              bytes;
+    size_t              budget;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+  } bcache;
+
+  struct {
+    upd_fdcache_entry_t* head;
+    upd_fdcache_entry_t* tail;
+    size_t               n;
+    size_t               max;
+
+    uint64_t evicted;
+    uint64_t kept;  /* updates which kept the fd as nothing changed */
+  } fdcache;
+
+  struct {
+    upd_hmap_t          map;   /* npath -> upd_prefetch_dir_t* */
+    upd_prefetch_dir_t* head;  /* FIFO of dirs waiting for a work */
+    upd_prefetch_dir_t* tail;
+    size_t              works;
+    size_t              max;   /* works in flight, 0 disables */
+    bool                closing;
+
+    upd_array_of(upd_prefetch_t*) mounts;
+  } prefetch;
+
+  struct {
+#if UPD_USE_IO_URING
+    struct io_uring* ring;  /* liburing is included only by fs.c */
+    uv_prepare_t    prepare;  /* submits queued ops before polling */
+    uv_poll_t       poll;     /* on efd, active while ops are in flight */
+    int             efd;
+
+    size_t   pending;  /* ops queued but not submitted */
+    size_t   inflight;
+    uint64_t probe;    /* bits of IORING_OP_* supported by the kernel */
+#endif
+    bool ok;  /* ops go through the ring */
+
+    uint64_t ops;
+    uint64_t submits;
+    uint64_t fallback;
+  } fs;
+
+  /* upd_file_watch_t* -> upd_file_watcher_t* */
+  upd_hmap_t watchers;
+
+  /* upd_file_lock_t* -> upd_file_lock_wait_t* */
+  upd_hmap_t lock_waits;
+
   struct {
     CURLM*     ctx;
     uv_timer_t timer;
   } curl;
 
+  /*  Intrusive MPSC queue (Vyukov) of async triggers. Any thread can
+   * push without locks, and only the loop thread pops. */
   struct {
-    uv_async_t    uv;
-    upd_file_id_t id[UPD_ISO_ASYNC_MAX];
-    size_t        n;
+    uv_async_t uv;
+
+    _Atomic(upd_iso_async_t*) head;
+    upd_iso_async_t*          tail;
+    upd_iso_async_t*          stub;
+
+    uint64_t round;
+
+    /* counters, only depth and enqueued are touched by producers */
+    atomic_size_t         depth;
+    atomic_uint_least64_t enqueued;
+    uint64_t              drained;
+    uint64_t              merged;
+    size_t                peak;
   } async;
 
+  struct {
+    upd_iso_group_t* group;
+    size_t           index;
+  } shard;
+
+  struct {
+    uv_async_t uv;
+    upd_array_of(upd_iso_post_t*) items;
+  } post;
+
   struct {
     uint8_t runtime[UPD_PATH_MAX];
     uint8_t working[UPD_PATH_MAX];
@@ -88,6 +330,50 @@ struct upd_iso_work_t {
   upd_iso_work_cb_t     cb;
 };
 
+/*  A group of isolated instances running on their own threads (shards).
+ * Each shard owns its loop, files, stack and drivers. Nothing is shared
+ * between them except the listening ports (SO_REUSEPORT) and this table,
+ * which is used to post callbacks onto other shards' loops.
+ *
+ *  Sharding is experimental and built only with UPD_USE_SHARDS: every
+ * shard builds its own tree from the config and no request is routed
+ * across shards yet, upd_malloc is called from all shard threads though
+ * it is not guaranteed to be thread safe, and drivers loaded from shared
+ * libraries share their globals between shards. */
+struct upd_iso_group_t {
+  uv_mutex_t mtx;
+
+  size_t     n;
+  upd_iso_t* shards[UPD_ISO_SHARD_MAX];
+};
+
+struct upd_iso_stack_head_t {
+  /* keeps the user area aligned as malloc does */
+  _Alignas(16) size_t   cls;
+  upd_iso_stack_head_t* next;
+};
+
+struct upd_iso_timeout_t {
+  upd_iso_timeout_t*  prev;
+  upd_iso_timeout_t*  next;
+  upd_iso_timeout_t** head;  /* NULL if not active */
+
+  uint64_t expire;
+
+  void*                udata;
+  upd_iso_timeout_cb_t cb;
+};
+
+struct upd_iso_async_t {
+  _Atomic(upd_iso_async_t*) next;
+  upd_file_id_t             id;
+};
+
+struct upd_iso_post_t {
+  void*             udata;
+  upd_iso_post_cb_t cb;
+};
+
 
 /* Application must exit immediately if this function fails. */
 upd_iso_t*
@@ -107,6 +393,55 @@ upd_iso_exit(
   upd_iso_status_t status);
 
 
+HEDLEY_NON_NULL(1)
+bool
+upd_iso_group_init(
+  upd_iso_group_t* group,
+  size_t           n);
+
+HEDLEY_NON_NULL(1)
+void
+upd_iso_group_deinit(
+  upd_iso_group_t* group);
+
+/* Must be called before upd_iso_run. */
+HEDLEY_NON_NULL(1, 2)
+bool
+upd_iso_join(
+  upd_iso_t*       iso,
+  upd_iso_group_t* group,
+  size_t           index);
+
+/*  Calls the callback on the loop of the specified shard.
+ * This is the only way to touch files owned by other shards, but
+ * nothing routes requests or pathfinds through it yet.
+ * Thread-safe. Returns false if the shard doesn't exist or is tearing down. */
+HEDLEY_NON_NULL(1, 3)
+bool
+upd_iso_post(
+  upd_iso_t*        iso,
+  size_t            shard,
+  upd_iso_post_cb_t cb,
+  void*             udata);
+
+
+/*  Calls the callback after dur milliseconds unless stopped.
+ * The timeout must stay alive until it fires or is stopped. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_iso_timeout_start(
+  upd_iso_t*         iso,
+  upd_iso_timeout_t* t,
+  uint64_t           dur);
+
+/* Does nothing if the timeout is not active. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_iso_timeout_stop(
+  upd_iso_t*         iso,
+  upd_iso_timeout_t* t);
+
+
 typedef
 void
 (*upd_iso_curl_cb_t)(
@@ -123,50 +458,104 @@ upd_iso_curl_perform(
   void*             udata);
 
 
-static inline void* upd_iso_stack(upd_iso_t* iso, uint64_t len) {
-  if (HEDLEY_UNLIKELY(iso->stack.used+len > iso->stack.size || len > 1024*4)) {
-    void* ptr = NULL;
-    if (HEDLEY_UNLIKELY(!upd_malloc(&ptr, len))) {
+static inline void* upd_iso_stack_carve_(upd_iso_t* iso, size_t sz) {
+  const uintptr_t base  = (uintptr_t) iso->stack.ptr;
+  const size_t    align = (16 - base%16) % 16;
+  if (HEDLEY_LIKELY(align+iso->stack.used+sz <= iso->stack.size)) {
+    void* ret = iso->stack.ptr + align + iso->stack.used;
+    iso->stack.used += sz;
+    return ret;
+  }
+
+  if (HEDLEY_UNLIKELY(
+      iso->stack.slab == NULL ||
+      iso->stack.slab_used+sz > UPD_ISO_STACK_SLAB)) {
+    uint8_t* slab = NULL;
+    if (HEDLEY_UNLIKELY(!upd_malloc(&slab, UPD_ISO_STACK_SLAB+16))) {
       return NULL;
     }
-    return ptr;
+    *(void**) slab = iso->stack.slabs;
+    iso->stack.slabs     = slab;
+    iso->stack.slab      = slab+16;
+    iso->stack.slab_used = 0;
+    ++iso->stack.stats.slab;
+  }
+  void* ret = iso->stack.slab + iso->stack.slab_used;
+  iso->stack.slab_used += sz;
+  return ret;
+}
+
+static inline void* upd_iso_stack(upd_iso_t* iso, uint64_t len) {
+  const uint64_t need = len + sizeof(upd_iso_stack_head_t);
+
+  size_t cls = 0;
+  while (
+      cls < UPD_ISO_STACK_CLASSES &&
+      ((uint64_t) UPD_ISO_STACK_CLASS_MIN << cls) < need) {
+    ++cls;
   }
 
-  void* ret = iso->stack.ptr + iso->stack.used;
-  iso->stack.used += len;
+  upd_iso_stack_head_t* head = NULL;
+  if (HEDLEY_UNLIKELY(cls >= UPD_ISO_STACK_CLASSES)) {
+    if (HEDLEY_UNLIKELY(!upd_malloc(&head, need))) {
+      return NULL;
+    }
+    ++iso->stack.stats.large;
+
+  } else if (HEDLEY_LIKELY(iso->stack.free[cls])) {
+    head = iso->stack.free[cls];
+    iso->stack.free[cls] = head->next;
+    ++iso->stack.stats.hit;
+
+  } else {
+    head = upd_iso_stack_carve_(iso, UPD_ISO_STACK_CLASS_MIN << cls);
+    if (HEDLEY_UNLIKELY(head == NULL)) {
+      return NULL;
+    }
+    ++iso->stack.stats.carve;
+  }
+  head->cls = cls;
   ++iso->stack.refcnt;
 
+  void* ret = head+1;
 # if UPD_USE_VALGRIND
-    VALGRIND_MALLOCLIKE_BLOCK(ret, len, 0, 0);
+    if (HEDLEY_LIKELY(cls < UPD_ISO_STACK_CLASSES)) {
+      VALGRIND_MALLOCLIKE_BLOCK(ret, len, 0, 0);
+    }
 # endif
   return ret;
 }
 
 static inline void upd_iso_unstack(upd_iso_t* iso, void* ptr) {
-  (void) ptr;
-
-  void* begin = iso->stack.ptr;
-  void* end   = iso->stack.ptr + iso->stack.size;
-
-  if (HEDLEY_UNLIKELY(ptr < begin || end <= ptr)) {
-    upd_free(&ptr);
+  if (HEDLEY_UNLIKELY(ptr == NULL)) {
     return;
   }
+  upd_iso_stack_head_t* head = (upd_iso_stack_head_t*) ptr - 1;
   assert(iso->stack.refcnt);
+  --iso->stack.refcnt;
+
+  const size_t cls = head->cls;
+  if (HEDLEY_UNLIKELY(cls >= UPD_ISO_STACK_CLASSES)) {
+    upd_free(&head);
+    return;
+  }
 
 # if UPD_USE_VALGRIND
     VALGRIND_FREELIKE_BLOCK(ptr, 0);
 # endif
 
-  if (--iso->stack.refcnt == 0) {
-    iso->stack.used = 0;
-  }
+  head->next = iso->stack.free[cls];
+  iso->stack.free[cls] = head;
 }
 
 static inline uint64_t upd_iso_now(upd_iso_t* iso) {
   return uv_now(&iso->loop);
 }
 
+static inline size_t upd_iso_shards(upd_iso_t* iso) {
+  return iso->shard.group? iso->shard.group->n: 1;
+}
+
 static void upd_iso_msg_write_cb_(uv_write_t* req, int status) {
   upd_iso_unstack(req->data, req);
   if (HEDLEY_UNLIKELY(status < 0)) {
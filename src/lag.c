@@ -0,0 +1,180 @@
+#include "common.h"
+
+
+#define LOG_PREFIX_ "upd.lag: "
+
+#define WINDOW_      (60*1000*1000*UINT64_C(1000))  /* = 60 sec in ns */
+#define SLOW_DEFAULT_ 100  /* ms */
+
+
+static
+uint64_t
+lag_get_slow_threshold_(
+  void);
+
+static
+size_t
+lag_bucket_(
+  uint64_t us);
+
+static
+uint64_t
+lag_bucket_upper_(
+  size_t i);
+
+static
+void
+lag_record_(
+  upd_lag_hist_t* h,
+  uint64_t        us);
+
+
+static
+void
+lag_check_cb_(
+  uv_check_t* check);
+
+
+bool upd_lag_init(upd_iso_t* iso) {
+  /* uv_metrics_idle_time() requires libuv 1.39 or later */
+  uv_loop_configure(&iso->loop, UV_METRICS_IDLE_TIME);
+
+  iso->lag.check.data = iso;
+  if (HEDLEY_UNLIKELY(0 > uv_check_init(&iso->loop, &iso->lag.check))) {
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(0 > uv_check_start(&iso->lag.check, lag_check_cb_))) {
+    return false;
+  }
+  uv_unref((uv_handle_t*) &iso->lag.check);
+
+  const uint64_t now = uv_hrtime();
+  iso->lag.last  = now;
+  iso->lag.since = now;
+  iso->lag.idle  = uv_metrics_idle_time(&iso->loop);
+  iso->lag.slow  = lag_get_slow_threshold_()*1000;
+  return true;
+}
+
+void upd_lag_deinit(upd_iso_t* iso) {
+  uv_close((uv_handle_t*) &iso->lag.check, NULL);
+}
+
+void upd_lag_check_(
+    upd_iso_t*          iso,
+    const upd_driver_t* driver,
+    upd_file_id_t       id,
+    const char*         what,
+    uint32_t            arg,
+    uint64_t            begin) {
+  const uint64_t us = (uv_hrtime() - begin) / 1000;
+  if (HEDLEY_LIKELY(us < iso->lag.slow)) {
+    return;
+  }
+
+  upd_lag_slow_t* s = &iso->lag.slows[iso->lag.nslow++ % UPD_LAG_SLOWS];
+  *s = (upd_lag_slow_t) {
+    .at     = upd_iso_now(iso),
+    .dur    = us,
+    .driver = driver,
+    .id     = id,
+    .what   = what,
+    .arg    = arg,
+  };
+
+  const upd_file_t* f = upd_file_get(iso, id);
+  size_t len = 0;
+  if (HEDLEY_LIKELY(f)) {
+    len = f->pathlen < UPD_LAG_PATH? f->pathlen: UPD_LAG_PATH-1;
+    if (len) {
+      memcpy(s->path, f->path, len);
+    }
+  }
+  s->path[len] = 0;
+
+  upd_iso_msgf(iso,
+    LOG_PREFIX_"slow callback: %"PRIu64" ms on %s %#"PRIx32" of '%s' (%s)\n",
+    us/1000, what, arg, (const char*) driver->name, s->path);
+}
+
+uint64_t upd_lag_percentile(const upd_lag_hist_t* h, double p) {
+  if (HEDLEY_UNLIKELY(h->n == 0)) {
+    return 0;
+  }
+  const uint64_t rank = (uint64_t) (h->n * p / 100);
+
+  uint64_t sum = 0;
+  for (size_t i = 0; i < UPD_LAG_BUCKETS; ++i) {
+    sum += h->buckets[i];
+    if (sum > rank) {
+      const uint64_t upper = lag_bucket_upper_(i);
+      return upper < h->max? upper: h->max;
+    }
+  }
+  return h->max;
+}
+
+
+static uint64_t lag_get_slow_threshold_(void) {
+  const char* env = getenv("UPD_SLOW_CB_MS");
+  if (HEDLEY_LIKELY(env == NULL || env[0] == 0)) {
+    return SLOW_DEFAULT_;
+  }
+  return strtoull(env, NULL, 10);
+}
+
+static size_t lag_bucket_(uint64_t us) {
+  if (us < 4) {
+    return us;
+  }
+  size_t msb = 0;
+  for (uint64_t v = us; v >>= 1;) {
+    ++msb;
+  }
+  const size_t i = (msb-1)*4 + ((us >> (msb-2)) & 3);
+  return i < UPD_LAG_BUCKETS? i: UPD_LAG_BUCKETS-1;
+}
+
+static uint64_t lag_bucket_upper_(size_t i) {
+  if (i < 4) {
+    return i+1;
+  }
+  const size_t msb = i/4 + 1;
+  const size_t sub = i%4;
+  return (uint64_t) (5+sub) << (msb-2);
+}
+
+static void lag_record_(upd_lag_hist_t* h, uint64_t us) {
+  ++h->n;
+  ++h->buckets[lag_bucket_(us)];
+  if (HEDLEY_UNLIKELY(h->max < us)) {
+    h->max = us;
+  }
+}
+
+
+static void lag_check_cb_(uv_check_t* check) {
+  upd_iso_t* iso = check->data;
+
+  const uint64_t now  = uv_hrtime();
+  const uint64_t idle = uv_metrics_idle_time(&iso->loop);
+
+  const uint64_t wall  = now - iso->lag.last;
+  const uint64_t idled = idle - iso->lag.idle;
+  const uint64_t busy  = wall > idled? wall-idled: 0;
+
+  iso->lag.last = now;
+  iso->lag.idle = idle;
+
+  if (HEDLEY_UNLIKELY(now - iso->lag.since >= WINDOW_)) {
+    iso->lag.prev  = iso->lag.curr;
+    iso->lag.curr  = (upd_lag_hist_t) {0};
+    iso->lag.since = now;
+  }
+
+  const uint64_t us = busy/1000;
+  lag_record_(&iso->lag.curr, us);
+  if (HEDLEY_UNLIKELY(iso->lag.max < us)) {
+    iso->lag.max = us;
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Event loop lag monitor.
+ * The busy time of each loop iteration (wall time between two check
+ * phases minus the time the loop was idle in polling) is recorded into
+ * log-linear histograms rotated every window.
+ * Watch callbacks, req completions of the core drivers and syncdir
+ * merges taking longer than UPD_SLOW_CB_MS (100 ms by default, 0
+ * disables) are logged with the driver and path of the file. */
+
+
+#define UPD_LAG_BUCKETS 96  /* 4 per power of two of microseconds */
+#define UPD_LAG_SLOWS   32
+#define UPD_LAG_PATH    96
+
+
+typedef struct upd_lag_hist_t upd_lag_hist_t;
+typedef struct upd_lag_slow_t upd_lag_slow_t;
+
+
+struct upd_lag_hist_t {
+  uint64_t n;
+  uint64_t max;
+  uint64_t buckets[UPD_LAG_BUCKETS];
+};
+
+struct upd_lag_slow_t {
+  uint64_t            at;   /* upd_iso_now() */
+  uint64_t            dur;  /* us */
+  const upd_driver_t* driver;
+  upd_file_id_t       id;
+  const char*         what;  /* static string: "watch", "req", ... */
+  uint32_t            arg;   /* file event, req type or merged entries */
+  char                path[UPD_LAG_PATH];
+};
+
+
+HEDLEY_NON_NULL(1)
+bool
+upd_lag_init(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1)
+void
+upd_lag_deinit(
+  upd_iso_t* iso);
+
+/*  Records a callback on the file which started at the hrtime if it
+ * was too slow. The callback may delete the file, so the path is
+ * looked up by the id only when it's recorded. */
+HEDLEY_NON_NULL(1, 2, 4)
+void
+upd_lag_check_(
+  upd_iso_t*          iso,
+  const upd_driver_t* driver,
+  upd_file_id_t       id,
+  const char*         what,
+  uint32_t            arg,
+  uint64_t            begin);
+
+/* Returns an upper bound of the p-th percentile in microseconds. */
+HEDLEY_NON_NULL(1)
+uint64_t
+upd_lag_percentile(
+  const upd_lag_hist_t* h,
+  double                p);
@@ -1,6 +1,35 @@
 #include "common.h"
 
 
+#define STACK_SIZE_ (1024*1024*8)  /* = 8 MiB */
+
+
+typedef struct shard_t_ {
+  uv_thread_t      thread;
+  upd_iso_group_t* group;
+  size_t           index;
+
+  bool ok;
+} shard_t_;
+
+
+static
+size_t
+shard_count_(
+  void);
+
+static
+bool
+shard_run_(
+  upd_iso_group_t* group,
+  size_t           index);
+
+
+static
+void
+shard_main_(
+  void* udata);
+
 static
 void
 config_load_cb_(
@@ -14,18 +43,104 @@ int main(int argc, char** argv) {
     return EXIT_FAILURE;
   }
 
+  const size_t n = shard_count_();
+
+  upd_iso_group_t group;
+  if (HEDLEY_UNLIKELY(!upd_iso_group_init(&group, n))) {
+    fprintf(stderr, "shard group init failure\n");
+    return EXIT_FAILURE;
+  }
+
+  bool ok = true;
+  if (HEDLEY_LIKELY(n == 1)) {
+    ok = shard_run_(&group, 0);
+
+  } else {
+    printf("running %zu shards\n", n);
+
+    shard_t_ shards[UPD_ISO_SHARD_MAX];
+    size_t   started = 0;
+    for (; started < n; ++started) {
+      shard_t_* s = &shards[started];
+      *s = (shard_t_) {
+        .group = &group,
+        .index = started,
+      };
+      if (HEDLEY_UNLIKELY(0 > uv_thread_create(&s->thread, shard_main_, s))) {
+        fprintf(stderr, "shard thread creation failure\n");
+        ok = false;
+        break;
+      }
+    }
+    for (size_t i = 0; i < started; ++i) {
+      uv_thread_join(&shards[i].thread);
+      ok = ok && shards[i].ok;
+    }
+  }
+
+  upd_iso_group_deinit(&group);
+  curl_global_cleanup();
+  return ok? EXIT_SUCCESS: EXIT_FAILURE;
+}
+
+
+static size_t shard_count_(void) {
+  const char* env = getenv("UPD_SHARDS");
+  if (HEDLEY_LIKELY(env == NULL || env[0] == 0)) {
+    return 1;
+  }
+
+  size_t n = 0;
+  if (upd_strcaseq_c("auto", (const uint8_t*) env, utf8size_lazy(env))) {
+    uv_cpu_info_t* info;
+    int            count;
+    if (HEDLEY_LIKELY(0 <= uv_cpu_info(&info, &count))) {
+      uv_free_cpu_info(info, count);
+      n = count;
+    }
+  } else {
+    n = strtoul(env, NULL, 10);
+  }
+
+  if (HEDLEY_UNLIKELY(n == 0)) {
+    fprintf(stderr, "invalid UPD_SHARDS, running with 1 shard\n");
+    n = 1;
+  }
+# if !UPD_USE_SHARDS
+    if (HEDLEY_UNLIKELY(n > 1)) {
+      fprintf(stderr, "built without UPD_USE_SHARDS, running with 1 shard\n");
+      n = 1;
+    }
+# endif
+  if (HEDLEY_UNLIKELY(n > UPD_ISO_SHARD_MAX)) {
+    n = UPD_ISO_SHARD_MAX;
+  }
+  return n;
+}
+
+static bool shard_run_(upd_iso_group_t* group, size_t index) {
   for (;;) {
-    printf(
-      ".   ..   ..--.  .    .--.     .    .   . .--. --.--.--. \n"
-      "|   ||\\  ||   )/ \\   |   )   / \\   |\\  |:    :  |  |   :\n"
-      "|   || \\ ||--'/___\\  |--'   /___\\  | \\ ||    |  |  |   |\n"
-      ":   ;|  \\||  /     \\ |  \\  /     \\ |  \\|:    ;  |  |   ;\n"
-      " `-' '   '' '       `'   `'       `'   ' `--' --'--'--' \n");
-
-    upd_iso_t* iso = upd_iso_new(1024*1024*8);
+    if (HEDLEY_LIKELY(index == 0)) {
+      printf(
+        ".   ..   ..--.  .    .--.     .    .   . .--. --.--.--. \n"
+        "|   ||\\  ||   )/ \\   |   )   / \\   |\\  |:    :  |  |   :\n"
+        "|   || \\ ||--'/___\\  |--'   /___\\  | \\ ||    |  |  |   |\n"
+        ":   ;|  \\||  /     \\ |  \\  /     \\ |  \\|:    ;  |  |   ;\n"
+        " `-' '   '' '       `'   `'       `'   ' `--' --'--'--' \n");
+    }
+
+    upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
     if (HEDLEY_UNLIKELY(iso == NULL)) {
       fprintf(stderr, "isolated machine creation failure\n");
-      return EXIT_FAILURE;
+      return false;
+    }
+    if (HEDLEY_UNLIKELY(!upd_iso_join(iso, group, index))) {
+      fprintf(stderr, "isolated machine failed to join shard group\n");
+
+      /* the loop stopped in advance only runs the teardown */
+      upd_iso_exit(iso, UPD_ISO_PANIC);
+      upd_iso_run(iso);
+      return false;
     }
 
     upd_iso_msgf(iso, "building isolated machine...\n");
@@ -37,7 +152,7 @@ int main(int argc, char** argv) {
       });
     if (HEDLEY_UNLIKELY(!config)) {
       fprintf(stderr, "configuration failure\n");
-      return EXIT_FAILURE;
+      return false;
     }
 
     const upd_iso_status_t status = upd_iso_run(iso);
@@ -45,15 +160,15 @@ int main(int argc, char** argv) {
     switch (status) {
     case UPD_ISO_PANIC:
       fprintf(stderr, "isolated machine panicked X(\n");
-      return EXIT_FAILURE;
+      return false;
 
     case UPD_ISO_RUNNING:
       printf("isolated machine has finished all jobs X3\n");
-      goto EXIT;
+      return true;
 
     case UPD_ISO_SHUTDOWN:
       printf("isolated machine exited gracefully X)\n");
-      goto EXIT;
+      return true;
 
     case UPD_ISO_REBOOT:
       continue;
@@ -63,13 +178,14 @@ int main(int argc, char** argv) {
       HEDLEY_UNREACHABLE();
     }
   }
-
-EXIT:
-  curl_global_cleanup();
-  return EXIT_SUCCESS;
 }
 
 
+static void shard_main_(void* udata) {
+  shard_t_* s = udata;
+  s->ok = shard_run_(s->group, s->index);
+}
+
 static void config_load_cb_(upd_config_load_t* load) {
   upd_iso_t* iso = load->iso;
 
@@ -0,0 +1,578 @@
+#include "common.h"
+
+
+#define LOG_PREFIX_ "upd.prefetch: "
+
+#define BATCH_    16     /* dirs per work */
+#define MAX_DIRS_ 65536  /* per mount */
+#define EXPIRE_   30000  /* ms */
+
+
+typedef struct key_t_  key_t_;
+typedef struct work_t_ work_t_;
+
+struct key_t_ {
+  const uint8_t* path;
+  size_t         len;
+};
+
+struct work_t_ {
+  upd_iso_t* iso;
+
+  size_t              n;
+  upd_prefetch_dir_t* dirs[BATCH_];
+};
+
+
+static
+bool
+prefetch_eq_(
+  const void* item,
+  const void* key);
+
+static
+upd_prefetch_dir_t*
+prefetch_find_(
+  upd_iso_t*     iso,
+  const uint8_t* path,
+  size_t         len,
+  uint64_t       hash);
+
+static
+bool
+prefetch_enqueue_(
+  upd_prefetch_t* m,
+  const uint8_t*  path,
+  size_t          len);
+
+static
+void
+prefetch_link_(
+  upd_iso_t*          iso,
+  upd_prefetch_dir_t* d,
+  bool                front);
+
+static
+void
+prefetch_unlink_(
+  upd_iso_t*          iso,
+  upd_prefetch_dir_t* d);
+
+static
+void
+prefetch_dispatch_(
+  upd_iso_t* iso);
+
+static
+void
+prefetch_cancel_(
+  upd_iso_t* iso);
+
+static
+void
+prefetch_deliver_(
+  upd_prefetch_dir_t* d);
+
+static
+void
+prefetch_release_(
+  upd_prefetch_dir_t* d);
+
+static
+bool
+prefetch_is_fresh_(
+  const upd_prefetch_dir_t* d);
+
+static
+void
+prefetch_finish_(
+  upd_prefetch_t* m);
+
+static
+void
+prefetch_drop_(
+  upd_prefetch_t* m);
+
+static
+void
+prefetch_close_(
+  upd_iso_t* iso);
+
+static
+void
+prefetch_scan_(
+  upd_prefetch_dir_t* d);
+
+
+static
+void
+prefetch_work_main_(
+  void* udata);
+
+static
+void
+prefetch_work_cb_(
+  upd_iso_t* iso,
+  void*      udata);
+
+static
+void
+prefetch_expire_cb_(
+  upd_iso_timeout_t* t);
+
+
+void upd_prefetch_deinit(upd_iso_t* iso) {
+  iso->prefetch.closing = true;
+  prefetch_cancel_(iso);
+  prefetch_close_(iso);
+}
+
+void upd_prefetch_mount(upd_iso_t* iso, const uint8_t* path, size_t len) {
+  if (HEDLEY_UNLIKELY(iso->prefetch.max == 0 || iso->prefetch.closing)) {
+    return;
+  }
+  const uint64_t hash = upd_hmap_hash_str(0, path, len);
+  if (prefetch_find_(iso, path, len, hash)) {
+    return;  /* a part of another mount */
+  }
+
+  upd_prefetch_t* m = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&m, sizeof(*m)+len+1))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"mount allocation failure\n");
+    return;
+  }
+  *m = (upd_prefetch_t) {
+    .iso = iso,
+    .expire = {
+      .udata = m,
+      .cb    = prefetch_expire_cb_,
+    },
+    .begin = uv_hrtime(),
+    .ndirs = 1,
+    .len   = len,
+  };
+  utf8ncpy(m->path, path, len);
+  m->path[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->prefetch.mounts, m, SIZE_MAX))) {
+    upd_free(&m);
+    upd_iso_msgf(iso, LOG_PREFIX_"mount insertion failure\n");
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!prefetch_enqueue_(m, path, len))) {
+    prefetch_finish_(m);
+    return;
+  }
+  prefetch_dispatch_(iso);
+}
+
+bool upd_prefetch_take(
+    upd_iso_t*        iso,
+    const uint8_t*    path,
+    size_t            len,
+    upd_prefetch_cb_t cb,
+    void*             udata) {
+  upd_prefetch_dir_t* d =
+    prefetch_find_(iso, path, len, upd_hmap_hash_str(0, path, len));
+  if (d == NULL || d->cb || d->state == UPD_PREFETCH_TAKEN) {
+    return false;
+  }
+
+  /* entries may be added or removed since the scan */
+  if (d->state == UPD_PREFETCH_DONE && !prefetch_is_fresh_(d)) {
+    prefetch_release_(d);
+    return false;
+  }
+  d->cb    = cb;
+  d->udata = udata;
+
+  switch (d->state) {
+  case UPD_PREFETCH_QUEUED:
+    /* someone is waiting, so it goes ahead of others */
+    prefetch_unlink_(iso, d);
+    prefetch_link_(iso, d, true);
+    break;
+  case UPD_PREFETCH_DONE:
+    prefetch_deliver_(d);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+
+static bool prefetch_eq_(const void* item, const void* key) {
+  const upd_prefetch_dir_t* d = item;
+  const key_t_*             k = key;
+  return upd_streq(d->path, d->len, k->path, k->len);
+}
+
+static upd_prefetch_dir_t* prefetch_find_(
+    upd_iso_t* iso, const uint8_t* path, size_t len, uint64_t hash) {
+  const key_t_ k = {
+    .path = path,
+    .len  = len,
+  };
+  return upd_hmap_find(&iso->prefetch.map, hash, prefetch_eq_, &k);
+}
+
+static bool prefetch_enqueue_(
+    upd_prefetch_t* m, const uint8_t* path, size_t len) {
+  upd_iso_t* iso = m->iso;
+
+  if (HEDLEY_UNLIKELY(m->dirs.n >= MAX_DIRS_)) {
+    return false;
+  }
+  const uint64_t hash = upd_hmap_hash_str(0, path, len);
+  if (HEDLEY_UNLIKELY(prefetch_find_(iso, path, len, hash))) {
+    return false;
+  }
+
+  upd_prefetch_dir_t* d = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&d, sizeof(*d)+len+1))) {
+    return false;
+  }
+  *d = (upd_prefetch_dir_t) {
+    .mount = m,
+    .hash  = hash,
+    .state = UPD_PREFETCH_QUEUED,
+    .len   = len,
+  };
+  utf8ncpy(d->path, path, len);
+  d->path[len] = 0;
+
+  if (HEDLEY_UNLIKELY(!upd_hmap_insert(&iso->prefetch.map, hash, d))) {
+    upd_free(&d);
+    return false;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&m->dirs, d, SIZE_MAX))) {
+    upd_hmap_remove(&iso->prefetch.map, hash, upd_hmap_eq_ptr, d);
+    upd_free(&d);
+    return false;
+  }
+  prefetch_link_(iso, d, false);
+  ++m->running;
+  return true;
+}
+
+static void prefetch_link_(
+    upd_iso_t* iso, upd_prefetch_dir_t* d, bool front) {
+  if (front) {
+    d->prev = NULL;
+    d->next = iso->prefetch.head;
+    if (d->next) {
+      d->next->prev = d;
+    } else {
+      iso->prefetch.tail = d;
+    }
+    iso->prefetch.head = d;
+  } else {
+    d->prev = iso->prefetch.tail;
+    d->next = NULL;
+    if (d->prev) {
+      d->prev->next = d;
+    } else {
+      iso->prefetch.head = d;
+    }
+    iso->prefetch.tail = d;
+  }
+}
+
+static void prefetch_unlink_(upd_iso_t* iso, upd_prefetch_dir_t* d) {
+  if (d->prev) {
+    d->prev->next = d->next;
+  } else {
+    iso->prefetch.head = d->next;
+  }
+  if (d->next) {
+    d->next->prev = d->prev;
+  } else {
+    iso->prefetch.tail = d->prev;
+  }
+  d->prev = NULL;
+  d->next = NULL;
+}
+
+static void prefetch_dispatch_(upd_iso_t* iso) {
+  while (iso->prefetch.works < iso->prefetch.max && iso->prefetch.head) {
+    work_t_* w = upd_iso_stack(iso, sizeof(*w));
+    if (HEDLEY_UNLIKELY(w == NULL)) {
+      upd_iso_msgf(iso, LOG_PREFIX_"work allocation failure\n");
+      goto ABORT;
+    }
+    *w = (work_t_) { .iso = iso, };
+
+    while (w->n < BATCH_ && iso->prefetch.head) {
+      upd_prefetch_dir_t* d = iso->prefetch.head;
+      prefetch_unlink_(iso, d);
+      d->state = UPD_PREFETCH_RUNNING;
+      w->dirs[w->n++] = d;
+    }
+
+    if (HEDLEY_UNLIKELY(!upd_iso_start_work(
+        iso, prefetch_work_main_, prefetch_work_cb_, w))) {
+      for (size_t i = w->n; i > 0;) {
+        upd_prefetch_dir_t* d = w->dirs[--i];
+        d->state = UPD_PREFETCH_QUEUED;
+        prefetch_link_(iso, d, true);
+      }
+      upd_iso_unstack(iso, w);
+      upd_iso_msgf(iso, LOG_PREFIX_"work start failure\n");
+      goto ABORT;
+    }
+    ++iso->prefetch.works;
+  }
+  return;
+
+ABORT:
+  /* nothing would dispatch them again */
+  if (HEDLEY_UNLIKELY(iso->prefetch.works == 0)) {
+    prefetch_cancel_(iso);
+  }
+}
+
+static void prefetch_cancel_(upd_iso_t* iso) {
+  while (iso->prefetch.head) {
+    upd_prefetch_dir_t* d = iso->prefetch.head;
+    prefetch_unlink_(iso, d);
+
+    d->state  = UPD_PREFETCH_DONE;
+    d->result = UV_ECANCELED;
+    --d->mount->running;
+    if (d->cb) {
+      prefetch_deliver_(d);
+    }
+  }
+  if (HEDLEY_UNLIKELY(iso->prefetch.closing)) {
+    return;
+  }
+  for (size_t i = 0; i < iso->prefetch.mounts.n; ++i) {
+    upd_prefetch_t* m = iso->prefetch.mounts.p[i];
+    if (m->running == 0 && m->end == 0) {
+      prefetch_finish_(m);
+    }
+  }
+}
+
+static void prefetch_deliver_(upd_prefetch_dir_t* d) {
+  upd_prefetch_cb_t cb = d->cb;
+  d->cb    = NULL;
+  d->state = UPD_PREFETCH_TAKEN;
+
+  cb(d, d->udata);
+  prefetch_release_(d);
+}
+
+static void prefetch_release_(upd_prefetch_dir_t* d) {
+  upd_prefetch_t* m = d->mount;
+
+  d->state = UPD_PREFETCH_TAKEN;
+  ++m->taken;
+
+  free(d->ents);
+  d->ents = NULL;
+  d->n    = 0;
+
+  if (HEDLEY_UNLIKELY(m->end && m->taken == m->dirs.n)) {
+    upd_iso_timeout_stop(m->iso, &m->expire);
+    prefetch_drop_(m);
+  }
+}
+
+static bool prefetch_is_fresh_(const upd_prefetch_dir_t* d) {
+  if (HEDLEY_UNLIKELY(d->result < 0 || d->ino == 0)) {
+    return false;
+  }
+
+  uv_fs_t          req;
+  const int        err = uv_fs_lstat(NULL, &req, (char*) d->path, NULL);
+  const uv_stat_t* st  = &req.statbuf;
+  const bool fresh =
+    err >= 0                                &&
+    st->st_ino          == d->ino           &&
+    st->st_mtim.tv_sec  == d->mtime.tv_sec  &&
+    st->st_mtim.tv_nsec == d->mtime.tv_nsec &&
+    st->st_ctim.tv_sec  == d->ctime.tv_sec  &&
+    st->st_ctim.tv_nsec == d->ctime.tv_nsec;
+  uv_fs_req_cleanup(&req);
+  return fresh;
+}
+
+static void prefetch_finish_(upd_prefetch_t* m) {
+  upd_iso_t* iso = m->iso;
+
+  m->end = uv_hrtime();
+  upd_iso_msgf(iso, LOG_PREFIX_
+    "mounted '%s' (%"PRIu64" dirs, %"PRIu64" files) in %"PRIu64" ms\n",
+    m->path, m->ndirs, m->nfiles, (m->end - m->begin) / 1000000);
+
+  if (m->taken == m->dirs.n) {
+    prefetch_drop_(m);
+  } else {
+    upd_iso_timeout_start(iso, &m->expire, EXPIRE_);
+  }
+}
+
+static void prefetch_drop_(upd_prefetch_t* m) {
+  upd_iso_t* iso = m->iso;
+
+  for (size_t i = 0; i < m->dirs.n; ++i) {
+    upd_prefetch_dir_t* d = m->dirs.p[i];
+    assert(d->state != UPD_PREFETCH_RUNNING);
+    assert(d->cb == NULL);
+
+    if (HEDLEY_UNLIKELY(d->state == UPD_PREFETCH_QUEUED)) {
+      prefetch_unlink_(iso, d);
+    }
+    upd_hmap_remove(&iso->prefetch.map, d->hash, upd_hmap_eq_ptr, d);
+    free(d->ents);
+    upd_free(&d);
+  }
+  upd_array_clear(&m->dirs);
+}
+
+static void prefetch_close_(upd_iso_t* iso) {
+  for (size_t i = iso->prefetch.mounts.n; i > 0;) {
+    upd_prefetch_t* m = iso->prefetch.mounts.p[--i];
+    if (HEDLEY_UNLIKELY(m->running)) {
+      continue;  /* waits for works in flight */
+    }
+    upd_iso_timeout_stop(iso, &m->expire);
+    prefetch_drop_(m);
+    upd_array_remove(&iso->prefetch.mounts, i);
+    upd_free(&m);
+  }
+  if (iso->prefetch.mounts.n == 0) {
+    upd_array_clear(&iso->prefetch.mounts);
+    upd_hmap_clear(&iso->prefetch.map);
+  }
+}
+
+/*  Runs on the threadpool, where upd_malloc and upd_free have no
+ * guarantee of thread safety, so buffers come from malloc and ents
+ * are released by free on the loop thread. */
+static void prefetch_scan_(upd_prefetch_dir_t* d) {
+  uv_fs_t req;
+
+  /* taken before the scan, so that changes during it are noticed */
+  if (HEDLEY_LIKELY(0 <= uv_fs_lstat(NULL, &req, (char*) d->path, NULL))) {
+    d->ino   = req.statbuf.st_ino;
+    d->mtime = req.statbuf.st_mtim;
+    d->ctime = req.statbuf.st_ctim;
+  }
+  uv_fs_req_cleanup(&req);
+
+  const int n = uv_fs_scandir(NULL, &req, (char*) d->path, 0, NULL);
+  if (HEDLEY_UNLIKELY(n < 0)) {
+    d->result = n;
+    uv_fs_req_cleanup(&req);
+    return;
+  }
+
+  uv_dirent_t* temp = n? malloc(sizeof(*temp)*n): NULL;
+  if (HEDLEY_UNLIKELY(n && temp == NULL)) {
+    d->result = UV_ENOMEM;
+    goto EXIT;
+  }
+
+  size_t m = 0, total = 0;
+  while (m < (size_t) n && 0 <= uv_fs_scandir_next(&req, &temp[m])) {
+    total += strlen(temp[m].name)+1;
+    ++m;
+  }
+
+  if (m) {
+    d->ents = malloc(sizeof(*d->ents)*m + total);
+    if (HEDLEY_UNLIKELY(d->ents == NULL)) {
+      d->result = UV_ENOMEM;
+      goto EXIT;
+    }
+    char* names = (char*) (d->ents + m);
+    for (size_t i = 0; i < m; ++i) {
+      const size_t len = strlen(temp[i].name);
+      memcpy(names, temp[i].name, len+1);
+      d->ents[i] = (uv_dirent_t) {
+        .name = names,
+        .type = temp[i].type,
+      };
+      names += len+1;
+    }
+  }
+  d->n      = m;
+  d->result = (int) m;
+
+EXIT:
+  free(temp);
+  uv_fs_req_cleanup(&req);
+}
+
+
+static void prefetch_work_main_(void* udata) {
+  work_t_* w = udata;
+  for (size_t i = 0; i < w->n; ++i) {
+    prefetch_scan_(w->dirs[i]);
+  }
+}
+
+static void prefetch_work_cb_(upd_iso_t* iso, void* udata) {
+  work_t_* w = udata;
+
+  --iso->prefetch.works;
+
+  /* dirs can be dropped on delivery, but mounts live until closing */
+  upd_prefetch_t* mounts[BATCH_];
+  for (size_t i = 0; i < w->n; ++i) {
+    mounts[i] = w->dirs[i]->mount;
+  }
+
+  for (size_t i = 0; i < w->n; ++i) {
+    upd_prefetch_dir_t* d = w->dirs[i];
+    upd_prefetch_t*     m = mounts[i];
+
+    d->state = UPD_PREFETCH_DONE;
+    --m->running;
+
+    /* children are known before the waiter mounts them */
+    for (size_t j = 0; !iso->prefetch.closing && j < d->n; ++j) {
+      const uv_dirent_t* e = &d->ents[j];
+      if (e->type == UV_DIRENT_FILE) {
+        ++m->nfiles;
+        continue;
+      }
+      if (e->type != UV_DIRENT_DIR) {
+        continue;
+      }
+      ++m->ndirs;
+
+      uint8_t path[UPD_PATH_MAX];
+      const size_t len = cwk_path_join(
+        (char*) d->path, e->name, (char*) path, sizeof(path));
+      if (HEDLEY_LIKELY(len < sizeof(path))) {
+        prefetch_enqueue_(m, path, len);
+      }
+    }
+    if (d->cb) {
+      prefetch_deliver_(d);
+    }
+  }
+
+  for (size_t i = 0; i < w->n; ++i) {
+    upd_prefetch_t* m = mounts[i];
+    if (m->running == 0 && m->end == 0 && !iso->prefetch.closing) {
+      prefetch_finish_(m);
+    }
+  }
+  upd_iso_unstack(iso, w);
+
+  if (HEDLEY_UNLIKELY(iso->prefetch.closing)) {
+    prefetch_close_(iso);
+    return;
+  }
+  prefetch_dispatch_(iso);
+}
+
+static void prefetch_expire_cb_(upd_iso_timeout_t* t) {
+  upd_prefetch_t* m = t->udata;
+  prefetch_drop_(m);
+}
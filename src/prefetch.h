@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Recursive prefetch of directory trees mounted by syncdir.
+ * Starting from the root of a mount, directories are scanned on the
+ * threadpool in batches, with at most UPD_PREFETCH (4 by default, 0
+ * disables) works in flight per isolate. Results are kept by npath
+ * until taken by the syncdir mounted there, so nested syncdirs are
+ * synced without waiting for their own scandir one after another.
+ * Results which nobody takes are dropped a while after the mount
+ * finishes, and each mount is left as a record of its cost. */
+
+
+#define UPD_PREFETCH_DEFAULT 4
+
+
+typedef
+void
+(*upd_prefetch_cb_t)(
+  upd_prefetch_dir_t* dir,
+  void*               udata);
+
+
+struct upd_prefetch_t {
+  upd_iso_t* iso;
+
+  upd_iso_timeout_t expire;
+  upd_array_of(upd_prefetch_dir_t*) dirs;
+
+  uint64_t begin;  /* hrtime */
+  uint64_t end;    /* hrtime, 0 while running */
+
+  size_t   running;  /* dirs queued or in flight */
+  uint64_t ndirs;
+  uint64_t nfiles;
+  uint64_t taken;
+
+  size_t  len;
+  uint8_t path[];
+};
+
+struct upd_prefetch_dir_t {
+  upd_prefetch_t* mount;
+
+  /* FIFO of dirs waiting for a work */
+  upd_prefetch_dir_t* prev;
+  upd_prefetch_dir_t* next;
+
+  /* written by the worker, ents is from malloc (not upd_malloc) */
+  int          result;
+  uv_dirent_t* ents;
+  size_t       n;
+
+  /* the dir stat just before the scan, ino is 0 if unknown */
+  uint64_t      ino;
+  uv_timespec_t mtime;
+  uv_timespec_t ctime;
+
+  void*             udata;
+  upd_prefetch_cb_t cb;  /* who waits for the result */
+
+  uint64_t hash;
+  enum {
+    UPD_PREFETCH_QUEUED,
+    UPD_PREFETCH_RUNNING,
+    UPD_PREFETCH_DONE,
+    UPD_PREFETCH_TAKEN,
+  } state;
+
+  size_t  len;
+  uint8_t path[];
+};
+
+
+HEDLEY_NON_NULL(1)
+void
+upd_prefetch_deinit(
+  upd_iso_t* iso);
+
+/*  Starts prefetching the tree under the path unless it's already
+ * known as a part of another mount. */
+HEDLEY_NON_NULL(1, 2)
+void
+upd_prefetch_mount(
+  upd_iso_t*     iso,
+  const uint8_t* path,
+  size_t         len);
+
+/*  Returns false if the path is not prefetched, otherwise the callback is
+ * called with the result, immediately if it's ready. The result is
+ * valid only until the callback returns. A ready result is dropped and
+ * false is returned when the dir has been modified since the scan,
+ * which is checked by a synchronous lstat. */
+HEDLEY_NON_NULL(1, 2, 4)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_prefetch_take(
+  upd_iso_t*        iso,
+  const uint8_t*    path,
+  size_t            len,
+  upd_prefetch_cb_t cb,
+  void*             udata);
@@ -0,0 +1,166 @@
+#include "common.h"
+
+
+#define LOG_PREFIX_ "upd.trace: "
+
+#define LINE_MAX_ 256
+
+
+static
+size_t
+trace_get_capacity_(
+  void);
+
+static
+bool
+trace_write_file_(
+  void*       udata,
+  const char* str,
+  size_t      len);
+
+
+#if defined(SIGUSR1)
+static
+void
+trace_signal_cb_(
+  uv_signal_t* sig,
+  int          signum);
+#endif
+
+
+bool upd_trace_init(upd_iso_t* iso) {
+  iso->trace.sig.data = iso;
+  if (HEDLEY_UNLIKELY(0 > uv_signal_init(&iso->loop, &iso->trace.sig))) {
+    return false;
+  }
+  uv_unref((uv_handle_t*) &iso->trace.sig);
+
+  const size_t cap = trace_get_capacity_();
+  if (HEDLEY_LIKELY(cap == 0)) {
+    return true;
+  }
+  if (HEDLEY_UNLIKELY(!upd_malloc(&iso->trace.ring, sizeof(*iso->trace.ring)*cap))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"ring allocation failure, tracing is disabled\n");
+    return true;
+  }
+  iso->trace.cap  = cap;
+  iso->trace.base = uv_hrtime();
+
+#if defined(SIGUSR1)
+  if (HEDLEY_UNLIKELY(0 > uv_signal_start(&iso->trace.sig, trace_signal_cb_, SIGUSR1))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"SIGUSR1 is unavailable, use /sys/upd.trace\n");
+  }
+#endif
+  upd_iso_msgf(iso, LOG_PREFIX_"recording last %zu events\n", cap);
+  return true;
+}
+
+void upd_trace_deinit(upd_iso_t* iso) {
+  uv_close((uv_handle_t*) &iso->trace.sig, NULL);
+
+  /* events emitted while closing are ignored */
+  upd_free(&iso->trace.ring);
+  iso->trace.cap = 0;
+  iso->trace.n   = 0;
+}
+
+void upd_trace_record_(
+    upd_iso_t*        iso,
+    const char*       name,
+    char              phase,
+    const void*       id,
+    const upd_file_t* f,
+    uint64_t          arg) {
+  iso->trace.ring[iso->trace.head] = (upd_trace_event_t) {
+    .name  = name,
+    .ts    = uv_hrtime(),
+    .id    = (uintptr_t) id,
+    .file  = f? f->id: 0,
+    .arg   = arg,
+    .phase = phase,
+  };
+  iso->trace.head = (iso->trace.head+1) % iso->trace.cap;
+  if (HEDLEY_LIKELY(iso->trace.n < iso->trace.cap)) {
+    ++iso->trace.n;
+  }
+}
+
+bool upd_trace_dump(upd_iso_t* iso, upd_trace_write_t write, void* udata) {
+  if (HEDLEY_UNLIKELY(!write(udata, "[\n", 2))) {
+    return false;
+  }
+
+  /* the ring starts from the head once it's filled */
+  const size_t n     = iso->trace.n;
+  const size_t first = n < iso->trace.cap? 0: iso->trace.head;
+  for (size_t i = 0; i < n; ++i) {
+    const upd_trace_event_t* e =
+      &iso->trace.ring[(first+i) % iso->trace.cap];
+
+    const uint64_t ns = e->ts - iso->trace.base;
+
+    char line[LINE_MAX_];
+    const int len = snprintf(line, sizeof(line),
+      "%s{\"name\":\"%s\",\"cat\":\"upd\",\"ph\":\"%c\","
+      "\"ts\":%"PRIu64".%03"PRIu64",\"pid\":%zu,\"tid\":0,"
+      "\"id\":\"0x%"PRIxPTR"\","
+      "\"args\":{\"file\":%"PRIu64",\"arg\":%"PRIu64"}}",
+      i? ",\n": "",
+      e->name, e->phase,
+      ns/1000, ns%1000, iso->shard.index,
+      e->id,
+      e->file, e->arg);
+    if (HEDLEY_UNLIKELY(len < 0 || (size_t) len >= sizeof(line))) {
+      continue;
+    }
+    if (HEDLEY_UNLIKELY(!write(udata, line, len))) {
+      return false;
+    }
+  }
+  return write(udata, "\n]\n", 3);
+}
+
+
+static size_t trace_get_capacity_(void) {
+  const char* env = getenv("UPD_TRACE");
+  if (HEDLEY_LIKELY(env == NULL || env[0] == 0)) {
+    return 0;
+  }
+  return strtoull(env, NULL, 10);
+}
+
+static bool trace_write_file_(void* udata, const char* str, size_t len) {
+  FILE* fp = udata;
+  return fwrite(str, 1, len, fp) == len;
+}
+
+
+#if defined(SIGUSR1)
+static void trace_signal_cb_(uv_signal_t* sig, int signum) {
+  upd_iso_t* iso = sig->data;
+  (void) signum;
+
+  char path[UPD_PATH_MAX];
+  const int len = snprintf(path, sizeof(path),
+    "%s/upd-trace-%zu.json", (const char*) iso->path.working, iso->shard.index);
+  if (HEDLEY_UNLIKELY(len < 0 || (size_t) len >= sizeof(path))) {
+    upd_iso_msgf(iso, LOG_PREFIX_"too long dump path\n");
+    return;
+  }
+
+  /* blocks the loop, but it's only for debugging */
+  FILE* fp = fopen(path, "w");
+  if (HEDLEY_UNLIKELY(fp == NULL)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"failed to open %s\n", path);
+    return;
+  }
+  const bool ok = upd_trace_dump(iso, trace_write_file_, fp);
+  fclose(fp);
+
+  if (HEDLEY_UNLIKELY(!ok)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"failed to write %s\n", path);
+    return;
+  }
+  upd_iso_msgf(iso, LOG_PREFIX_"dumped %zu events to %s\n", iso->trace.n, path);
+}
+#endif
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Opt-in tracer recording spans into a per-isolate ring buffer.
+ * Setting UPD_TRACE to the ring capacity (number of events) enables it,
+ * and the ring is dumped as Chrome trace-event JSON on SIGUSR1 or by
+ * reading /sys/upd.trace. Spans are recorded as async events keyed by
+ * a pointer, because they may overlap on the single loop thread.
+ * While disabled, each trace point costs one branch. */
+
+
+#define UPD_TRACE_BEGIN   'b'
+#define UPD_TRACE_END     'e'
+#define UPD_TRACE_INSTANT 'n'
+
+
+struct upd_trace_event_t {
+  const char*   name;  /* must be a static string */
+  uint64_t      ts;    /* hrtime */
+  uintptr_t     id;
+  upd_file_id_t file;
+  uint64_t      arg;
+  char          phase;
+};
+
+typedef
+bool
+(*upd_trace_write_t)(
+  void*       udata,
+  const char* str,
+  size_t      len);
+
+
+HEDLEY_NON_NULL(1)
+bool
+upd_trace_init(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1)
+void
+upd_trace_deinit(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1, 2)
+void
+upd_trace_record_(
+  upd_iso_t*        iso,
+  const char*       name,
+  char              phase,
+  const void*       id,
+  const upd_file_t* f,
+  uint64_t          arg);
+
+/* Writes all recorded events in Chrome trace-event JSON. */
+HEDLEY_NON_NULL(1, 2)
+bool
+upd_trace_dump(
+  upd_iso_t*        iso,
+  upd_trace_write_t write,
+  void*             udata);
+
+
+HEDLEY_NON_NULL(1, 2)
+static inline void upd_trace(
+    upd_iso_t*        iso,
+    const char*       name,
+    char              phase,
+    const void*       id,
+    const upd_file_t* f,
+    uint64_t          arg) {
+  if (HEDLEY_UNLIKELY(iso->trace.ring)) {
+    upd_trace_record_(iso, name, phase, id, f, arg);
+  }
+}
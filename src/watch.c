@@ -0,0 +1,612 @@
+#include "common.h"
+
+
+#define LOG_PREFIX_ "upd.watch: "
+
+#define POLL_INTERVAL_ 1500
+
+
+static
+bool
+watch_is_dir_(
+  const upd_driver_t* d);
+
+static
+int
+watch_cmp_(
+  const uint8_t* a,
+  size_t         alen,
+  const uint8_t* b,
+  size_t         blen);
+
+static
+size_t
+watch_lower_bound_(
+  upd_watch_t*   w,
+  const uint8_t* name,
+  size_t         len);
+
+static
+upd_watch_t*
+watch_get_(
+  upd_iso_t*     iso,
+  const uint8_t* path,
+  size_t         len);
+
+static
+bool
+watch_poll_(
+  upd_watch_sub_t* sub);
+
+static
+void
+watch_mark_(
+  upd_watch_sub_t* sub);
+
+static
+void
+watch_rearm_(
+  upd_watch_t* w);
+
+static
+void
+watch_stat_(
+  upd_watch_sub_t* sub);
+
+static
+void
+watch_note_(
+  upd_watch_sub_t* sub,
+  const uint8_t*   name,
+  size_t           len);
+
+
+static
+void
+watch_event_cb_(
+  uv_fs_event_t* ev,
+  const char*    filename,
+  int            events,
+  int            status);
+
+static
+void
+watch_check_cb_(
+  uv_check_t* check);
+
+static
+void
+watch_stat_cb_(
+  uv_fs_t* fsreq);
+
+static
+void
+watch_poll_cb_(
+  uv_fs_poll_t*    poll,
+  int              status,
+  const uv_stat_t* prev,
+  const uv_stat_t* curr);
+
+static
+void
+watch_close_cb_(
+  uv_handle_t* handle);
+
+static
+void
+watch_handle_close_cb_(
+  uv_handle_t* handle);
+
+
+bool upd_watch_init(upd_iso_t* iso) {
+  iso->watch.check = (uv_check_t) { .data = iso, };
+  if (HEDLEY_UNLIKELY(0 > uv_check_init(&iso->loop, &iso->watch.check))) {
+    return false;
+  }
+  uv_unref((uv_handle_t*) &iso->watch.check);
+  return true;
+}
+
+void upd_watch_deinit(upd_iso_t* iso) {
+  assert(iso->watch.dirs.n == 0);
+  assert(iso->watch.dirty  == NULL);
+
+  uv_close((uv_handle_t*) &iso->watch.check, NULL);
+  upd_array_clear(&iso->watch.dirs);
+}
+
+bool upd_watch_start(upd_watch_sub_t* sub, upd_file_t* f) {
+  upd_iso_t* iso = f->iso;
+
+  *sub = (upd_watch_sub_t) {
+    .file   = f,
+    .exists = true,
+  };
+
+  const uint8_t* dir    = f->npath;
+  size_t         dirlen = f->npathlen;
+  if (!watch_is_dir_(f->driver)) {
+    const char* base;
+    size_t      baselen;
+    cwk_path_get_basename((char*) f->npath, &base, &baselen);
+    if (HEDLEY_UNLIKELY(base == NULL)) {
+      goto POLL;
+    }
+    sub->name = (uint8_t*) base;
+    sub->len  = baselen;
+
+    dirlen = (uint8_t*) base - f->npath;
+    while (dirlen > 1 && (dir[dirlen-1] == '/' || dir[dirlen-1] == '\\')) {
+      --dirlen;
+    }
+    if (HEDLEY_UNLIKELY(dirlen == 0)) {
+      dir    = (uint8_t*) ".";
+      dirlen = 1;
+    }
+  }
+
+  upd_watch_t* w = watch_get_(iso, dir, dirlen);
+  if (HEDLEY_UNLIKELY(w == NULL)) {
+    goto POLL;
+  }
+
+  const size_t i = watch_lower_bound_(w, sub->name, sub->len);
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&w->subs, sub, i))) {
+    if (HEDLEY_UNLIKELY(w->subs.n == 0)) {
+      upd_array_find_and_remove(&iso->watch.dirs, w);
+      uv_close((uv_handle_t*) &w->uv, watch_close_cb_);
+    }
+    sub->file = NULL;
+    return false;
+  }
+  sub->dir = w;
+  return true;
+
+POLL:
+  if (HEDLEY_UNLIKELY(!watch_poll_(sub))) {
+    sub->file = NULL;
+    return false;
+  }
+  return true;
+}
+
+void upd_watch_stop(upd_watch_sub_t* sub) {
+  upd_file_t* f = sub->file;
+  if (HEDLEY_UNLIKELY(f == NULL)) {
+    return;
+  }
+  upd_iso_t* iso = f->iso;
+
+  /* stat in flight holds the file, so it never dangles */
+  assert(!sub->stating);
+
+  if (sub->poll) {
+    uv_fs_poll_stop(sub->poll);
+    uv_close((uv_handle_t*) sub->poll, watch_handle_close_cb_);
+    sub->poll = NULL;
+  }
+
+  if (sub->dirty) {
+    if (sub->prev) {
+      sub->prev->next = sub->next;
+    } else {
+      iso->watch.dirty = sub->next;
+    }
+    if (sub->next) {
+      sub->next->prev = sub->prev;
+    }
+  }
+
+  upd_watch_t* w = sub->dir;
+  if (w) {
+    size_t i = watch_lower_bound_(w, sub->name, sub->len);
+    while (i < w->subs.n && w->subs.p[i] != sub) {
+      ++i;
+    }
+    assert(i < w->subs.n);
+    upd_array_remove(&w->subs, i);
+
+    if (w->subs.n == 0) {
+      upd_array_find_and_remove(&iso->watch.dirs, w);
+      uv_fs_event_stop(&w->uv);
+      uv_close((uv_handle_t*) &w->uv, watch_close_cb_);
+    }
+  }
+  upd_free(&sub->change);
+  *sub = (upd_watch_sub_t) {0};
+}
+
+bool upd_watch_take_change(upd_watch_sub_t* sub, uint8_t** name, size_t* len) {
+  const bool one = sub->change && !sub->changes;
+  if (HEDLEY_LIKELY(one)) {
+    *name = sub->change;
+    *len  = sub->changelen;
+  } else {
+    upd_free(&sub->change);
+  }
+  sub->change    = NULL;
+  sub->changelen = 0;
+  sub->changes   = false;
+  return one;
+}
+
+
+static bool watch_is_dir_(const upd_driver_t* d) {
+  for (const upd_req_cat_t* c = d->cats; *c; ++c) {
+    if (*c == UPD_REQ_DIR) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static int watch_cmp_(
+    const uint8_t* a, size_t alen, const uint8_t* b, size_t blen) {
+  const size_t n = alen < blen? alen: blen;
+
+  const int c = n? memcmp(a, b, n): 0;
+  if (c) {
+    return c;
+  }
+  return alen < blen? -1: alen > blen? 1: 0;
+}
+
+static size_t watch_lower_bound_(
+    upd_watch_t* w, const uint8_t* name, size_t len) {
+  size_t l = 0, r = w->subs.n;
+  while (l < r) {
+    const size_t i = (l+r)/2;
+
+    const upd_watch_sub_t* s = w->subs.p[i];
+    if (watch_cmp_(s->name, s->len, name, len) < 0) {
+      l = i+1;
+    } else {
+      r = i;
+    }
+  }
+  return l;
+}
+
+static upd_watch_t* watch_get_(
+    upd_iso_t* iso, const uint8_t* path, size_t len) {
+  size_t l = 0, r = iso->watch.dirs.n;
+  while (l < r) {
+    const size_t i = (l+r)/2;
+
+    upd_watch_t* w = iso->watch.dirs.p[i];
+    const int c = watch_cmp_(w->path, w->len, path, len);
+    if (HEDLEY_UNLIKELY(c == 0)) {
+      return w;
+    }
+    if (c < 0) {
+      l = i+1;
+    } else {
+      r = i;
+    }
+  }
+
+  upd_watch_t* w = NULL;
+  if (HEDLEY_UNLIKELY(!upd_malloc(&w, sizeof(*w)+len+1))) {
+    return NULL;
+  }
+  *w = (upd_watch_t) {
+    .uv   = { .data = w, },
+    .iso  = iso,
+    .path = (uint8_t*) (w+1),
+    .len  = len,
+  };
+  utf8ncpy(w->path, path, len);
+  w->path[len] = 0;
+
+  if (HEDLEY_UNLIKELY(0 > uv_fs_event_init(&iso->loop, &w->uv))) {
+    upd_free(&w);
+    return NULL;
+  }
+  uv_unref((uv_handle_t*) &w->uv);
+
+  const int start =
+    uv_fs_event_start(&w->uv, watch_event_cb_, (char*) w->path, 0);
+  if (HEDLEY_UNLIKELY(0 > start)) {
+    uv_close((uv_handle_t*) &w->uv, watch_close_cb_);
+    return NULL;
+  }
+  if (HEDLEY_UNLIKELY(!upd_array_insert(&iso->watch.dirs, w, l))) {
+    uv_fs_event_stop(&w->uv);
+    uv_close((uv_handle_t*) &w->uv, watch_close_cb_);
+    return NULL;
+  }
+  return w;
+}
+
+static bool watch_poll_(upd_watch_sub_t* sub) {
+  upd_file_t* f   = sub->file;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(!upd_malloc(&sub->poll, sizeof(*sub->poll)))) {
+    goto ABORT;
+  }
+  *sub->poll = (uv_fs_poll_t) { .data = sub, };
+  if (HEDLEY_UNLIKELY(0 > uv_fs_poll_init(&iso->loop, sub->poll))) {
+    upd_free(&sub->poll);
+    goto ABORT;
+  }
+  uv_unref((uv_handle_t*) sub->poll);
+
+  const bool start = 0 <= uv_fs_poll_start(
+    sub->poll, watch_poll_cb_, (char*) f->npath, POLL_INTERVAL_);
+  if (HEDLEY_UNLIKELY(!start)) {
+    uv_close((uv_handle_t*) sub->poll, watch_handle_close_cb_);
+    sub->poll = NULL;
+    goto ABORT;
+  }
+  ++iso->watch.fallbacks;
+  return true;
+
+ABORT:
+  return false;
+}
+
+static void watch_mark_(upd_watch_sub_t* sub) {
+  upd_iso_t* iso = sub->file->iso;
+
+  if (sub->dirty) {
+    return;
+  }
+  sub->dirty = true;
+  sub->prev  = NULL;
+  sub->next  = iso->watch.dirty;
+  if (sub->next) {
+    sub->next->prev = sub;
+  }
+  iso->watch.dirty = sub;
+
+  uv_check_start(&iso->watch.check, watch_check_cb_);
+}
+
+static void watch_rearm_(upd_watch_t* w) {
+  upd_iso_t* iso = w->iso;
+
+  w->rearm = false;
+
+  /* events may be lost meanwhile */
+  for (size_t i = 0; i < w->subs.n; ++i) {
+    watch_mark_(w->subs.p[i]);
+  }
+
+  /* the inotify watch dies with the inode, so starts again on the path */
+  uv_fs_event_stop(&w->uv);
+  const int start =
+    uv_fs_event_start(&w->uv, watch_event_cb_, (char*) w->path, 0);
+  if (HEDLEY_LIKELY(0 <= start)) {
+    return;
+  }
+
+  upd_iso_msgf(iso,
+    LOG_PREFIX_"lost '%s', falls back to polling\n", (char*) w->path);
+  upd_array_find_and_remove(&iso->watch.dirs, w);
+  for (size_t i = 0; i < w->subs.n; ++i) {
+    upd_watch_sub_t* sub = w->subs.p[i];
+    sub->dir = NULL;
+    if (HEDLEY_UNLIKELY(!watch_poll_(sub))) {
+      upd_iso_msgf(iso,
+        LOG_PREFIX_"'%s' is no longer watched\n", (char*) sub->file->npath);
+    }
+  }
+  uv_close((uv_handle_t*) &w->uv, watch_close_cb_);
+}
+
+static void watch_stat_(upd_watch_sub_t* sub) {
+  upd_file_t* f   = sub->file;
+  upd_iso_t*  iso = f->iso;
+
+  if (HEDLEY_UNLIKELY(sub->stating)) {
+    sub->restat = true;
+    return;
+  }
+
+  uv_fs_t* fsreq = upd_iso_stack(iso, sizeof(*fsreq));
+  if (HEDLEY_UNLIKELY(fsreq == NULL)) {
+    upd_iso_msgf(iso, LOG_PREFIX_"stat req allocation failure\n");
+    return;
+  }
+  *fsreq = (uv_fs_t) { .data = sub, };
+
+  const int err =
+    uv_fs_stat(&iso->loop, fsreq, (char*) f->npath, watch_stat_cb_);
+  if (HEDLEY_UNLIKELY(0 > err)) {
+    upd_iso_unstack(iso, fsreq);
+    upd_iso_msgf(iso, LOG_PREFIX_"stat failure\n");
+    return;
+  }
+  sub->stating = true;
+  upd_file_ref(f);
+}
+
+static void watch_note_(
+    upd_watch_sub_t* sub, const uint8_t* name, size_t len) {
+  if (HEDLEY_UNLIKELY(sub->changes)) {
+    return;
+  }
+  if (HEDLEY_UNLIKELY(name == NULL)) {
+    goto UNKNOWN;
+  }
+  if (sub->change) {
+    if (HEDLEY_UNLIKELY(!upd_streq(sub->change, sub->changelen, name, len))) {
+      goto UNKNOWN;
+    }
+    return;
+  }
+  if (HEDLEY_UNLIKELY(!upd_malloc(&sub->change, len+1))) {
+    goto UNKNOWN;
+  }
+  utf8ncpy(sub->change, name, len);
+  sub->change[len] = 0;
+  sub->changelen   = len;
+  return;
+
+UNKNOWN:
+  upd_free(&sub->change);
+  sub->changelen = 0;
+  sub->changes   = true;
+}
+
+
+static void watch_event_cb_(
+    uv_fs_event_t* ev, const char* filename, int events, int status) {
+  upd_watch_t* w   = ev->data;
+  upd_iso_t*   iso = w->iso;
+
+  ++iso->watch.events;
+
+  if (HEDLEY_UNLIKELY(status < 0)) {
+    w->rearm = true;
+    iso->watch.rearm = true;
+  }
+
+  /* marks everything if the event cannot be specified */
+  if (HEDLEY_UNLIKELY(status < 0 || filename == NULL)) {
+    for (size_t i = 0; i < w->subs.n; ++i) {
+      upd_watch_sub_t* sub = w->subs.p[i];
+      if (sub->len == 0) {
+        watch_note_(sub, NULL, 0);
+      }
+      watch_mark_(sub);
+    }
+    return;
+  }
+
+  const uint8_t* name = (uint8_t*) filename;
+  const size_t   len  = utf8size_lazy(filename);
+
+  const bool rename = events & UV_RENAME;
+
+  /* the directory itself is reported by its basename when it goes away */
+  if (HEDLEY_UNLIKELY(rename)) {
+    const char* base;
+    size_t      baselen;
+    cwk_path_get_basename((char*) w->path, &base, &baselen);
+    if (HEDLEY_UNLIKELY(base && upd_streq(base, baselen, name, len))) {
+      w->rearm = true;
+      iso->watch.rearm = true;
+      uv_check_start(&iso->watch.check, watch_check_cb_);
+    }
+  }
+
+  /* directories watching themselves are notified of entries changed */
+  for (size_t i = 0; rename && i < w->subs.n; ++i) {
+    upd_watch_sub_t* sub = w->subs.p[i];
+    if (sub->len) {
+      break;
+    }
+    watch_note_(sub, name, len);
+    watch_mark_(sub);
+  }
+
+  for (size_t i = watch_lower_bound_(w, name, len); i < w->subs.n; ++i) {
+    upd_watch_sub_t* sub = w->subs.p[i];
+    if (watch_cmp_(sub->name, sub->len, name, len)) {
+      break;
+    }
+    watch_mark_(sub);
+  }
+}
+
+static void watch_check_cb_(uv_check_t* check) {
+  upd_iso_t* iso = check->data;
+
+  uv_check_stop(check);
+  ++iso->watch.flushes;
+
+  if (HEDLEY_UNLIKELY(iso->watch.rearm)) {
+    iso->watch.rearm = false;
+    for (size_t i = iso->watch.dirs.n; i > 0;) {
+      upd_watch_t* w = iso->watch.dirs.p[--i];
+      if (HEDLEY_UNLIKELY(w->rearm)) {
+        watch_rearm_(w);
+      }
+    }
+  }
+
+  upd_watch_sub_t* sub = iso->watch.dirty;
+  iso->watch.dirty = NULL;
+
+  while (sub) {
+    upd_watch_sub_t* next = sub->next;
+    sub->dirty = false;
+    sub->prev  = NULL;
+    sub->next  = NULL;
+    watch_stat_(sub);
+    sub = next;
+  }
+}
+
+static void watch_stat_cb_(uv_fs_t* fsreq) {
+  upd_watch_sub_t* sub = fsreq->data;
+  upd_file_t*      f   = sub->file;
+  upd_iso_t*       iso = f->iso;
+
+  const ssize_t   result = fsreq->result;
+  const uv_stat_t st     = fsreq->statbuf;
+  uv_fs_req_cleanup(fsreq);
+  upd_iso_unstack(iso, fsreq);
+
+  sub->stating = false;
+  if (HEDLEY_UNLIKELY(sub->restat)) {
+    sub->restat = false;
+    watch_stat_(sub);
+  }
+
+  if (HEDLEY_UNLIKELY(result < 0)) {
+    if (sub->exists) {
+      sub->exists = false;
+      upd_file_trigger(f, UPD_FILE_DELETE_N);
+    }
+  } else {
+    const bool same = sub->exists && sub->known &&
+      sub->ino           == st.st_ino           &&
+      sub->size          == st.st_size          &&
+      sub->mtime.tv_sec  == st.st_mtim.tv_sec   &&
+      sub->mtime.tv_nsec == st.st_mtim.tv_nsec  &&
+      sub->ctime.tv_sec  == st.st_ctim.tv_sec   &&
+      sub->ctime.tv_nsec == st.st_ctim.tv_nsec;
+
+    sub->exists = true;
+    sub->known  = true;
+    sub->ino    = st.st_ino;
+    sub->size   = st.st_size;
+    sub->mtime  = st.st_mtim;
+    sub->ctime  = st.st_ctim;
+    if (HEDLEY_LIKELY(!same)) {
+      upd_file_trigger(f, UPD_FILE_UPDATE_N);
+    }
+  }
+  upd_file_unref(f);
+}
+
+static void watch_poll_cb_(
+    uv_fs_poll_t*    poll,
+    int              status,
+    const uv_stat_t* prev,
+    const uv_stat_t* curr) {
+  (void) prev;
+  (void) curr;
+
+  upd_watch_sub_t* sub = poll->data;
+  upd_file_t*      f   = sub->file;
+
+  if (HEDLEY_UNLIKELY(status < 0)) {
+    upd_file_trigger(f, UPD_FILE_DELETE_N);
+    return;
+  }
+  upd_file_trigger(f, UPD_FILE_UPDATE_N);
+}
+
+static void watch_close_cb_(uv_handle_t* handle) {
+  upd_watch_t* w = handle->data;
+  upd_array_clear(&w->subs);
+  upd_free(&w);
+}
+
+static void watch_handle_close_cb_(uv_handle_t* handle) {
+  upd_free(&handle);
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "common.h"
+
+
+/*  Change notification for files which have npath.
+ * Every directory is watched by a single uv_fs_event shared by all
+ * files in it, and changes reported within a loop iteration are
+ * coalesced into one stat per file at the check phase.
+ * Directory subscriptions are only notified of entries created,
+ * deleted or renamed, and UPDATE_N is triggered only when the stat
+ * differs from the last one. When the directory cannot be watched, or
+ * goes away while watched, the files fall back to uv_fs_poll which
+ * stats their npath periodically.
+ * Directories also remember the name changed since the last
+ * upd_watch_take_change(), as long as it's only one. */
+
+
+struct upd_watch_t {
+  uv_fs_event_t uv;
+  upd_iso_t*    iso;
+
+  /* sorted by name, directories watching themselves come first */
+  upd_array_of(upd_watch_sub_t*) subs;
+
+  uint8_t* path;
+  size_t   len;
+
+  unsigned rearm : 1;  /* the directory itself may have gone away */
+};
+
+struct upd_watch_sub_t {
+  upd_file_t*  file;
+  upd_watch_t* dir;
+
+  const uint8_t* name;
+  size_t         len;  /* 0 if the file is the directory itself */
+
+  uv_fs_poll_t* poll;  /* only for fallback */
+
+  uint8_t* change;  /* only for directories */
+  size_t   changelen;
+
+  upd_watch_sub_t* prev;
+  upd_watch_sub_t* next;
+
+  /* the last stat, compared to filter out no-op notifications */
+  uint64_t      ino;
+  uint64_t      size;
+  uv_timespec_t mtime;
+  uv_timespec_t ctime;
+
+  unsigned dirty   : 1;
+  unsigned stating : 1;
+  unsigned restat  : 1;
+  unsigned exists  : 1;
+  unsigned known   : 1;  /* the last stat is filled */
+  unsigned changes : 1;  /* more than one or unknown names changed */
+};
+
+
+HEDLEY_NON_NULL(1)
+bool
+upd_watch_init(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1)
+void
+upd_watch_deinit(
+  upd_iso_t* iso);
+
+HEDLEY_NON_NULL(1, 2)
+bool
+upd_watch_start(
+  upd_watch_sub_t* sub,
+  upd_file_t*      f);
+
+/* Does nothing if the subscription is not active. */
+HEDLEY_NON_NULL(1)
+void
+upd_watch_stop(
+  upd_watch_sub_t* sub);
+
+/*  Returns true and moves the name to *name (to be freed by the caller)
+ * if exactly one entry of the directory has changed since the last call,
+ * otherwise returns false. Either way the record is reset. */
+HEDLEY_NON_NULL(1, 2, 3)
+HEDLEY_WARN_UNUSED_RESULT
+bool
+upd_watch_take_change(
+  upd_watch_sub_t* sub,
+  uint8_t**        name,
+  size_t*          len);
@@ -0,0 +1,143 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define THREADS_ 4
+#define FILES_   16
+#define PUSHES_  100000  /* per thread */
+
+
+typedef struct target_t_ {
+  upd_file_t*      file;
+  upd_file_watch_t watch;
+  size_t           events;
+} target_t_;
+
+typedef struct producer_t_ {
+  uv_thread_t   thread;
+  upd_iso_t*    iso;
+  size_t        index;
+  size_t        dead;  /* pushes of the deleted file */
+  upd_file_id_t ids[FILES_+1];
+} producer_t_;
+
+
+static atomic_size_t finished_;
+
+
+static
+void
+producer_main_(
+  void* udata);
+
+
+static
+void
+watch_cb_(
+  upd_file_watch_t* w);
+
+
+int main(void) {
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  static target_t_ targets[FILES_];
+  for (size_t i = 0; i < FILES_; ++i) {
+    target_t_* t = &targets[i];
+    t->file = upd_file_new(&(upd_file_t) {
+        .iso    = iso,
+        .driver = &upd_driver_dir,
+      });
+    assert(t->file);
+
+    t->watch = (upd_file_watch_t) {
+      .file  = t->file,
+      .udata = t,
+      .cb    = watch_cb_,
+    };
+    assert(upd_file_watch_with_mask(
+      &t->watch, UPD_FILE_EVENT_BIT(UPD_FILE_ASYNC)));
+  }
+
+  /* triggers to a deleted file are dropped by the loop */
+  upd_file_t* dead = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = &upd_driver_dir,
+    });
+  assert(dead);
+  const upd_file_id_t dead_id = dead->id;
+  upd_file_unref(dead);
+
+  static producer_t_ producers[THREADS_];
+  for (size_t i = 0; i < THREADS_; ++i) {
+    producer_t_* p = &producers[i];
+    *p = (producer_t_) {
+      .iso   = iso,
+      .index = i,
+    };
+    for (size_t j = 0; j < FILES_; ++j) {
+      p->ids[j] = targets[j].file->id;
+    }
+    p->ids[FILES_] = dead_id;
+  }
+  for (size_t i = 0; i < THREADS_; ++i) {
+    assert(0 <= uv_thread_create(
+      &producers[i].thread, producer_main_, &producers[i]));
+  }
+
+  /* drains while producers are pushing, then the rest */
+  while (atomic_load(&finished_) < THREADS_ || atomic_load(&iso->async.depth)) {
+    uv_run(&iso->loop, UV_RUN_NOWAIT);
+  }
+  uint64_t dropped = 0;
+  for (size_t i = 0; i < THREADS_; ++i) {
+    uv_thread_join(&producers[i].thread);
+    dropped += producers[i].dead;
+  }
+
+  const uint64_t total = (uint64_t) THREADS_*PUSHES_;
+  assert(atomic_load(&iso->async.enqueued) == total);
+  assert(iso->async.drained == total);
+
+  /* every node is delivered, merged or dropped exactly once */
+  size_t events = 0;
+  for (size_t i = 0; i < FILES_; ++i) {
+    assert(targets[i].events > 0);
+    events += targets[i].events;
+  }
+  assert(events + iso->async.merged + dropped == total);
+
+  for (size_t i = 0; i < FILES_; ++i) {
+    upd_file_unwatch(&targets[i].watch);
+    upd_file_unref(targets[i].file);
+  }
+
+  upd_iso_exit(iso, UPD_ISO_SHUTDOWN);
+  assert(upd_iso_run(iso) == UPD_ISO_SHUTDOWN);
+
+  curl_global_cleanup();
+  return EXIT_SUCCESS;
+}
+
+
+static void producer_main_(void* udata) {
+  producer_t_* p = udata;
+  for (size_t i = 0; i < PUSHES_; ++i) {
+    const size_t j = (p->index + i) % (FILES_+1);
+    assert(upd_file_trigger_async(p->iso, p->ids[j]));
+    p->dead += j == FILES_;
+  }
+  atomic_fetch_add(&finished_, 1);
+}
+
+
+static void watch_cb_(upd_file_watch_t* w) {
+  target_t_* t = w->udata;
+  assert(w->event == UPD_FILE_ASYNC);
+  ++t->events;
+}
@@ -0,0 +1,165 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define BLOCKS_ 4  /* budget in blocks */
+
+
+/* the cache only needs ids of files and the isolate-wide state */
+static upd_iso_t  iso_;
+static upd_file_t f_[2] = {
+  { .iso = &iso_, .id = 1, },
+  { .iso = &iso_, .id = 2, },
+};
+
+static uint8_t data_[UPD_BCACHE_BLOCK];
+
+
+static
+void
+reset_(
+  size_t budget);
+
+static
+void
+put_(
+  upd_file_t* f,
+  uint32_t    gen,
+  uint64_t    index,
+  size_t      len);
+
+static
+bool
+has_(
+  upd_file_t* f,
+  uint32_t    gen,
+  uint64_t    index);
+
+
+static
+void
+test_lookup_(
+  void);
+
+static
+void
+test_lru_(
+  void);
+
+static
+void
+test_disabled_(
+  void);
+
+
+int main(void) {
+  for (size_t i = 0; i < sizeof(data_); ++i) {
+    data_[i] = i*7;
+  }
+  test_lookup_();
+  test_lru_();
+  test_disabled_();
+  return EXIT_SUCCESS;
+}
+
+
+static void reset_(size_t budget) {
+  memset(&iso_.bcache, 0, sizeof(iso_.bcache));
+  iso_.bcache.budget = budget;
+}
+
+static void put_(upd_file_t* f, uint32_t gen, uint64_t index, size_t len) {
+  /* each block starts at a different byte to tell blocks apart */
+  upd_bcache_put(f, gen, index, data_ + (index%256), len - (index%256));
+}
+
+static bool has_(upd_file_t* f, uint32_t gen, uint64_t index) {
+  const upd_bcache_block_t* b = upd_bcache_lookup(f, gen, index);
+  if (b == NULL) {
+    return false;
+  }
+  assert(b->file == f->id && b->gen == gen && b->index == index);
+  assert(memcmp(b->data, data_ + (index%256), b->len) == 0);
+  return true;
+}
+
+
+static void test_lookup_(void) {
+  reset_(UPD_BCACHE_BLOCK*BLOCKS_);
+
+  assert(!has_(&f_[0], 0, 0));
+  assert(iso_.bcache.misses == 1);
+
+  put_(&f_[0], 0, 0, UPD_BCACHE_BLOCK);
+  put_(&f_[0], 0, 1, UPD_BCACHE_BLOCK);
+  assert(has_(&f_[0], 0, 0));
+  assert(has_(&f_[0], 0, 1));
+  assert(iso_.bcache.hits == 2);
+
+  /* keys are (file, generation, index) */
+  assert(!has_(&f_[1], 0, 0));
+  assert(!has_(&f_[0], 1, 0));
+  assert(!has_(&f_[0], 0, 2));
+
+  /* a put to the same key replaces the block */
+  const size_t bytes = iso_.bcache.bytes;
+  put_(&f_[0], 0, 1, UPD_BCACHE_BLOCK/2);
+  assert(iso_.bcache.bytes == bytes - UPD_BCACHE_BLOCK/2);
+  const upd_bcache_block_t* b = upd_bcache_lookup(&f_[0], 0, 1);
+  assert(b && b->len == UPD_BCACHE_BLOCK/2 - 1);
+
+  upd_bcache_forget(&f_[0], 0, 0);
+  assert(!has_(&f_[0], 0, 0));
+  upd_bcache_forget(&f_[0], 0, 0);  /* no-op */
+
+  upd_bcache_deinit(&iso_);
+  assert(iso_.bcache.bytes == 0);
+  assert(iso_.bcache.head == NULL && iso_.bcache.tail == NULL);
+  assert(iso_.bcache.map.n == 0);
+}
+
+static void test_lru_(void) {
+  reset_(UPD_BCACHE_BLOCK*BLOCKS_);
+
+  /* index 0 makes full blocks */
+  for (uint32_t gen = 0; gen < BLOCKS_; ++gen) {
+    put_(&f_[0], gen, 0, UPD_BCACHE_BLOCK);
+  }
+  assert(iso_.bcache.bytes == UPD_BCACHE_BLOCK*BLOCKS_);
+
+  /* a lookup makes the block the hottest */
+  assert(has_(&f_[0], 0, 0));
+
+  /* so the coldest one is evicted instead */
+  put_(&f_[1], 0, 0, UPD_BCACHE_BLOCK);
+  assert(iso_.bcache.bytes == UPD_BCACHE_BLOCK*BLOCKS_);
+  assert( has_(&f_[0], 0, 0));
+  assert(!has_(&f_[0], 1, 0));
+  assert( has_(&f_[0], 2, 0));
+  assert( has_(&f_[0], 3, 0));
+  assert( has_(&f_[1], 0, 0));
+
+  /* blocks of old generations age out without being forgotten */
+  for (uint32_t gen = 10; gen < 10+BLOCKS_; ++gen) {
+    put_(&f_[0], gen, 0, UPD_BCACHE_BLOCK);
+  }
+  for (uint32_t gen = 0; gen < BLOCKS_; ++gen) {
+    assert(!has_(&f_[0], gen, 0));
+  }
+  assert(!has_(&f_[1], 0, 0));
+  assert(iso_.bcache.map.n == BLOCKS_);
+
+  upd_bcache_deinit(&iso_);
+  assert(iso_.bcache.map.n == 0);
+}
+
+static void test_disabled_(void) {
+  reset_(0);
+
+  put_(&f_[0], 0, 0, UPD_BCACHE_BLOCK);
+  assert(iso_.bcache.bytes == 0);
+  assert(!has_(&f_[0], 0, 0));
+
+  upd_bcache_deinit(&iso_);
+}
@@ -0,0 +1,155 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define COUNT_DEFAULT_ 10000
+#define CHUNK_         64
+
+
+/*  Appends small chunks to a file through upd.bin one by one,
+ * and reports the cost of each sync mode.
+ * usage: bench-updcore.append <path> [count] */
+
+
+typedef struct bench_t_ {
+  upd_req_t   req;
+  upd_iso_t*  iso;
+  upd_file_t* file;
+
+  size_t count;
+  size_t done;
+
+  uint64_t begin;
+  uint64_t end;
+  uint64_t last;
+  uint64_t worst;
+
+  uint8_t buf[CHUNK_];
+} bench_t_;
+
+
+static
+bool
+bench_run_(
+  const char* path,
+  const char* sync,
+  size_t      count);
+
+static
+bool
+bench_append_(
+  bench_t_* b);
+
+
+static
+void
+bench_append_cb_(
+  upd_req_t* req);
+
+
+int main(int argc, char** argv) {
+  argv = uv_setup_args(argc, argv);
+  if (HEDLEY_UNLIKELY(argc < 2)) {
+    fprintf(stderr, "usage: %s <path> [count]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const size_t count = argc >= 3? strtoul(argv[2], NULL, 10): COUNT_DEFAULT_;
+  assert(count);
+
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  static const char* const syncs[] = { "none", "periodic", "request", };
+
+  bool ok = true;
+  for (size_t i = 0; ok && i < sizeof(syncs)/sizeof(syncs[0]); ++i) {
+    ok = bench_run_(argv[1], syncs[i], count);
+  }
+  curl_global_cleanup();
+  return ok? EXIT_SUCCESS: EXIT_FAILURE;
+}
+
+
+static bool bench_run_(const char* path, const char* sync, size_t count) {
+  FILE* fp = fopen(path, "wb");
+  assert(fp);
+  fclose(fp);
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  char param[32];
+  snprintf(param, sizeof(param), "sync: %s", sync);
+
+  bench_t_ b = {
+    .iso   = iso,
+    .count = count,
+  };
+  memset(b.buf, 'x', sizeof(b.buf));
+
+  b.file = upd_file_new(&(upd_file_t) {
+      .iso      = iso,
+      .driver   = &upd_driver_bin,
+      .npath    = (uint8_t*) path,
+      .npathlen = strlen(path),
+      .param    = (uint8_t*) param,
+      .paramlen = strlen(param),
+    });
+  assert(b.file);
+
+  b.begin = uv_hrtime();
+  assert(bench_append_(&b));
+
+  const upd_iso_status_t status = upd_iso_run(iso);
+  if (HEDLEY_UNLIKELY(status == UPD_ISO_PANIC || b.done != b.count)) {
+    fprintf(stderr, "%-8s: aborted after %zu appends\n", sync, b.done);
+    return false;
+  }
+
+  const uint64_t total = b.end - b.begin;
+  printf("%-8s: %zu appends of %d bytes in %.3f ms (avg %.3f us, worst %.3f us)\n",
+    sync, b.done, CHUNK_,
+    total/1e6, total/1e3/b.done, b.worst/1e3);
+  return true;
+}
+
+static bool bench_append_(bench_t_* b) {
+  b->req = (upd_req_t) {
+    .file = b->file,
+    .type = UPD_REQ_STREAM_WRITE,
+    .stream = { .io = {
+      .offset = b->done*CHUNK_,
+      .size   = CHUNK_,
+      .buf    = b->buf,
+    }, },
+    .udata = b,
+    .cb    = bench_append_cb_,
+  };
+  b->last = uv_hrtime();
+  return upd_req(&b->req);
+}
+
+
+static void bench_append_cb_(upd_req_t* req) {
+  bench_t_* b = req->udata;
+
+  assert(req->result == UPD_REQ_OK);
+  assert(req->stream.io.size == CHUNK_);
+
+  const uint64_t now = uv_hrtime();
+  if (HEDLEY_UNLIKELY(now-b->last > b->worst)) {
+    b->worst = now-b->last;
+  }
+
+  if (HEDLEY_LIKELY(++b->done < b->count)) {
+    assert(bench_append_(b));
+    return;
+  }
+  b->end = now;
+
+  /* the file is synced by its deinit unless sync is none */
+  upd_file_unref(b->file);
+  upd_iso_exit(b->iso, UPD_ISO_SHUTDOWN);
+}
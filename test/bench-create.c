@@ -0,0 +1,63 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define COUNT_DEFAULT_  100000
+#define ROUNDS_DEFAULT_ 10
+
+
+/*  Creates and destroys plain files repeatedly, so that every round
+ * after the first reuses freed slots.
+ * usage: bench-updcore.create [count] [rounds] */
+
+
+int main(int argc, char** argv) {
+  argv = uv_setup_args(argc, argv);
+  const size_t count  = argc >= 2? strtoul(argv[1], NULL, 10): COUNT_DEFAULT_;
+  const size_t rounds = argc >= 3? strtoul(argv[2], NULL, 10): ROUNDS_DEFAULT_;
+  assert(count && rounds);
+
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  upd_file_t** files = NULL;
+  assert(upd_malloc(&files, sizeof(*files)*count));
+
+  uint64_t create = 0, destroy = 0;
+  for (size_t r = 0; r < rounds; ++r) {
+    const uint64_t t0 = uv_hrtime();
+    for (size_t i = 0; i < count; ++i) {
+      files[i] = upd_file_new(&(upd_file_t) {
+          .iso    = iso,
+          .driver = &upd_driver_dir,
+        });
+      assert(files[i]);
+    }
+    const uint64_t t1 = uv_hrtime();
+    for (size_t i = 0; i < count; ++i) {
+      upd_file_unref(files[i]);
+    }
+    const uint64_t t2 = uv_hrtime();
+
+    printf("round %2zu: create %.1f ns/file, destroy %.1f ns/file\n",
+      r, (double) (t1-t0)/count, (double) (t2-t1)/count);
+    create  += t1-t0;
+    destroy += t2-t1;
+  }
+  printf("average : create %.1f ns/file, destroy %.1f ns/file (%zu slots)\n",
+    (double) create/count/rounds, (double) destroy/count/rounds,
+    (size_t) iso->files.used);
+
+  upd_free(&files);
+
+  upd_iso_exit(iso, UPD_ISO_SHUTDOWN);
+  const upd_iso_status_t status = upd_iso_run(iso);
+
+  curl_global_cleanup();
+  return status == UPD_ISO_SHUTDOWN? EXIT_SUCCESS: EXIT_FAILURE;
+}
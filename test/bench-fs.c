@@ -0,0 +1,204 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define COUNT_DEFAULT_ 100000
+#define DEPTH_DEFAULT_ 32
+#define DEPTH_MAX_     256
+#define BLOCK_         4096
+
+
+/*  Compares file operations going through the libuv threadpool with
+ * the ones going through upd_fs_*, which use io_uring when it's built
+ * with UPD_USE_IO_URING and the kernel allows.
+ * Each phase keeps `depth` ops in flight until `count` ops complete.
+ * usage: bench-updcore.fs <path> [count] [depth] */
+
+
+typedef enum phase_t_ {
+  PHASE_UV_READ_,
+  PHASE_FS_READ_,
+  PHASE_UV_STAT_,
+  PHASE_FS_STAT_,
+  PHASE_END_,
+} phase_t_;
+
+typedef struct bench_t_ bench_t_;
+typedef struct slot_t_  slot_t_;
+
+struct slot_t_ {
+  uv_fs_t   fsreq;
+  bench_t_* bench;
+  uint8_t   buf[BLOCK_];
+};
+
+struct bench_t_ {
+  upd_iso_t*  iso;
+  const char* path;
+  uv_file     fd;
+  uint64_t    blocks;
+
+  phase_t_ phase;
+  size_t   count;
+  size_t   depth;
+  size_t   issued;
+  size_t   done;
+  uint64_t begin;
+
+  slot_t_ slots[DEPTH_MAX_];
+};
+
+
+static const char* const phase_names_[] = {
+  [PHASE_UV_READ_] = "uv_fs_read",
+  [PHASE_FS_READ_] = "upd_fs_read",
+  [PHASE_UV_STAT_] = "uv_fs_stat",
+  [PHASE_FS_STAT_] = "upd_fs_stat",
+};
+
+
+static
+void
+bench_start_(
+  bench_t_* b);
+
+static
+void
+bench_issue_(
+  bench_t_* b,
+  slot_t_*  s);
+
+
+static
+void
+bench_cb_(
+  uv_fs_t* fsreq);
+
+
+int main(int argc, char** argv) {
+  argv = uv_setup_args(argc, argv);
+  if (HEDLEY_UNLIKELY(argc < 2)) {
+    fprintf(stderr, "usage: %s <path> [count] [depth]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const size_t count = argc >= 3? strtoul(argv[2], NULL, 10): COUNT_DEFAULT_;
+  const size_t depth = argc >= 4? strtoul(argv[3], NULL, 10): DEPTH_DEFAULT_;
+  assert(count);
+  assert(depth && depth <= DEPTH_MAX_);
+
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  static bench_t_ b;
+  b = (bench_t_) {
+    .iso   = iso,
+    .path  = argv[1],
+    .count = count,
+    .depth = depth,
+  };
+
+  uv_fs_t fsreq;
+  b.fd = uv_fs_open(&iso->loop, &fsreq, b.path, O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&fsreq);
+  if (HEDLEY_UNLIKELY(b.fd < 0)) {
+    fprintf(stderr, "failed to open '%s'\n", b.path);
+    return EXIT_FAILURE;
+  }
+  assert(0 <= uv_fs_fstat(&iso->loop, &fsreq, b.fd, NULL));
+  b.blocks = fsreq.statbuf.st_size / BLOCK_;
+  uv_fs_req_cleanup(&fsreq);
+  if (HEDLEY_UNLIKELY(b.blocks == 0)) {
+    fprintf(stderr, "'%s' must be %d bytes or larger\n", b.path, BLOCK_);
+    return EXIT_FAILURE;
+  }
+
+  printf("upd_fs_* go through %s\n", iso->fs.ok? "io_uring": "threadpool");
+  bench_start_(&b);
+
+  const upd_iso_status_t status = upd_iso_run(iso);
+  curl_global_cleanup();
+  return status != UPD_ISO_PANIC && b.phase == PHASE_END_?
+    EXIT_SUCCESS: EXIT_FAILURE;
+}
+
+
+static void bench_start_(bench_t_* b) {
+  if (HEDLEY_UNLIKELY(b->phase == PHASE_END_)) {
+    uv_fs_t fsreq;
+    uv_fs_close(&b->iso->loop, &fsreq, b->fd, NULL);
+    uv_fs_req_cleanup(&fsreq);
+    upd_iso_exit(b->iso, UPD_ISO_SHUTDOWN);
+    return;
+  }
+
+  b->issued = 0;
+  b->done   = 0;
+  b->begin  = uv_hrtime();
+
+  const size_t n = b->depth < b->count? b->depth: b->count;
+  for (size_t i = 0; i < n; ++i) {
+    slot_t_* s = &b->slots[i];
+    s->bench = b;
+    bench_issue_(b, s);
+  }
+}
+
+static void bench_issue_(bench_t_* b, slot_t_* s) {
+  upd_iso_t* iso = b->iso;
+
+  s->fsreq = (uv_fs_t) { .data = s, };
+
+  const size_t   i   = b->issued++;
+  const uv_buf_t buf = uv_buf_init((char*) s->buf, BLOCK_);
+  const int64_t  off = (int64_t) (i%b->blocks) * BLOCK_;
+
+  int err = 0;
+  switch (b->phase) {
+  case PHASE_UV_READ_:
+    err = uv_fs_read(&iso->loop, &s->fsreq, b->fd, &buf, 1, off, bench_cb_);
+    break;
+  case PHASE_FS_READ_:
+    err = upd_fs_read(iso, &s->fsreq, b->fd, &buf, 1, off, bench_cb_);
+    break;
+  case PHASE_UV_STAT_:
+    err = uv_fs_stat(&iso->loop, &s->fsreq, b->path, bench_cb_);
+    break;
+  case PHASE_FS_STAT_:
+    err = upd_fs_stat(iso, &s->fsreq, b->path, bench_cb_);
+    break;
+  default:
+    assert(false);
+    HEDLEY_UNREACHABLE();
+  }
+  assert(0 <= err);
+}
+
+
+static void bench_cb_(uv_fs_t* fsreq) {
+  slot_t_*  s = fsreq->data;
+  bench_t_* b = s->bench;
+
+  assert(fsreq->result >= 0);
+  uv_fs_req_cleanup(fsreq);
+
+  ++b->done;
+  if (HEDLEY_LIKELY(b->issued < b->count)) {
+    bench_issue_(b, s);
+    return;
+  }
+  if (HEDLEY_LIKELY(b->done < b->count)) {
+    return;
+  }
+
+  const uint64_t total = uv_hrtime() - b->begin;
+  printf("%-12s: %zu ops in %.3f ms (%.0f ops/s)\n",
+    phase_names_[b->phase], b->done, total/1e6, b->done/(total/1e9));
+
+  ++b->phase;
+  bench_start_(b);
+}
@@ -0,0 +1,208 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024*8)
+
+#define DIRS_DEFAULT_  100
+#define FILES_DEFAULT_ 1000
+
+#define POLL_ 1  /* ms */
+
+
+/*  Measures time until a syncdir over a generated tree has instantiated
+ * all of its entries. The tree is created at the first run and reused.
+ * Rules of subdirs fall through to the parent's, and half of the files
+ * are selected by a rule which still goes through the regex.
+ * usage: bench-updcore.syncdir <dir> [dirs] [files per dir] */
+
+
+typedef struct bench_t_ {
+  upd_iso_t*        iso;
+  upd_file_t*       root;
+  upd_iso_timeout_t poll;
+
+  size_t   expect;
+  size_t   polls;
+  uint64_t begin;
+  bool     done;
+} bench_t_;
+
+
+static
+bool
+bench_make_tree_(
+  const char* dir,
+  size_t      dirs,
+  size_t      files);
+
+static
+size_t
+bench_count_(
+  upd_file_t* f);
+
+
+static
+void
+bench_list_cb_(
+  upd_req_t* req);
+
+static
+void
+bench_poll_cb_(
+  upd_iso_timeout_t* t);
+
+
+static const char param_[] =
+  "'.*\\.txt': [upd.bin]\n"
+  "'f[0-9]+\\.dat': [upd.bin]\n"
+  "'d[0-9]+':\n"
+  "  - driver: upd.syncdir\n"
+  "    param: \"'.*\\\\.lua': [upd.bin]\"\n";
+
+
+int main(int argc, char** argv) {
+  argv = uv_setup_args(argc, argv);
+  if (HEDLEY_UNLIKELY(argc < 2)) {
+    fprintf(stderr, "usage: %s <dir> [dirs] [files per dir]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  const size_t dirs  = argc >= 3? strtoul(argv[2], NULL, 10): DIRS_DEFAULT_;
+  const size_t files = argc >= 4? strtoul(argv[3], NULL, 10): FILES_DEFAULT_;
+  assert(dirs && files);
+
+  if (HEDLEY_UNLIKELY(!bench_make_tree_(argv[1], dirs, files))) {
+    fprintf(stderr, "failed to make a tree at '%s'\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  bench_t_ b = {
+    .iso = iso,
+    .poll = {
+      .udata = &b,
+      .cb    = bench_poll_cb_,
+    },
+    .expect = dirs*(files+1),
+  };
+
+  b.begin = uv_hrtime();
+  b.root  = upd_file_new(&(upd_file_t) {
+      .iso      = iso,
+      .driver   = &upd_driver_syncdir,
+      .path     = (uint8_t*) "/bench",
+      .pathlen  = sizeof("/bench")-1,
+      .npath    = (uint8_t*) argv[1],
+      .npathlen = strlen(argv[1]),
+      .param    = (uint8_t*) param_,
+      .paramlen = sizeof(param_)-1,
+    });
+  assert(b.root);
+  upd_iso_timeout_start(iso, &b.poll, POLL_);
+
+  const upd_iso_status_t status = upd_iso_run(iso);
+  curl_global_cleanup();
+  return status != UPD_ISO_PANIC && b.done? EXIT_SUCCESS: EXIT_FAILURE;
+}
+
+
+static bool bench_make_tree_(const char* dir, size_t dirs, size_t files) {
+  char path[UPD_PATH_MAX];
+
+  snprintf(path, sizeof(path), "%s/.bench-%zu-%zu", dir, dirs, files);
+  FILE* fp = fopen(path, "rb");
+  if (fp) {
+    fclose(fp);
+    return true;
+  }
+
+  uv_fs_t fsreq;
+  uv_fs_mkdir(NULL, &fsreq, dir, 0755, NULL);
+  uv_fs_req_cleanup(&fsreq);
+
+  for (size_t i = 0; i < dirs; ++i) {
+    snprintf(path, sizeof(path), "%s/d%04zu", dir, i);
+    const int mk = uv_fs_mkdir(NULL, &fsreq, path, 0755, NULL);
+    uv_fs_req_cleanup(&fsreq);
+    if (HEDLEY_UNLIKELY(mk < 0 && mk != UV_EEXIST)) {
+      return false;
+    }
+    for (size_t j = 0; j < files; ++j) {
+      snprintf(path, sizeof(path), "%s/d%04zu/f%06zu.%s",
+        dir, i, j, j%2? "dat": "txt");
+      fp = fopen(path, "wb");
+      if (HEDLEY_UNLIKELY(fp == NULL)) {
+        return false;
+      }
+      fclose(fp);
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/.bench-%zu-%zu", dir, dirs, files);
+  fp = fopen(path, "wb");
+  if (HEDLEY_UNLIKELY(fp == NULL)) {
+    return false;
+  }
+  fclose(fp);
+  return true;
+}
+
+static size_t bench_count_(upd_file_t* f) {
+  upd_req_t req = {
+    .file = f,
+    .type = UPD_REQ_DIR_LIST,
+    .cb   = bench_list_cb_,
+  };
+  size_t n = SIZE_MAX;
+  req.udata = &n;
+
+  /* syncdir answers lists synchronously unless it's lazy */
+  if (HEDLEY_UNLIKELY(!upd_req(&req))) {
+    return 0;
+  }
+  assert(n != SIZE_MAX);
+  return n;
+}
+
+
+static void bench_list_cb_(upd_req_t* req) {
+  size_t* n = req->udata;
+  *n = 0;
+  if (HEDLEY_UNLIKELY(req->result != UPD_REQ_OK)) {
+    return;
+  }
+  for (size_t i = 0; i < req->dir.entries.n; ++i) {
+    const upd_req_dir_entry_t* e = req->dir.entries.p[i];
+    if (HEDLEY_UNLIKELY(e->file == NULL)) {
+      continue;
+    }
+    ++*n;
+    if (e->file->driver == &upd_driver_syncdir) {
+      *n += bench_count_(e->file);
+    }
+  }
+}
+
+static void bench_poll_cb_(upd_iso_timeout_t* t) {
+  bench_t_* b = t->udata;
+
+  ++b->polls;
+  const size_t n = bench_count_(b->root);
+  if (HEDLEY_LIKELY(n < b->expect)) {
+    upd_iso_timeout_start(b->iso, t, POLL_);
+    return;
+  }
+
+  const uint64_t total = uv_hrtime() - b->begin;
+  printf("%zu files are ready in %.3f ms (%zu polls of %d ms)\n",
+    n, total/1e6, b->polls, POLL_);
+
+  b->done = true;
+  upd_file_unref(b->root);
+  upd_iso_exit(b->iso, UPD_ISO_SHUTDOWN);
+}
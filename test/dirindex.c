@@ -0,0 +1,180 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define MANY_ 1000
+
+
+static
+upd_req_dir_entry_t
+entry_(
+  const char* name,
+  upd_file_t* file);
+
+
+static
+void
+test_basic_(
+  void);
+
+static
+void
+test_alias_(
+  void);
+
+static
+void
+test_lazy_(
+  void);
+
+static
+void
+test_many_(
+  void);
+
+
+int main(void) {
+  test_basic_();
+  test_alias_();
+  test_lazy_();
+  test_many_();
+  return EXIT_SUCCESS;
+}
+
+
+static upd_req_dir_entry_t entry_(const char* name, upd_file_t* file) {
+  return (upd_req_dir_entry_t) {
+    .name = (uint8_t*) name,
+    .len  = strlen(name),
+    .file = file,
+  };
+}
+
+
+static void test_basic_(void) {
+  upd_file_t f[3] = {0};
+
+  upd_req_dir_entry_t e[] = {
+    entry_("a",   &f[0]),
+    entry_("bb",  &f[1]),
+    entry_("ccc", &f[2]),
+  };
+
+  upd_dirindex_t idx = {0};
+  for (size_t i = 0; i < 3; ++i) {
+    assert(upd_dirindex_insert(&idx, &e[i]));
+  }
+  for (size_t i = 0; i < 3; ++i) {
+    assert(upd_dirindex_find_by_name(&idx, e[i].name, e[i].len) == &e[i]);
+    assert(upd_dirindex_find_by_file(&idx, &f[i]) == &e[i]);
+
+    /* a query finds by file if it has, otherwise by name */
+    const upd_req_dir_entry_t qf = entry_("", &f[i]);
+    const upd_req_dir_entry_t qn = entry_((char*) e[i].name, NULL);
+    assert(upd_dirindex_find(&idx, &qf) == &e[i]);
+    assert(upd_dirindex_find(&idx, &qn) == &e[i]);
+  }
+
+  /* names are compared with their length */
+  assert(upd_dirindex_find_by_name(&idx, (uint8_t*) "bbb", 2) == &e[1]);
+  assert(upd_dirindex_find_by_name(&idx, (uint8_t*) "b",   1) == NULL);
+  assert(upd_dirindex_find_by_name(&idx, (uint8_t*) "cc",  2) == NULL);
+
+  upd_dirindex_remove(&idx, &e[1]);
+  assert(upd_dirindex_find_by_name(&idx, e[1].name, e[1].len) == NULL);
+  assert(upd_dirindex_find_by_file(&idx, &f[1]) == NULL);
+  assert(upd_dirindex_find_by_name(&idx, e[0].name, e[0].len) == &e[0]);
+  assert(upd_dirindex_find_by_name(&idx, e[2].name, e[2].len) == &e[2]);
+
+  upd_dirindex_remove(&idx, &e[0]);
+  upd_dirindex_remove(&idx, &e[2]);
+  assert(idx.names.n == 0);
+  assert(idx.files.n == 0);
+  upd_dirindex_clear(&idx);
+}
+
+static void test_alias_(void) {
+  upd_file_t f = {0};
+
+  /* a file can be added under multiple names */
+  upd_req_dir_entry_t e[] = {
+    entry_("x", &f),
+    entry_("y", &f),
+  };
+
+  upd_dirindex_t idx = {0};
+  assert(upd_dirindex_insert(&idx, &e[0]));
+  assert(upd_dirindex_insert(&idx, &e[1]));
+  assert(idx.files.n == 2);
+
+  const upd_req_dir_entry_t* found = upd_dirindex_find_by_file(&idx, &f);
+  assert(found == &e[0] || found == &e[1]);
+
+  /* removal drops exactly the given entry */
+  upd_dirindex_remove(&idx, &e[0]);
+  assert(upd_dirindex_find_by_file(&idx, &f) == &e[1]);
+  assert(upd_dirindex_find_by_name(&idx, e[0].name, e[0].len) == NULL);
+  assert(upd_dirindex_find_by_name(&idx, e[1].name, e[1].len) == &e[1]);
+
+  upd_dirindex_remove(&idx, &e[1]);
+  assert(upd_dirindex_find_by_file(&idx, &f) == NULL);
+  upd_dirindex_clear(&idx);
+}
+
+static void test_lazy_(void) {
+  upd_file_t f[2] = {0};
+
+  /* entries without file are indexed only by name */
+  upd_req_dir_entry_t e = entry_("lazy", NULL);
+
+  upd_dirindex_t idx = {0};
+  assert(upd_dirindex_insert(&idx, &e));
+  assert(idx.files.n == 0);
+  assert(upd_dirindex_find_by_name(&idx, e.name, e.len) == &e);
+
+  assert(upd_dirindex_set_file(&idx, &e, &f[0]));
+  assert(e.file == &f[0]);
+  assert(upd_dirindex_find_by_file(&idx, &f[0]) == &e);
+
+  /* replacing the file moves the reverse index */
+  assert(upd_dirindex_set_file(&idx, &e, &f[1]));
+  assert(upd_dirindex_find_by_file(&idx, &f[0]) == NULL);
+  assert(upd_dirindex_find_by_file(&idx, &f[1]) == &e);
+
+  /* releasing the file keeps the name */
+  assert(upd_dirindex_set_file(&idx, &e, NULL));
+  assert(idx.files.n == 0);
+  assert(upd_dirindex_find_by_file(&idx, &f[1]) == NULL);
+  assert(upd_dirindex_find_by_name(&idx, e.name, e.len) == &e);
+
+  upd_dirindex_remove(&idx, &e);
+  assert(idx.names.n == 0);
+  upd_dirindex_clear(&idx);
+}
+
+static void test_many_(void) {
+  static upd_file_t          f[MANY_];
+  static upd_req_dir_entry_t e[MANY_];
+  static char                names[MANY_][8];
+
+  upd_dirindex_t idx = {0};
+  for (size_t i = 0; i < MANY_; ++i) {
+    snprintf(names[i], sizeof(names[i]), "%zu", i);
+    e[i] = entry_(names[i], &f[i]);
+    assert(upd_dirindex_insert(&idx, &e[i]));
+  }
+
+  /* removes every other entry while the rest keep being found */
+  for (size_t i = 0; i < MANY_; i += 2) {
+    upd_dirindex_remove(&idx, &e[i]);
+  }
+  for (size_t i = 0; i < MANY_; ++i) {
+    const upd_req_dir_entry_t* expect = i%2? &e[i]: NULL;
+    assert(upd_dirindex_find_by_name(&idx, e[i].name, e[i].len) == expect);
+    assert(upd_dirindex_find_by_file(&idx, &f[i]) == expect);
+  }
+  assert(idx.names.n == MANY_/2);
+  assert(idx.files.n == MANY_/2);
+  upd_dirindex_clear(&idx);
+}
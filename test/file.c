@@ -0,0 +1,189 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define FILES_  3000
+#define WALKED_ 1000  /* = WALKER_FILES_PER_PERIOD_ in iso.c */
+
+
+static
+upd_file_t*
+file_new_(
+  upd_iso_t* iso);
+
+static
+uint32_t
+file_index_(
+  const upd_file_t* f);
+
+static
+void
+walker_wait_(
+  upd_iso_t* iso);
+
+static
+size_t
+live_slots_(
+  upd_iso_t* iso,
+  size_t     begin,
+  size_t     end);
+
+
+static
+void
+test_reuse_(
+  upd_iso_t* iso);
+
+static
+void
+test_walker_(
+  upd_iso_t* iso);
+
+
+int main(void) {
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  upd_iso_t* iso = upd_iso_new(STACK_SIZE_);
+  assert(iso);
+
+  /* slots freed while building the iso are taken first */
+  upd_array_of(upd_file_t*) fillers = {0};
+  while (iso->files.free_head != UPD_FILE_SLOT_NONE) {
+    assert(upd_array_insert(&fillers, file_new_(iso), SIZE_MAX));
+  }
+
+  test_reuse_(iso);
+  test_walker_(iso);
+
+  for (size_t i = 0; i < fillers.n; ++i) {
+    upd_file_unref(fillers.p[i]);
+  }
+  upd_array_clear(&fillers);
+
+  upd_iso_exit(iso, UPD_ISO_SHUTDOWN);
+  assert(upd_iso_run(iso) == UPD_ISO_SHUTDOWN);
+
+  curl_global_cleanup();
+  return EXIT_SUCCESS;
+}
+
+
+static upd_file_t* file_new_(upd_iso_t* iso) {
+  upd_file_t* f = upd_file_new(&(upd_file_t) {
+      .iso    = iso,
+      .driver = &upd_driver_dir,
+    });
+  assert(f);
+  return f;
+}
+
+static uint32_t file_index_(const upd_file_t* f) {
+  return f->id & UINT32_MAX;
+}
+
+static void walker_wait_(upd_iso_t* iso) {
+  const size_t next = iso->walker.next;
+  while (iso->walker.next == next) {
+    uv_run(&iso->loop, UV_RUN_ONCE);
+  }
+}
+
+static size_t live_slots_(upd_iso_t* iso, size_t begin, size_t end) {
+  size_t n = 0;
+  for (size_t i = begin; i < end; ++i) {
+    n += !!iso->files.slots[i].file;
+  }
+  return n;
+}
+
+
+static void test_reuse_(upd_iso_t* iso) {
+  upd_file_t* f[4];
+  upd_file_id_t id[4];
+  for (size_t i = 0; i < 4; ++i) {
+    f[i]  = file_new_(iso);
+    id[i] = f[i]->id;
+    assert(upd_file_get(iso, id[i]) == f[i]);
+  }
+
+  /* freed slots are reused in the order they're freed */
+  upd_file_unref(f[1]);
+  upd_file_unref(f[3]);
+  upd_file_unref(f[0]);
+  assert(upd_file_get(iso, id[1]) == NULL);
+  assert(upd_file_get(iso, id[3]) == NULL);
+  assert(upd_file_get(iso, id[0]) == NULL);
+
+  upd_file_t* g[3];
+  for (size_t i = 0; i < 3; ++i) {
+    g[i] = file_new_(iso);
+  }
+  assert(file_index_(g[0]) == (id[1] & UINT32_MAX));
+  assert(file_index_(g[1]) == (id[3] & UINT32_MAX));
+  assert(file_index_(g[2]) == (id[0] & UINT32_MAX));
+
+  /* stale ids never resolve to the new owners of their slots */
+  assert(g[0]->id != id[1]);
+  assert(upd_file_get(iso, id[1]) == NULL);
+  assert(upd_file_get(iso, g[0]->id) == g[0]);
+
+  /* ids beyond the used slots */
+  assert(upd_file_get(iso, iso->files.used) == NULL);
+  assert(upd_file_get(iso, UINT64_MAX) == NULL);
+
+  upd_file_unref(f[2]);
+  for (size_t i = 0; i < 3; ++i) {
+    upd_file_unref(g[i]);
+  }
+}
+
+static void test_walker_(upd_iso_t* iso) {
+  /* fills the free list left by test_reuse_ first */
+  upd_array_of(upd_file_t*) fillers = {0};
+  while (iso->files.free_head != UPD_FILE_SLOT_NONE) {
+    assert(upd_array_insert(&fillers, file_new_(iso), SIZE_MAX));
+  }
+
+  static upd_file_t* files[FILES_];
+  for (size_t i = 0; i < FILES_; ++i) {
+    files[i] = file_new_(iso);
+  }
+  assert(iso->files.used >= 2*WALKED_);
+
+  /* a period walks a fixed number of files from the head */
+  iso->walker.next = 0;
+  walker_wait_(iso);
+  const size_t next1 = iso->walker.next;
+  assert(live_slots_(iso, 0, next1) == WALKED_);
+
+  /* deletes slots right after the cursor */
+  size_t deleted = 0;
+  for (size_t i = 0; i < FILES_; ++i) {
+    const uint32_t index = file_index_(files[i]);
+    if (index >= next1 && index < next1+WALKED_/2) {
+      upd_file_unref(files[i]);
+      files[i] = NULL;
+      ++deleted;
+    }
+  }
+  assert(deleted == WALKED_/2);
+
+  /* the next period resumes from the cursor, skipping empty slots */
+  walker_wait_(iso);
+  const size_t next2 = iso->walker.next;
+  assert(next2 == next1 + WALKED_ + deleted);
+  assert(live_slots_(iso, next1, next2) == WALKED_);
+
+  for (size_t i = 0; i < FILES_; ++i) {
+    if (files[i]) {
+      upd_file_unref(files[i]);
+    }
+  }
+  for (size_t i = 0; i < fillers.n; ++i) {
+    upd_file_unref(fillers.p[i]);
+  }
+  upd_array_clear(&fillers);
+}
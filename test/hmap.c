@@ -0,0 +1,193 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STRESS_ITEMS_ 1000
+#define STRESS_STEPS_ 100000
+
+
+typedef struct item_t_ {
+  uint64_t hash;
+  bool     in;
+} item_t_;
+
+
+static
+void
+check_(
+  const upd_hmap_t* m);
+
+static
+void
+insert_(
+  upd_hmap_t* m,
+  item_t_*    item);
+
+static
+void
+remove_(
+  upd_hmap_t* m,
+  item_t_*    item);
+
+
+static
+void
+test_cluster_(
+  void);
+
+static
+void
+test_wrap_(
+  void);
+
+static
+void
+test_stress_(
+  void);
+
+
+int main(void) {
+  test_cluster_();
+  test_wrap_();
+  test_stress_();
+  return EXIT_SUCCESS;
+}
+
+
+/* every item must be reachable from its home without crossing a hole */
+static void check_(const upd_hmap_t* m) {
+  const size_t mask = m->cap - 1;
+
+  size_t n = 0;
+  for (size_t i = 0; i < m->cap; ++i) {
+    const upd_hmap_item_t* item = &m->items[i];
+    if (item->ptr == NULL) {
+      continue;
+    }
+    ++n;
+    for (size_t j = item->hash & mask; j != i; j = (j+1) & mask) {
+      assert(m->items[j].ptr);
+    }
+    assert(upd_hmap_find(m, item->hash, upd_hmap_eq_ptr, item->ptr) == item->ptr);
+  }
+  assert(n == m->n);
+}
+
+static void insert_(upd_hmap_t* m, item_t_* item) {
+  assert(!item->in);
+  assert(upd_hmap_insert(m, item->hash, item));
+  item->in = true;
+  check_(m);
+}
+
+static void remove_(upd_hmap_t* m, item_t_* item) {
+  assert(item->in);
+  assert(upd_hmap_remove(m, item->hash, upd_hmap_eq_ptr, item) == item);
+  assert(upd_hmap_find(m, item->hash, upd_hmap_eq_ptr, item) == NULL);
+  item->in = false;
+  check_(m);
+}
+
+
+static void test_cluster_(void) {
+  upd_hmap_t m = {0};
+
+  /* a cluster from 3 to 7 mixing two homes */
+  item_t_ items[] = {
+    { .hash = 3, }, { .hash = 3, }, { .hash = 4, },
+    { .hash = 3, }, { .hash = 5, },
+  };
+  const size_t n = sizeof(items)/sizeof(items[0]);
+  for (size_t i = 0; i < n; ++i) {
+    insert_(&m, &items[i]);
+  }
+  assert(m.cap == UPD_HMAP_MIN);
+
+  /* removing the head shifts the rest backward */
+  remove_(&m, &items[0]);
+  assert(m.items[3].ptr == &items[1]);
+  assert(m.items[7].ptr == NULL);
+
+  /* an item at its home stays */
+  remove_(&m, &items[1]);
+  remove_(&m, &items[3]);
+  assert(m.items[4].ptr == &items[2]);
+  assert(m.items[5].ptr == &items[4]);
+
+  remove_(&m, &items[2]);
+  remove_(&m, &items[4]);
+  assert(m.n == 0);
+
+  /* missing keys */
+  assert(upd_hmap_remove(&m, 3, upd_hmap_eq_ptr, &items[0]) == NULL);
+  upd_hmap_clear(&m);
+  assert(upd_hmap_remove(&m, 3, upd_hmap_eq_ptr, &items[0]) == NULL);
+}
+
+static void test_wrap_(void) {
+  upd_hmap_t m = {0};
+
+  /* a cluster wrapping around the end of the table */
+  item_t_ items[] = {
+    { .hash = 14, }, { .hash = 15, }, { .hash = 14, },
+    { .hash = 15, }, { .hash = 0,  },
+  };
+  const size_t n = sizeof(items)/sizeof(items[0]);
+  for (size_t i = 0; i < n; ++i) {
+    insert_(&m, &items[i]);
+  }
+  assert(m.cap == UPD_HMAP_MIN);
+  assert(m.items[0].ptr == &items[2]);
+  assert(m.items[2].ptr == &items[4]);
+
+  remove_(&m, &items[1]);
+  assert(m.items[15].ptr == &items[2]);
+  assert(m.items[0].ptr  == &items[3]);
+  assert(m.items[1].ptr  == &items[4]);
+  assert(m.items[2].ptr  == NULL);
+
+  remove_(&m, &items[0]);
+  remove_(&m, &items[3]);
+  assert(m.items[0].ptr == &items[4]);
+
+  remove_(&m, &items[2]);
+  remove_(&m, &items[4]);
+  assert(m.n == 0);
+  upd_hmap_clear(&m);
+}
+
+static void test_stress_(void) {
+  static item_t_ items[STRESS_ITEMS_];
+
+  /* hashes in a narrow range make long clusters */
+  uint64_t x = 1;
+  for (size_t i = 0; i < STRESS_ITEMS_; ++i) {
+    x = x*UINT64_C(6364136223846793005) + 1;
+    items[i] = (item_t_) { .hash = (x >> 33) % 256, };
+  }
+
+  upd_hmap_t m = {0};
+  for (size_t i = 0; i < STRESS_STEPS_; ++i) {
+    x = x*UINT64_C(6364136223846793005) + 1;
+    item_t_* item = &items[(x >> 33) % STRESS_ITEMS_];
+    if (item->in) {
+      assert(upd_hmap_remove(&m, item->hash, upd_hmap_eq_ptr, item) == item);
+      item->in = false;
+    } else {
+      assert(upd_hmap_insert(&m, item->hash, item));
+      item->in = true;
+    }
+    if (i%1000 == 0) {
+      check_(&m);
+    }
+  }
+  check_(&m);
+
+  for (size_t i = 0; i < STRESS_ITEMS_; ++i) {
+    const void* found =
+      upd_hmap_find(&m, items[i].hash, upd_hmap_eq_ptr, &items[i]);
+    assert(!!found == items[i].in);
+  }
+  upd_hmap_clear(&m);
+}
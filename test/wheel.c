@@ -0,0 +1,133 @@
+#undef NDEBUG
+
+#include "common.h"
+
+
+#define STACK_SIZE_ (1024*1024)
+
+#define REARMS_ 3
+
+
+typedef struct timeout_t_ {
+  upd_iso_timeout_t super;
+
+  uint64_t dur;
+  uint64_t start;
+  size_t   fired;
+  size_t   rearm;  /* restarts itself from the callback this many times */
+} timeout_t_;
+
+
+static upd_iso_t* iso_;
+
+static uint64_t last_expire_;
+static size_t   fired_;
+
+
+static
+void
+timeout_start_(
+  timeout_t_* t);
+
+
+static
+void
+timeout_cb_(
+  upd_iso_timeout_t* t);
+
+
+int main(void) {
+  assert(!curl_global_init(CURL_GLOBAL_ALL));
+
+  iso_ = upd_iso_new(STACK_SIZE_);
+  assert(iso_);
+
+  /* crosses the boundary of the first level, and lands on the second */
+  static timeout_t_ ts[] = {
+    { .dur = 0,   }, { .dur = 1,   }, { .dur = 2,   },
+    { .dur = 7,   }, { .dur = 63,  }, { .dur = 64,  },
+    { .dur = 65,  }, { .dur = 130, }, { .dur = 200, },
+    { .dur = 5,   .rearm = REARMS_, },
+    { .dur = 150, },  /* stopped before firing */
+    { .dur = 150, },  /* restarted before firing */
+    { .dur = 7,   },  /* same expiry as another */
+  };
+  const size_t n = sizeof(ts)/sizeof(ts[0]);
+
+  timeout_t_* stopped   = &ts[n-3];
+  timeout_t_* restarted = &ts[n-2];
+
+  const size_t base = iso_->wheel.n;
+  for (size_t i = 0; i < n; ++i) {
+    timeout_start_(&ts[i]);
+  }
+  assert(iso_->wheel.n == base+n);
+
+  /* far beyond the wheel goes to the overflow list */
+  static timeout_t_ far = { .dur = UINT64_C(1000)*60*60*24, };
+  timeout_start_(&far);
+
+  upd_iso_timeout_stop(iso_, &stopped->super);
+  assert(stopped->super.head == NULL);
+  upd_iso_timeout_stop(iso_, &stopped->super);  /* no-op */
+
+  upd_iso_timeout_stop(iso_, &restarted->super);
+  restarted->dur = 30;
+  timeout_start_(restarted);
+
+  const size_t expect = (n-1) + REARMS_;
+  while (fired_ < expect) {
+    uv_run(&iso_->loop, UV_RUN_ONCE);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    const timeout_t_* t = &ts[i];
+    if (t == stopped) {
+      assert(t->fired == 0);
+    } else {
+      assert(t->fired == 1 + (t == &ts[n-4]? REARMS_: 0));
+      assert(t->super.head == NULL);
+    }
+  }
+
+  assert(far.fired == 0);
+  assert(far.super.head);
+  assert(iso_->wheel.n == base+1);
+  upd_iso_timeout_stop(iso_, &far.super);
+  assert(iso_->wheel.n == base);
+
+  upd_iso_exit(iso_, UPD_ISO_SHUTDOWN);
+  assert(upd_iso_run(iso_) == UPD_ISO_SHUTDOWN);
+
+  curl_global_cleanup();
+  return EXIT_SUCCESS;
+}
+
+
+static void timeout_start_(timeout_t_* t) {
+  t->super.udata = t;
+  t->super.cb    = timeout_cb_;
+  t->start       = upd_iso_now(iso_);
+  upd_iso_timeout_start(iso_, &t->super, t->dur);
+  assert(t->super.head);
+}
+
+
+static void timeout_cb_(upd_iso_timeout_t* t) {
+  timeout_t_* t_ = t->udata;
+
+  /* never fires early, and fires in order of expiry */
+  assert(t->head == NULL);
+  assert(upd_iso_now(iso_) >= t->expire);
+  assert(t->expire >= t_->start + t_->dur);
+  assert(t->expire >= last_expire_);
+  last_expire_ = t->expire;
+
+  ++t_->fired;
+  ++fired_;
+
+  if (t_->rearm) {
+    --t_->rearm;
+    timeout_start_(t_);
+  }
+}